@@ -29,34 +29,22 @@
 #include <client/internal.h>
 #include <client/remctl.h>
 #include <util/macros.h>
+#include <util/tokens.h>
 
 
 /*
  * Handle an internal failure for the simplified interface.  We try to grab
- * the remctl error and put it into the error field in the remctl result, but
- * if that fails, we free the remctl result and return NULL to indicate a
- * fatal error.
+ * the remctl error and put it into the error field in the remctl result,
+ * leaving it NULL if that fails.  Always returns false for the convenience
+ * of the caller.
  */
-static struct remctl_result *
+static bool
 internal_fail(struct remctl *r, struct remctl_result *result)
 {
-    const char *error;
-
-    error = remctl_error(r);
-    if (error == NULL) {
-        remctl_close(r);
-        remctl_result_free(result);
-        return NULL;
-    } else {
-        result->error = strdup(error);
-        remctl_close(r);
-        if (result->error != NULL)
-            return result;
-        else {
-            remctl_result_free(result);
-            return NULL;
-        }
-    }
+    if (result->error != NULL)
+        free(result->error);
+    result->error = strdup(remctl_error(r));
+    return false;
 }
 
 
@@ -67,7 +55,7 @@ internal_fail(struct remctl *r, struct remctl_result *result)
  * Returns false if something fails and tries to set result->error; if we
  * can't even do that, make sure it's set to NULL.
  */
-static bool
+bool
 internal_output_append(struct remctl_result *result,
                        struct remctl_output *output)
 {
@@ -129,53 +117,74 @@ internal_output_append(struct remctl_result *result,
 
 
 /*
- * The simplified interface.  Given a host, a port, and a command (as a
- * null-terminated argv-style vector), run the command on that host and port
- * and return a struct remctl_result.  The result should be freed with
- * remctl_result_free.
+ * Send a command over an open connection and accumulate all of its output
+ * into result.  Used by the simplified interface and by connection pools.
+ * Returns true if the command completed, whether successfully or with an
+ * error from the server, in which case the connection is ready for another
+ * command.  Returns false on an internal or network failure and tries to set
+ * result->error; if even that fails, it's left NULL.
  */
-struct remctl_result *
-remctl(const char *host, unsigned short port, const char *principal,
-       const char **command)
+bool
+internal_collect(struct remctl *r, const char **command,
+                 struct remctl_result *result)
 {
-    struct remctl *r = NULL;
-    struct remctl_result *result = NULL;
+    struct remctl_output *output;
     enum remctl_output_type type;
 
-    result = calloc(1, sizeof(struct remctl_result));
-    if (result == NULL)
-        return NULL;
-    r = remctl_new();
-    if (r == NULL)
-        return internal_fail(r, result);
-    if (!remctl_open(r, host, port, principal))
-        return internal_fail(r, result);
     if (!remctl_command(r, command))
         return internal_fail(r, result);
     do {
-        struct remctl_output *output;
-
         output = remctl_output(r);
         if (output == NULL)
             return internal_fail(r, result);
         type = output->type;
         if (type == REMCTL_OUT_OUTPUT || type == REMCTL_OUT_ERROR) {
-            if (!internal_output_append(result, output)) {
-                if (result->error != NULL)
-                    return result;
-                else {
-                    remctl_result_free(result);
-                    return NULL;
-                }
-            }
+            if (!internal_output_append(result, output))
+                return false;
         } else if (type == REMCTL_OUT_STATUS) {
             result->status = output->status;
-        } else {
-            remctl_close(r);
-            return result;
         }
     } while (type == REMCTL_OUT_OUTPUT);
+    return true;
+}
+
+
+/*
+ * The simplified interface.  Given a host, a port, and a command (as a
+ * null-terminated argv-style vector), run the command on that host and port
+ * and return a struct remctl_result.  The result should be freed with
+ * remctl_result_free.  If a pool has been set with remctl_set_pool, reuse a
+ * connection from it instead of opening a new one.
+ */
+struct remctl_result *
+remctl(const char *host, unsigned short port, const char *principal,
+       const char **command)
+{
+    struct remctl *r;
+    struct remctl_result *result;
+    struct remctl_pool *pool;
+    bool okay;
+
+    pool = internal_pool_default();
+    if (pool != NULL)
+        return remctl_pool_command(pool, host, port, principal, command);
+    result = calloc(1, sizeof(struct remctl_result));
+    if (result == NULL)
+        return NULL;
+    r = remctl_new();
+    if (r == NULL) {
+        remctl_result_free(result);
+        return NULL;
+    }
+    if (!remctl_open(r, host, port, principal))
+        okay = internal_fail(r, result);
+    else
+        okay = internal_collect(r, command, result);
     remctl_close(r);
+    if (!okay && result->error == NULL) {
+        remctl_result_free(result);
+        return NULL;
+    }
     return result;
 }
 
@@ -306,17 +315,18 @@ remctl_set_timeout(struct remctl *r, time_t timeout)
 
 
 /*
- * Open a new persistant remctl connection to a server, given the host, port,
- * and principal.  Returns true on success and false on failure.
+ * Close any existing connection and reset the error and output before
+ * opening a new connection.
  */
-int
-remctl_open(struct remctl *r, const char *host, unsigned short port,
-            const char *principal)
+static void
+internal_reset(struct remctl *r)
 {
+    internal_async_close(r);
     if (r->fd != -1) {
         if (r->protocol > 1)
             internal_v2_quit(r);
         socket_close(r->fd);
+        r->fd = INVALID_SOCKET;
     }
     if (r->error != NULL) {
         free(r->error);
@@ -327,6 +337,19 @@ remctl_open(struct remctl *r, const char *host, unsigned short port,
         free(r->output);
         r->output = NULL;
     }
+    r->noop_unknown = false;
+}
+
+
+/*
+ * Open a new persistant remctl connection to a server, given the host, port,
+ * and principal.  Returns true on success and false on failure.
+ */
+int
+remctl_open(struct remctl *r, const char *host, unsigned short port,
+            const char *principal)
+{
+    internal_reset(r);
     r->host = host;
     r->port = port;
     r->principal = principal;
@@ -334,6 +357,38 @@ remctl_open(struct remctl *r, const char *host, unsigned short port,
 }
 
 
+/*
+ * Start opening a new persistant remctl connection to a server without
+ * blocking, given the host, port, and principal.  Only resolving the host may
+ * block.  The connection is finished with remctl_open_try.  Returns true on
+ * success and false on failure.
+ */
+int
+remctl_open_start(struct remctl *r, const char *host, unsigned short port,
+                  const char *principal)
+{
+    internal_reset(r);
+    return internal_async_open(r, host, port, principal);
+}
+
+
+/*
+ * Advance the opening of a connection started with remctl_open_start as far
+ * as possible without blocking.  Returns REMCTL_ASYNC_DONE once the
+ * connection is open, REMCTL_ASYNC_PENDING if the caller should wait for the
+ * events returned by remctl_events, and REMCTL_ASYNC_ERROR on failure.
+ */
+enum remctl_async_status
+remctl_open_try(struct remctl *r)
+{
+    if (r->error != NULL) {
+        free(r->error);
+        r->error = NULL;
+    }
+    return internal_async_open_step(r);
+}
+
+
 /*
  * Close a persistant remctl connection.
  */
@@ -343,12 +398,15 @@ remctl_close(struct remctl *r)
     OM_uint32 minor;
 
     if (r != NULL) {
+        internal_async_close(r);
         if (r->protocol > 1 && r->fd != -1)
             internal_v2_quit(r);
         if (r->source != NULL)
             free(r->source);
         if (r->fd != -1)
             socket_close(r->fd);
+        if (r->buffer != NULL)
+            token_buffer_free(r->buffer);
         if (r->error != NULL)
             free(r->error);
         if (r->output != NULL) {
@@ -367,12 +425,14 @@ remctl_close(struct remctl *r)
 /*
  * Internal function to reopen the connection if it was closed and verify that
  * we have an open connection, and reset the error message.  Used by
- * remctl_commandv and remctl_noop.  Returns true on success and false on
- * failure.
+ * remctl_commandv and remctl_noop.  Any non-blocking state is dropped first,
+ * which closes the connection if it was left in the middle of a token.
+ * Returns true on success and false on failure.
  */
 static bool
 internal_reopen(struct remctl *r)
 {
+    internal_async_close(r);
     if (r->fd < 0) {
         if (r->host == NULL) {
             internal_set_error(r, "no connection open");
@@ -438,10 +498,59 @@ remctl_commandv(struct remctl *r, const struct iovec *command, size_t count)
 }
 
 
+/*
+ * Start sending a command without blocking.  The command is queued and as
+ * much of it as possible is sent immediately; the rest is sent by
+ * remctl_output_try.  Returns true on success and false on failure.
+ *
+ * Implement in terms of remctl_commandv_start.
+ */
+int
+remctl_command_start(struct remctl *r, const char **command)
+{
+    struct iovec *vector;
+    size_t count, i;
+    int status;
+
+    for (count = 0; command[count] != NULL; count++)
+        ;
+    vector = malloc(sizeof(struct iovec) * count);
+    if (vector == NULL) {
+        internal_set_error(r, "cannot allocate memory: %s", strerror(errno));
+        return 0;
+    }
+    for (i = 0; i < count; i++) {
+        vector[i].iov_base = (void *) command[i];
+        vector[i].iov_len = strlen(command[i]);
+    }
+    status = remctl_commandv_start(r, vector, count);
+    free(vector);
+    return status;
+}
+
+
+/*
+ * Same as remctl_command_start, but take the command as an array of struct
+ * iovecs instead.  Unlike remctl_commandv, this doesn't reopen a closed
+ * connection, since that could block.
+ */
+int
+remctl_commandv_start(struct remctl *r, const struct iovec *command,
+                      size_t count)
+{
+    if (r->error != NULL) {
+        free(r->error);
+        r->error = NULL;
+    }
+    return internal_async_commandv(r, command, count);
+}
+
+
 /*
  * Send a NOOP command, or return an error if we're using too old of a
  * protocol version.  Returns true on success, false on failure.  On failure,
- * use remctl_error to get the error.
+ * use remctl_error to get the error.  If the server doesn't support NOOP,
+ * the connection is still usable and r->noop_unknown is set.
  */
 int
 remctl_noop(struct remctl *r)
@@ -450,6 +559,7 @@ remctl_noop(struct remctl *r)
         return 0;
     if (r->protocol == 1) {
         internal_set_error(r, "NOOP message not supported");
+        r->noop_unknown = true;
         return 0;
     }
     return internal_noop(r);
@@ -502,6 +612,8 @@ remctl_output(struct remctl *r)
         free(r->error);
         r->error = NULL;
     }
+    if (r->async != NULL)
+        return internal_async_output_wait(r);
     if (r->protocol == 1)
         return internal_v1_output(r);
     else
@@ -509,6 +621,54 @@ remctl_output(struct remctl *r)
 }
 
 
+/*
+ * Retrieve output from the remote server without blocking.  Returns
+ * REMCTL_ASYNC_DONE and stores the output in *output, with the same meaning
+ * as the return value of remctl_output, once a complete message has arrived.
+ * Returns REMCTL_ASYNC_PENDING if the caller should wait for the events
+ * returned by remctl_events and REMCTL_ASYNC_ERROR on failure.
+ */
+enum remctl_async_status
+remctl_output_try(struct remctl *r, struct remctl_output **output)
+{
+    if (r->error != NULL) {
+        free(r->error);
+        r->error = NULL;
+    }
+    return internal_async_output(r, output);
+}
+
+
+/*
+ * Return the file descriptor of the connection to the server, or -1 if there
+ * is no open connection, for use with poll or an event loop.
+ */
+int
+remctl_fd(struct remctl *r)
+{
+    return (r->fd == INVALID_SOCKET) ? -1 : (int) r->fd;
+}
+
+
+/*
+ * Return the events that the non-blocking functions are waiting for on the
+ * connection, as a combination of REMCTL_EVENT_READ and REMCTL_EVENT_WRITE,
+ * or 0 if they aren't waiting for anything.
+ */
+int
+remctl_events(struct remctl *r)
+{
+    int events, wanted = 0;
+
+    events = internal_async_events(r);
+    if (events & POLLIN)
+        wanted |= REMCTL_EVENT_READ;
+    if (events & POLLOUT)
+        wanted |= REMCTL_EVENT_WRITE;
+    return wanted;
+}
+
+
 /*
  * Returns the internal error message after a failure or "no error" if the
  * last command completed successfully.  This should generally only be called
@@ -0,0 +1,780 @@
+/*
+ * Non-blocking connections for the remctl client library.
+ *
+ * The normal remctl API blocks in each call until the network I/O it needs
+ * is done.  The functions here instead drive a connection as a state machine
+ * over a non-blocking socket: starting the TCP connection, establishing the
+ * GSS-API context, sending a command, and reading its output all return as
+ * soon as the socket isn't ready, and the caller waits for the socket with
+ * poll (or any other event loop) and then calls them again.  This is what
+ * lets remctl_multi drive many connections from one thread.
+ *
+ * This is also how remctl_open opens connections: it just waits on the
+ * socket between steps.  Opening a connection falls back on protocol version
+ * one like the blocking code always has, but commands can only be sent
+ * without blocking with protocol version two and later, since version one
+ * requires a new connection for every command and a MIC exchange that
+ * doesn't fit this model.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+#include <portable/gssapi.h>
+#include <portable/socket.h>
+
+#include <errno.h>
+#include <limits.h>
+
+#include <client/internal.h>
+#include <client/remctl.h>
+#include <util/fdflag.h>
+#include <util/network.h>
+#include <util/protocol.h>
+#include <util/tokens.h>
+
+/* Where a non-blocking connection is in opening. */
+enum async_state {
+    ASYNC_CONNECT,              /* Waiting for the TCP connection. */
+    ASYNC_CONTEXT,              /* Establishing the GSS-API context. */
+    ASYNC_OPEN                  /* Context established. */
+};
+
+/* State of a non-blocking connection, kept in struct remctl. */
+struct internal_async {
+    enum async_state state;
+    struct addrinfo *addrs;     /* Addresses for the current port. */
+    struct addrinfo *next;      /* Next address to try. */
+    unsigned short port;        /* Port we're connecting to. */
+    bool fallback;              /* Whether to fall back on the old port. */
+    int err;                    /* Error from the last connect attempt. */
+    gss_name_t name;            /* Server name while negotiating. */
+    char *out;                  /* Data waiting to be sent. */
+    size_t size;                /* Allocated size of out. */
+    size_t length;              /* Length of the data in out. */
+    size_t sent;                /* How much of out has been sent. */
+    unsigned char header[5];    /* Flags and length of the token in. */
+    size_t have;                /* Bytes of the token read so far. */
+    gss_buffer_desc token;      /* Data of the token being read. */
+};
+
+
+/*
+ * Free the non-blocking state of a connection.
+ */
+static void
+async_free(struct internal_async *async)
+{
+    OM_uint32 minor;
+
+    if (async->addrs != NULL)
+        freeaddrinfo(async->addrs);
+    if (async->name != GSS_C_NO_NAME)
+        gss_release_name(&minor, &async->name);
+    free(async->out);
+    free(async->token.value);
+    free(async);
+}
+
+
+/*
+ * Close the socket and delete the context after a failure, leaving the error
+ * in the remctl struct.  Always returns REMCTL_ASYNC_ERROR for the
+ * convenience of the caller.
+ */
+static enum remctl_async_status
+async_fail(struct remctl *r)
+{
+    OM_uint32 minor;
+
+    if (r->fd != INVALID_SOCKET)
+        socket_close(r->fd);
+    r->fd = INVALID_SOCKET;
+    if (r->context != GSS_C_NO_CONTEXT)
+        gss_delete_sec_context(&minor, &r->context, GSS_C_NO_BUFFER);
+    r->ready = false;
+    if (r->async != NULL)
+        async_free(r->async);
+    r->async = NULL;
+    return REMCTL_ASYNC_ERROR;
+}
+
+
+/*
+ * Drop the non-blocking state of a connection.  If the connection hadn't
+ * finished opening, or was in the middle of sending or receiving a token,
+ * close it, since it can't be used for anything else.  Otherwise, put the
+ * socket back in blocking mode and leave it open so that it can be used with
+ * the normal blocking functions or closed cleanly.
+ */
+void
+internal_async_close(struct remctl *r)
+{
+    struct internal_async *async = r->async;
+
+    if (async == NULL)
+        return;
+    if (async->state != ASYNC_OPEN || async->sent < async->length
+        || async->have > 0)
+        async_fail(r);
+    else {
+        fdflag_nonblocking(r->fd, false);
+        async_free(async);
+        r->async = NULL;
+    }
+}
+
+
+/*
+ * Set up the non-blocking state for a connection opened with the blocking
+ * functions, so that the non-blocking functions can be used with it.  Does
+ * nothing if the connection already has non-blocking state.  Returns false
+ * on failure, setting the error.
+ */
+static bool
+async_attach(struct remctl *r)
+{
+    if (r->async != NULL)
+        return true;
+    if (r->fd == INVALID_SOCKET) {
+        internal_set_error(r, "no connection open");
+        return false;
+    }
+    r->async = calloc(1, sizeof(struct internal_async));
+    if (r->async == NULL) {
+        internal_set_error(r, "cannot allocate memory: %s", strerror(errno));
+        return false;
+    }
+    r->async->state = ASYNC_OPEN;
+    r->async->name = GSS_C_NO_NAME;
+    fdflag_nonblocking(r->fd, true);
+    return true;
+}
+
+
+/*
+ * Add a token with the given flags to the data waiting to be sent.  Returns
+ * true on success and false on memory allocation failure.
+ */
+static bool
+async_queue(struct remctl *r, int flags, gss_buffer_t token)
+{
+    struct internal_async *async = r->async;
+    size_t needed;
+    OM_uint32 length;
+    char *out;
+
+    if (async->sent == async->length) {
+        async->sent = 0;
+        async->length = 0;
+    }
+    needed = async->length + 5 + token->length;
+    if (needed > async->size) {
+        out = realloc(async->out, needed);
+        if (out == NULL) {
+            internal_set_error(r, "cannot allocate memory: %s",
+                               strerror(errno));
+            return false;
+        }
+        async->out = out;
+        async->size = needed;
+    }
+    out = async->out + async->length;
+    out[0] = (char) flags;
+    length = htonl(token->length);
+    memcpy(out + 1, &length, 4);
+    memcpy(out + 5, token->value, token->length);
+    async->length = needed;
+    return true;
+}
+
+
+/*
+ * Wrap a data token and add it to the data waiting to be sent.  This is the
+ * send function passed to internal_v2_command_tokens.  Returns true on
+ * success and false on failure, setting the error.
+ */
+static bool
+async_queue_wrapped(struct remctl *r, gss_buffer_t token)
+{
+    gss_buffer_desc wrapped;
+    OM_uint32 major, minor;
+    int state;
+    bool okay;
+
+    if (token->length > TOKEN_MAX_DATA) {
+        internal_token_error(r, "sending token", TOKEN_FAIL_LARGE, 0, 0);
+        return false;
+    }
+    major = gss_wrap(&minor, r->context, 1, GSS_C_QOP_DEFAULT, token, &state,
+                     &wrapped);
+    if (major != GSS_S_COMPLETE) {
+        internal_gssapi_error(r, "wrapping token", major, minor);
+        return false;
+    }
+    okay = async_queue(r, TOKEN_DATA | TOKEN_PROTOCOL, &wrapped);
+    gss_release_buffer(&minor, &wrapped);
+    return okay;
+}
+
+
+/*
+ * Send as much of the waiting data as the socket will take.  Returns
+ * REMCTL_ASYNC_DONE if everything has been sent, REMCTL_ASYNC_PENDING if the
+ * socket is full, or REMCTL_ASYNC_ERROR on error.
+ */
+static enum remctl_async_status
+async_flush(struct remctl *r)
+{
+    struct internal_async *async = r->async;
+    ssize_t status;
+
+    while (async->sent < async->length) {
+        status = send(r->fd, async->out + async->sent,
+                      async->length - async->sent, 0);
+        if (status < 0) {
+            if (socket_errno == EINTR)
+                continue;
+            if (socket_errno == EAGAIN)
+                return REMCTL_ASYNC_PENDING;
+            internal_token_error(r, "sending token", TOKEN_FAIL_SOCKET, 0, 0);
+            return REMCTL_ASYNC_ERROR;
+        }
+        async->sent += status;
+    }
+    return REMCTL_ASYNC_DONE;
+}
+
+
+/*
+ * Read as much of the next token from the server as is available.  Returns
+ * REMCTL_ASYNC_DONE once the token is complete, storing its flags in flags
+ * and its data in token (which the caller must free), REMCTL_ASYNC_PENDING if
+ * more data is needed, or REMCTL_ASYNC_ERROR on error.
+ */
+static enum remctl_async_status
+async_read(struct remctl *r, int *flags, gss_buffer_t token)
+{
+    struct internal_async *async = r->async;
+    ssize_t status;
+    OM_uint32 length;
+    size_t size;
+    char *p;
+
+    do {
+        if (async->have < sizeof(async->header)) {
+            p = (char *) async->header + async->have;
+            size = sizeof(async->header) - async->have;
+        } else {
+            p = (char *) async->token.value;
+            p += async->have - sizeof(async->header);
+            size = async->token.length + sizeof(async->header) - async->have;
+        }
+        if (size > 0) {
+            status = 0;
+            if (r->buffer != NULL)
+                status = token_buffer_take(r->buffer, p, size);
+            if (status == 0)
+                status = recv(r->fd, p, size, 0);
+            if (status == 0) {
+                internal_token_error(r, "receiving token", TOKEN_FAIL_EOF, 0,
+                                     0);
+                return REMCTL_ASYNC_ERROR;
+            } else if (status < 0) {
+                if (socket_errno == EINTR)
+                    continue;
+                if (socket_errno == EAGAIN)
+                    return REMCTL_ASYNC_PENDING;
+                internal_token_error(r, "receiving token", TOKEN_FAIL_SOCKET,
+                                     0, 0);
+                return REMCTL_ASYNC_ERROR;
+            }
+            async->have += status;
+        }
+        if (async->have == sizeof(async->header) && size > 0) {
+            memcpy(&length, async->header + 1, sizeof(length));
+            async->token.length = ntohl(length);
+            if (async->token.length > TOKEN_MAX_LENGTH) {
+                internal_token_error(r, "receiving token", TOKEN_FAIL_LARGE,
+                                     0, 0);
+                return REMCTL_ASYNC_ERROR;
+            }
+            async->token.value = malloc(async->token.length + 1);
+            if (async->token.value == NULL) {
+                internal_token_error(r, "receiving token", TOKEN_FAIL_SYSTEM,
+                                     0, 0);
+                return REMCTL_ASYNC_ERROR;
+            }
+        }
+    } while (async->have < sizeof(async->header)
+             || async->have < async->token.length + sizeof(async->header));
+
+    /* The token is complete.  Hand it to the caller and reset. */
+    *flags = async->header[0];
+    *token = async->token;
+    async->token.value = NULL;
+    async->token.length = 0;
+    async->have = 0;
+    return REMCTL_ASYNC_DONE;
+}
+
+
+/*
+ * Start a connection to the next address that we haven't tried, falling back
+ * on the old remctl port once all addresses for the standard port have been
+ * tried if no port was given.  Returns true if a connection is in progress
+ * and false if there are no more addresses, setting the error.
+ */
+static bool
+async_connect_next(struct remctl *r)
+{
+    struct internal_async *async = r->async;
+    struct addrinfo hints, *ai;
+    char portbuf[16];
+    socket_type fd;
+    int status;
+
+    while (1) {
+        while (async->next != NULL) {
+            ai = async->next;
+            async->next = ai->ai_next;
+            fd = network_client_create(ai->ai_family, SOCK_STREAM, r->source);
+            if (fd == INVALID_SOCKET) {
+                async->err = socket_errno;
+                continue;
+            }
+            fdflag_nonblocking(fd, true);
+            status = connect(fd, ai->ai_addr, ai->ai_addrlen);
+            if (status == 0 || socket_errno == EINPROGRESS) {
+                r->fd = fd;
+                async->state = ASYNC_CONNECT;
+                return true;
+            }
+            async->err = socket_errno;
+            socket_close(fd);
+        }
+        if (!async->fallback)
+            break;
+
+        /* Try again with the old port. */
+        async->fallback = false;
+        async->port = REMCTL_PORT_OLD;
+        freeaddrinfo(async->addrs);
+        async->addrs = NULL;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        snprintf(portbuf, sizeof(portbuf), "%hu", async->port);
+        status = getaddrinfo(r->host, portbuf, &hints, &async->addrs);
+        if (status != 0) {
+            internal_set_error(r, "unknown host %s: %s", r->host,
+                               gai_strerror(status));
+            return false;
+        }
+        async->next = async->addrs;
+    }
+    internal_set_error(r, "cannot connect to %s (port %hu): %s", r->host,
+                       async->port, socket_strerror(async->err));
+    return false;
+}
+
+
+/*
+ * Call gss_init_sec_context with the token from the server, or
+ * GSS_C_NO_BUFFER the first time, and queue any token it generates.  Once
+ * the context is established, check its flags and mark the connection open.
+ * Returns false on failure, setting the error.
+ */
+static bool
+async_context(struct remctl *r, gss_buffer_t token)
+{
+    struct internal_async *async = r->async;
+    gss_buffer_desc send_tok;
+    OM_uint32 major, minor, init_minor, gss_flags;
+    int flags;
+    bool okay = true;
+
+    major = gss_init_sec_context(&init_minor, GSS_C_NO_CREDENTIAL,
+                &r->context, async->name, (const gss_OID) GSS_KRB5_MECHANISM,
+                INTERNAL_GSS_WANTED, 0, NULL, token, NULL, &send_tok,
+                &gss_flags, NULL);
+    flags = TOKEN_CONTEXT;
+    if (r->protocol > 1)
+        flags |= TOKEN_PROTOCOL;
+    if (send_tok.length != 0)
+        okay = async_queue(r, flags, &send_tok);
+    gss_release_buffer(&minor, &send_tok);
+    if (!okay)
+        return false;
+    if (major != GSS_S_COMPLETE && major != GSS_S_CONTINUE_NEEDED) {
+        internal_gssapi_error(r, "initializing context", major, init_minor);
+        return false;
+    }
+    if (major == GSS_S_CONTINUE_NEEDED)
+        return true;
+
+    /*
+     * If the flags we get back from the server are bad and we're doing
+     * protocol v2, report an error and abort.  This must be done after
+     * establishing the context, since Heimdal doesn't report all flags until
+     * context negotiation is complete.
+     */
+    if (r->protocol > 1
+        && (gss_flags & INTERNAL_GSS_REQUIRED) != INTERNAL_GSS_REQUIRED) {
+        internal_set_error(r, "server did not negotiate acceptable GSS-API"
+                           " flags");
+        return false;
+    }
+    gss_release_name(&minor, &async->name);
+    async->name = GSS_C_NO_NAME;
+    async->state = ASYNC_OPEN;
+    return true;
+}
+
+
+/*
+ * Start opening a non-blocking connection to the given host, port, and
+ * principal.  This resolves the host, which may block, and starts the TCP
+ * connection.  The caller should then call internal_async_open_step each
+ * time the socket is ready for the events given by internal_async_events.
+ * If r->canonicalize is set and principal is NULL, the canonical name from
+ * the lookup is used for the server principal.  Returns false on failure,
+ * setting the error.
+ */
+bool
+internal_async_open(struct remctl *r, const char *host, unsigned short port,
+                    const char *principal)
+{
+    struct internal_async *async;
+    struct addrinfo hints;
+    const char *name;
+    char portbuf[16];
+    int status;
+    OM_uint32 minor;
+
+    /* Discard any previous connection. */
+    internal_async_close(r);
+    if (r->fd != INVALID_SOCKET)
+        socket_close(r->fd);
+    r->fd = INVALID_SOCKET;
+    if (r->context != GSS_C_NO_CONTEXT)
+        gss_delete_sec_context(&minor, &r->context, GSS_C_NO_BUFFER);
+    r->ready = false;
+    r->async = calloc(1, sizeof(struct internal_async));
+    if (r->async == NULL) {
+        internal_set_error(r, "cannot allocate memory: %s", strerror(errno));
+        return false;
+    }
+    async = r->async;
+    async->name = GSS_C_NO_NAME;
+    r->host = host;
+    r->port = port;
+    r->principal = principal;
+    if (r->protocol == 0)
+        r->protocol = 2;
+    if (r->buffer != NULL) {
+        token_buffer_free(r->buffer);
+        r->buffer = NULL;
+    }
+    if (port == 0) {
+        async->port = REMCTL_PORT;
+        async->fallback = true;
+    } else
+        async->port = port;
+
+    /* Resolve the host and import the name. */
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (r->canonicalize && principal == NULL)
+        hints.ai_flags = AI_CANONNAME;
+    snprintf(portbuf, sizeof(portbuf), "%hu", async->port);
+    status = getaddrinfo(host, portbuf, &hints, &async->addrs);
+    if (status != 0) {
+        internal_set_error(r, "unknown host %s: %s", host,
+                           gai_strerror(status));
+        async_fail(r);
+        return false;
+    }
+    async->next = async->addrs;
+    name = host;
+    if (r->canonicalize && principal == NULL
+        && async->addrs->ai_canonname != NULL)
+        name = async->addrs->ai_canonname;
+    if (!internal_import_name(r, name, principal, &async->name)) {
+        async_fail(r);
+        return false;
+    }
+
+    /* Start the connection. */
+    if (!async_connect_next(r)) {
+        async_fail(r);
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Return the poll events that a non-blocking connection is waiting for:
+ * POLLOUT while connecting or while there is data waiting to be sent, and
+ * otherwise POLLIN if a response from the server is expected.  Returns 0
+ * if the connection isn't waiting for anything.
+ */
+int
+internal_async_events(struct remctl *r)
+{
+    struct internal_async *async = r->async;
+
+    if (async == NULL)
+        return 0;
+    if (async->state == ASYNC_CONNECT || async->sent < async->length)
+        return POLLOUT;
+    if (async->state == ASYNC_CONTEXT || r->ready)
+        return POLLIN;
+    return 0;
+}
+
+
+/*
+ * Advance the opening of a non-blocking connection as far as possible
+ * without blocking.  Returns REMCTL_ASYNC_DONE once the connection is open
+ * and the last negotiation token has been sent, REMCTL_ASYNC_PENDING if we're
+ * waiting on the socket, and REMCTL_ASYNC_ERROR on failure, setting the error
+ * and closing the connection.
+ */
+enum remctl_async_status
+internal_async_open_step(struct remctl *r)
+{
+    struct internal_async *async = r->async;
+    gss_buffer_desc empty_token = { 0, (void *) "" };
+    gss_buffer_desc token;
+    enum remctl_async_status status;
+    struct pollfd pfd;
+    socklen_t length;
+    int err, flags;
+    bool okay;
+
+    if (async == NULL) {
+        internal_set_error(r, "no connection open");
+        return REMCTL_ASYNC_ERROR;
+    }
+
+    /*
+     * See if the TCP connection has completed.  SO_ERROR is only meaningful
+     * once the socket is writable, so check that first.
+     */
+    if (async->state == ASYNC_CONNECT) {
+        pfd.fd = r->fd;
+        pfd.events = POLLOUT;
+        if (socket_poll(&pfd, 1, 0) == 0)
+            return REMCTL_ASYNC_PENDING;
+        length = sizeof(err);
+        if (getsockopt(r->fd, SOL_SOCKET, SO_ERROR, (void *) &err,
+                       &length) < 0)
+            err = socket_errno;
+        if (err == EINPROGRESS || err == EALREADY)
+            return REMCTL_ASYNC_PENDING;
+        if (err != 0) {
+            async->err = err;
+            socket_close(r->fd);
+            r->fd = INVALID_SOCKET;
+            if (!async_connect_next(r))
+                return async_fail(r);
+            return REMCTL_ASYNC_PENDING;
+        }
+
+        /*
+         * Connected.  Queue the initial negotiation token and the first
+         * token of the context.
+         */
+        async->state = ASYNC_CONTEXT;
+        flags = TOKEN_NOOP | TOKEN_CONTEXT_NEXT | TOKEN_PROTOCOL;
+        if (!async_queue(r, flags, &empty_token))
+            return async_fail(r);
+        if (!async_context(r, GSS_C_NO_BUFFER))
+            return async_fail(r);
+    }
+
+    /* Send what we have, and then read and process tokens from the server. */
+    while (1) {
+        status = async_flush(r);
+        if (status == REMCTL_ASYNC_ERROR)
+            return async_fail(r);
+        if (async->state == ASYNC_OPEN)
+            return status;
+        status = async_read(r, &flags, &token);
+        if (status == REMCTL_ASYNC_ERROR)
+            return async_fail(r);
+        if (status == REMCTL_ASYNC_PENDING)
+            return REMCTL_ASYNC_PENDING;
+        if (r->protocol > 1 && (flags & TOKEN_PROTOCOL) != TOKEN_PROTOCOL)
+            r->protocol = 1;
+        okay = async_context(r, &token);
+        free(token.value);
+        if (!okay)
+            return async_fail(r);
+    }
+}
+
+
+/*
+ * Check that a connection can be used for non-blocking commands, setting up
+ * the non-blocking state if it was opened with the blocking functions.
+ * Returns false on failure, setting the error.
+ */
+static bool
+async_check_open(struct remctl *r)
+{
+    if (!async_attach(r))
+        return false;
+    if (r->async->state != ASYNC_OPEN) {
+        internal_set_error(r, "connection not yet open");
+        return false;
+    }
+    if (r->protocol < 2) {
+        internal_set_error(r, "non-blocking commands require protocol"
+                           " version 2");
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Queue a command on an open connection and send as much of it as possible
+ * without blocking.  Returns false on failure, setting the error.  The output
+ * is then retrieved with internal_async_output.
+ */
+bool
+internal_async_commandv(struct remctl *r, const struct iovec *command,
+                        size_t count)
+{
+    if (!async_check_open(r))
+        return false;
+    if (!internal_v2_command_tokens(r, command, count, async_queue_wrapped))
+        return false;
+    if (async_flush(r) == REMCTL_ASYNC_ERROR) {
+        async_fail(r);
+        return false;
+    }
+    r->ready = true;
+    return true;
+}
+
+
+/*
+ * Retrieve the next output from the server on a non-blocking connection.
+ * Returns REMCTL_ASYNC_DONE and stores the output in *output when a complete
+ * message has been read, with REMCTL_OUT_DONE once the command is finished,
+ * just like remctl_output.  Returns REMCTL_ASYNC_PENDING if the socket isn't
+ * ready and REMCTL_ASYNC_ERROR on failure, setting the error.
+ */
+enum remctl_async_status
+internal_async_output(struct remctl *r, struct remctl_output **output)
+{
+    gss_buffer_desc wrapped, token;
+    enum remctl_async_status status;
+    OM_uint32 major, minor;
+    int flags, state;
+
+    if (!async_check_open(r))
+        return REMCTL_ASYNC_ERROR;
+    if (async_flush(r) == REMCTL_ASYNC_ERROR)
+        return async_fail(r);
+    if (!internal_v2_output_init(r))
+        return REMCTL_ASYNC_ERROR;
+    if (!r->ready) {
+        *output = r->output;
+        return REMCTL_ASYNC_DONE;
+    }
+    status = async_read(r, &flags, &wrapped);
+    if (status == REMCTL_ASYNC_ERROR)
+        return async_fail(r);
+    if (status == REMCTL_ASYNC_PENDING)
+        return REMCTL_ASYNC_PENDING;
+    major = gss_unwrap(&minor, r->context, &wrapped, &token, &state, NULL);
+    free(wrapped.value);
+    if (major != GSS_S_COMPLETE) {
+        internal_gssapi_error(r, "receiving token", major, minor);
+        return async_fail(r);
+    }
+    if (!internal_v2_check_token(r, flags, &token))
+        return REMCTL_ASYNC_ERROR;
+    *output = internal_v2_parse_output(r, &token);
+    return (*output == NULL) ? REMCTL_ASYNC_ERROR : REMCTL_ASYNC_DONE;
+}
+
+
+/*
+ * Wait until a non-blocking connection is ready for the events it's waiting
+ * for, or until the timeout set for the connection expires.  This is used to
+ * implement the blocking functions on top of the non-blocking ones.  If
+ * connecting to one address times out, move on to the next.  Returns false
+ * on a timeout or other failure, setting the error and closing the
+ * connection.
+ */
+bool
+internal_async_wait(struct remctl *r)
+{
+    struct pollfd pfd;
+    time_t wait;
+    int status, timeout;
+
+    if (r->async == NULL) {
+        internal_set_error(r, "no connection open");
+        return false;
+    }
+    pfd.fd = r->fd;
+    pfd.events = internal_async_events(r);
+    wait = r->timeout;
+    if (wait > INT_MAX / 1000)
+        wait = INT_MAX / 1000;
+    timeout = (wait > 0) ? (int) wait * 1000 : -1;
+    do {
+        status = socket_poll(&pfd, 1, timeout);
+    } while (status < 0 && socket_errno == EINTR);
+    if (status > 0)
+        return true;
+    if (status < 0) {
+        internal_set_error(r, "cannot wait for server: %s",
+                           socket_strerror(socket_errno));
+        async_fail(r);
+        return false;
+    }
+
+    /* We timed out. */
+    if (r->async->state == ASYNC_CONNECT) {
+        r->async->err = ETIMEDOUT;
+        socket_close(r->fd);
+        r->fd = INVALID_SOCKET;
+        if (async_connect_next(r))
+            return true;
+    } else if (pfd.events == POLLOUT)
+        internal_token_error(r, "sending token", TOKEN_FAIL_TIMEOUT, 0, 0);
+    else
+        internal_token_error(r, "receiving token", TOKEN_FAIL_TIMEOUT, 0, 0);
+    async_fail(r);
+    return false;
+}
+
+
+/*
+ * Retrieve the next output from the server, waiting for it.  This is
+ * remctl_output for connections that are using the non-blocking functions,
+ * so that the two can be mixed.  Returns NULL on failure, setting the error.
+ */
+struct remctl_output *
+internal_async_output_wait(struct remctl *r)
+{
+    enum remctl_async_status status;
+    struct remctl_output *output = NULL;
+
+    do {
+        status = internal_async_output(r, &output);
+        if (status == REMCTL_ASYNC_PENDING && !internal_async_wait(r))
+            return NULL;
+    } while (status == REMCTL_ASYNC_PENDING);
+    return (status == REMCTL_ASYNC_DONE) ? output : NULL;
+}
@@ -27,8 +27,29 @@
 
 
 /*
- * Send a command to the server using protocol v2.  Returns true on success,
- * false on failure.
+ * Wrap and send a token to the server, setting the error on failure.  Used as
+ * the send function for internal_v2_command_tokens by internal_v2_commandv.
+ */
+static bool
+internal_v2_send_token(struct remctl *r, gss_buffer_t token)
+{
+    OM_uint32 major, minor;
+    int status;
+
+    status = token_send_priv(r->fd, r->context, TOKEN_DATA | TOKEN_PROTOCOL,
+                             token, r->timeout, &major, &minor);
+    if (status != TOKEN_OK) {
+        internal_token_error(r, "sending token", status, major, minor);
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Break a command into protocol v2 tokens and pass each of them to the given
+ * send function, which is responsible for wrapping the token and setting the
+ * error on failure.  Returns true on success, false on failure.
  *
  * All of the complexity in this function comes from implementing command
  * continuation.  The protocol specifies that commands can be continued by
@@ -40,14 +61,14 @@
  * TOKEN_MAX_DATA.
  */
 bool
-internal_v2_commandv(struct remctl *r, const struct iovec *command,
-                     size_t count)
+internal_v2_command_tokens(struct remctl *r, const struct iovec *command,
+                           size_t count,
+                           bool (*send)(struct remctl *, gss_buffer_t))
 {
     size_t length, iov, offset, sent, left, delta;
     gss_buffer_desc token;
     char *p;
-    OM_uint32 data, major, minor;
-    int status;
+    OM_uint32 data;
 
     /* Determine the total length of the message. */
     length = 4;
@@ -148,16 +169,27 @@ internal_v2_commandv(struct remctl *r, const struct iovec *command,
 
         /* Send the result. */
         token.length -= left;
-        status = token_send_priv(r->fd, r->context,
-                                 TOKEN_DATA | TOKEN_PROTOCOL, &token,
-                                 r->timeout, &major, &minor);
-        if (status != TOKEN_OK) {
-            internal_token_error(r, "sending token", status, major, minor);
+        if (!send(r, &token)) {
             free(token.value);
             return false;
         }
         free(token.value);
     }
+    return true;
+}
+
+
+/*
+ * Send a command to the server using protocol v2.  Returns true on success,
+ * false on failure.
+ */
+bool
+internal_v2_commandv(struct remctl *r, const struct iovec *command,
+                     size_t count)
+{
+    if (!internal_v2_command_tokens(r, command, count,
+                                    internal_v2_send_token))
+        return false;
     r->ready = true;
     return true;
 }
@@ -188,27 +220,16 @@ internal_v2_quit(struct remctl *r)
 
 
 /*
- * Read a token from the server connection and store it in the provided
- * buffer.  Return true on success and false on any failure.
+ * Check the flags and header of an unwrapped token from the server.  Returns
+ * true if it looks like a valid protocol v2 or v3 message.  Otherwise, sets
+ * the error, frees the token, and returns false.
  */
-static bool
-internal_v2_read_token(struct remctl *r, gss_buffer_t token)
+bool
+internal_v2_check_token(struct remctl *r, int flags, gss_buffer_t token)
 {
-    int status, flags;
-    OM_uint32 major, minor;
+    OM_uint32 minor;
     char *p;
 
-    status = token_recv_priv(r->fd, r->context, &flags, token,
-                             TOKEN_MAX_LENGTH, r->timeout, &major, &minor);
-    if (status != TOKEN_OK) {
-        internal_token_error(r, "receiving token", status, major, minor);
-        if (status == TOKEN_FAIL_EOF || status == TOKEN_FAIL_TIMEOUT) {
-            gss_delete_sec_context(&minor, &r->context, GSS_C_NO_BUFFER);
-            socket_close(r->fd);
-            r->fd = INVALID_SOCKET;
-        }
-        return false;
-    }
     if (flags != (TOKEN_DATA | TOKEN_PROTOCOL)) {
         internal_set_error(r, "unexpected token from server");
         goto fail;
@@ -230,6 +251,34 @@ fail:
 }
 
 
+/*
+ * Read a token from the server connection and store it in the provided
+ * buffer.  Return true on success and false on any failure.
+ */
+static bool
+internal_v2_read_token(struct remctl *r, gss_buffer_t token)
+{
+    int status, flags;
+    OM_uint32 major, minor;
+
+    if (r->buffer == NULL)
+        r->buffer = token_buffer_new();
+    status = token_recv_priv_buffered(r->fd, r->buffer, r->context, &flags,
+                                      token, TOKEN_MAX_LENGTH, r->timeout,
+                                      &major, &minor);
+    if (status != TOKEN_OK) {
+        internal_token_error(r, "receiving token", status, major, minor);
+        if (status == TOKEN_FAIL_EOF || status == TOKEN_FAIL_TIMEOUT) {
+            gss_delete_sec_context(&minor, &r->context, GSS_C_NO_BUFFER);
+            socket_close(r->fd);
+            r->fd = INVALID_SOCKET;
+        }
+        return false;
+    }
+    return internal_v2_check_token(r, flags, token);
+}
+
+
 /*
  * Read a string from a server token, with its length starting at the given
  * offset, and store it in newly allocated memory in the remctl struct.
@@ -261,6 +310,27 @@ internal_v2_read_string(struct remctl *r, gss_buffer_t token, size_t offset)
 }
 
 
+/*
+ * Allocate the output struct if necessary and reset it to REMCTL_OUT_DONE.
+ * Returns true on success and false on memory allocation failure.
+ */
+bool
+internal_v2_output_init(struct remctl *r)
+{
+    if (r->output == NULL) {
+        r->output = malloc(sizeof(struct remctl_output));
+        if (r->output == NULL) {
+            internal_set_error(r, "cannot allocate memory: %s",
+                               strerror(errno));
+            return false;
+        }
+        r->output->data = NULL;
+    }
+    internal_output_wipe(r->output);
+    return true;
+}
+
+
 /*
  * Retrieve the output from the server using protocol v2 and return it.  This
  * function may be called any number of times; if the last packet we got from
@@ -272,30 +342,35 @@ struct remctl_output *
 internal_v2_output(struct remctl *r)
 {
     gss_buffer_desc token = GSS_C_EMPTY_BUFFER;
-    OM_uint32 data, minor;
-    char *p;
-    int type;
 
     /*
      * Initialize our output.  If we're not ready to read more data from the
      * server, return REMCTL_OUT_DONE.
      */
-    if (r->output == NULL) {
-        r->output = malloc(sizeof(struct remctl_output));
-        if (r->output == NULL) {
-            internal_set_error(r, "cannot allocate memory: %s",
-                               strerror(errno));
-            return NULL;
-        }
-        r->output->data = NULL;
-    }
-    internal_output_wipe(r->output);
+    if (!internal_v2_output_init(r))
+        return NULL;
     if (!r->ready)
         return r->output;
 
     /* Otherwise, we have to read the token from the server. */
     if (!internal_v2_read_token(r, &token))
         return NULL;
+    return internal_v2_parse_output(r, &token);
+}
+
+
+/*
+ * Parse a checked token from the server into the output struct, which must
+ * already have been reset with internal_v2_output_init, and free the token.
+ * Returns the output struct on success and NULL on failure.
+ */
+struct remctl_output *
+internal_v2_parse_output(struct remctl *r, gss_buffer_t buffer)
+{
+    gss_buffer_desc token = *buffer;
+    OM_uint32 data, minor;
+    char *p;
+    int type;
 
     /* Now, what we do depends on the message type. */
     p = token.value;
@@ -356,14 +431,18 @@ fail:
 
 /*
  * Send a NOOP command to the server using protocol v3 and read the response.
- * Returns true on success, false on failure.
+ * Returns true on success, false on failure.  Servers that only speak
+ * protocol v2 reply with a version message and servers that don't know NOOP
+ * reply with an unknown message error; in both cases the connection is still
+ * usable, so set r->noop_unknown so that the caller can tell.
  */
 bool
 internal_noop(struct remctl *r)
 {
     gss_buffer_desc token;
     char buffer[2] = { 3, MESSAGE_NOOP };
-    OM_uint32 major, minor;
+    OM_uint32 code, major, minor;
+    bool unknown = false;
     int status;
     char *p;
 
@@ -383,6 +462,16 @@ internal_noop(struct remctl *r)
     if (!internal_v2_read_token(r, &token))
         return false;
     p = token.value;
+    if (p[1] == MESSAGE_ERROR && token.length >= 2 + 4) {
+        memcpy(&code, p + 2, 4);
+        unknown = (ntohl(code) == ERROR_UNKNOWN_MESSAGE);
+    }
+    if (p[1] == MESSAGE_VERSION || unknown) {
+        internal_set_error(r, "NOOP message not supported");
+        r->noop_unknown = true;
+        gss_release_buffer(&minor, &token);
+        return false;
+    }
     if (p[1] != MESSAGE_NOOP) {
         internal_set_error(r, "unexpected message type %d from server", p[1]);
         gss_release_buffer(&minor, &token);
@@ -19,8 +19,10 @@
 #include <portable/stdbool.h>
 #include <sys/types.h>
 
-/* Forward declaration to avoid unnecessary includes. */
-struct iovec;
+#include <client/remctl.h>
+
+/* Forward declarations to avoid unnecessary includes. */
+struct internal_async;
 
 /* Private structure that holds the details of an open remctl connection. */
 struct remctl {
@@ -36,8 +38,19 @@ struct remctl {
     struct remctl_output *output;
     int status;
     bool ready;                 /* If true, we are expecting server output. */
+    struct token_buffer *buffer; /* Read-ahead buffer for v2 tokens. */
+    struct internal_async *async; /* State for non-blocking connections. */
+    bool noop_unknown;          /* Server rejected NOOP as unknown. */
+    bool canonicalize;          /* Use the canonical host in the principal. */
 };
 
+/* GSS-API flags we ask for and those the server must agree to. */
+#define INTERNAL_GSS_WANTED                                     \
+    (GSS_C_MUTUAL_FLAG | GSS_C_CONF_FLAG | GSS_C_INTEG_FLAG     \
+     | GSS_C_REPLAY_FLAG | GSS_C_SEQUENCE_FLAG)
+#define INTERNAL_GSS_REQUIRED \
+    (GSS_C_MUTUAL_FLAG | GSS_C_CONF_FLAG | GSS_C_INTEG_FLAG)
+
 BEGIN_DECLS
 
 /* Internal functions should all default to hidden visibility. */
@@ -53,10 +66,37 @@ void internal_token_error(struct remctl *, const char *error, int status,
 /* Wipe and free the output token. */
 void internal_output_wipe(struct remctl_output *);
 
+/* Add output to a result for the simplified interface. */
+bool internal_output_append(struct remctl_result *, struct remctl_output *);
+
+/* Run a command and accumulate its output for the simplified interface. */
+bool internal_collect(struct remctl *, const char **command,
+                      struct remctl_result *);
+
+/* Returns the pool used by the simplified interface, or NULL. */
+struct remctl_pool *internal_pool_default(void);
+
 /* General connection opening and negotiation function. */
 bool internal_open(struct remctl *, const char *host, unsigned short port,
                    const char *principal);
 
+/* Convert the host and principal into a GSS-API name. */
+bool internal_import_name(struct remctl *, const char *host,
+                          const char *principal, gss_name_t *);
+
+/* Non-blocking connections.  See async.c for the details. */
+bool internal_async_open(struct remctl *, const char *host,
+                         unsigned short port, const char *principal);
+enum remctl_async_status internal_async_open_step(struct remctl *);
+int internal_async_events(struct remctl *);
+bool internal_async_commandv(struct remctl *, const struct iovec *command,
+                             size_t count);
+enum remctl_async_status internal_async_output(struct remctl *,
+                                                 struct remctl_output **);
+void internal_async_close(struct remctl *);
+bool internal_async_wait(struct remctl *);
+struct remctl_output *internal_async_output_wait(struct remctl *);
+
 /* Send a protocol v1 command. */
 bool internal_v1_commandv(struct remctl *, const struct iovec *command,
                           size_t count);
@@ -68,6 +108,14 @@ struct remctl_output *internal_v1_output(struct remctl *);
 bool internal_v2_commandv(struct remctl *, const struct iovec *command,
                           size_t count);
 
+/*
+ * Build the protocol v2 tokens for a command, passing each to the send
+ * function, which is responsible for wrapping and sending it.
+ */
+bool internal_v2_command_tokens(struct remctl *, const struct iovec *command,
+                                size_t count,
+                                bool (*send)(struct remctl *, gss_buffer_t));
+
 /* Send a protocol v3 NOOP command. */
 bool internal_noop(struct remctl *);
 
@@ -77,6 +125,11 @@ bool internal_v2_quit(struct remctl *);
 /* Read a protocol v2 response. */
 struct remctl_output *internal_v2_output(struct remctl *);
 
+/* Pieces of internal_v2_output shared with non-blocking connections. */
+bool internal_v2_check_token(struct remctl *, int flags, gss_buffer_t);
+bool internal_v2_output_init(struct remctl *);
+struct remctl_output *internal_v2_parse_output(struct remctl *, gss_buffer_t);
+
 /* Undo default visibility change. */
 #pragma GCC visibility pop
 
@@ -0,0 +1,641 @@
+/*
+ * Running one command on many hosts in parallel.
+ *
+ * A remctl_multi struct holds a list of hosts and a command.  It opens
+ * non-blocking connections to up to a configurable number of those hosts at
+ * a time, sends the command to each, and waits on all of the sockets with a
+ * single poll call, so the whole fan-out runs in one thread.  The caller
+ * either retrieves output as it arrives from any host with
+ * remctl_multi_output or runs everything to completion with
+ * remctl_multi_run and then looks at the result for each host.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+#include <portable/socket.h>
+#include <portable/uio.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#include <client/internal.h>
+#include <client/remctl.h>
+
+/* Where each host is in running the command. */
+enum multi_state {
+    MULTI_WAITING,              /* Not started yet. */
+    MULTI_OPENING,              /* Opening the connection. */
+    MULTI_RUNNING,              /* Command sent, reading output. */
+    MULTI_FINISHED,             /* Final output returned to the caller. */
+    MULTI_DONE                  /* Connection closed. */
+};
+
+/* A host to run the command on. */
+struct multi_host {
+    char *host;
+    unsigned short port;
+    char *principal;
+    enum multi_state state;
+    struct remctl *r;
+    bool runnable;              /* Whether to step without waiting. */
+    time_t deadline;            /* When to give up waiting, or 0. */
+    struct remctl_output error; /* For reporting local failures. */
+    struct remctl_result *result;
+};
+
+/* The set of hosts, the command, and the state of the poll loop. */
+struct remctl_multi {
+    struct multi_host *hosts;
+    size_t count;
+    size_t size;                /* Allocated size of hosts. */
+    size_t parallel;            /* Maximum open connections, or 0. */
+    time_t timeout;             /* Network timeout, or 0. */
+    bool canonicalize;          /* Canonicalize hosts for the principal. */
+    char *source;               /* Source address for connections. */
+    struct iovec *command;
+    size_t argc;
+    size_t next;                /* Next host to start. */
+    size_t active;              /* Number of hosts started but not done. */
+    size_t current;             /* Where to start looking for output. */
+    struct pollfd *pfds;
+    size_t *polled;             /* Host index for each entry in pfds. */
+    struct remctl_output done;  /* Returned when everything is finished. */
+    char *error;
+};
+
+
+/*
+ * Set the error for the multi struct.  On memory allocation failure, the
+ * error is left NULL, which remctl_multi_error turns into a generic message.
+ */
+static void
+multi_set_error(struct remctl_multi *m, const char *error)
+{
+    free(m->error);
+    m->error = strdup(error);
+}
+
+
+/*
+ * Close the connection to a host, if any, and free the local error message.
+ */
+static void
+multi_host_close(struct multi_host *host)
+{
+    if (host->r != NULL)
+        remctl_close(host->r);
+    host->r = NULL;
+    free(host->error.data);
+    host->error.data = NULL;
+    host->error.length = 0;
+}
+
+
+/*
+ * Report a local failure for a host as a REMCTL_OUT_ERROR output with an
+ * error code of 0, taking the message from the remctl struct if the message
+ * isn't given.  The connection is closed once the caller asks for the next
+ * output.  Returns the output, or NULL on memory allocation failure.
+ */
+static struct remctl_output *
+multi_host_fail(struct remctl_multi *m, struct multi_host *host,
+                const char *message)
+{
+    if (message == NULL)
+        message = remctl_error(host->r);
+    host->state = MULTI_FINISHED;
+    host->runnable = false;
+    host->error.type = REMCTL_OUT_ERROR;
+    host->error.data = strdup(message);
+    if (host->error.data == NULL) {
+        multi_set_error(m, "cannot allocate memory");
+        return NULL;
+    }
+    host->error.length = strlen(host->error.data);
+    host->error.stream = 0;
+    host->error.status = 0;
+    host->error.error = 0;
+    return &host->error;
+}
+
+
+/*
+ * Start the connection to a host.  Returns true on success or false if the
+ * host failed immediately, in which case the caller should call
+ * multi_host_fail.  Returns false with host->r set to NULL on memory
+ * allocation failure.
+ */
+static bool
+multi_host_start(struct remctl_multi *m, struct multi_host *host)
+{
+    host->r = remctl_new();
+    if (host->r == NULL)
+        return false;
+    m->active++;
+    host->state = MULTI_OPENING;
+    host->runnable = true;
+    host->deadline = (m->timeout > 0) ? time(NULL) + m->timeout : 0;
+    if (m->source != NULL && !remctl_set_source_ip(host->r, m->source))
+        return false;
+    remctl_set_timeout(host->r, m->timeout);
+    host->r->canonicalize = m->canonicalize;
+    return internal_async_open(host->r, host->host, host->port,
+                               host->principal);
+}
+
+
+/*
+ * Do as much work for a host as possible without blocking.  Returns the
+ * next output from that host, or NULL with *pending set to true if there is
+ * nothing yet.  Returns NULL with *pending set to false on a fatal error.
+ */
+static struct remctl_output *
+multi_host_step(struct remctl_multi *m, struct multi_host *host,
+                bool *pending)
+{
+    enum remctl_async_status status;
+    struct remctl_output *output;
+
+    *pending = false;
+    if (host->state == MULTI_OPENING) {
+        status = internal_async_open_step(host->r);
+        if (status == REMCTL_ASYNC_ERROR)
+            return multi_host_fail(m, host, NULL);
+        if (status == REMCTL_ASYNC_PENDING) {
+            host->runnable = false;
+            *pending = true;
+            return NULL;
+        }
+        if (!internal_async_commandv(host->r, m->command, m->argc))
+            return multi_host_fail(m, host, NULL);
+        host->state = MULTI_RUNNING;
+    }
+    status = internal_async_output(host->r, &output);
+    if (status == REMCTL_ASYNC_ERROR)
+        return multi_host_fail(m, host, NULL);
+    if (status == REMCTL_ASYNC_PENDING) {
+        host->runnable = false;
+        *pending = true;
+        return NULL;
+    }
+    if (output->type != REMCTL_OUT_OUTPUT) {
+        host->state = MULTI_FINISHED;
+        host->runnable = false;
+    }
+    return output;
+}
+
+
+/*
+ * Wait for any of the started hosts to be ready, marking those that are as
+ * runnable and failing those whose timeout has expired.  Returns false on
+ * failure of poll or memory allocation.
+ */
+static bool
+multi_wait(struct remctl_multi *m)
+{
+    struct multi_host *host;
+    size_t i, n;
+    time_t now, wait;
+    int timeout, status;
+
+    /* Build the list of sockets to poll and find the nearest deadline. */
+    if (m->pfds == NULL || m->polled == NULL) {
+        free(m->pfds);
+        free(m->polled);
+        m->pfds = calloc(m->count, sizeof(struct pollfd));
+        m->polled = calloc(m->count, sizeof(size_t));
+        if (m->pfds == NULL || m->polled == NULL) {
+            multi_set_error(m, "cannot allocate memory");
+            return false;
+        }
+    }
+    now = time(NULL);
+    timeout = -1;
+    for (n = 0, i = 0; i < m->count; i++) {
+        host = &m->hosts[i];
+        if (host->state != MULTI_OPENING && host->state != MULTI_RUNNING)
+            continue;
+        m->pfds[n].fd = host->r->fd;
+        m->pfds[n].events = internal_async_events(host->r);
+        m->pfds[n].revents = 0;
+        m->polled[n] = i;
+        n++;
+        if (host->deadline > 0) {
+            wait = (host->deadline > now) ? host->deadline - now : 0;
+            if (wait > INT_MAX / 1000)
+                wait = INT_MAX / 1000;
+            if (timeout < 0 || wait * 1000 < timeout)
+                timeout = wait * 1000;
+        }
+    }
+
+    /* Wait for something to happen. */
+    do {
+        status = poll(m->pfds, n, timeout);
+    } while (status < 0 && errno == EINTR);
+    if (status < 0) {
+        multi_set_error(m, strerror(errno));
+        return false;
+    }
+
+    /* Mark the hosts that are ready and find those that timed out. */
+    now = time(NULL);
+    for (i = 0; i < n; i++) {
+        host = &m->hosts[m->polled[i]];
+        if (m->pfds[i].revents != 0) {
+            host->runnable = true;
+            if (m->timeout > 0)
+                host->deadline = now + m->timeout;
+        } else if (host->deadline > 0 && now >= host->deadline) {
+            internal_set_error(host->r, "timed out waiting for %s",
+                               host->host);
+            socket_close(host->r->fd);
+            host->r->fd = INVALID_SOCKET;
+            host->state = MULTI_FINISHED;
+            host->runnable = true;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Create a new remctl_multi struct with no hosts.  Returns NULL on memory
+ * allocation failure.
+ */
+struct remctl_multi *
+remctl_multi_new(void)
+{
+    struct remctl_multi *m;
+
+    if (!socket_init())
+        return NULL;
+    m = calloc(1, sizeof(struct remctl_multi));
+    if (m == NULL)
+        return NULL;
+    m->hosts = NULL;
+    m->source = NULL;
+    m->command = NULL;
+    m->pfds = NULL;
+    m->polled = NULL;
+    m->error = NULL;
+    m->done.type = REMCTL_OUT_DONE;
+    return m;
+}
+
+
+/*
+ * Add a host to run the command on.  port and principal are as for
+ * remctl_open.  Returns true on success and false on failure.
+ */
+int
+remctl_multi_add(struct remctl_multi *m, const char *host,
+                 unsigned short port, const char *principal)
+{
+    struct multi_host *hosts, *new;
+    size_t size;
+
+    if (m->count == m->size) {
+        size = (m->size == 0) ? 16 : m->size * 2;
+        hosts = realloc(m->hosts, size * sizeof(struct multi_host));
+        if (hosts == NULL)
+            goto fail;
+        m->hosts = hosts;
+        m->size = size;
+    }
+    new = &m->hosts[m->count];
+    memset(new, 0, sizeof(struct multi_host));
+    new->host = strdup(host);
+    if (new->host == NULL)
+        goto fail;
+    new->port = port;
+    if (principal != NULL) {
+        new->principal = strdup(principal);
+        if (new->principal == NULL) {
+            free(new->host);
+            goto fail;
+        }
+    }
+    new->r = NULL;
+    new->error.data = NULL;
+    new->result = NULL;
+    m->count++;
+
+    /* The poll arrays are sized by the number of hosts. */
+    free(m->pfds);
+    free(m->polled);
+    m->pfds = NULL;
+    m->polled = NULL;
+    return 1;
+
+fail:
+    multi_set_error(m, "cannot allocate memory");
+    return 0;
+}
+
+
+/*
+ * Set the maximum number of connections to have open at once, or 0 to open
+ * connections to all hosts at once (the default).  Returns true.
+ */
+int
+remctl_multi_set_parallel(struct remctl_multi *m, size_t parallel)
+{
+    m->parallel = parallel;
+    return 1;
+}
+
+
+/*
+ * Set the network timeout in seconds, which may be 0 to not use any timeout
+ * (the default).  A host fails if there is no network activity for that
+ * long.  Returns true on success, false on an invalid timeout.
+ */
+int
+remctl_multi_set_timeout(struct remctl_multi *m, time_t timeout)
+{
+    if (timeout < 0) {
+        multi_set_error(m, "invalid timeout");
+        return 0;
+    }
+    m->timeout = timeout;
+    return 1;
+}
+
+
+/*
+ * Set whether to canonicalize the names of hosts added without a principal
+ * and use the canonical name for the server principal, as the remctl
+ * command-line client does.  The canonical name comes from the same lookup
+ * used to connect.  The default is not to.  Returns true.
+ */
+int
+remctl_multi_set_canonicalize(struct remctl_multi *m, int canonicalize)
+{
+    m->canonicalize = canonicalize;
+    return 1;
+}
+
+
+/*
+ * Set the source address for the connections, as with remctl_set_source_ip.
+ * Returns true on success and false on failure to allocate memory.
+ */
+int
+remctl_multi_set_source_ip(struct remctl_multi *m, const char *source)
+{
+    char *copy;
+
+    copy = strdup(source);
+    if (copy == NULL) {
+        multi_set_error(m, "cannot allocate memory");
+        return 0;
+    }
+    free(m->source);
+    m->source = copy;
+    return 1;
+}
+
+
+/*
+ * Set the command to run on all of the hosts and get ready to start it.
+ * Takes a NULL-terminated array of nul-terminated strings, as with
+ * remctl_command, and copies it.  Nothing is sent until remctl_multi_output
+ * or remctl_multi_run is called.  Any connections and results from a
+ * previous command are closed and discarded.  Returns true on success and
+ * false on failure.
+ */
+int
+remctl_multi_command(struct remctl_multi *m, const char **command)
+{
+    struct iovec *vector;
+    size_t count, i;
+
+    for (count = 0; command[count] != NULL; count++)
+        ;
+    vector = calloc(count == 0 ? 1 : count, sizeof(struct iovec));
+    if (vector == NULL)
+        goto fail;
+    for (i = 0; i < count; i++) {
+        vector[i].iov_len = strlen(command[i]);
+        vector[i].iov_base = malloc(vector[i].iov_len + 1);
+        if (vector[i].iov_base == NULL) {
+            while (i-- > 0)
+                free(vector[i].iov_base);
+            free(vector);
+            goto fail;
+        }
+        memcpy(vector[i].iov_base, command[i], vector[i].iov_len + 1);
+    }
+
+    /* Replace any previous command and reset the hosts. */
+    for (i = 0; i < m->argc; i++)
+        free(m->command[i].iov_base);
+    free(m->command);
+    m->command = vector;
+    m->argc = count;
+    for (i = 0; i < m->count; i++) {
+        multi_host_close(&m->hosts[i]);
+        remctl_result_free(m->hosts[i].result);
+        m->hosts[i].result = NULL;
+        m->hosts[i].state = MULTI_WAITING;
+        m->hosts[i].runnable = false;
+    }
+    m->next = 0;
+    m->active = 0;
+    m->current = 0;
+    return 1;
+
+fail:
+    multi_set_error(m, "cannot allocate memory");
+    return 0;
+}
+
+
+/*
+ * Return the next output from any host, storing the index of that host (in
+ * the order in which hosts were added) in *index.  For each host, this
+ * returns zero or more REMCTL_OUT_OUTPUT outputs followed by either a
+ * REMCTL_OUT_STATUS or a REMCTL_OUT_ERROR output, just like remctl_output.
+ * Failures to talk to a host are returned as REMCTL_OUT_ERROR with an error
+ * code of 0 and the message in data.  Once all hosts have finished, returns
+ * a REMCTL_OUT_DONE output.
+ *
+ * The output is invalidated by the next call.  Returns NULL on an internal
+ * failure, such as memory allocation or poll failure; remctl_multi_error
+ * returns the error.
+ */
+struct remctl_output *
+remctl_multi_output(struct remctl_multi *m, size_t *index)
+{
+    struct multi_host *host;
+    struct remctl_output *output;
+    size_t i, j;
+    bool pending;
+
+    if (m->command == NULL) {
+        multi_set_error(m, "no command given");
+        return NULL;
+    }
+    while (1) {
+        /* Close the hosts whose final output has already been returned. */
+        for (i = 0; i < m->count; i++)
+            if (m->hosts[i].state == MULTI_FINISHED
+                && !m->hosts[i].runnable) {
+                multi_host_close(&m->hosts[i]);
+                m->hosts[i].state = MULTI_DONE;
+                m->active--;
+            }
+
+        /* Start as many new hosts as we're allowed. */
+        while (m->next < m->count
+               && (m->parallel == 0 || m->active < m->parallel)) {
+            host = &m->hosts[m->next];
+            *index = m->next;
+            m->next++;
+            if (!multi_host_start(m, host)) {
+                if (host->r == NULL) {
+                    multi_set_error(m, "cannot allocate memory");
+                    return NULL;
+                }
+                return multi_host_fail(m, host, NULL);
+            }
+        }
+
+        /*
+         * Look for a host with output, starting after the last one that
+         * returned output so that a fast host doesn't starve the others.
+         */
+        for (j = 0; j < m->count; j++) {
+            i = (m->current + j) % m->count;
+            host = &m->hosts[i];
+            if (!host->runnable)
+                continue;
+            *index = i;
+            if (host->state == MULTI_FINISHED)
+                return multi_host_fail(m, host, NULL);
+            output = multi_host_step(m, host, &pending);
+            if (pending)
+                continue;
+            m->current = (i + 1) % m->count;
+            return output;
+        }
+
+        /* If everything is done, say so.  Otherwise, wait. */
+        if (m->active == 0 && m->next == m->count)
+            return &m->done;
+        if (!multi_wait(m))
+            return NULL;
+    }
+}
+
+
+/*
+ * Run the command on all hosts and collect the results, which can then be
+ * retrieved with remctl_multi_result.  Returns true on success and false on
+ * an internal failure.  Failures for individual hosts are reported in their
+ * results.
+ */
+int
+remctl_multi_run(struct remctl_multi *m)
+{
+    struct remctl_output *output;
+    struct remctl_result *result;
+    size_t i;
+
+    for (i = 0; i < m->count; i++) {
+        if (m->hosts[i].result == NULL)
+            m->hosts[i].result = calloc(1, sizeof(struct remctl_result));
+        if (m->hosts[i].result == NULL) {
+            multi_set_error(m, "cannot allocate memory");
+            return 0;
+        }
+    }
+    do {
+        output = remctl_multi_output(m, &i);
+        if (output == NULL)
+            return 0;
+        if (output->type == REMCTL_OUT_DONE)
+            break;
+        result = m->hosts[i].result;
+        if (output->type == REMCTL_OUT_STATUS)
+            result->status = output->status;
+        else if (!internal_output_append(result, output)) {
+            multi_set_error(m, "cannot allocate memory");
+            return 0;
+        }
+    } while (1);
+    return 1;
+}
+
+
+/*
+ * Return the result for the host with the given index after
+ * remctl_multi_run, or NULL if there is no such host or no result.  The
+ * result belongs to the multi struct and must not be freed by the caller.
+ */
+struct remctl_result *
+remctl_multi_result(struct remctl_multi *m, size_t index)
+{
+    if (index >= m->count)
+        return NULL;
+    return m->hosts[index].result;
+}
+
+
+/*
+ * Return the name of the host with the given index, or NULL if there is no
+ * such host.
+ */
+const char *
+remctl_multi_host(struct remctl_multi *m, size_t index)
+{
+    if (index >= m->count)
+        return NULL;
+    return m->hosts[index].host;
+}
+
+
+/*
+ * Return the error from the last failed call on the multi struct.
+ */
+const char *
+remctl_multi_error(struct remctl_multi *m)
+{
+    if (m->error != NULL)
+        return m->error;
+    return "no error";
+}
+
+
+/*
+ * Close all connections and free the multi struct.
+ */
+void
+remctl_multi_free(struct remctl_multi *m)
+{
+    size_t i;
+
+    if (m == NULL)
+        return;
+    for (i = 0; i < m->count; i++) {
+        multi_host_close(&m->hosts[i]);
+        free(m->hosts[i].host);
+        free(m->hosts[i].principal);
+        remctl_result_free(m->hosts[i].result);
+    }
+    for (i = 0; i < m->argc; i++)
+        free(m->command[i].iov_base);
+    free(m->command);
+    free(m->hosts);
+    free(m->source);
+    free(m->pfds);
+    free(m->polled);
+    free(m->error);
+    free(m);
+    socket_shutdown();
+}
@@ -0,0 +1,272 @@
+/*
+ * Connection pooling for the remctl library API.
+ *
+ * A pool keeps open, authenticated remctl connections keyed by the host,
+ * port, and principal they were opened with, so that callers running many
+ * commands against the same few servers only pay for the TCP connection and
+ * the GSS-API context negotiation once.  Connections are checked with a
+ * NOOP message before they're reused, unless the server doesn't support
+ * NOOP, and closed once they've been idle for longer than the idle timeout
+ * of the pool.
+ *
+ * The simple remctl interface uses a process-wide pool if one has been set
+ * with remctl_set_pool.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <time.h>
+
+#include <client/internal.h>
+#include <client/remctl.h>
+
+/* An idle connection in a pool. */
+struct remctl_pool_conn {
+    char *host;                 /* Kept here since struct remctl only */
+    unsigned short port;        /*   stores pointers to the strings   */
+    char *principal;            /*   passed to remctl_open.           */
+    struct remctl *r;
+    time_t last;                /* When the connection was last used. */
+    struct remctl_pool_conn *next;
+};
+
+/* A pool of idle connections, most recently used first. */
+struct remctl_pool {
+    time_t idle;                /* Seconds before closing, or 0 for never. */
+    struct remctl_pool_conn *conns;
+};
+
+/* The pool used by the simple interface, if any. */
+static struct remctl_pool *pool_default = NULL;
+
+
+/*
+ * Close a pooled connection and free it.
+ */
+static void
+pool_conn_free(struct remctl_pool_conn *conn)
+{
+    remctl_close(conn->r);
+    free(conn->host);
+    free(conn->principal);
+    free(conn);
+}
+
+
+/*
+ * Close all connections in the pool that have been idle for longer than the
+ * idle timeout.  Since the list is kept in order of use, everything after
+ * the first expired connection has expired as well.
+ */
+static void
+pool_expire(struct remctl_pool *pool)
+{
+    struct remctl_pool_conn **conn, *next;
+    time_t now;
+
+    if (pool->idle == 0)
+        return;
+    now = time(NULL);
+    for (conn = &pool->conns; *conn != NULL; conn = &(*conn)->next)
+        if (now - (*conn)->last >= pool->idle)
+            break;
+    while (*conn != NULL) {
+        next = (*conn)->next;
+        pool_conn_free(*conn);
+        *conn = next;
+    }
+}
+
+
+/*
+ * Returns whether a pooled connection matches the given host, port, and
+ * principal.
+ */
+static bool
+pool_conn_match(struct remctl_pool_conn *conn, const char *host,
+                unsigned short port, const char *principal)
+{
+    if (conn->port != port || strcmp(conn->host, host) != 0)
+        return false;
+    if (conn->principal == NULL || principal == NULL)
+        return conn->principal == principal;
+    return strcmp(conn->principal, principal) == 0;
+}
+
+
+/*
+ * Take a connection to the given host, port, and principal out of the pool,
+ * checking that it still works with a NOOP message, or open a new one if
+ * there is no working connection in the pool.  Connections that fail the
+ * check are closed.  Connections to servers that rejected NOOP can't be
+ * checked and are reused as is.  On failure to open a new connection, stores the error
+ * in result->error (leaving it NULL if even that fails) and returns NULL.
+ */
+static struct remctl_pool_conn *
+pool_checkout(struct remctl_pool *pool, const char *host, unsigned short port,
+              const char *principal, struct remctl_result *result)
+{
+    struct remctl_pool_conn **prev, *conn;
+
+    pool_expire(pool);
+    prev = &pool->conns;
+    while (*prev != NULL) {
+        conn = *prev;
+        if (!pool_conn_match(conn, host, port, principal)) {
+            prev = &conn->next;
+            continue;
+        }
+        *prev = conn->next;
+        conn->next = NULL;
+        if (conn->r->noop_unknown || remctl_noop(conn->r))
+            return conn;
+
+        /* The server answered, but doesn't know NOOP, so the check passed. */
+        if (conn->r->noop_unknown)
+            return conn;
+        pool_conn_free(conn);
+    }
+
+    /* Nothing usable in the pool, so open a new connection. */
+    conn = calloc(1, sizeof(struct remctl_pool_conn));
+    if (conn == NULL)
+        return NULL;
+    conn->host = strdup(host);
+    if (conn->host == NULL)
+        goto fail;
+    conn->port = port;
+    if (principal != NULL) {
+        conn->principal = strdup(principal);
+        if (conn->principal == NULL)
+            goto fail;
+    }
+    conn->r = remctl_new();
+    if (conn->r == NULL)
+        goto fail;
+    if (!remctl_open(conn->r, conn->host, conn->port, conn->principal)) {
+        result->error = strdup(remctl_error(conn->r));
+        goto fail;
+    }
+    return conn;
+
+fail:
+    if (conn->r != NULL)
+        remctl_close(conn->r);
+    free(conn->host);
+    free(conn->principal);
+    free(conn);
+    return NULL;
+}
+
+
+/*
+ * Create a new, empty connection pool.  idle is the number of seconds after
+ * which an unused connection is closed, or 0 to keep connections until the
+ * pool is freed.  Returns NULL on memory allocation failure.
+ */
+struct remctl_pool *
+remctl_pool_new(time_t idle)
+{
+    struct remctl_pool *pool;
+
+    if (idle < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    pool = calloc(1, sizeof(struct remctl_pool));
+    if (pool == NULL)
+        return NULL;
+    pool->idle = idle;
+    pool->conns = NULL;
+    return pool;
+}
+
+
+/*
+ * Close all connections in a pool and free it.  If the pool is the one used
+ * by the simple interface, stop using it.
+ */
+void
+remctl_pool_free(struct remctl_pool *pool)
+{
+    struct remctl_pool_conn *conn, *next;
+
+    if (pool == NULL)
+        return;
+    if (pool == pool_default)
+        pool_default = NULL;
+    for (conn = pool->conns; conn != NULL; conn = next) {
+        next = conn->next;
+        pool_conn_free(conn);
+    }
+    free(pool);
+}
+
+
+/*
+ * Like remctl, but run the command over a connection from the pool, opening
+ * one if needed, and return the connection to the pool afterwards if the
+ * command completed.  The result should be freed with remctl_result_free.
+ */
+struct remctl_result *
+remctl_pool_command(struct remctl_pool *pool, const char *host,
+                    unsigned short port, const char *principal,
+                    const char **command)
+{
+    struct remctl_result *result;
+    struct remctl_pool_conn *conn;
+
+    result = calloc(1, sizeof(struct remctl_result));
+    if (result == NULL)
+        return NULL;
+    conn = pool_checkout(pool, host, port, principal, result);
+    if (conn == NULL) {
+        if (result->error != NULL)
+            return result;
+        remctl_result_free(result);
+        return NULL;
+    }
+
+    /*
+     * If the command completed, the connection is ready for another command
+     * and goes back at the front of the pool.  Otherwise, we don't know what
+     * state it's in, so close it.
+     */
+    if (internal_collect(conn->r, command, result)) {
+        conn->last = time(NULL);
+        conn->next = pool->conns;
+        pool->conns = conn;
+    } else {
+        pool_conn_free(conn);
+        if (result->error == NULL) {
+            remctl_result_free(result);
+            return NULL;
+        }
+    }
+    return result;
+}
+
+
+/*
+ * Set the pool used by the simple remctl interface, or NULL to go back to
+ * opening a new connection for each call.  The caller still owns the pool.
+ */
+void
+remctl_set_pool(struct remctl_pool *pool)
+{
+    pool_default = pool;
+}
+
+
+/*
+ * Return the pool used by the simple remctl interface, or NULL if none.
+ */
+struct remctl_pool *
+internal_pool_default(void)
+{
+    return pool_default;
+}
@@ -19,21 +19,43 @@
 #include <portable/socket.h>
 
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 
 #include <client/remctl.h>
 #include <util/messages.h>
+#include <util/vector.h>
 #include <util/xmalloc.h>
 
+/* Default number of hosts to run a command on at once with -H. */
+#define DEFAULT_JOBS 16
+
+/* Largest timeout, in seconds, that fits in milliseconds in an int. */
+#define TIMEOUT_MAX (INT_MAX / 1000)
+
+/*
+ * Output from one host in fan-out mode, buffered until we have a complete
+ * line so that lines from different hosts aren't interleaved.
+ */
+struct host_output {
+    char *data[2];              /* Partial lines for stdout and stderr. */
+    size_t length[2];
+};
+
 /* Usage message. */
 static const char usage_message[] = "\
 Usage: remctl <options> <host> <command> [<subcommand> [<parameters>]]\n\
+       remctl <options> -H <file> <command> [<subcommand> [<parameters>]]\n\
 \n\
 Options:\n\
     -b <source>   Source IP used for outgoing connections\n\
     -d            Debugging level of output\n\
+    -H <file>     Run the command on each host listed in <file>\n\
     -h            Display this help\n\
+    -j <jobs>     Hosts to run the command on at once with -H (default: 16)\n\
     -p <port>     remctld port (default: 4373 falling back to 4444)\n\
     -s <service>  remctld service principal (default: host/<host>)\n\
+    -t <timeout>  Seconds to wait for the server (default: 0, no timeout)\n\
     -v            Display the version of remctl\n";
 
 
@@ -48,6 +70,26 @@ usage(int status)
 }
 
 
+/*
+ * Parse the numeric argument to a command-line option, dying with an error
+ * if it isn't a number between min and max inclusive.
+ */
+static long
+parse_number(const char *arg, int option, long min, long max)
+{
+    char *end;
+    long value;
+
+    errno = 0;
+    value = strtol(arg, &end, 10);
+    if (!isdigit((unsigned char) *arg) || *end != '\0' || errno != 0
+        || value < min || value > max)
+        die("invalid argument %s to -%c (must be between %ld and %ld)", arg,
+            option, min, max);
+    return value;
+}
+
+
 /*
  * Get the responses back from the server, taking appropriate action on each
  * one depending on its type.  Sets the errorcode parameter to the exit status
@@ -95,6 +137,204 @@ process_response(struct remctl *r, int *errorcode)
 }
 
 
+/*
+ * Canonicalize a host name for use as the server name.  See the comment in
+ * main for why this is done.  Fan-out mode has the library do this instead
+ * as part of connecting.  Returns a newly allocated string, or NULL if
+ * the host name cannot be resolved, in which case the error is stored in
+ * status.
+ */
+static char *
+canonicalize_host(const char *host, int *status)
+{
+    struct addrinfo hints, *ai;
+    char *canonical;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = AI_CANONNAME;
+    *status = getaddrinfo(host, NULL, &hints, &ai);
+    if (*status != 0)
+        return NULL;
+    canonical = xstrdup(ai->ai_canonname);
+    freeaddrinfo(ai);
+    return canonical;
+}
+
+
+/*
+ * Read the list of hosts for fan-out mode from a file.  The file contains one
+ * host per line.  Blank lines and lines starting with # are ignored, as is
+ * anything following the host name on a line.  Returns a new vector of
+ * hosts.
+ */
+static struct vector *
+read_hosts(const char *path)
+{
+    FILE *file;
+    char buffer[BUFSIZ];
+    char *host;
+    size_t line = 0;
+    struct vector *hosts;
+
+    if (strcmp(path, "-") == 0)
+        file = stdin;
+    else {
+        file = fopen(path, "r");
+        if (file == NULL)
+            sysdie("cannot open %s", path);
+    }
+    hosts = vector_new();
+    while (fgets(buffer, sizeof(buffer), file) != NULL) {
+        line++;
+        if (strchr(buffer, '\n') == NULL && !feof(file))
+            die("%s:%lu: line too long", path, (unsigned long) line);
+        for (host = buffer; isspace((unsigned char) *host); host++)
+            ;
+        if (*host == '\0' || *host == '#')
+            continue;
+        host[strcspn(host, " \t\r\n")] = '\0';
+        vector_add(hosts, host);
+    }
+    if (ferror(file))
+        sysdie("cannot read %s", path);
+    if (file != stdin)
+        fclose(file);
+    if (hosts->count == 0)
+        die("no hosts found in %s", path);
+    return hosts;
+}
+
+
+/*
+ * Print the complete lines in the buffered output from a host to the given
+ * stream, each prefixed by the host name, and keep the rest.  If flush is
+ * true, also print any partial line, adding a newline.
+ */
+static void
+print_lines(const char *host, struct host_output *buffer, int stream,
+            bool flush)
+{
+    FILE *out = (stream == 0) ? stdout : stderr;
+    char *data = buffer->data[stream];
+    char *start, *end;
+    size_t left;
+
+    start = data;
+    left = buffer->length[stream];
+    while (left > 0) {
+        end = memchr(start, '\n', left);
+        if (end == NULL) {
+            if (!flush)
+                break;
+            fprintf(out, "%s: ", host);
+            fwrite(start, left, 1, out);
+            fputc('\n', out);
+            left = 0;
+            break;
+        }
+        fprintf(out, "%s: ", host);
+        fwrite(start, end - start + 1, 1, out);
+        left -= end - start + 1;
+        start = end + 1;
+    }
+    fflush(out);
+    if (left > 0 && start != data)
+        memmove(data, start, left);
+    buffer->length[stream] = left;
+    if (left == 0) {
+        free(buffer->data[stream]);
+        buffer->data[stream] = NULL;
+    }
+}
+
+
+/*
+ * Run the command on each of the given hosts in parallel, running at most
+ * jobs at a time, and print the output from each host as it arrives, one
+ * line at a time, prefixed by the host name.  A host fails if it doesn't
+ * respond for timeout seconds, unless timeout is 0.  Returns the largest
+ * exit status of the command on any host, which will be 255 if the command
+ * failed with an error on any host.
+ */
+static int
+process_fanout(struct vector *hosts, unsigned short port,
+               const char *service_name, const char *source, size_t jobs,
+               time_t timeout, const char **command)
+{
+    struct remctl_multi *multi;
+    struct remctl_output *out;
+    struct host_output *buffers, *buffer;
+    const char *host;
+    size_t i;
+    int stream;
+    int errorcode = 0;
+
+    /*
+     * Canonicalize the host names as for a single host.  The library does
+     * this with the same lookup it uses to connect, so that each host is
+     * only resolved once, when its connection is started, and a host that
+     * can't be resolved only fails that host.
+     */
+    multi = remctl_multi_new();
+    if (multi == NULL)
+        sysdie("cannot initialize remctl connections");
+    for (i = 0; i < hosts->count; i++)
+        if (!remctl_multi_add(multi, hosts->strings[i], port, service_name))
+            die("%s", remctl_multi_error(multi));
+    if (source != NULL)
+        if (!remctl_multi_set_source_ip(multi, source))
+            die("%s", remctl_multi_error(multi));
+    remctl_multi_set_canonicalize(multi, service_name == NULL);
+    remctl_multi_set_parallel(multi, jobs);
+    if (!remctl_multi_set_timeout(multi, timeout))
+        die("%s", remctl_multi_error(multi));
+    if (!remctl_multi_command(multi, command))
+        die("%s", remctl_multi_error(multi));
+
+    /* Print output as it arrives. */
+    buffers = xcalloc(hosts->count, sizeof(struct host_output));
+    while ((out = remctl_multi_output(multi, &i)) != NULL) {
+        if (out->type == REMCTL_OUT_DONE)
+            break;
+        host = remctl_multi_host(multi, i);
+        buffer = &buffers[i];
+        switch (out->type) {
+        case REMCTL_OUT_OUTPUT:
+            stream = (out->stream == 1) ? 0 : 1;
+            if (out->stream != 1 && out->stream != 2)
+                warn("%s: unknown output stream %d", host, out->stream);
+            buffer->data[stream] = xrealloc(buffer->data[stream],
+                                            buffer->length[stream]
+                                            + out->length);
+            memcpy(buffer->data[stream] + buffer->length[stream], out->data,
+                   out->length);
+            buffer->length[stream] += out->length;
+            print_lines(host, buffer, stream, false);
+            break;
+        case REMCTL_OUT_ERROR:
+        case REMCTL_OUT_STATUS:
+            print_lines(host, buffer, 0, true);
+            print_lines(host, buffer, 1, true);
+            if (out->type == REMCTL_OUT_ERROR) {
+                fprintf(stderr, "%s: ", host);
+                fwrite(out->data, out->length, 1, stderr);
+                fputc('\n', stderr);
+                errorcode = 255;
+            } else if (out->status > errorcode)
+                errorcode = out->status;
+            break;
+        case REMCTL_OUT_DONE:
+            break;
+        }
+    }
+    if (out == NULL)
+        die("%s", remctl_multi_error(multi));
+    free(buffers);
+    remctl_multi_free(multi);
+    return errorcode;
+}
+
+
 /*
  * Main routine.  Parse the arguments, open the remctl connection, send the
  * command, and then call process_response.
@@ -104,10 +344,13 @@ main(int argc, char *argv[])
 {
     int option, status;
     char *server_host;
-    struct addrinfo hints, *ai;
     const char *source = NULL;
     const char *service_name = NULL;
+    const char *host_file = NULL;
     unsigned short port = 0;
+    long jobs = DEFAULT_JOBS;
+    long timeout = 0;
+    struct vector *hosts;
     struct remctl *r;
     int errorcode = 0;
 
@@ -123,7 +366,7 @@ main(int argc, char *argv[])
      * Non-GNU getopt will treat the + as a supported option, which is handled
      * below.
      */
-    while ((option = getopt(argc, argv, "+b:dhp:s:v")) != EOF) {
+    while ((option = getopt(argc, argv, "+b:dH:hj:p:s:t:v")) != EOF) {
         switch (option) {
         case 'b':
             source = optarg;
@@ -131,15 +374,24 @@ main(int argc, char *argv[])
         case 'd':
             message_handlers_debug(1, message_log_stderr);
             break;
+        case 'H':
+            host_file = optarg;
+            break;
         case 'h':
             usage(0);
             break;
+        case 'j':
+            jobs = parse_number(optarg, option, 1, INT_MAX);
+            break;
         case 'p':
             port = atoi(optarg);
             break;
         case 's':
             service_name = optarg;
             break;
+        case 't':
+            timeout = parse_number(optarg, option, 0, TIMEOUT_MAX);
+            break;
         case 'v':
             printf("%s\n", PACKAGE_STRING);
             exit(0);
@@ -153,6 +405,18 @@ main(int argc, char *argv[])
     }
     argc -= optind;
     argv += optind;
+
+    /* In fan-out mode, the hosts come from a file instead. */
+    if (host_file != NULL) {
+        if (argc < 1)
+            usage(1);
+        hosts = read_hosts(host_file);
+        errorcode = process_fanout(hosts, port, service_name, source, jobs,
+                                   timeout, (const char **) argv);
+        vector_free(hosts);
+        socket_shutdown();
+        return errorcode;
+    }
     if (argc < 2)
         usage(1);
     server_host = *argv++;
@@ -187,14 +451,10 @@ main(int argc, char *argv[])
      * they're doing and don't do any of this.
      */
     if (service_name == NULL) {
-        memset(&hints, 0, sizeof(hints));
-        hints.ai_flags = AI_CANONNAME;
-        status = getaddrinfo(server_host, NULL, &hints, &ai);
-        if (status != 0)
-            die("cannot resolve host %s: %s", server_host,
+        server_host = canonicalize_host(server_host, &status);
+        if (server_host == NULL)
+            die("cannot resolve host %s: %s", argv[-1],
                 gai_strerror(status));
-        server_host = xstrdup(ai->ai_canonname);
-        freeaddrinfo(ai);
     }
 
     /* Open connection. */
@@ -204,6 +464,8 @@ main(int argc, char *argv[])
     if (source != NULL)
         if (!remctl_set_source_ip(r, source))
             die("%s", remctl_error(r));
+    if (!remctl_set_timeout(r, timeout))
+        die("%s", remctl_error(r));
     if (!remctl_open(r, server_host, port, service_name))
         die("%s", remctl_error(r));
 
@@ -95,9 +95,28 @@ struct remctl_output {
     int error;                  /* Remote error code. */
 };
 
+/* The result of a step of the non-blocking interface. */
+enum remctl_async_status {
+    REMCTL_ASYNC_ERROR,         /* Failed; call remctl_error. */
+    REMCTL_ASYNC_PENDING,       /* Waiting for the socket. */
+    REMCTL_ASYNC_DONE           /* Step complete. */
+};
+
+/* Events returned by remctl_events, to wait for with poll or similar. */
+enum remctl_event {
+    REMCTL_EVENT_READ  = 1,
+    REMCTL_EVENT_WRITE = 2
+};
+
 /* Opaque struct representing an open remctl connection. */
 struct remctl;
 
+/* Opaque struct representing a pool of open remctl connections. */
+struct remctl_pool;
+
+/* Opaque struct representing a command run on many hosts in parallel. */
+struct remctl_multi;
+
 BEGIN_DECLS
 
 /*
@@ -112,6 +131,25 @@ struct remctl_result *remctl(const char *host, unsigned short port,
                              const char *principal, const char **command);
 void remctl_result_free(struct remctl_result *);
 
+/*
+ * Connection pooling for the simple interface.  remctl_pool_new creates a
+ * pool that keeps connections open, keyed by host, port, and principal,
+ * closing them after they've been unused for idle seconds (or never, if idle
+ * is 0).  remctl_pool_command works like remctl, but reuses a connection
+ * from the pool if there is one, checking it first with a NOOP message.
+ * remctl_set_pool makes remctl use the given pool, or stop using a pool if
+ * passed NULL; the caller still has to free the pool with remctl_pool_free.
+ * A pool must not be used by more than one thread at a time.
+ */
+struct remctl_pool *remctl_pool_new(time_t idle);
+struct remctl_result *remctl_pool_command(struct remctl_pool *,
+                                          const char *host,
+                                          unsigned short port,
+                                          const char *principal,
+                                          const char **command);
+void remctl_set_pool(struct remctl_pool *);
+void remctl_pool_free(struct remctl_pool *);
+
 /*
  * Now, the more complex persistant interface.  The basic housekeeping
  * functions.  port may be 0, in which case REMCTL_PORT is used with fallback
@@ -205,6 +243,71 @@ struct remctl_output *remctl_output(struct remctl *);
  */
 const char *remctl_error(struct remctl *);
 
+/*
+ * The non-blocking interface, for callers with their own event loop.
+ * remctl_open_start resolves the host (which may block) and starts the
+ * connection, and remctl_open_try advances the connection and GSS-API
+ * negotiation as far as possible without blocking.  remctl_command_start and
+ * remctl_commandv_start queue a command and send as much of it as the socket
+ * will take, and remctl_output_try returns the next output from the server,
+ * just like remctl_output, once it has arrived.  The _try functions return
+ * REMCTL_ASYNC_PENDING if the socket isn't ready; the caller should then
+ * wait on the descriptor returned by remctl_fd for the events returned by
+ * remctl_events and call them again.  remctl_output_try also finishes
+ * sending the command.
+ *
+ * These functions also work on connections opened with remctl_open, and the
+ * normal blocking functions may be used on connections opened with
+ * remctl_open_start.  Non-blocking commands require protocol version 2.
+ */
+int remctl_open_start(struct remctl *, const char *host, unsigned short port,
+                      const char *principal);
+enum remctl_async_status remctl_open_try(struct remctl *);
+int remctl_command_start(struct remctl *, const char **command);
+int remctl_commandv_start(struct remctl *, const struct iovec *,
+                          size_t count);
+enum remctl_async_status remctl_output_try(struct remctl *,
+                                           struct remctl_output **);
+int remctl_fd(struct remctl *);
+int remctl_events(struct remctl *);
+
+/*
+ * Running one command on many hosts in parallel from a single thread.  Add
+ * hosts with remctl_multi_add (port and principal are as for remctl_open),
+ * optionally limit how many connections are open at once with
+ * remctl_multi_set_parallel (0, the default, means no limit), optionally ask
+ * for host names to be canonicalized for the default principal with
+ * remctl_multi_set_canonicalize, and set the command with
+ * remctl_multi_command.  Then either call remctl_multi_output
+ * repeatedly to get output from any host as it arrives, with the index of
+ * the host stored in its second argument, until it returns REMCTL_OUT_DONE,
+ * or call remctl_multi_run to run the command everywhere and then retrieve
+ * the result for each host with remctl_multi_result.
+ *
+ * remctl_multi_output returns, for each host, the same sequence of outputs
+ * as remctl_output would.  Failures to connect to or talk to a host are
+ * returned as REMCTL_OUT_ERROR with an error code of 0.  Functions returning
+ * int return true on success and false on failure, and functions returning
+ * pointers return NULL on failure; use remctl_multi_error to get the error.
+ * Results are freed by remctl_multi_free.
+ */
+struct remctl_multi *remctl_multi_new(void);
+int remctl_multi_add(struct remctl_multi *, const char *host,
+                     unsigned short port, const char *principal);
+int remctl_multi_set_parallel(struct remctl_multi *, size_t);
+int remctl_multi_set_canonicalize(struct remctl_multi *, int);
+int remctl_multi_set_source_ip(struct remctl_multi *, const char *);
+int remctl_multi_set_timeout(struct remctl_multi *, time_t);
+int remctl_multi_command(struct remctl_multi *, const char **command);
+struct remctl_output *remctl_multi_output(struct remctl_multi *,
+                                          size_t *index);
+int remctl_multi_run(struct remctl_multi *);
+struct remctl_result *remctl_multi_result(struct remctl_multi *,
+                                          size_t index);
+const char *remctl_multi_host(struct remctl_multi *, size_t index);
+const char *remctl_multi_error(struct remctl_multi *);
+void remctl_multi_free(struct remctl_multi *);
+
 END_DECLS
 
 #endif /* !REMCTL_H */
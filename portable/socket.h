@@ -56,6 +56,7 @@
 # include <netinet/in.h>
 # include <arpa/inet.h>
 # include <netdb.h>
+# include <poll.h>
 # include <sys/socket.h>
 #endif
 
@@ -223,10 +224,10 @@ extern const char *inet_ntop(int, const void *, char *, socklen_t);
  * socket_shutdown at the end of the program.  socket_init may return failure,
  * but this interface doesn't have a way to retrieve the exact error.
  *
- * socket_close, socket_read, and socket_write must be used instead of the
- * standard functions.  On Windows, closesocket must be called instead of
- * close for sockets and recv and send must always be used instead of read and
- * write.
+ * socket_close, socket_read, socket_write, and socket_poll must be used
+ * instead of the standard functions.  On Windows, closesocket must be called
+ * instead of close for sockets, recv and send must always be used instead of
+ * read and write, and poll is called WSAPoll.
  *
  * When reporting errors from socket functions, use socket_errno and
  * socket_strerror instead of errno and strerror.  When setting errno to
@@ -244,6 +245,7 @@ int socket_init(void);
 # define socket_close(fd)       closesocket(fd)
 # define socket_read(fd, b, s)  recv((fd), (b), (s), 0)
 # define socket_write(fd, b, s) send((fd), (b), (s), 0)
+# define socket_poll(p, n, t)   WSAPoll((p), (n), (t))
 # define socket_errno           WSAGetLastError()
 # define socket_set_errno(e)    WSASetLastError(e)
 const char *socket_strerror(int);
@@ -254,6 +256,7 @@ typedef SOCKET socket_type;
 # define socket_close(fd)       close(fd)
 # define socket_read(fd, b, s)  read((fd), (b), (s))
 # define socket_write(fd, b, s) write((fd), (b), (s))
+# define socket_poll(p, n, t)   poll((p), (n), (t))
 # define socket_errno           errno
 # define socket_set_errno(e)    errno = (e)
 # define socket_strerror(e)     strerror(e)
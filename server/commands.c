@@ -19,18 +19,44 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <grp.h>
-#ifdef HAVE_SYS_SELECT_H
-# include <sys/select.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#ifdef HAVE_POSIX_SPAWN
+# include <spawn.h>
 #endif
+#include <sys/resource.h>
 #include <sys/time.h>
 #include <sys/wait.h>
+#include <time.h>
 
 #include <server/internal.h>
 #include <util/fdflag.h>
+#include <util/macros.h>
 #include <util/messages.h>
 #include <util/protocol.h>
+#include <util/vector.h>
 #include <util/xmalloc.h>
 
+/*
+ * The size to which to enlarge the pipe for standard output of commands, if
+ * the operating system supports it.
+ */
+#define OUTPUT_PIPE_SIZE (1024 * 1024)
+
+/*
+ * The most output to read after a command has exited.  Output still in the
+ * pipes when the command exits is sent to the client, but a background
+ * process that inherited them and keeps writing shouldn't keep us reading
+ * forever.
+ */
+#define OUTPUT_DRAIN_LIMIT (2 * OUTPUT_PIPE_SIZE)
+
+/* Not all systems declare the environment in unistd.h. */
+#if !HAVE_DECL_ENVIRON
+extern char **environ;
+#endif
+
 /* Data structure used to hold details about a running process. */
 struct process {
     bool reaped;                /* Whether we've reaped the process. */
@@ -39,8 +65,107 @@ struct process {
     struct iovec *input;        /* Data to pass on standard input. */
     pid_t pid;                  /* Process ID of child. */
     int status;                 /* Exit status. */
+    int wake_fd;                /* Read end of pipe written on SIGCHLD. */
 };
 
+/*
+ * The write end of the pipe used to wake up server_process_output when the
+ * child process exits, or -1 if no child is running.  The SIGCHLD handler
+ * writes a byte to this pipe.
+ */
+static volatile sig_atomic_t wake_pipe = -1;
+
+
+/*
+ * Signal handler for SIGCHLD while running a command.  Write a byte to the
+ * wake pipe so that poll in server_process_output returns, even if the
+ * signal arrives before we call poll.  The pipe is non-blocking, so if it
+ * is full, a wakeup is already pending and the write can be ignored.
+ */
+static RETSIGTYPE
+wake_handler(int sig UNUSED)
+{
+    int saved_errno = errno;
+    ssize_t status UNUSED;
+
+    if (wake_pipe >= 0)
+        status = write(wake_pipe, "", 1);
+    errno = saved_errno;
+}
+
+
+/*
+ * Get the current time for use with deadlines.  Use the monotonic clock where
+ * it's available, so that changes to the system time don't make deadlines
+ * expire early or late, and otherwise fall back on the time of day.
+ */
+static void
+deadline_now(struct timeval *now)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+        now->tv_sec = ts.tv_sec;
+        now->tv_usec = ts.tv_nsec / 1000;
+        return;
+    }
+#endif
+    gettimeofday(now, NULL);
+}
+
+
+/*
+ * Set a deadline the given number of milliseconds from now.
+ */
+static void
+deadline_set(struct timeval *deadline, long delay)
+{
+    deadline_now(deadline);
+    deadline->tv_sec += delay / 1000;
+    deadline->tv_usec += (delay % 1000) * 1000;
+    if (deadline->tv_usec >= 1000000) {
+        deadline->tv_sec++;
+        deadline->tv_usec -= 1000000;
+    }
+}
+
+
+/*
+ * Return the number of milliseconds remaining until the given deadline, or 0
+ * if it has already passed.
+ */
+static long
+deadline_remaining(const struct timeval *deadline)
+{
+    struct timeval now;
+    long remaining;
+
+    deadline_now(&now);
+    remaining = (deadline->tv_sec - now.tv_sec) * 1000
+        + (deadline->tv_usec - now.tv_usec) / 1000;
+    return (remaining > 0) ? remaining : 0;
+}
+
+
+/*
+ * Send the output held for a stream when coalescing output, if any.  Takes
+ * the client, the stream number, the buffer, and a pointer to the length of
+ * held output, which is reset to 0.  Returns true on success, false on
+ * failure.
+ */
+static bool
+flush_output(struct client *client, int stream, const char *buffer,
+             size_t *length)
+{
+    size_t held = *length;
+
+    if (held == 0)
+        return true;
+    *length = 0;
+    return server_v2_send_output(client, stream, buffer, held);
+}
+
 
 /*
  * Processes the input to and output from an external program.  Takes the
@@ -53,25 +178,51 @@ struct process {
  * in our client struct, and will send it out later in conjunction with the
  * exit status.
  *
+ * If the configuration line asks for output to be coalesced, protocol v2
+ * output is instead held for each stream until the configured amount has
+ * accumulated, the configured delay has passed since the first held output,
+ * or the stream is closed, and then sent in a single token.
+ *
  * Returns true on success, false on failure.
  */
 static int
-server_process_output(struct client *client, struct process *process)
+server_process_output(struct client *client, struct confline *cline,
+                      struct process *process)
 {
     char junk[BUFSIZ];
-    char *p;
+    char *p, *output;
+    char *held[2] = { NULL, NULL };
+    size_t held_length[2] = { 0, 0 };
+    struct timeval deadline[2];
     size_t offset = 0;
     size_t left = MAXBUFFER;
+    size_t drained = 0;
     ssize_t status[2], instatus;
-    int i, maxfd, fd, result;
-    fd_set readfds, writefds;
-    struct timeval timeout;
+    int i, fd, result, timeout;
+    long delay;
+    bool timed_out = false;
+    bool draining = false;
+    struct pollfd pfds[4];
+    struct timeval expires;
 
     /* If we haven't allocated an output buffer, do so now. */
     if (client->output == NULL)
         client->output = xmalloc(MAXBUFFER);
     p = client->output;
 
+    /* If the command has a timeout, note when it expires. */
+    if (cline->timeout > 0)
+        deadline_set(&expires, cline->timeout * 1000);
+
+    /*
+     * If coalescing output, hold standard output in the client output buffer
+     * and standard error in a separate buffer.
+     */
+    if (client->protocol > 1 && cline->coalesce > 0) {
+        held[0] = client->output;
+        held[1] = xmalloc(cline->coalesce);
+    }
+
     /*
      * Initialize read status for standard output and standard error and write
      * status for standard input to the process.  Non-zero says that we keep
@@ -92,79 +243,103 @@ server_process_output(struct client *client, struct process *process)
      * init scripts that start poorly-written daemons.  Once our child process
      * is finished, we're done, even if standard output and error from the
      * child process aren't closed yet.  To catch this case, call waitpid with
-     * the WNOHANG flag each time through the select loop and decide we're
-     * done as soon as our child has exited.
+     * the WNOHANG flag each time through the poll loop and decide we're
+     * done as soon as our child has exited and we've read whatever output
+     * it left in the pipes.
      *
      * Meanwhile, if we have input data, then as long as we've not gotten an
      * EPIPE error from sending input data to the process we keep writing
-     * input data as select indicates the process can receive it.  However, we
+     * input data as poll indicates the process can receive it.  However, we
      * don't care if we've sent all input data before the process says it's
      * done and exits.
+     *
+     * The poll set always has standard output and standard error of the
+     * process first, then its standard input, and then the wake pipe.  File
+     * descriptors we're done with are set to -1, which poll ignores.
      */
-    while (!process->reaped) {
-        FD_ZERO(&readfds);
-        maxfd = -1;
+    while (!process->reaped || draining) {
         for (i = 0; i < 2; i++) {
-            if (status[i] != 0) {
-                if (process->fds[i] > maxfd)
-                    maxfd = process->fds[i];
-                FD_SET(process->fds[i], &readfds);
-            }
-        }
-        if (instatus != 0) {
-            FD_ZERO(&writefds);
-            if (process->stdin_fd > maxfd)
-                maxfd = process->stdin_fd;
-            FD_SET(process->stdin_fd, &writefds);
+            pfds[i].fd = (status[i] != 0) ? process->fds[i] : -1;
+            pfds[i].events = POLLIN;
         }
-        if (maxfd == -1)
+        pfds[2].fd = (instatus != 0) ? process->stdin_fd : -1;
+        pfds[2].events = POLLOUT;
+        if (pfds[0].fd < 0 && pfds[1].fd < 0 && pfds[2].fd < 0)
             break;
 
         /*
          * We want to wait until either our child exits or until we get data
          * on its output file descriptors.  Normally, the SIGCHLD signal from
-         * the child exiting would break us out of our select loop.  However,
-         * the child could exit between the waitpid call and the select call,
-         * in which case select could block forever since there's nothing to
-         * wake it up.
+         * the child exiting would break us out of our poll loop.  However,
+         * the child could exit between the waitpid call and the poll call, in
+         * which case poll could block forever since there's nothing to wake
+         * it up.
          *
-         * The POSIX-correct way of doing this is to block SIGCHLD and then
-         * use pselect instead of select with a signal mask that allows
-         * SIGCHLD.  This allows SIGCHLD from the exiting child process to
-         * reliably interrupt pselect without race conditions from the child
-         * exiting before pselect is called.
+         * To avoid this race, the SIGCHLD handler writes a byte to a pipe
+         * whose read end we include in the poll set, so poll returns as soon
+         * as the child exits no matter when the signal arrived.  We can
+         * therefore block indefinitely in poll rather than waking up
+         * periodically to check for our child.
          *
-         * Unfortunately, Linux didn't implement a proper pselect until 2.6.16
-         * and the glibc wrapper that emulates it leaves us open to exactly
-         * the race condition we're trying to avoid.  This unfortunately
-         * leaves us with no choice but to set a timeout and wake up every
-         * five seconds to see if our child died.  (The wait time is arbitrary
-         * but makes the test suite less annoying.)
-         *
-         * If we see that the child has already exited, do one final poll of
-         * our output file descriptors and then call the command finished.
+         * If we see that the child has already exited, stop waiting and keep
+         * reading our output file descriptors only until there's nothing
+         * more in them, which may be a lot of output with a large pipe.
          */
-        timeout.tv_sec = 5;
-        timeout.tv_usec = 0;
-        if (waitpid(process->pid, &process->status, WNOHANG) > 0) {
+        if (!process->reaped
+            && waitpid(process->pid, &process->status, WNOHANG) > 0)
             process->reaped = true;
-            timeout.tv_sec = 0;
+        pfds[3].fd = process->wake_fd;
+        pfds[3].events = POLLIN;
+        timeout = process->reaped ? 0 : -1;
+
+        /*
+         * If the command has a timeout or we're holding coalesced output,
+         * wake up in time to kill the command or send the output.
+         */
+        if (!process->reaped) {
+            delay = -1;
+            if (cline->timeout > 0 && !timed_out)
+                delay = deadline_remaining(&expires);
+            for (i = 0; i < 2; i++)
+                if (held_length[i] > 0)
+                    if (delay < 0 || deadline_remaining(&deadline[i]) < delay)
+                        delay = deadline_remaining(&deadline[i]);
+            if (delay >= 0)
+                timeout = (delay > INT_MAX) ? INT_MAX : (int) delay;
         }
-        if (instatus != 0)
-            result = select(maxfd + 1, &readfds, &writefds, NULL, &timeout);
-        else
-            result = select(maxfd + 1, &readfds, NULL, NULL, &timeout);
-        if (result < 0 && errno != EINTR) {
-            syswarn("select failed");
-            server_send_error(client, ERROR_INTERNAL, "Internal failure");
-            goto fail;
+        result = poll(pfds, ARRAY_SIZE(pfds), timeout);
+        if (result < 0) {
+            if (errno != EINTR) {
+                syswarn("poll failed");
+                server_send_error(client, ERROR_INTERNAL, "Internal failure");
+                goto fail;
+            }
+            for (i = 0; i < (int) ARRAY_SIZE(pfds); i++)
+                pfds[i].revents = 0;
+        }
+        if (pfds[3].revents != 0)
+            while (read(process->wake_fd, junk, sizeof(junk)) > 0)
+                ;
+
+        /*
+         * If the command has run too long, kill its process group.  We then
+         * keep reading its output until it has exited.
+         */
+        if (cline->timeout > 0 && !timed_out && !process->reaped
+            && deadline_remaining(&expires) == 0) {
+            warn("command %s timed out after %ld seconds", cline->program,
+                 cline->timeout);
+            if (kill(-process->pid, SIGKILL) < 0 && errno != ESRCH)
+                syswarn("cannot kill process group %ld",
+                        (long) process->pid);
+            timed_out = true;
         }
 
         /*
-         * If we can still write and our child selected for writing, send as
+         * If we can still write and our child is ready for writing, send as
          * much data as we can.
          */
-        if (instatus != 0 && FD_ISSET(process->stdin_fd, &writefds)) {
+        if (instatus != 0 && pfds[2].revents != 0) {
             instatus = write(process->stdin_fd,
                              (char *) process->input->iov_base + offset,
                              process->input->iov_len - offset);
@@ -186,14 +361,18 @@ server_process_output(struct client *client, struct process *process)
         }
 
         /*
-         * Iterate through each set file descriptor and read its output.  If
+         * Iterate through each ready file descriptor and read its output.  If
          * we're using protocol version one, we append all the output together
-         * into the buffer.  Otherwise, we send an output token for each bit
-         * of output as we see it.
+         * into the buffer.  If we're coalescing output, we add it to the
+         * output held for that stream and send it once there's enough or the
+         * stream is closed.  Otherwise, we send an output token for each bit
+         * of output as we see it, reading it directly into the buffer in
+         * which the token will be wrapped.
          */
+        draining = false;
         for (i = 0; i < 2; i++) {
             fd = process->fds[i];
-            if (!FD_ISSET(fd, &readfds))
+            if (pfds[i].revents == 0)
                 continue;
             if (client->protocol == 1) {
                 if (left > 0) {
@@ -209,83 +388,290 @@ server_process_output(struct client *client, struct process *process)
                     if (status[i] < 0 && (errno != EINTR && errno != EAGAIN))
                         goto readfail;
                 }
-            } else {
-                status[i] = read(fd, client->output, MAXBUFFER);
+            } else if (held[i] != NULL) {
+                status[i] = read(fd, held[i] + held_length[i],
+                                 cline->coalesce - held_length[i]);
                 if (status[i] < 0 && (errno != EINTR && errno != EAGAIN))
                     goto readfail;
                 if (status[i] > 0) {
-                    client->outlen = status[i];
-                    if (!server_v2_send_output(client, i + 1))
-                        goto fail;
+                    if (held_length[i] == 0)
+                        deadline_set(&deadline[i], cline->coalesce_delay);
+                    held_length[i] += status[i];
                 }
+                if (status[i] == 0 || held_length[i] >= cline->coalesce)
+                    if (!flush_output(client, i + 1, held[i], &held_length[i]))
+                        goto fail;
+            } else {
+                output = server_v2_prepare_output(client);
+                status[i] = read(fd, output, MAXBUFFER);
+                if (status[i] < 0 && (errno != EINTR && errno != EAGAIN))
+                    goto readfail;
+                if (status[i] > 0)
+                    if (!server_v2_send_prepared_output(client, i + 1, output,
+                                                        status[i]))
+                        goto fail;
+            }
+            if (process->reaped && status[i] > 0) {
+                drained += status[i];
+                draining = (drained < OUTPUT_DRAIN_LIMIT);
             }
         }
+
+        /* Send any coalesced output that has been held long enough. */
+        for (i = 0; i < 2; i++)
+            if (held_length[i] > 0 && deadline_remaining(&deadline[i]) == 0)
+                if (!flush_output(client, i + 1, held[i], &held_length[i]))
+                    goto fail;
     }
     if (client->protocol == 1)
         client->outlen = p - client->output;
+    for (i = 0; i < 2; i++)
+        if (!flush_output(client, i + 1, held[i], &held_length[i]))
+            goto fail;
+    if (timed_out) {
+        server_send_error(client, ERROR_INTERNAL, "Command timed out");
+        goto fail;
+    }
+    free(held[1]);
     return 1;
 
 readfail:
     syswarn("read failed");
     server_send_error(client, ERROR_INTERNAL, "Internal failure");
 fail:
+    free(held[1]);
     return 0;
 }
 
 
 /*
- * Given a configuration line, a command, and a subcommand, return true if
- * that command and subcommand match that configuration line and false
- * otherwise.  Handles the ALL and NULL special cases.
- *
- * Empty commands are not yet supported by the rest of the code, but this
- * function copes in case that changes later.
+ * Apply the resource limits and scheduling priority from the configuration
+ * line to the current process.  Called in the child before running a command
+ * and before dropping privileges, so that the limits can't be raised again
+ * by the command.  Returns true on success and false on failure, reporting
+ * an error.
  */
 static bool
-line_matches(struct confline *cline, const char *command,
-             const char *subcommand)
+set_limits(struct confline *cline)
+{
+    struct rlimit limit;
+
+    /*
+     * Set the hard CPU limit one second past the soft limit so that the
+     * command gets SIGXCPU and a chance to clean up before it is killed.
+     */
+    if (cline->rlimit_cpu > 0) {
+        limit.rlim_cur = cline->rlimit_cpu;
+        limit.rlim_max = cline->rlimit_cpu + 1;
+        if (setrlimit(RLIMIT_CPU, &limit) != 0) {
+            syswarn("cannot set CPU time limit to %ld", cline->rlimit_cpu);
+            return false;
+        }
+    }
+    if (cline->rlimit_as > 0) {
+        limit.rlim_cur = cline->rlimit_as;
+        limit.rlim_max = cline->rlimit_as;
+        if (setrlimit(RLIMIT_AS, &limit) != 0) {
+            syswarn("cannot set address space limit to %lu",
+                    cline->rlimit_as);
+            return false;
+        }
+    }
+    if (cline->nice != 0) {
+        errno = 0;
+        if (nice(cline->nice) == -1 && errno != 0) {
+            syswarn("cannot change priority by %ld", cline->nice);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Add a variable to an environment being built.  The vector must already
+ * have room for it.
+ */
+static void
+env_add(struct vector *env, const char *name, const char *value)
 {
-    bool okay = false;
-
-    if (strcmp(cline->command, "ALL") == 0)
-        okay = true;
-    if (command != NULL && strcmp(cline->command, command) == 0)
-        okay = true;
-    if (command == NULL && strcmp(cline->command, "EMPTY") == 0)
-        okay = true;
-    if (okay) {
-        if (strcmp(cline->subcommand, "ALL") == 0)
-            return true;
-        if (subcommand != NULL && strcmp(cline->subcommand, subcommand) == 0)
-            return true;
-        if (subcommand == NULL && strcmp(cline->subcommand, "EMPTY") == 0)
-            return true;
+    xasprintf(&env->strings[env->count], "%s=%s", name, value);
+    env->count++;
+}
+
+
+/*
+ * Build the environment for a command.  This is our environment plus the
+ * authenticated principal and other connection and command information.
+ * REMUSER is for backwards compatibility with earlier versions of remctl.
+ * Looking up the client hostname for REMOTE_HOST may be slow, so it's
+ * skipped for commands configured with remote-host=no.
+ * It's built in the parent so that the child doesn't have to allocate
+ * memory before running the command, and the result is NULL-terminated so
+ * that its strings can be passed directly to execve.
+ */
+static struct vector *
+build_env(struct client *client, struct confline *cline, const char *command)
+{
+    struct vector *env;
+    const char *hostname;
+    size_t count, i, j, length, set;
+
+    for (count = 0; environ[count] != NULL; count++)
+        ;
+    env = vector_new();
+    vector_resize(env, count + 6);
+    env_add(env, "REMUSER", client->user);
+    env_add(env, "REMOTE_USER", client->user);
+    env_add(env, "REMOTE_ADDR", client->ipaddress);
+    if (cline->remote_host) {
+        hostname = server_client_hostname(client);
+        if (hostname != NULL)
+            env_add(env, "REMOTE_HOST", hostname);
+    }
+    env_add(env, "REMCTL_COMMAND", command);
+
+    /* Copy our environment, skipping anything we've overridden. */
+    set = env->count;
+    for (i = 0; i < count; i++) {
+        length = strcspn(environ[i], "=") + 1;
+        for (j = 0; j < set; j++)
+            if (strncmp(environ[i], env->strings[j], length) == 0)
+                break;
+        if (j == set)
+            env->strings[env->count++] = xstrdup(environ[i]);
     }
-    return false;
+    env->strings[env->count] = NULL;
+    return env;
 }
 
 
 /*
- * Look up the matching configuration line for a command and subcommand.
- * Takes the configuration, a command, and a subcommand to match against
- * Returns the matching config line or NULL if none match.
+ * Older versions of MIT Kerberos left the replay cache file open across
+ * exec.  Newer versions correctly set it close-on-exec, but the child closes
+ * our low-numbered file descriptors anyway for older versions.  We're just
+ * trying to get the replay cache, so we don't have to go very high.
  */
-static struct confline *
-find_config_line(struct config *config, char *command, char *subcommand)
+#define CHILD_CLOSE_MAX 16
+
+
+#ifdef HAVE_POSIX_SPAWN
+/*
+ * Start a command with posix_spawn, which avoids copying our address space
+ * for a child that is only going to exec.  This is only possible if the
+ * command doesn't need resource limits or a different user, since those
+ * have to be set up in the child.  Takes the configuration line, the
+ * argument list, the environment, the pipes for standard input (both -1 to
+ * use /dev/null), standard output, and standard error, and where to store
+ * the process ID.
+ *
+ * The child closes the same descriptors that it would after fork: both ends
+ * of each pipe once they've been copied to the standard descriptors, which
+ * may be numbered above the range closed for the replay cache, and any other
+ * open descriptors in that range.
+ *
+ * Returns true if the command was started and false if it should be run with
+ * fork instead.  That includes failing to exec it, so that the fork path can
+ * report the error to the client the same way it always has.
+ */
+static bool
+spawn_command(struct confline *cline, char **req_argv, char **env,
+              int stdin_pipe[2], int stdout_pipe[2], int stderr_pipe[2],
+              pid_t *pid)
 {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigs;
+    short flags = POSIX_SPAWN_SETSIGDEF;
+    bool ok = false;
+    int pipes[6];
     size_t i;
+    int fd, fdflags;
+
+    if (cline->rlimit_cpu > 0 || cline->rlimit_as > 0 || cline->nice != 0)
+        return false;
+    if (cline->user != NULL && cline->uid > 0)
+        return false;
+    if (posix_spawn_file_actions_init(&actions) != 0)
+        return false;
+    if (posix_spawnattr_init(&attr) != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+        return false;
+    }
+
+    /*
+     * Set up the same standard file descriptors that the fork path does, and
+     * restore the default SIGCHLD handler.  If the command has a timeout,
+     * put it in its own process group.
+     */
+    if (stdin_pipe[0] >= 0) {
+        if (posix_spawn_file_actions_adddup2(&actions, stdin_pipe[0], 0) != 0)
+            goto done;
+    } else {
+        if (posix_spawn_file_actions_addopen(&actions, 0, "/dev/null",
+                                             O_RDONLY, 0) != 0)
+            goto done;
+    }
+    if (posix_spawn_file_actions_adddup2(&actions, stdout_pipe[1], 1) != 0)
+        goto done;
+    if (posix_spawn_file_actions_adddup2(&actions, stderr_pipe[1], 2) != 0)
+        goto done;
+
+    /*
+     * Close the pipes and then whatever else is open in the replay cache
+     * range.  Only add descriptors that are open and not already
+     * close-on-exec, since some implementations fail the spawn when asked to
+     * close a descriptor that isn't open.
+     */
+    pipes[0] = stdin_pipe[0];
+    pipes[1] = stdin_pipe[1];
+    pipes[2] = stdout_pipe[0];
+    pipes[3] = stdout_pipe[1];
+    pipes[4] = stderr_pipe[0];
+    pipes[5] = stderr_pipe[1];
+    for (i = 0; i < ARRAY_SIZE(pipes); i++)
+        if (pipes[i] > 2)
+            if (posix_spawn_file_actions_addclose(&actions, pipes[i]) != 0)
+                goto done;
+    for (fd = 3; fd < CHILD_CLOSE_MAX; fd++) {
+        for (i = 0; i < ARRAY_SIZE(pipes); i++)
+            if (pipes[i] == fd)
+                break;
+        if (i < ARRAY_SIZE(pipes))
+            continue;
+        fdflags = fcntl(fd, F_GETFD);
+        if (fdflags < 0 || (fdflags & FD_CLOEXEC))
+            continue;
+        if (posix_spawn_file_actions_addclose(&actions, fd) != 0)
+            goto done;
+    }
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGCHLD);
+    if (posix_spawnattr_setsigdefault(&attr, &sigs) != 0)
+        goto done;
+    if (cline->timeout > 0) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        if (posix_spawnattr_setpgroup(&attr, 0) != 0)
+            goto done;
+    }
+    if (posix_spawnattr_setflags(&attr, flags) != 0)
+        goto done;
+    ok = (posix_spawn(pid, cline->program, &actions, &attr, req_argv,
+                      env) == 0);
 
-    for (i = 0; i < config->count; i++)
-        if (line_matches(config->rules[i], command, subcommand))
-            return config->rules[i];
-    return NULL;
+done:
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    return ok;
 }
+#endif /* HAVE_POSIX_SPAWN */
 
 
 /*
- * Runs a given command via exec.  This forks a child process, sets
+ * Runs a given command via exec.  This starts a child process, sets
  * environment and changes ownership if needed, then runs the command and
- * sends the output back to the remctl client.
+ * sends the output back to the remctl client.  The child is started with
+ * posix_spawn if possible and fork otherwise.
  *
  * Takes the client, the short name for the command, an argument list, the
  * configuration line for that command, and the process.  Returns true on
@@ -298,6 +684,14 @@ server_exec(struct client *client, char *command, char **req_argv,
     int stdin_pipe[2] = { -1, -1 };
     int stdout_pipe[2] = { -1, -1 };
     int stderr_pipe[2] = { -1, -1 };
+    int wake[2] = { -1, -1 };
+    struct sigaction sa, oldsa;
+    struct vector *env = NULL;
+    const gid_t *groups = NULL;
+    size_t ngroups = 0;
+    bool have_groups = false;
+    bool handler = false;
+    bool spawned = false;
     bool ok = false;
     int fd;
 
@@ -310,19 +704,63 @@ server_exec(struct client *client, char *command, char **req_argv,
         server_send_error(client, ERROR_INTERNAL, "Internal failure");
         goto done;
     }
+
+    /*
+     * Enlarge the standard output pipe where possible so that a command
+     * producing a lot of output can keep writing while we wrap and send its
+     * previous output.  This is only an optimization, so ignore failure.
+     */
+#ifdef F_SETPIPE_SZ
+    fcntl(stdout_pipe[0], F_SETPIPE_SZ, OUTPUT_PIPE_SIZE);
+#endif
     if (process->input != NULL && pipe(stdin_pipe) != 0) {
         syswarn("cannot create stdin pipe");
         server_send_error(client, ERROR_INTERNAL, "Internal failure");
         goto done;
     }
 
+    /*
+     * Set up the pipe and SIGCHLD handler used to notice when the child
+     * exits.  This has to be done before forking so that we can't miss the
+     * signal.
+     */
+    if (pipe(wake) != 0) {
+        syswarn("cannot create wake pipe");
+        server_send_error(client, ERROR_INTERNAL, "Internal failure");
+        goto done;
+    }
+    fdflag_nonblocking(wake[0], true);
+    fdflag_nonblocking(wake[1], true);
+    fdflag_close_exec(wake[0], true);
+    fdflag_close_exec(wake[1], true);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = wake_handler;
+    wake_pipe = wake[1];
+    if (sigaction(SIGCHLD, &sa, &oldsa) < 0) {
+        syswarn("cannot set SIGCHLD handler");
+        server_send_error(client, ERROR_INTERNAL, "Internal failure");
+        goto done;
+    }
+    handler = true;
+
     /*
      * Flush output before forking, mostly in case -S was given and we've
      * therefore been writing log messages to standard output that may not
-     * have been flushed yet.
+     * have been flushed yet.  Then start the command, with posix_spawn if
+     * possible.  The supplementary groups for a command run as another user
+     * come from the cache loaded with the configuration, so that the child
+     * only has to call setgroups.
      */
+    env = build_env(client, cline, command);
+    if (cline->user != NULL && cline->uid > 0)
+        have_groups = server_config_groups(cline, &groups, &ngroups);
     fflush(stdout);
-    process->pid = fork();
+#ifdef HAVE_POSIX_SPAWN
+    spawned = spawn_command(cline, req_argv, env->strings, stdin_pipe,
+                            stdout_pipe, stderr_pipe, &process->pid);
+#endif
+    if (!spawned)
+        process->pid = fork();
     switch (process->pid) {
     case -1:
         syswarn("cannot fork");
@@ -331,6 +769,7 @@ server_exec(struct client *client, char *command, char **req_argv,
 
     /* In the child. */
     case 0:
+        sigaction(SIGCHLD, &oldsa, NULL);
         dup2(stdout_pipe[1], 1);
         close(stdout_pipe[0]);
         stdout_pipe[0] = -1;
@@ -355,7 +794,7 @@ server_exec(struct client *client, char *command, char **req_argv,
             close(stdin_pipe[0]);
             stdin_pipe[0] = -1;
             close(stdin_pipe[1]);
-            stdin_pipe[0] = -1;
+            stdin_pipe[1] = -1;
         } else {
             close(0);
             fd = open("/dev/null", O_RDONLY);
@@ -365,47 +804,30 @@ server_exec(struct client *client, char *command, char **req_argv,
             }
         }
 
-        /*
-         * Older versions of MIT Kerberos left the replay cache file open
-         * across exec.  Newer versions correctly set it close-on-exec, but
-         * close our low-numbered file descriptors anyway for older versions.
-         * We're just trying to get the replay cache, so we don't have to go
-         * very high.
-         */
-        for (fd = 3; fd < 16; fd++)
+        /* Close the replay cache and anything else we have open. */
+        for (fd = 3; fd < CHILD_CLOSE_MAX; fd++)
             close(fd);
 
         /*
-         * Put the authenticated principal and other connection and command
-         * information in the environment.  REMUSER is for backwards
-         * compatibility with earlier versions of remctl.
+         * If the command has a timeout, put it in its own process group so
+         * that it and anything it starts can be killed together.  Then apply
+         * any resource limits.
          */
-        if (setenv("REMUSER", client->user, 1) < 0) {
-            syswarn("cannot set REMUSER in environment");
+        if (cline->timeout > 0 && setpgid(0, 0) != 0) {
+            syswarn("cannot create process group");
             exit(-1);
         }
-        if (setenv("REMOTE_USER", client->user, 1) < 0) {
-            syswarn("cannot set REMOTE_USER in environment");
-            exit(-1);
-        }
-        if (setenv("REMOTE_ADDR", client->ipaddress, 1) < 0) {
-            syswarn("cannot set REMOTE_ADDR in environment");
-            exit(-1);
-        }
-        if (client->hostname != NULL) {
-            if (setenv("REMOTE_HOST", client->hostname, 1) < 0) {
-                syswarn("cannot set REMOTE_HOST in environment");
-                exit(-1);
-            }
-        }
-        if (setenv("REMCTL_COMMAND", command, 1) < 0) {
-            syswarn("cannot set REMCTL_COMMAND in environment");
+        if (!set_limits(cline))
             exit(-1);
-        }
 
         /* Drop privileges if requested. */
         if (cline->user != NULL && cline->uid > 0) {
-            if (initgroups(cline->user, cline->gid) != 0) {
+            if (have_groups) {
+                if (setgroups(ngroups, groups) != 0) {
+                    syswarn("cannot setgroups for %s\n", cline->user);
+                    exit(-1);
+                }
+            } else if (initgroups(cline->user, cline->gid) != 0) {
                 syswarn("cannot initgroups for %s\n", cline->user);
                 exit(-1);
             }
@@ -419,8 +841,8 @@ server_exec(struct client *client, char *command, char **req_argv,
             }
         }
 
-        /* Run the command. */
-        execv(cline->program, req_argv);
+        /* Run the command with the environment built by the parent. */
+        execve(cline->program, req_argv, env->strings);
 
         /*
          * This happens only if the exec fails.  Print out an error message to
@@ -431,6 +853,8 @@ server_exec(struct client *client, char *command, char **req_argv,
 
     /* In the parent. */
     default:
+        if (cline->timeout > 0)
+            setpgid(process->pid, process->pid);
         close(stdout_pipe[1]);
         stdout_pipe[1] = -1;
         close(stderr_pipe[1]);
@@ -460,7 +884,8 @@ server_exec(struct client *client, char *command, char **req_argv,
         process->fds[1] = stderr_pipe[0];
         if (process->input != NULL)
             process->stdin_fd = stdin_pipe[1];
-        ok = server_process_output(client, process);
+        process->wake_fd = wake[0];
+        ok = server_process_output(client, cline, process);
         close(process->fds[0]);
         close(process->fds[1]);
         if (process->input != NULL)
@@ -474,6 +899,15 @@ server_exec(struct client *client, char *command, char **req_argv,
     }
 
  done:
+    if (env != NULL)
+        vector_free(env);
+    if (handler && sigaction(SIGCHLD, &oldsa, NULL) < 0)
+        syswarn("cannot restore SIGCHLD handler");
+    wake_pipe = -1;
+    if (wake[0] != -1)
+        close(wake[0]);
+    if (wake[1] != -1)
+        close(wake[1]);
     if (stdout_pipe[0] != -1)
         close(stdout_pipe[0]);
     if (stdout_pipe[1] != -1)
@@ -511,8 +945,8 @@ server_send_summary(struct client *client, const char *user,
     bool ok;
     bool ok_any = false;
     int status_all = 0;
-    struct process process = { 0, { 0, 0 }, 0, NULL, -1, 0 };
-    struct process empty_process = { 0, { 0, 0 }, 0, NULL, -1, 0 };
+    struct process process = { 0, { 0, 0 }, 0, NULL, -1, 0, -1 };
+    struct process empty_process = { 0, { 0, 0 }, 0, NULL, -1, 0, -1 };
 
     /*
      * Check each line in the config to find any that are "<command> ALL"
@@ -568,6 +1002,39 @@ server_send_summary(struct client *client, const char *user,
     }
 }
 
+/*
+ * Allocate an argv array with room for count pointers plus a NULL pointer and
+ * size bytes of string data, as a single block.  Sets *strings to the start
+ * of the string data.  The whole argv is freed with a single call to free.
+ */
+static char **
+argv_alloc(size_t count, size_t size, char **strings)
+{
+    char **req_argv;
+
+    req_argv = xmalloc((count + 1) * sizeof(char *) + size);
+    *strings = (char *) (req_argv + count + 1);
+    return req_argv;
+}
+
+
+/*
+ * Copy a string of the given length into argv string data, nul-terminating
+ * it, and return a pointer to the copy.  Advances *strings past the copy.
+ */
+static char *
+argv_copy(char **strings, const char *data, size_t length)
+{
+    char *copy = *strings;
+
+    if (length > 0)
+        memcpy(copy, data, length);
+    copy[length] = '\0';
+    *strings += length + 1;
+    return copy;
+}
+
+
 /*
  * Create the argv we will pass along to a program at a full command
  * request.  This will be created from the full command and arguments given
@@ -576,44 +1043,52 @@ server_send_summary(struct client *client, const char *user,
  * Takes the command and optional sub-command to run, the config line for this
  * command, the process, and the existing argv from remctl client.  Returns
  * a newly-allocated argv array that the caller is responsible for freeing.
+ * The strings are stored in the same allocation as the array, so only the
+ * array itself should be freed.
  */
 static char **
 create_argv_command(struct confline *cline, struct process *process,
                     struct iovec **argv)
 {
-    size_t count, i, j, stdin_arg;
+    size_t count, size, i, j, stdin_arg;
     char **req_argv = NULL;
+    char *strings;
     const char *program;
 
-    /* Get ready to assemble the argv of the command. */
-    for (count = 0; argv[count] != NULL; count++)
-        ;
-    req_argv = xmalloc((count + 1) * sizeof(char *));
-
     /*
      * Get the real program name, and use it as the first argument in argv
-     * passed to the command.  Then build the rest of the argv for the
-     * command, splicing out the argument we're passing on stdin (if any).
+     * passed to the command.  Then work out which argument, if any, is
+     * passed on stdin and how much space the rest of the arguments need.
      */
     program = strrchr(cline->program, '/');
     if (program == NULL)
         program = cline->program;
     else
         program++;
-    req_argv[0] = xstrdup(program);
+    for (count = 0; argv[count] != NULL; count++)
+        ;
     if (cline->stdin_arg == -1)
         stdin_arg = count - 1;
     else
         stdin_arg = (size_t) cline->stdin_arg;
+    size = strlen(program) + 1;
+    for (i = 1; i < count; i++)
+        if (i != stdin_arg)
+            size += argv[i]->iov_len + 1;
+
+    /*
+     * Build the argv for the command, splicing out the argument we're
+     * passing on stdin (if any).
+     */
+    req_argv = argv_alloc(count, size, &strings);
+    req_argv[0] = argv_copy(&strings, program, strlen(program));
     for (i = 1, j = 1; i < count; i++) {
         if (i == stdin_arg) {
             process->input = argv[i];
             continue;
         }
-        if (argv[i]->iov_len == 0)
-            req_argv[j] = xstrdup("");
-        else
-            req_argv[j] = xstrndup(argv[i]->iov_base, argv[i]->iov_len);
+        req_argv[j] = argv_copy(&strings, argv[i]->iov_base,
+                                argv[i]->iov_len);
         j++;
     }
     req_argv[j] = NULL;
@@ -628,18 +1103,16 @@ create_argv_command(struct confline *cline, struct process *process,
  *
  * Takes the path of the program to run and the command and optional
  * sub-command to run.  Returns a newly allocated argv array that the caller
- * is responsible for freeing.
+ * is responsible for freeing.  As with create_argv_command, the strings are
+ * part of the same allocation.
  */
 static char **
 create_argv_help(const char *path, const char *command, const char *subcommand)
 {
     char **req_argv = NULL;
+    char *strings;
     const char *program;
-
-    if (subcommand == NULL)
-        req_argv = xmalloc(3 * sizeof(char *));
-    else
-        req_argv = xmalloc(4 * sizeof(char *));
+    size_t size;
 
     /* The argv to pass along for a help command is very simple. */
     program = strrchr(path, '/');
@@ -647,12 +1120,16 @@ create_argv_help(const char *path, const char *command, const char *subcommand)
         program = path;
     else
         program++;
-    req_argv[0] = xstrdup(program);
-    req_argv[1] = xstrdup(command);
+    size = strlen(program) + 1 + strlen(command) + 1;
+    if (subcommand != NULL)
+        size += strlen(subcommand) + 1;
+    req_argv = argv_alloc(subcommand == NULL ? 2 : 3, size, &strings);
+    req_argv[0] = argv_copy(&strings, program, strlen(program));
+    req_argv[1] = argv_copy(&strings, command, strlen(command));
     if (subcommand == NULL)
         req_argv[2] = NULL;
     else {
-        req_argv[2] = xstrdup(subcommand);
+        req_argv[2] = argv_copy(&strings, subcommand, strlen(subcommand));
         req_argv[3] = NULL;
     }
     return req_argv;
@@ -690,7 +1167,7 @@ server_run_command(struct client *client, struct config *config,
     bool ok = false;
     bool help = false;
     const char *user = client->user;
-    struct process process = { 0, { 0, 0 }, 0, NULL, -1, 0 };
+    struct process process = { 0, { 0, 0 }, 0, NULL, -1, 0, -1 };
 
     /*
      * We need at least one argument.  This is also rejected earlier when
@@ -725,7 +1202,7 @@ server_run_command(struct client *client, struct config *config,
      * specific help command was listed, check for that in the configuration
      * instead.
      */
-    cline = find_config_line(config, command, subcommand);
+    cline = server_config_find(config, command, subcommand);
     if (cline == NULL && strcmp(command, "help") == 0) {
 
         /* Error if we have more than a command and possible subcommand. */
@@ -744,7 +1221,7 @@ server_run_command(struct client *client, struct config *config,
             if (argv[2] != NULL)
                 helpsubcommand = xstrndup(argv[2]->iov_base,
                                           argv[2]->iov_len);
-            cline = find_config_line(config, subcommand, helpsubcommand);
+            cline = server_config_find(config, subcommand, helpsubcommand);
         }
     }
 
@@ -806,6 +1283,10 @@ server_run_command(struct client *client, struct config *config,
         }
     }
 
+    /* Check the limits on simultaneous connections and commands. */
+    if (!server_limits_admit(client, cline))
+        goto done;
+
     /* Assemble the argv for the command we're about to run. */
     if (help)
         req_argv = create_argv_help(cline->program, subcommand, helpsubcommand);
@@ -814,6 +1295,7 @@ server_run_command(struct client *client, struct config *config,
 
     /* Now actually execute the program. */
     ok = server_exec(client, command, req_argv, cline, &process);
+    server_limits_release();
     if (ok) {
         if (client->protocol == 1)
             server_v1_send_output(client, process.status);
@@ -828,27 +1310,18 @@ server_run_command(struct client *client, struct config *config,
         free(subcommand);
     if (helpsubcommand != NULL)
         free(helpsubcommand);
-    if (req_argv != NULL) {
-        for (i = 0; req_argv[i] != NULL; i++)
-            free(req_argv[i]);
+    if (req_argv != NULL)
         free(req_argv);
-    }
 }
 
 
 /*
  * Free a command, represented as a NULL-terminated array of pointers to iovec
- * structs.
+ * structs.  The array and the iovecs are a single allocation made by
+ * server_parse_command, and the argument data belongs to the caller.
  */
 void
 server_free_command(struct iovec **command)
 {
-    struct iovec **arg;
-
-    for (arg = command; *arg != NULL; arg++) {
-        if ((*arg)->iov_base != NULL)
-            free((*arg)->iov_base);
-        free(*arg);
-    }
     free(command);
 }
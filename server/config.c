@@ -19,6 +19,8 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <grp.h>
+#include <limits.h>
 #ifdef HAVE_PCRE
 # include <pcre.h>
 #endif
@@ -27,6 +29,7 @@
 # include <regex.h>
 #endif
 #include <sys/stat.h>
+#include <time.h>
 
 #include <server/internal.h>
 #include <util/macros.h>
@@ -74,10 +77,155 @@ struct acl_scheme {
 #define ACL_SCHEME_FILE  0
 #define ACL_SCHEME_PRINC 1
 
+/*
+ * The longest allowed command timeout in seconds, so that the timeout in
+ * milliseconds fits in the int that poll takes.
+ */
+#define TIMEOUT_MAX (INT_MAX / 1000)
+
+/*
+ * Types of entries in a parsed ACL file.  Runs of consecutive plain
+ * principals are collapsed into a single hash set, other ACL entries
+ * (include lines and lines with an explicit scheme) are passed to acl_check,
+ * and a line that can't be parsed becomes an error entry that ends
+ * processing of the file when reached.
+ */
+enum acl_entry_type {
+    ACL_ENTRY_PRINCIPALS,
+    ACL_ENTRY_CHECK,
+    ACL_ENTRY_ERROR
+};
+
+/* A single entry in a parsed ACL file. */
+struct acl_entry {
+    enum acl_entry_type type;
+    int lineno;                 /* Line number of the entry. */
+    int def_index;              /* Default scheme for ACL_ENTRY_CHECK. */
+    char *data;                 /* ACL for a check or message for an error. */
+    char **principals;          /* Hash set of principals, NULL if empty. */
+    size_t size;                /* Number of slots in principals. */
+};
+
+/*
+ * A parsed ACL file.  The stamp is used to notice when the file has changed
+ * and needs to be parsed again.  busy counts checks currently walking the
+ * entries, so that a file replaced during a recursive check isn't freed out
+ * from under the caller.
+ */
+struct acl_file {
+    char *path;
+    struct file_stamp stamp;
+    struct acl_entry *entries;
+    size_t count;
+    unsigned int busy;
+    bool stale;
+    unsigned long generation;
+    struct acl_file *next;
+};
+
+/* Hash table of parsed ACL files keyed by path. */
+#define ACL_CACHE_SIZE 256
+static struct acl_file *acl_cache[ACL_CACHE_SIZE];
+
+/*
+ * Whether to parse the ACL files and look up the supplementary groups
+ * referenced by a configuration when it's loaded, and the number of times
+ * that has been done, so that preloading the ACL files it references visits
+ * each file only once.
+ */
+static bool config_preload = false;
+static unsigned long acl_generation = 0;
+
+/* Types of regular expressions used in ACLs. */
+enum acl_pattern_type {
+    ACL_PATTERN_PCRE,
+    ACL_PATTERN_REGEX
+};
+
+/*
+ * A compiled regular expression from a pcre or regex ACL, or the reason it
+ * could not be compiled.  generation records the configuration load that
+ * last used the expression, so that expressions no longer used can be
+ * dropped.
+ */
+struct acl_pattern {
+    char *data;                 /* The expression as written in the ACL. */
+    enum acl_pattern_type type;
+    char *error;                /* Compilation error, or NULL on success. */
+#ifdef HAVE_PCRE
+    pcre *pcre;
+    pcre_extra *extra;          /* Result of pcre_study, may be NULL. */
+#endif
+#ifdef HAVE_REGCOMP
+    regex_t regex;
+#endif
+    unsigned long generation;
+    struct acl_pattern *next;
+};
+
+/* Hash table of compiled regular expressions keyed by expression. */
+#if defined(HAVE_PCRE) || defined(HAVE_REGCOMP)
+static struct acl_pattern *acl_patterns[ACL_CACHE_SIZE];
+#endif
+
+/*
+ * The supplementary groups for a user and primary group named by a user
+ * option.  These are looked up when a command first needs them, or when the
+ * configuration is loaded if it's being preloaded, and again once they're
+ * older than GROUPS_TTL, so that running a command doesn't have to go
+ * through the group database each time.  generation records the
+ * configuration load that last used the entry, so that entries for users no
+ * longer in the configuration can be dropped.
+ */
+struct user_groups {
+    char *user;
+    gid_t gid;
+    gid_t *groups;
+    size_t count;
+    time_t loaded;
+    unsigned long generation;
+    struct user_groups *next;
+};
+
+/* List of cached supplementary groups.  There are only a few users. */
+static struct user_groups *user_groups = NULL;
+
+/*
+ * A parsed configuration file, kept so that reloading the configuration only
+ * has to parse the files that have changed.  Each item is either a command,
+ * shared with every loaded configuration that uses it, or an include, which
+ * is followed again on each load since the included files may have changed.
+ * The stamp is used to notice when the file has changed, as for ACL files.
+ */
+struct conf_item {
+    struct confline *rule;      /* A command, or NULL for an include. */
+    char *include;              /* The included file or directory. */
+    size_t lineno;              /* Line number of the include. */
+};
+struct conf_file {
+    char *path;
+    struct file_stamp stamp;
+    struct conf_item *items;
+    size_t count;
+    unsigned long generation;
+    struct conf_file *next;
+};
+
+/* Hash table of parsed configuration files keyed by path. */
+static struct conf_file *conf_cache[ACL_CACHE_SIZE];
+
+/*
+ * Incremented each time a configuration is loaded, so that cached
+ * configuration files and supplementary groups no longer used by the
+ * configuration can be dropped.
+ */
+static unsigned long config_generation = 0;
+
 /* Forward declarations. */
 static enum config_status acl_check(const char *user, const char *entry,
                                     int def_index, const char *file,
                                     int lineno);
+static enum config_status read_conf_file(void *data, const char *name);
 
 /*
  * Check a filename for acceptable characters.  Returns true if the file
@@ -103,6 +251,73 @@ valid_filename(const char *filename)
 }
 
 
+/*
+ * Add a string to an FNV-1a hash.  Start with HASH_INIT for a new hash.  Also
+ * used by the concurrency limit tracking in the parent.
+ */
+unsigned long
+server_hash_string(unsigned long hash, const char *string)
+{
+    const unsigned char *p;
+
+    for (p = (const unsigned char *) string; *p != '\0'; p++)
+        hash = ((hash ^ *p) * 16777619UL) & 0xffffffffUL;
+    return hash;
+}
+
+
+/*
+ * Record the identity of a file that is being read into a cache, given the
+ * result of stat on it.  Also used for the keytab.
+ */
+void
+server_file_stamp(struct file_stamp *stamp, const struct stat *st)
+{
+    stamp->dev = st->st_dev;
+    stamp->ino = st->st_ino;
+    stamp->size = st->st_size;
+    stamp->mtime = st->st_mtime;
+    stamp->ctime = st->st_ctime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+    stamp->mtime_nsec = st->st_mtim.tv_nsec;
+    stamp->ctime_nsec = st->st_ctim.tv_nsec;
+#else
+    stamp->mtime_nsec = 0;
+    stamp->ctime_nsec = 0;
+#endif
+    stamp->stamped = time(NULL);
+}
+
+
+/*
+ * Return true if the file described by the result of stat is still the one
+ * recorded in a stamp.  File timestamps may only have a granularity of a
+ * second or of a clock tick, so a file read in the same second that it was
+ * last changed may be changed again, with the same size, without any visible
+ * difference.  Such a stamp is never trusted, so the file is read again until
+ * it has been stamped after the second in which it last changed.  Timestamps
+ * in the future, such as from a clock that was set back or a file copied
+ * with its times preserved, can't be explained that way, so for those the
+ * stat fields are just compared; otherwise the file would be read again on
+ * every check until the clock caught up.
+ */
+bool
+server_file_unchanged(const struct file_stamp *stamp, const struct stat *st)
+{
+    struct file_stamp current;
+
+    if (stamp->ctime == stamp->stamped || stamp->mtime == stamp->stamped)
+        return false;
+    server_file_stamp(&current, st);
+    return (stamp->dev == current.dev && stamp->ino == current.ino
+            && stamp->size == current.size
+            && stamp->mtime == current.mtime
+            && stamp->mtime_nsec == current.mtime_nsec
+            && stamp->ctime == current.ctime
+            && stamp->ctime_nsec == current.ctime_nsec);
+}
+
+
 /*
  * Process a request for including a file, either for configuration or for
  * ACLs.  Called by read_conf_file and acl_check_file.
@@ -251,6 +466,28 @@ option_logmask(struct confline *confline, char *value, const char *name,
 }
 
 
+/*
+ * Parse the remote-host configuration option.  Verifies that the value is
+ * yes or no, stores it in the configuration line struct, and returns
+ * CONFIG_SUCCESS on success and CONFIG_ERROR on error.
+ */
+static enum config_status
+option_remote_host(struct confline *confline, char *value, const char *name,
+                   size_t lineno)
+{
+    if (strcmp(value, "yes") == 0)
+        confline->remote_host = true;
+    else if (strcmp(value, "no") == 0)
+        confline->remote_host = false;
+    else {
+        warn("%s:%lu: invalid remote-host value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
 /*
  * Parse the stdin configuration option.  Verifies the argument number or
  * "last" keyword, stores it in the configuration line struct, and returns
@@ -271,12 +508,138 @@ option_stdin(struct confline *confline, char *value, const char *name,
 }
 
 
+/*
+ * Look up the supplementary groups for a cached user and store them in the
+ * entry, replacing any previous list.  Returns true on success and false if
+ * they can't be looked up, in which case any previous list is kept.
+ */
+#ifdef HAVE_GETGROUPLIST
+static bool
+groups_load(struct user_groups *entry)
+{
+    gid_t *groups;
+    int size = 64;
+    int count;
+
+    /*
+     * getgrouplist returns -1 if the array is too small.  Some systems also
+     * tell us how large it needs to be, but others don't, so keep doubling
+     * it up to a sanity limit.
+     */
+    groups = xmalloc(size * sizeof(gid_t));
+    while (1) {
+        count = size;
+        if (getgrouplist(entry->user, entry->gid, groups, &count) >= 0)
+            break;
+        if (size >= 64 * 1024) {
+            warn("too many supplementary groups for %s", entry->user);
+            free(groups);
+            return false;
+        }
+        size = (count > size) ? count : size * 2;
+        groups = xrealloc(groups, size * sizeof(gid_t));
+    }
+    free(entry->groups);
+    entry->groups = groups;
+    entry->count = count;
+    entry->loaded = time(NULL);
+    return true;
+}
+#else
+static bool
+groups_load(struct user_groups *entry UNUSED)
+{
+    return false;
+}
+#endif
+
+
+/*
+ * Find the cached supplementary groups for a user and primary group, creating
+ * an empty entry if there isn't one yet.
+ */
+static struct user_groups *
+groups_find(const char *user, gid_t gid)
+{
+    struct user_groups *entry;
+
+    for (entry = user_groups; entry != NULL; entry = entry->next)
+        if (entry->gid == gid && strcmp(entry->user, user) == 0)
+            return entry;
+    entry = xcalloc(1, sizeof(struct user_groups));
+    entry->user = xstrdup(user);
+    entry->gid = gid;
+    entry->next = user_groups;
+    user_groups = entry;
+    return entry;
+}
+
+
+/*
+ * Returns true if the cached supplementary groups need to be looked up
+ * again, either because they've never been loaded or because they're older
+ * than GROUPS_TTL.
+ */
+static bool
+groups_expired(struct user_groups *entry, time_t now)
+{
+    if (entry->groups == NULL)
+        return true;
+    return (now < entry->loaded || now - entry->loaded >= GROUPS_TTL);
+}
+
+
+/*
+ * Note that the configuration being loaded runs commands as the given user,
+ * so that its cached supplementary groups are kept.  If the configuration is
+ * being preloaded, also look them up, once per load.  Otherwise, they're
+ * looked up when a command first needs them, since a single connection from
+ * inetd only runs a command as at most one of the users.
+ */
+static void
+groups_use(const char *user, gid_t gid)
+{
+    struct user_groups *entry;
+
+    entry = groups_find(user, gid);
+    if (entry->generation != config_generation) {
+        entry->generation = config_generation;
+        if (config_preload)
+            groups_load(entry);
+    }
+}
+
+
+/*
+ * Drop the cached supplementary groups of users that weren't named by the
+ * configuration that was just loaded.
+ */
+static void
+groups_prune(void)
+{
+    struct user_groups **entry, *old;
+
+    entry = &user_groups;
+    while (*entry != NULL) {
+        if ((*entry)->generation == config_generation) {
+            entry = &(*entry)->next;
+            continue;
+        }
+        old = *entry;
+        *entry = old->next;
+        free(old->user);
+        free(old->groups);
+        free(old);
+    }
+}
+
+
 /*
  * Parse the user configuration option.  Verifies that the value is either a
  * UID or a username, stores the user in the configuration line struct, and
  * looks up the UID and primary GID and stores that in the configuration
- * struct as well.  Returns CONFIG_SUCCESS on success and CONFIG_ERROR on
- * error.
+ * struct as well.  Also notes the user in the cache of supplementary groups.
+ * Returns CONFIG_SUCCESS on success and CONFIG_ERROR on error.
  */
 static enum config_status
 option_user(struct confline *confline, char *value, const char *name,
@@ -297,6 +660,7 @@ option_user(struct confline *confline, char *value, const char *name,
     confline->user = xstrdup(pw->pw_name);
     confline->uid = pw->pw_uid;
     confline->gid = pw->pw_gid;
+    groups_use(confline->user, confline->gid);
     return CONFIG_SUCCESS;
 }
 
@@ -315,6 +679,154 @@ option_summary(struct confline *confline, char *value,
 }
 
 
+/*
+ * Parse the coalesce configuration option.  The value is the number of bytes
+ * of output to accumulate before sending it, optionally followed by a comma
+ * and the maximum number of milliseconds to hold output.  Stores both in the
+ * configuration line struct and returns CONFIG_SUCCESS on success and
+ * CONFIG_ERROR on error.
+ */
+static enum config_status
+option_coalesce(struct confline *confline, char *value, const char *name,
+                size_t lineno)
+{
+    char *end;
+    long size;
+    long delay = COALESCE_DELAY;
+
+    errno = 0;
+    size = strtol(value, &end, 10);
+    if (errno == 0 && *end == ',')
+        delay = strtol(end + 1, &end, 10);
+    if (errno != 0 || *end != '\0' || size <= 0 || size > MAXBUFFER
+        || delay <= 0) {
+        warn("%s:%lu: invalid coalesce value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    confline->coalesce = size;
+    confline->coalesce_delay = delay;
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the max-running configuration option.  Verifies that the value is a
+ * positive number of simultaneous commands, stores it in the configuration
+ * line struct, and returns CONFIG_SUCCESS on success and CONFIG_ERROR on
+ * error.
+ */
+static enum config_status
+option_max_running(struct confline *confline, char *value, const char *name,
+                   size_t lineno)
+{
+    if (!convert_number(value, &confline->max_running)) {
+        warn("%s:%lu: invalid max-running value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the nice configuration option.  Verifies that the value is a valid
+ * adjustment to the scheduling priority, stores it in the configuration line
+ * struct, and returns CONFIG_SUCCESS on success and CONFIG_ERROR on error.
+ */
+static enum config_status
+option_nice(struct confline *confline, char *value, const char *name,
+            size_t lineno)
+{
+    char *end;
+    long adjust;
+
+    errno = 0;
+    adjust = strtol(value, &end, 10);
+    if (errno != 0 || *end != '\0' || end == value || adjust < -20
+        || adjust > 19) {
+        warn("%s:%lu: invalid nice value %s", name, (unsigned long) lineno,
+             value);
+        return CONFIG_ERROR;
+    }
+    confline->nice = adjust;
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the rlimit-as configuration option.  The value is a number of bytes,
+ * optionally followed by K, M, or G for kilobytes, megabytes, or gigabytes.
+ * Stores it in the configuration line struct and returns CONFIG_SUCCESS on
+ * success and CONFIG_ERROR on error.
+ */
+static enum config_status
+option_rlimit_as(struct confline *confline, char *value, const char *name,
+                 size_t lineno)
+{
+    char *end;
+    unsigned long size;
+    unsigned long multiplier = 1;
+
+    errno = 0;
+    size = strtoul(value, &end, 10);
+    if (*end == 'k' || *end == 'K')
+        multiplier = 1024UL;
+    else if (*end == 'm' || *end == 'M')
+        multiplier = 1024UL * 1024;
+    else if (*end == 'g' || *end == 'G')
+        multiplier = 1024UL * 1024 * 1024;
+    if (multiplier > 1)
+        end++;
+    if (errno != 0 || *end != '\0' || !isdigit((unsigned char) *value)
+        || size == 0 || size > ULONG_MAX / multiplier) {
+        warn("%s:%lu: invalid rlimit-as value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    confline->rlimit_as = size * multiplier;
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the rlimit-cpu configuration option.  Verifies that the value is a
+ * positive number of seconds, stores it in the configuration line struct, and
+ * returns CONFIG_SUCCESS on success and CONFIG_ERROR on error.
+ */
+static enum config_status
+option_rlimit_cpu(struct confline *confline, char *value, const char *name,
+                  size_t lineno)
+{
+    if (!convert_number(value, &confline->rlimit_cpu)) {
+        warn("%s:%lu: invalid rlimit-cpu value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the timeout configuration option.  Verifies that the value is a
+ * positive number of seconds no larger than TIMEOUT_MAX, stores it in the
+ * configuration line struct, and returns CONFIG_SUCCESS on success and
+ * CONFIG_ERROR on error.
+ */
+static enum config_status
+option_timeout(struct confline *confline, char *value, const char *name,
+               size_t lineno)
+{
+    if (!convert_number(value, &confline->timeout)
+        || confline->timeout > TIMEOUT_MAX) {
+        warn("%s:%lu: invalid timeout value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
 /*
  * Parse the help configuration option.  Stores the help option in the
  * configuration line struct.  Returns CONFIG_SUCCESS on success and
@@ -333,12 +845,19 @@ option_help(struct confline *confline, char *value,
  * The table relating configuration option names to functions.
  */
 static const struct config_option options[] = {
-    { "help",    option_help    },
-    { "logmask", option_logmask },
-    { "stdin",   option_stdin   },
-    { "summary", option_summary },
-    { "user",    option_user    },
-    { NULL,      NULL           }
+    { "coalesce",    option_coalesce    },
+    { "help",        option_help        },
+    { "logmask",     option_logmask     },
+    { "max-running", option_max_running },
+    { "nice",        option_nice        },
+    { "remote-host", option_remote_host },
+    { "rlimit-as",   option_rlimit_as   },
+    { "rlimit-cpu",  option_rlimit_cpu  },
+    { "stdin",       option_stdin       },
+    { "summary",     option_summary     },
+    { "timeout",     option_timeout     },
+    { "user",        option_user        },
+    { NULL,          NULL               }
 };
 
 
@@ -376,6 +895,197 @@ parse_conf_option(struct confline *confline, char *option, const char *name,
 }
 
 
+/*
+ * Release a reference to a configuration line, freeing it once neither a
+ * loaded configuration nor the configuration file cache uses it.
+ */
+static void
+confline_release(struct confline *rule)
+{
+    rule->refs--;
+    if (rule->refs > 0)
+        return;
+    if (rule->logmask != NULL)
+        free(rule->logmask);
+    if (rule->user != NULL)
+        free(rule->user);
+    if (rule->acls != NULL)
+        free(rule->acls);
+    if (rule->line != NULL)
+        vector_free(rule->line);
+    if (rule->file != NULL)
+        free(rule->file);
+    free(rule);
+}
+
+
+/*
+ * Add a configuration line to the end of a configuration.  The caller is
+ * responsible for the reference held by the configuration.
+ */
+static void
+config_add_rule(struct config *config, struct confline *rule)
+{
+    size_t size;
+
+    if (config->count == config->allocated) {
+        if (config->allocated < 4)
+            config->allocated = 4;
+        else
+            config->allocated *= 2;
+        size = config->allocated * sizeof(struct confline *);
+        config->rules = xrealloc(config->rules, size);
+    }
+    if (rule->max_running > 0)
+        config->max_running = true;
+    config->rules[config->count] = rule;
+    config->count++;
+}
+
+
+/*
+ * Free a parsed configuration file, releasing its commands.
+ */
+static void
+conf_file_free(struct conf_file *cf)
+{
+    size_t i;
+
+    for (i = 0; i < cf->count; i++) {
+        if (cf->items[i].rule != NULL)
+            confline_release(cf->items[i].rule);
+        if (cf->items[i].include != NULL)
+            free(cf->items[i].include);
+    }
+    free(cf->items);
+    free(cf->path);
+    free(cf);
+}
+
+
+/*
+ * Add a new item to a parsed configuration file and return it.  The caller
+ * fills in the command or include.
+ */
+static struct conf_item *
+conf_file_add(struct conf_file *cf, size_t *allocated)
+{
+    struct conf_item *item;
+
+    if (cf->count == *allocated) {
+        *allocated = (*allocated < 4) ? 4 : *allocated * 2;
+        cf->items = xrealloc(cf->items, *allocated * sizeof(struct conf_item));
+    }
+    item = &cf->items[cf->count];
+    cf->count++;
+    memset(item, 0, sizeof(*item));
+    return item;
+}
+
+
+/*
+ * Return the cached parse of a configuration file if there is one and the
+ * file, as described by st, hasn't changed since it was parsed.  Otherwise,
+ * return NULL.
+ */
+static struct conf_file *
+conf_file_get(const char *path, const struct stat *st)
+{
+    struct conf_file *cf;
+    size_t bucket;
+
+    bucket = server_hash_string(HASH_INIT, path) % ACL_CACHE_SIZE;
+    for (cf = conf_cache[bucket]; cf != NULL; cf = cf->next)
+        if (strcmp(cf->path, path) == 0)
+            break;
+    if (cf == NULL)
+        return NULL;
+    if (!server_file_unchanged(&cf->stamp, st))
+        return NULL;
+    return cf;
+}
+
+
+/*
+ * Store a newly parsed configuration file in the cache, replacing any older
+ * parse of the same file.
+ */
+static void
+conf_file_store(struct conf_file *cf)
+{
+    struct conf_file **link, *old;
+    size_t bucket;
+
+    bucket = server_hash_string(HASH_INIT, cf->path) % ACL_CACHE_SIZE;
+    for (link = &conf_cache[bucket]; *link != NULL; link = &(*link)->next)
+        if (strcmp((*link)->path, cf->path) == 0) {
+            old = *link;
+            *link = old->next;
+            conf_file_free(old);
+            break;
+        }
+    cf->next = conf_cache[bucket];
+    conf_cache[bucket] = cf;
+}
+
+
+/*
+ * Drop the cached configuration files that weren't used by the configuration
+ * that was just loaded.
+ */
+static void
+conf_file_prune(void)
+{
+    struct conf_file **link, *old;
+    size_t i;
+
+    for (i = 0; i < ACL_CACHE_SIZE; i++) {
+        link = &conf_cache[i];
+        while (*link != NULL) {
+            if ((*link)->generation == config_generation) {
+                link = &(*link)->next;
+                continue;
+            }
+            old = *link;
+            *link = old->next;
+            conf_file_free(old);
+        }
+    }
+}
+
+
+/*
+ * Add the contents of a cached configuration file to a configuration without
+ * parsing it again.  Included files are still processed by read_conf_file,
+ * since they may have changed.  Returns CONFIG_SUCCESS on success and
+ * CONFIG_ERROR on error, reporting an error message.
+ */
+static enum config_status
+conf_file_replay(struct config *config, struct conf_file *cf)
+{
+    struct conf_item *item;
+    enum config_status s;
+    size_t i;
+
+    cf->generation = config_generation;
+    for (i = 0; i < cf->count; i++) {
+        item = &cf->items[i];
+        if (item->rule == NULL) {
+            s = handle_include(item->include, cf->path, item->lineno,
+                               read_conf_file, config);
+            if (s < -1)
+                return CONFIG_ERROR;
+            continue;
+        }
+        item->rule->refs++;
+        config_add_rule(config, item->rule);
+        if (item->rule->user != NULL)
+            groups_use(item->rule->user, item->rule->gid);
+    }
+    return CONFIG_SUCCESS;
+}
+
+
 /*
  * Reads the configuration file and parses every line, populating a data
  * structure that will be traversed on each request to translate a command
@@ -392,6 +1102,10 @@ parse_conf_option(struct confline *confline, char *option, const char *name,
  * parse an included file (or, if <file> is a directory, every file in that
  * directory that doesn't contain a period).
  *
+ * Each successfully parsed file is cached, and if the file hasn't changed
+ * when the configuration is next loaded, the cached commands are reused
+ * instead of parsing it again.
+ *
  * Returns CONFIG_SUCCESS on success and CONFIG_ERROR on error, reporting an
  * error message.
  */
@@ -401,21 +1115,39 @@ read_conf_file(void *data, const char *name)
     struct config *config = data;
     FILE *file;
     char *buffer, *p, *option;
-    size_t bufsize, length, size, count, i, arg_i;
+    size_t bufsize, length, count, i, arg_i;
+    size_t allocated = 0;
     enum config_status s;
     struct vector *line = NULL;
     struct confline *confline = NULL;
+    struct conf_file *cf = NULL;
+    struct conf_item *item;
+    struct stat st;
     size_t lineno = 0;
     DIR *dir = NULL;
 
-    bufsize = 1024;
-    buffer = xmalloc(bufsize);
     file = fopen(name, "r");
     if (file == NULL) {
-        free(buffer);
         syswarn("cannot open config file %s", name);
         return CONFIG_ERROR;
     }
+    config->files++;
+    if (fstat(fileno(file), &st) < 0) {
+        syswarn("cannot stat config file %s", name);
+        fclose(file);
+        return CONFIG_ERROR;
+    }
+    cf = conf_file_get(name, &st);
+    if (cf != NULL) {
+        fclose(file);
+        return conf_file_replay(config, cf);
+    }
+    config->changed++;
+    cf = xcalloc(1, sizeof(struct conf_file));
+    cf->path = xstrdup(name);
+    server_file_stamp(&cf->stamp, &st);
+    bufsize = 1024;
+    buffer = xmalloc(bufsize);
     while (fgets(buffer, bufsize, file) != NULL) {
         length = strlen(buffer);
         if (length == 2 && buffer[length - 1] != '\n') {
@@ -474,6 +1206,9 @@ read_conf_file(void *data, const char *name)
                                config);
             if (s < -1)
                 goto fail;
+            item = conf_file_add(cf, &allocated);
+            item->include = xstrdup(line->strings[1]);
+            item->lineno = lineno;
             vector_free(line);
             line = NULL;
             continue;
@@ -483,22 +1218,15 @@ read_conf_file(void *data, const char *name)
         }
 
         /*
-         * Okay, we have a regular configuration line.  Make sure there's
-         * space for it in the config struct and stuff the vector into place.
+         * Okay, we have a regular configuration line.  Stuff the vector into
+         * place.
          */
-        if (config->count == config->allocated) {
-            if (config->allocated < 4)
-                config->allocated = 4;
-            else
-                config->allocated *= 2;
-            size = config->allocated * sizeof(struct confline *);
-            config->rules = xrealloc(config->rules, size);
-        }
         confline = xcalloc(1, sizeof(struct confline));
         confline->line       = line;
         confline->command    = line->strings[0];
         confline->subcommand = line->strings[1];
         confline->program    = line->strings[2];
+        confline->remote_host = true;
 
         /*
          * Parse config options.
@@ -530,14 +1258,21 @@ read_conf_file(void *data, const char *name)
             confline->acls[i] = line->strings[i + arg_i];
         confline->acls[i] = NULL;
 
-        /* Success.  Put the configuration line in place. */
-        config->rules[config->count] = confline;
-        config->count++;
+        /*
+         * Success.  Put the configuration line in place, with one reference
+         * for the configuration and one for the cached file.
+         */
+        confline->refs = 2;
+        config_add_rule(config, confline);
+        item = conf_file_add(cf, &allocated);
+        item->rule = confline;
         confline = NULL;
         line = NULL;
     }
 
-    /* Free allocated memory and return success. */
+    /* Cache the parsed file, free allocated memory, and return success. */
+    cf->generation = config_generation;
+    conf_file_store(cf);
     free(buffer);
     fclose(file);
     return 0;
@@ -553,6 +1288,7 @@ fail:
             free(confline->logmask);
         free(confline);
     }
+    conf_file_free(cf);
     free(buffer);
     fclose(file);
     return CONFIG_ERROR;
@@ -560,42 +1296,165 @@ fail:
 
 
 /*
- * Check to see if a principal is authorized by a given ACL file.
- *
- * This function is used to handle included ACL files and only does a simple
- * check to prevent infinite recursion, so be careful.  The first argument is
- * the user to check, which is passed in as a void * so that acl_check_file
- * and read_conf_file can share common include-handling code.
- *
- * Returns the result of the first check that returns a result other than
- * CONFIG_NOMATCH, or CONFIG_NOMATCH if no check returns some other value.
- * Also returns CONFIG_ERROR on some sort of failure (such as failure to read
- * a file or a syntax error).
+ * Free a parsed ACL file.
+ */
+static void
+acl_file_free(struct acl_file *acl)
+{
+    struct acl_entry *entry;
+    size_t i, j;
+
+    for (i = 0; i < acl->count; i++) {
+        entry = &acl->entries[i];
+        if (entry->data != NULL)
+            free(entry->data);
+        if (entry->principals != NULL) {
+            for (j = 0; j < entry->size; j++)
+                if (entry->principals[j] != NULL)
+                    free(entry->principals[j]);
+            free(entry->principals);
+        }
+    }
+    free(acl->entries);
+    free(acl->path);
+    free(acl);
+}
+
+
+/*
+ * Add a new entry to a parsed ACL file and return it.  The caller fills in
+ * everything but the line number.
+ */
+static struct acl_entry *
+acl_file_add(struct acl_file *acl, size_t *allocated, int lineno)
+{
+    struct acl_entry *entry;
+
+    if (acl->count == *allocated) {
+        *allocated = (*allocated < 4) ? 4 : *allocated * 2;
+        acl->entries = xrealloc(acl->entries,
+                                *allocated * sizeof(struct acl_entry));
+    }
+    entry = &acl->entries[acl->count];
+    acl->count++;
+    memset(entry, 0, sizeof(*entry));
+    entry->lineno = lineno;
+    return entry;
+}
+
+
+/*
+ * Turn a run of plain principals into a hash set entry in the parsed ACL
+ * file.  The set uses open addressing with linear probing and is kept at
+ * most half full.  Empties the vector of principals.
+ */
+static void
+acl_file_add_principals(struct acl_file *acl, size_t *allocated,
+                        struct vector *run, int lineno)
+{
+    struct acl_entry *entry;
+    size_t i, slot, mask;
+
+    if (run->count == 0)
+        return;
+    entry = acl_file_add(acl, allocated, lineno);
+    entry->type = ACL_ENTRY_PRINCIPALS;
+    entry->size = 8;
+    while (entry->size < run->count * 2)
+        entry->size *= 2;
+    entry->principals = xcalloc(entry->size, sizeof(char *));
+    mask = entry->size - 1;
+    for (i = 0; i < run->count; i++) {
+        slot = server_hash_string(HASH_INIT, run->strings[i]) & mask;
+        while (entry->principals[slot] != NULL) {
+            if (strcmp(entry->principals[slot], run->strings[i]) == 0)
+                break;
+            slot = (slot + 1) & mask;
+        }
+        if (entry->principals[slot] == NULL)
+            entry->principals[slot] = xstrdup(run->strings[i]);
+    }
+    vector_clear(run);
+}
+
+
+/*
+ * Check whether a principal is in the hash set of an ACL file entry.
+ */
+static bool
+acl_principals_member(const struct acl_entry *entry, const char *user)
+{
+    size_t slot, mask;
+
+    mask = entry->size - 1;
+    slot = server_hash_string(HASH_INIT, user) & mask;
+    while (entry->principals[slot] != NULL) {
+        if (strcmp(entry->principals[slot], user) == 0)
+            return true;
+        slot = (slot + 1) & mask;
+    }
+    return false;
+}
+
+
+/*
+ * Add an error entry to a parsed ACL file.  The message is reported when a
+ * check reaches that point in the file, which is when reading the file
+ * would have found the problem before ACL files were cached.
+ */
+static void
+acl_file_add_error(struct acl_file *acl, size_t *allocated, int lineno,
+                   const char *message)
+{
+    struct acl_entry *entry;
+
+    entry = acl_file_add(acl, allocated, lineno);
+    entry->type = ACL_ENTRY_ERROR;
+    entry->data = xstrdup(message);
+}
+
+
+/*
+ * Read and parse an ACL file.  Parsing stops at the first line that can't be
+ * parsed, since no check can get past it.  Returns the newly allocated parsed
+ * file or NULL if the file could not be opened, leaving errno set.
  */
-static enum config_status
-acl_check_file_internal(void *data, const char *aclfile)
+static struct acl_file *
+acl_file_parse(const char *path)
 {
-    const char *user = data;
-    FILE *file = NULL;
+    struct acl_file *acl;
+    struct acl_entry *entry;
+    struct stat st;
+    struct vector *run, *line;
+    FILE *file;
     char buffer[BUFSIZ];
     char *p;
-    int lineno;
-    enum config_status s;
+    int lineno, oerrno;
     size_t length;
-    struct vector *line = NULL;
+    size_t allocated = 0;
 
-    file = fopen(aclfile, "r");
-    if (file == NULL) {
-        syswarn("cannot open ACL file %s", aclfile);
-        return CONFIG_ERROR;
+    file = fopen(path, "r");
+    if (file == NULL)
+        return NULL;
+    if (fstat(fileno(file), &st) < 0) {
+        oerrno = errno;
+        fclose(file);
+        errno = oerrno;
+        return NULL;
     }
+    acl = xcalloc(1, sizeof(struct acl_file));
+    acl->path = xstrdup(path);
+    server_file_stamp(&acl->stamp, &st);
+    run = vector_new();
     lineno = 0;
     while (fgets(buffer, sizeof(buffer), file) != NULL) {
         lineno++;
         length = strlen(buffer);
         if (length >= sizeof(buffer) - 1) {
-            warn("%s:%d: ACL file line too long", aclfile, lineno);
-            goto fail;
+            acl_file_add_principals(acl, &allocated, run, lineno);
+            acl_file_add_error(acl, &allocated, lineno,
+                               "ACL file line too long");
+            break;
         }
 
         /*
@@ -612,35 +1471,133 @@ acl_check_file_internal(void *data, const char *aclfile)
         if (*p == '\0' || *p == '#')
             continue;
 
-        /* Parse the line. */
-        if (strchr(p, ' ') == NULL)
-            s = acl_check(user, p, ACL_SCHEME_PRINC, aclfile, lineno);
-        else {
-            line = vector_split_space(buffer, NULL);
-            if (line->count == 2 && strcmp(line->strings[0], "include") == 0) {
-                s = acl_check(data, line->strings[1], ACL_SCHEME_FILE,
-                              aclfile, lineno);
-                vector_free(line);
-                line = NULL;
-            } else {
-                warn("%s:%d: parse error", aclfile, lineno);
-                goto fail;
-            }
+        /*
+         * Plain principals are collected into a set.  Anything else is
+         * saved to be checked in order with the principal sets.
+         */
+        if (strchr(p, ' ') == NULL && strchr(p, ':') == NULL) {
+            vector_add(run, p);
+            continue;
+        }
+        acl_file_add_principals(acl, &allocated, run, lineno);
+        if (strchr(p, ' ') == NULL) {
+            entry = acl_file_add(acl, &allocated, lineno);
+            entry->type = ACL_ENTRY_CHECK;
+            entry->def_index = ACL_SCHEME_PRINC;
+            entry->data = xstrdup(p);
+            continue;
         }
-        if (s != CONFIG_NOMATCH) {
-            fclose(file);
-            return s;
+        line = vector_split_space(buffer, NULL);
+        if (line->count == 2 && strcmp(line->strings[0], "include") == 0) {
+            entry = acl_file_add(acl, &allocated, lineno);
+            entry->type = ACL_ENTRY_CHECK;
+            entry->def_index = ACL_SCHEME_FILE;
+            entry->data = xstrdup(line->strings[1]);
+            vector_free(line);
+        } else {
+            vector_free(line);
+            acl_file_add_error(acl, &allocated, lineno, "parse error");
+            break;
         }
     }
+    acl_file_add_principals(acl, &allocated, run, lineno);
+    vector_free(run);
     fclose(file);
-    return CONFIG_NOMATCH;
+    return acl;
+}
 
-fail:
-    if (line != NULL)
-        vector_free(line);
-    if (file != NULL)
-        fclose(file);
-    return CONFIG_ERROR;
+
+/*
+ * Return the parsed version of an ACL file, parsing it if it isn't already
+ * cached or if the file has changed since it was cached.  Returns NULL if
+ * the file could not be opened, leaving errno set.
+ */
+static struct acl_file *
+acl_file_get(const char *path)
+{
+    struct acl_file *acl, **link;
+    struct stat st;
+    size_t bucket;
+
+    if (stat(path, &st) < 0)
+        return NULL;
+    bucket = server_hash_string(HASH_INIT, path) % ACL_CACHE_SIZE;
+    for (link = &acl_cache[bucket]; *link != NULL; link = &(*link)->next)
+        if (strcmp((*link)->path, path) == 0)
+            break;
+    acl = *link;
+    if (acl != NULL) {
+        if (server_file_unchanged(&acl->stamp, &st))
+            return acl;
+
+        /* The file changed, so drop the old copy. */
+        *link = acl->next;
+        if (acl->busy > 0)
+            acl->stale = true;
+        else
+            acl_file_free(acl);
+    }
+    acl = acl_file_parse(path);
+    if (acl == NULL)
+        return NULL;
+    acl->next = acl_cache[bucket];
+    acl_cache[bucket] = acl;
+    return acl;
+}
+
+
+/*
+ * Check to see if a principal is authorized by a given ACL file.
+ *
+ * This function is used to handle included ACL files and only does a simple
+ * check to prevent infinite recursion, so be careful.  The first argument is
+ * the user to check, which is passed in as a void * so that acl_check_file
+ * and read_conf_file can share common include-handling code.
+ *
+ * The file is parsed once and cached, so normally this only needs to stat
+ * the file to make sure it hasn't changed and then walk the parsed entries.
+ *
+ * Returns the result of the first check that returns a result other than
+ * CONFIG_NOMATCH, or CONFIG_NOMATCH if no check returns some other value.
+ * Also returns CONFIG_ERROR on some sort of failure (such as failure to read
+ * a file or a syntax error).
+ */
+static enum config_status
+acl_check_file_internal(void *data, const char *aclfile)
+{
+    const char *user = data;
+    struct acl_file *acl;
+    struct acl_entry *entry;
+    enum config_status s = CONFIG_NOMATCH;
+    size_t i;
+
+    acl = acl_file_get(aclfile);
+    if (acl == NULL) {
+        syswarn("cannot open ACL file %s", aclfile);
+        return CONFIG_ERROR;
+    }
+    acl->busy++;
+    for (i = 0; i < acl->count && s == CONFIG_NOMATCH; i++) {
+        entry = &acl->entries[i];
+        switch (entry->type) {
+        case ACL_ENTRY_PRINCIPALS:
+            if (acl_principals_member(entry, user))
+                s = CONFIG_SUCCESS;
+            break;
+        case ACL_ENTRY_CHECK:
+            s = acl_check(user, entry->data, entry->def_index, acl->path,
+                          entry->lineno);
+            break;
+        case ACL_ENTRY_ERROR:
+            warn("%s:%d: %s", acl->path, entry->lineno, entry->data);
+            s = CONFIG_ERROR;
+            break;
+        }
+    }
+    acl->busy--;
+    if (acl->stale && acl->busy == 0)
+        acl_file_free(acl);
+    return s;
 }
 
 
@@ -811,6 +1768,133 @@ acl_check_gput(const char *user, const char *data, const char *file,
 #endif /* HAVE_GPUT */
 
 
+/*
+ * Return the compiled form of a regular expression, compiling it if this is
+ * the first time it has been seen.  Compiled expressions are kept until a
+ * configuration is loaded that doesn't use them, so each distinct expression
+ * is only compiled once no matter how many ACLs or checks use it.  If
+ * compilation fails, the returned pattern has its error set instead.
+ */
+#if defined(HAVE_PCRE) || defined(HAVE_REGCOMP)
+static struct acl_pattern *
+acl_pattern_get(const char *data, enum acl_pattern_type type)
+{
+    struct acl_pattern *pattern;
+    size_t bucket;
+#ifdef HAVE_PCRE
+    const char *error;
+    int offset;
+#endif
+#ifdef HAVE_REGCOMP
+    char message[BUFSIZ];
+    int status;
+#endif
+
+    bucket = server_hash_string(HASH_INIT, data) % ACL_CACHE_SIZE;
+    for (pattern = acl_patterns[bucket]; pattern != NULL;
+         pattern = pattern->next)
+        if (pattern->type == type && strcmp(pattern->data, data) == 0) {
+            pattern->generation = config_generation;
+            return pattern;
+        }
+    pattern = xcalloc(1, sizeof(struct acl_pattern));
+    pattern->data = xstrdup(data);
+    pattern->type = type;
+    pattern->generation = config_generation;
+#ifdef HAVE_PCRE
+    if (type == ACL_PATTERN_PCRE) {
+        pattern->pcre = pcre_compile(data, PCRE_NO_AUTO_CAPTURE, &error,
+                                     &offset, NULL);
+        if (pattern->pcre == NULL)
+            xasprintf(&pattern->error, "failed around %d", offset);
+        else {
+            /*
+             * Study the expression, which also JIT-compiles it if this PCRE
+             * supports that.  This returns NULL if there was nothing to
+             * gain, which pcre_exec accepts.
+             */
+# ifdef PCRE_STUDY_JIT_COMPILE
+            pattern->extra = pcre_study(pattern->pcre,
+                                        PCRE_STUDY_JIT_COMPILE, &error);
+# else
+            pattern->extra = pcre_study(pattern->pcre, 0, &error);
+# endif
+        }
+    }
+#endif
+#ifdef HAVE_REGCOMP
+    if (type == ACL_PATTERN_REGEX) {
+        status = regcomp(&pattern->regex, data, REG_EXTENDED | REG_NOSUB);
+        if (status != 0) {
+            regerror(status, &pattern->regex, message, sizeof(message));
+            xasprintf(&pattern->error, "failed: %s", message);
+        }
+    }
+#endif
+    pattern->next = acl_patterns[bucket];
+    acl_patterns[bucket] = pattern;
+    return pattern;
+}
+
+
+/*
+ * Free a compiled regular expression.
+ */
+static void
+acl_pattern_free(struct acl_pattern *pattern)
+{
+#ifdef HAVE_PCRE
+    if (pattern->type == ACL_PATTERN_PCRE && pattern->pcre != NULL) {
+# ifdef PCRE_STUDY_JIT_COMPILE
+        pcre_free_study(pattern->extra);
+# else
+        pcre_free(pattern->extra);
+# endif
+        pcre_free(pattern->pcre);
+    }
+#endif
+#ifdef HAVE_REGCOMP
+    if (pattern->type == ACL_PATTERN_REGEX && pattern->error == NULL)
+        regfree(&pattern->regex);
+#endif
+    free(pattern->data);
+    free(pattern->error);
+    free(pattern);
+}
+
+
+/*
+ * Drop the compiled regular expressions that weren't used by the
+ * configuration that was just loaded or by any check since.
+ */
+static void
+acl_pattern_prune(void)
+{
+    struct acl_pattern **link, *old;
+    size_t i;
+
+    for (i = 0; i < ACL_CACHE_SIZE; i++) {
+        link = &acl_patterns[i];
+        while (*link != NULL) {
+            if ((*link)->generation == config_generation) {
+                link = &(*link)->next;
+                continue;
+            }
+            old = *link;
+            *link = old->next;
+            acl_pattern_free(old);
+        }
+    }
+}
+#else
+static void
+acl_pattern_prune(void)
+{
+    return;
+}
+#endif
+
+
 /*
  * The ACL check operation for PCRE matches.  Takes the user to check, the
  * regular expression, and the referencing file name and line number.  This
@@ -822,18 +1906,17 @@ static enum config_status
 acl_check_pcre(const char *user, const char *data, const char *file,
                int lineno)
 {
-    pcre *regex;
-    const char *error;
-    int offset, status;
+    struct acl_pattern *pattern;
+    int status;
 
-    regex = pcre_compile(data, PCRE_NO_AUTO_CAPTURE, &error, &offset, NULL);
-    if (regex == NULL) {
-        warn("%s:%d: compilation of regex '%s' failed around %d", file,
-             lineno, data, offset);
+    pattern = acl_pattern_get(data, ACL_PATTERN_PCRE);
+    if (pattern->error != NULL) {
+        warn("%s:%d: compilation of regex '%s' %s", file, lineno, data,
+             pattern->error);
         return CONFIG_ERROR;
     }
-    status = pcre_exec(regex, NULL, user, strlen(user), 0, 0, NULL, 0);
-    pcre_free(regex);
+    status = pcre_exec(pattern->pcre, pattern->extra, user, strlen(user), 0,
+                       0, NULL, 0);
     switch (status) {
     case 0:
         return CONFIG_SUCCESS;
@@ -859,36 +1942,28 @@ static enum config_status
 acl_check_regex(const char *user, const char *data, const char *file,
                 int lineno)
 {
-    regex_t regex;
+    struct acl_pattern *pattern;
     char error[BUFSIZ];
     int status;
-    enum config_status result;
 
-    memset(&regex, 0, sizeof(regex));
-    status = regcomp(&regex, data, REG_EXTENDED | REG_NOSUB);
-    if (status != 0) {
-        regerror(status, &regex, error, sizeof(error));
-        warn("%s:%d: compilation of regex '%s' failed: %s", file, lineno,
-             data, error);
+    pattern = acl_pattern_get(data, ACL_PATTERN_REGEX);
+    if (pattern->error != NULL) {
+        warn("%s:%d: compilation of regex '%s' %s", file, lineno, data,
+             pattern->error);
         return CONFIG_ERROR;
     }
-    status = regexec(&regex, user, 0, NULL, 0);
+    status = regexec(&pattern->regex, user, 0, NULL, 0);
     switch (status) {
     case 0:
-        result = CONFIG_SUCCESS;
-        break;
+        return CONFIG_SUCCESS;
     case REG_NOMATCH:
-        result = CONFIG_NOMATCH;
-        break;
+        return CONFIG_NOMATCH;
     default:
-        regerror(status, &regex, error, sizeof(error));
+        regerror(status, &pattern->regex, error, sizeof(error));
         warn("%s:%d: matching with regex '%s' failed: %s", file, lineno,
              data, error);
-        result = CONFIG_ERROR;
-        break;
+        return CONFIG_ERROR;
     }
-    regfree(&regex);
-    return result;
 }
 #endif /* HAVE_REGCOMP */
 
@@ -963,53 +2038,358 @@ acl_check(const char *user, const char *entry, int def_index,
 }
 
 
+/*
+ * Given an ACL entry, return the data following the scheme if the entry
+ * explicitly uses the given scheme, or NULL otherwise.
+ */
+static const char *
+acl_scheme_data(const char *entry, const char *scheme)
+{
+    size_t length;
+
+    length = strlen(scheme);
+    if (strncmp(entry, scheme, length) == 0 && entry[length] == ':')
+        return entry + length + 1;
+    return NULL;
+}
+
+
+/*
+ * Given an ACL entry and its default scheme, return the file it names if it
+ * uses the file scheme, or NULL otherwise.
+ */
+static const char *
+acl_file_name(const char *entry, int def_index)
+{
+    if (strchr(entry, ':') == NULL)
+        return (def_index == ACL_SCHEME_FILE) ? entry : NULL;
+    return acl_scheme_data(entry, "file");
+}
+
+
+/*
+ * Compile any regular expression in an ACL entry ahead of time so that
+ * errors are reported when the configuration is loaded rather than only when
+ * a client first runs into them.  Follows deny entries.  Files are handled
+ * by preloading instead, and the default schemes never use expressions.
+ */
+static void
+acl_precompile(const char *entry, const char *file, int lineno)
+{
+    struct acl_pattern *pattern = NULL;
+    const char *data;
+
+    if ((data = acl_scheme_data(entry, "deny")) != NULL) {
+        acl_precompile(data, file, lineno);
+        return;
+    }
+    if ((data = acl_scheme_data(entry, "pcre")) != NULL) {
+#ifdef HAVE_PCRE
+        pattern = acl_pattern_get(data, ACL_PATTERN_PCRE);
+#endif
+    } else if ((data = acl_scheme_data(entry, "regex")) != NULL) {
+#ifdef HAVE_REGCOMP
+        pattern = acl_pattern_get(data, ACL_PATTERN_REGEX);
+#endif
+    }
+    if (pattern != NULL && pattern->error != NULL)
+        warn("%s:%d: compilation of regex '%s' %s", file, lineno, data,
+             pattern->error);
+}
+
+
+/* Forward declaration for the mutual recursion of preloading. */
+static void acl_preload(const char *path);
+
+
+/*
+ * Preload a single ACL file into the cache, followed by any ACL files that it
+ * includes.  Errors are ignored here; they'll be reported by the ACL check
+ * that runs into them.
+ */
+static void
+acl_preload_file(const char *path)
+{
+    struct acl_file *acl;
+    struct acl_entry *entry;
+    const char *included;
+    size_t i;
+
+    acl = acl_file_get(path);
+    if (acl == NULL || acl->generation == acl_generation)
+        return;
+    acl->generation = acl_generation;
+    acl->busy++;
+    for (i = 0; i < acl->count; i++) {
+        entry = &acl->entries[i];
+        if (entry->type != ACL_ENTRY_CHECK)
+            continue;
+        acl_precompile(entry->data, acl->path, entry->lineno);
+        included = acl_file_name(entry->data, entry->def_index);
+        if (included != NULL)
+            acl_preload(included);
+    }
+    acl->busy--;
+    if (acl->stale && acl->busy == 0)
+        acl_file_free(acl);
+}
+
+
+/*
+ * Preload an ACL file or, if given a directory, every file in it that would
+ * be included, mirroring handle_include.
+ */
+static void
+acl_preload(const char *path)
+{
+    struct stat st;
+    DIR *dir;
+    struct dirent *entry;
+    char *file;
+
+    if (stat(path, &st) < 0)
+        return;
+    if (!S_ISDIR(st.st_mode)) {
+        acl_preload_file(path);
+        return;
+    }
+    dir = opendir(path);
+    if (dir == NULL)
+        return;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!valid_filename(entry->d_name))
+            continue;
+        xasprintf(&file, "%s/%s", path, entry->d_name);
+        acl_preload_file(file);
+        free(file);
+    }
+    closedir(dir);
+}
+
+
+/*
+ * Hash a command and subcommand pair for the dispatch index, separating the
+ * two strings with a nul.
+ */
+static size_t
+index_hash(const char *command, const char *subcommand)
+{
+    unsigned long hash;
+
+    hash = server_hash_string(HASH_INIT, command);
+    hash = (hash * 16777619UL) & 0xffffffffUL;
+    return server_hash_string(hash, subcommand);
+}
+
+
+/*
+ * Find the slot in the dispatch index for a command and subcommand pair.
+ * The index uses open addressing with linear probing, and each occupied slot
+ * holds one more than the position of the first rule in config->rules with
+ * exactly that command and subcommand.  Returns the slot, which will be zero
+ * if the pair isn't in the index.
+ */
+static size_t *
+index_slot(struct config *config, const char *command, const char *subcommand)
+{
+    struct confline *rule;
+    size_t mask, i;
+
+    mask = config->index_size - 1;
+    i = index_hash(command, subcommand) & mask;
+    while (config->index[i] != 0) {
+        rule = config->rules[config->index[i] - 1];
+        if (strcmp(rule->command, command) == 0
+            && strcmp(rule->subcommand, subcommand) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+    return &config->index[i];
+}
+
+
+/*
+ * Build the dispatch index for a configuration.  Only the first rule for
+ * each command and subcommand pair is recorded, since any later rule with
+ * the same pair can never be the first match for a request.  The index is
+ * kept at most half full.
+ */
+static void
+index_build(struct config *config)
+{
+    struct confline *rule;
+    size_t *slot;
+    size_t i;
+
+    config->index_size = 16;
+    while (config->index_size < config->count * 2)
+        config->index_size *= 2;
+    config->index = xcalloc(config->index_size, sizeof(size_t));
+    for (i = 0; i < config->count; i++) {
+        rule = config->rules[i];
+        slot = index_slot(config, rule->command, rule->subcommand);
+        if (*slot == 0)
+            *slot = i + 1;
+    }
+}
+
+
+/*
+ * Look up the configuration line for a command and subcommand, either of
+ * which may be NULL if not given by the client.  Returns the first rule in
+ * configuration order that matches or NULL if none match.
+ *
+ * A rule matches if its command is ALL, equal to the command, or EMPTY when
+ * there is no command, and likewise for its subcommand.  That means at most
+ * four pairs can match a request, so look up each of them in the index and
+ * return whichever matching rule comes first in the configuration.
+ */
+struct confline *
+server_config_find(struct config *config, const char *command,
+                   const char *subcommand)
+{
+    const char *commands[2], *subcommands[2];
+    size_t i, j, found;
+    size_t best = 0;
+
+    if (config->index == NULL)
+        return NULL;
+    commands[0] = (command == NULL) ? "EMPTY" : command;
+    commands[1] = "ALL";
+    subcommands[0] = (subcommand == NULL) ? "EMPTY" : subcommand;
+    subcommands[1] = "ALL";
+    for (i = 0; i < 2; i++)
+        for (j = 0; j < 2; j++) {
+            found = *index_slot(config, commands[i], subcommands[j]);
+            if (found != 0 && (best == 0 || found < best))
+                best = found;
+        }
+    return (best == 0) ? NULL : config->rules[best - 1];
+}
+
+
 /*
  * Load a configuration file.  Returns a newly allocated config struct if
- * successful or NULL on failure, logging an appropriate error message.
+ * successful or NULL on failure, logging an appropriate error message.  Files
+ * that haven't changed since a previous load aren't parsed again, and any
+ * previously loaded configuration is unaffected, so a caller reloading the
+ * configuration can keep using the old one if this fails.
  */
 struct config *
 server_config_load(const char *file)
 {
     struct config *config;
+    struct confline *rule;
+    const char *path;
+    size_t i, j;
 
     /* Read the configuration file. */
     config = xcalloc(1, sizeof(struct config));
+    config_generation++;
     if (read_conf_file(config, file) != 0) {
         server_config_free(config);
         return NULL;
     }
+    index_build(config);
+    groups_prune();
+    conf_file_prune();
+
+    /*
+     * If requested, parse all the ACL files and compile all the regular
+     * expressions used by the configuration now, so that they're already
+     * cached in any child process that checks them and errors in expressions
+     * are reported now.  Otherwise, only the ACLs of the command that's run
+     * are read, when it's run.
+     */
+    if (config_preload) {
+        acl_generation++;
+        for (i = 0; i < config->count; i++) {
+            rule = config->rules[i];
+            for (j = 0; rule->acls[j] != NULL; j++) {
+                acl_precompile(rule->acls[j], rule->file, rule->lineno);
+                path = acl_file_name(rule->acls[j], ACL_SCHEME_FILE);
+                if (path != NULL)
+                    acl_preload(path);
+            }
+        }
+    }
+    acl_pattern_prune();
     return config;
 }
 
 
+/*
+ * Parse the ACL files and look up the supplementary groups used by a
+ * configuration when it is loaded, rather than only when a command needs
+ * them.  This is only worthwhile when the same configuration is used for
+ * many connections, as it is in standalone mode.
+ */
+void
+server_config_preload(void)
+{
+    config_preload = true;
+}
+
+
 /*
  * Free the config structure created by calling server_config_load.
  */
 void
 server_config_free(struct config *config)
 {
-    struct confline *rule;
     size_t i;
 
-    for (i = 0; i < config->count; i++) {
-        rule = config->rules[i];
-        if (rule->logmask != NULL)
-            free(rule->logmask);
-        if (rule->user != NULL)
-            free(rule->user);
-        if (rule->acls != NULL)
-            free(rule->acls);
-        if (rule->line != NULL)
-            vector_free(rule->line);
-        if (rule->file != NULL)
-            free(rule->file);
-        free(rule);
-    }
+    for (i = 0; i < config->count; i++)
+        confline_release(config->rules[i]);
     free(config->rules);
+    free(config->index);
     free(config);
 }
 
 
+/*
+ * Get the supplementary groups for the user a command runs as, looking them
+ * up again if the cached list has expired.  Stores the list and its length
+ * in groups and count and returns true, or returns false if the list isn't
+ * available, in which case the caller should fall back on initgroups.
+ */
+bool
+server_config_groups(struct confline *cline, const gid_t **groups,
+                     size_t *count)
+{
+    struct user_groups *entry;
+
+    if (cline->user == NULL)
+        return false;
+    entry = groups_find(cline->user, cline->gid);
+    if (groups_expired(entry, time(NULL)))
+        groups_load(entry);
+    if (entry->groups == NULL)
+        return false;
+    *groups = entry->groups;
+    *count = entry->count;
+    return true;
+}
+
+
+/*
+ * Look up again any cached supplementary groups that have expired.  Called
+ * by the parent before starting children so that they inherit current lists
+ * rather than each looking them up again.
+ */
+void
+server_config_groups_refresh(void)
+{
+    struct user_groups *entry;
+    time_t now;
+
+    now = time(NULL);
+    for (entry = user_groups; entry != NULL; entry = entry->next)
+        if (entry->groups != NULL && groups_expired(entry, now))
+            groups_load(entry);
+}
+
+
 /*
  * Given the confline corresponding to the command and the principal
  * requesting access, see if the command is allowed.  Return true if so, false
@@ -0,0 +1,601 @@
+/*
+ * Multiplexed connection handling for remctld.
+ *
+ * In this mode, a single remctld process holds all client connections,
+ * establishing GSS-API contexts and reading protocol messages from every
+ * client as data arrives, using epoll to wait for activity.  A child process
+ * is only forked when a client sends a command.  The child handles that
+ * command exactly as remctld would normally, and then sends its updated
+ * GSS-API context back to the parent over a pipe using
+ * gss_export_sec_context so that the parent can continue to use the
+ * connection for further messages.  This means idle keep-alive connections
+ * only cost the memory for their session rather than a process.
+ *
+ * Only protocol version two and later connections are kept in the parent.
+ * Version one clients can only send a single command, so once their context
+ * is established they are handed off to a child immediately.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+#include <portable/gssapi.h>
+#include <portable/socket.h>
+
+#ifdef HAVE_EPOLL_CREATE1
+
+#include <signal.h>
+#include <sys/epoll.h>
+#include <time.h>
+
+#include <server/internal.h>
+#include <util/fdflag.h>
+#include <util/messages.h>
+#include <util/tokens.h>
+#include <util/xmalloc.h>
+#include <util/xwrite.h>
+
+/* Maximum number of events to process per call to epoll_wait. */
+#define EVENT_MAX 64
+
+/* How often, in seconds, to look for sessions that have timed out. */
+#define EVENT_EXPIRE_INTERVAL 60
+
+/*
+ * How long, in seconds, the parent will wait to send a token to a client.
+ * The replies sent by the parent are small and normally fit in the socket
+ * buffer, and a client that stops reading mustn't stall every other session.
+ */
+#define EVENT_SEND_TIMEOUT 1
+
+/* The state of a single client connection. */
+enum session_state {
+    SESSION_CONTEXT,            /* Establishing the GSS-API context. */
+    SESSION_READY,              /* Waiting for a message from the client. */
+    SESSION_BUSY                /* A child is handling a command. */
+};
+
+/* Holds a client connection managed by the event loop. */
+struct session {
+    struct client *client;      /* The client, including its fd. */
+    enum session_state state;   /* What we're doing with the client. */
+    unsigned char header[5];    /* Flags and length of the current token. */
+    size_t have;                /* Bytes of the current token read so far. */
+    gss_buffer_desc token;      /* Data of the current token. */
+    time_t last;                /* Time of the last client activity. */
+    int result;                 /* Pipe from the child running a command. */
+    char *context;              /* Exported context read from the child. */
+    size_t length;              /* Length of the exported context. */
+    size_t size;                /* Allocated size of context. */
+};
+
+/* The state of the event loop. */
+struct event_loop {
+    int epoll;                  /* The epoll file descriptor. */
+    int *listeners;             /* Listening sockets. */
+    unsigned int nlisteners;    /* Count of listening sockets. */
+    gss_cred_id_t creds;        /* Server credentials. */
+    struct session **sessions;  /* Sessions, indexed by file descriptor. */
+    size_t size;                /* Size of the sessions array. */
+    time_t expired;             /* Last time we checked for timeouts. */
+};
+
+
+/*
+ * Register a file descriptor with epoll for read events and record the
+ * session that it belongs to.  Dies on failure, since this means the event
+ * loop is broken.
+ */
+static void
+event_add(struct event_loop *loop, int fd, struct session *session)
+{
+    struct epoll_event event;
+    size_t size;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(loop->epoll, EPOLL_CTL_ADD, fd, &event) < 0)
+        sysdie("cannot add fd %d to epoll", fd);
+    if ((size_t) fd >= loop->size) {
+        size = loop->size;
+        loop->size = (fd < 64) ? 64 : fd * 2;
+        loop->sessions = xrealloc(loop->sessions,
+                                  loop->size * sizeof(struct session *));
+        memset(loop->sessions + size, 0,
+               (loop->size - size) * sizeof(struct session *));
+    }
+    loop->sessions[fd] = session;
+}
+
+
+/*
+ * Stop watching a file descriptor.  We have to remove the file descriptor
+ * from epoll explicitly, since a child process may still hold a copy of it.
+ */
+static void
+event_remove(struct event_loop *loop, int fd)
+{
+    if (epoll_ctl(loop->epoll, EPOLL_CTL_DEL, fd, NULL) < 0)
+        syswarn("cannot remove fd %d from epoll", fd);
+    loop->sessions[fd] = NULL;
+}
+
+
+/*
+ * Reset the token buffer of a session so that it's ready to read another
+ * token.
+ */
+static void
+session_reset_token(struct session *session)
+{
+    free(session->token.value);
+    session->token.value = NULL;
+    session->token.length = 0;
+    session->have = 0;
+}
+
+
+/*
+ * Close a session, freeing all of its resources and closing the client
+ * connection.
+ */
+static void
+session_close(struct event_loop *loop, struct session *session)
+{
+    if (session->state != SESSION_BUSY)
+        event_remove(loop, session->client->fd);
+    if (session->result >= 0) {
+        event_remove(loop, session->result);
+        close(session->result);
+    }
+    session_reset_token(session);
+    free(session->context);
+    server_free_client(session->client);
+    free(session);
+}
+
+
+/*
+ * Read as much of the current token for a session as is available without
+ * blocking.  Never reads past the end of the current token, since the next
+ * token may need to be read by a child process instead.  Returns TOKEN_OK
+ * on success, whether or not the token is complete, or a TOKEN_FAIL_* code
+ * on error.
+ */
+static enum token_status
+session_read(struct session *session)
+{
+    int fd = session->client->fd;
+    ssize_t status;
+    OM_uint32 length;
+    size_t size;
+    char *p;
+
+    do {
+        if (session->have < sizeof(session->header)) {
+            p = (char *) session->header + session->have;
+            size = sizeof(session->header) - session->have;
+        } else {
+            p = (char *) session->token.value;
+            p += session->have - sizeof(session->header);
+            size = session->token.length + sizeof(session->header);
+            size -= session->have;
+        }
+        status = recv(fd, p, size, MSG_DONTWAIT);
+        if (status == 0)
+            return TOKEN_FAIL_EOF;
+        else if (status < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                return TOKEN_OK;
+            return TOKEN_FAIL_SOCKET;
+        }
+        session->have += status;
+        if (session->have == sizeof(session->header)) {
+            memcpy(&length, session->header + 1, sizeof(length));
+            session->token.length = ntohl(length);
+            if (session->token.length > TOKEN_MAX_LENGTH)
+                return TOKEN_FAIL_LARGE;
+            if (session->token.length > 0)
+                session->token.value = xmalloc(session->token.length);
+        }
+    } while (session->have < sizeof(session->header)
+             || session->have < session->token.length
+                                + sizeof(session->header));
+    return TOKEN_OK;
+}
+
+
+/*
+ * Returns true if the current token for a session has been completely read.
+ */
+static bool
+session_complete(struct session *session)
+{
+    if (session->have < sizeof(session->header))
+        return false;
+    return (session->have == session->token.length + sizeof(session->header));
+}
+
+
+/*
+ * In a child process, close all of the file descriptors belonging to the
+ * event loop other than the client connection that we're handling.  Busy
+ * sessions are only registered under the pipe from their child, so close
+ * their client connections as well, or they wouldn't be closed when their
+ * session ends until this child exits.
+ */
+static void
+event_child_cleanup(struct event_loop *loop, struct session *session)
+{
+    struct session *other;
+    size_t i;
+    unsigned int j;
+
+    close(loop->epoll);
+    for (j = 0; j < loop->nlisteners; j++)
+        close(loop->listeners[j]);
+    for (i = 0; i < loop->size; i++) {
+        other = loop->sessions[i];
+        if (other == NULL || other == session)
+            continue;
+        close(i);
+        if (other->state == SESSION_BUSY)
+            close(other->client->fd);
+    }
+}
+
+
+/*
+ * Hand off a session to a child process.  In the child, process the message
+ * (or, for protocol version one, the single command the client is allowed
+ * to send) and then, if the connection should be kept open, export the
+ * GSS-API context and write it to a pipe to the parent.  In the parent,
+ * start watching that pipe instead of the client connection.  Returns false
+ * if we couldn't fork.
+ */
+static bool
+session_fork(struct event_loop *loop, struct session *session,
+             struct config *config, gss_buffer_t message)
+{
+    struct client *client = session->client;
+    int result[2];
+    pid_t child;
+    bool keep;
+    gss_buffer_desc context;
+    OM_uint32 major, minor;
+
+    if (pipe(result) < 0) {
+        syswarn("cannot create pipe");
+        return false;
+    }
+    fdflag_close_exec(result[0], true);
+    fdflag_close_exec(result[1], true);
+    server_config_groups_refresh();
+    child = fork();
+    if (child < 0) {
+        syswarn("forking a new child failed");
+        close(result[0]);
+        close(result[1]);
+        return false;
+    } else if (child == 0) {
+        close(result[0]);
+        event_child_cleanup(loop, session);
+        signal(SIGCHLD, SIG_DFL);
+        client->timeout = TIMEOUT;
+        if (client->protocol == 1) {
+            server_v1_handle_messages(client, config);
+            exit(0);
+        }
+        keep = server_v2_handle_token(client, config, message);
+        if (keep && client->keepalive && !client->fatal) {
+            major = gss_export_sec_context(&minor, &client->context,
+                                           &context);
+            if (major != GSS_S_COMPLETE)
+                warn_gssapi("while exporting context", major, minor);
+            else if (xwrite(result[1], context.value, context.length) < 0)
+                syswarn("cannot send context to parent");
+        }
+        exit(0);
+    }
+
+    /* In the parent.  Wait for the child to finish. */
+    debug("child %lu for %s", (unsigned long) child, client->user);
+    close(result[1]);
+    event_remove(loop, client->fd);
+    session->state = SESSION_BUSY;
+    session->result = result[0];
+    event_add(loop, session->result, session);
+    return true;
+}
+
+
+/*
+ * Handle data from the child running a command for a session.  Accumulate
+ * the exported context until the child closes the pipe.  If the child sent
+ * a context, import it and go back to waiting for messages from the client.
+ * Otherwise, the connection is finished.
+ */
+static void
+session_result(struct event_loop *loop, struct session *session)
+{
+    struct client *client = session->client;
+    gss_buffer_desc context;
+    OM_uint32 major, minor;
+    ssize_t status;
+
+    if (session->size - session->length < BUFSIZ) {
+        session->size += BUFSIZ;
+        session->context = xrealloc(session->context, session->size);
+    }
+    status = read(session->result, session->context + session->length,
+                  session->size - session->length);
+    if (status < 0 && errno == EINTR)
+        return;
+    else if (status < 0) {
+        syswarn("cannot read context from child");
+        session_close(loop, session);
+        return;
+    } else if (status > 0) {
+        session->length += status;
+        return;
+    }
+
+    /* The child is done.  Close the session unless it sent a context. */
+    if (session->length == 0) {
+        session_close(loop, session);
+        return;
+    }
+    event_remove(loop, session->result);
+    close(session->result);
+    session->result = -1;
+    context.value = session->context;
+    context.length = session->length;
+    gss_delete_sec_context(&minor, &client->context, GSS_C_NO_BUFFER);
+    major = gss_import_sec_context(&minor, &context, &client->context);
+    free(session->context);
+    session->context = NULL;
+    session->length = 0;
+    session->size = 0;
+    if (major != GSS_S_COMPLETE) {
+        warn_gssapi("while importing context", major, minor);
+        session_close(loop, session);
+        return;
+    }
+    session->state = SESSION_READY;
+    session->last = time(NULL);
+    event_add(loop, client->fd, session);
+}
+
+
+/*
+ * Handle a complete token from a client whose context has been established.
+ * Commands are run in a child process.  Other messages don't require
+ * running anything and are handled directly.  Returns false if the session
+ * should be closed.
+ */
+static bool
+session_message(struct event_loop *loop, struct session *session,
+                struct config *config)
+{
+    struct client *client = session->client;
+    gss_buffer_desc message;
+    OM_uint32 major, minor;
+    const char *p;
+    bool keep;
+
+    major = gss_unwrap(&minor, client->context, &session->token, &message,
+                       NULL, NULL);
+    session_reset_token(session);
+    if (major != GSS_S_COMPLETE) {
+        warn_token("receiving token", TOKEN_FAIL_GSSAPI, major, minor);
+        server_send_error(client, ERROR_BAD_TOKEN, "Invalid token");
+        return !client->fatal;
+    }
+    p = message.value;
+    if (message.length >= 2 && (p[0] == 2 || p[0] == 3)
+        && p[1] == MESSAGE_COMMAND) {
+        if (!session_fork(loop, session, config, &message))
+            server_send_error(client, ERROR_INTERNAL, "Internal failure");
+        gss_release_buffer(&minor, &message);
+        return !client->fatal;
+    }
+    keep = server_v2_handle_token(client, config, &message);
+    gss_release_buffer(&minor, &message);
+    return keep && client->keepalive && !client->fatal;
+}
+
+
+/*
+ * Handle data arriving on a client connection.  Reads what's available of
+ * the current token and, if it's complete, processes it according to the
+ * state of the session.
+ */
+static void
+session_readable(struct event_loop *loop, struct session *session,
+                 struct config *config)
+{
+    struct client *client = session->client;
+    enum token_status status;
+    enum accept_status result;
+
+    status = session_read(session);
+    if (status != TOKEN_OK) {
+        warn_token("receiving token", status, 0, 0);
+        if (status == TOKEN_FAIL_LARGE && session->state == SESSION_READY)
+            server_send_error(client, ERROR_BAD_TOKEN, "Invalid token");
+        session_close(loop, session);
+        return;
+    }
+    session->last = time(NULL);
+    if (!session_complete(session))
+        return;
+
+    /* Process a token used to establish the context. */
+    if (session->state == SESSION_CONTEXT) {
+        result = server_accept_token(client, loop->creds, session->header[0],
+                                     &session->token);
+        session_reset_token(session);
+        if (result == ACCEPT_CONTINUE)
+            return;
+        else if (result == ACCEPT_FAIL) {
+            session_close(loop, session);
+            return;
+        }
+        debug("accepted connection from %s (protocol %d)", client->user,
+              client->protocol);
+        session->state = SESSION_READY;
+        client->keepalive = true;
+        if (client->protocol == 1)
+            if (!session_fork(loop, session, config, NULL))
+                session_close(loop, session);
+        return;
+    }
+
+    /* Otherwise, this is a protocol message. */
+    if (!session_message(loop, session, config))
+        session_close(loop, session);
+}
+
+
+/*
+ * Accept all pending connections on a listening socket and create sessions
+ * for them.
+ */
+static void
+event_accept(struct event_loop *loop, int fd)
+{
+    struct session *session;
+    struct client *client;
+    int s;
+
+    while ((s = accept(fd, NULL, NULL)) >= 0) {
+        fdflag_close_exec(s, true);
+        client = server_start_client(s);
+        if (client == NULL) {
+            close(s);
+            continue;
+        }
+        client->timeout = EVENT_SEND_TIMEOUT;
+        debug("new connection from %s", client->ipaddress);
+        session = xcalloc(1, sizeof(struct session));
+        session->client = client;
+        session->state = SESSION_CONTEXT;
+        session->result = -1;
+        session->last = time(NULL);
+        event_add(loop, s, session);
+    }
+    if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+        syswarn("error accepting incoming connection");
+}
+
+
+/*
+ * Close any sessions that haven't had any activity from the client for
+ * longer than TIMEOUT.  This is only done every EVENT_EXPIRE_INTERVAL
+ * seconds, since it requires walking all sessions.
+ */
+static void
+event_expire(struct event_loop *loop)
+{
+    struct session *session;
+    time_t now;
+    size_t i;
+
+    now = time(NULL);
+    if (now - loop->expired < EVENT_EXPIRE_INTERVAL)
+        return;
+    loop->expired = now;
+    for (i = 0; i < loop->size; i++) {
+        session = loop->sessions[i];
+        if (session == NULL || session->state == SESSION_BUSY)
+            continue;
+        if (now - session->last < TIMEOUT)
+            continue;
+        warn_token("receiving token", TOKEN_FAIL_TIMEOUT, 0, 0);
+        session_close(loop, session);
+    }
+}
+
+
+/*
+ * Create a new event loop.  Takes the listening sockets, which are made
+ * non-blocking, and the server credentials to use for new connections.
+ * Dies on failure.
+ */
+struct event_loop *
+server_event_new(int fds[], unsigned int nfds, gss_cred_id_t creds)
+{
+    struct event_loop *loop;
+    unsigned int i;
+
+    loop = xcalloc(1, sizeof(struct event_loop));
+    loop->epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll < 0)
+        sysdie("cannot create epoll instance");
+    loop->listeners = fds;
+    loop->nlisteners = nfds;
+    loop->creds = creds;
+    loop->expired = time(NULL);
+    for (i = 0; i < nfds; i++) {
+        fdflag_nonblocking(fds[i], true);
+        fdflag_close_exec(fds[i], true);
+        event_add(loop, fds[i], NULL);
+    }
+    return loop;
+}
+
+
+/*
+ * Replace the server credentials used for new connections, such as after the
+ * keytab was reloaded.
+ */
+void
+server_event_set_creds(struct event_loop *loop, gss_cred_id_t creds)
+{
+    loop->creds = creds;
+}
+
+
+/*
+ * Wait for activity for at most timeout seconds and then process all
+ * events.  This should be called repeatedly by the main processing loop,
+ * which is responsible for reaping child processes.  The configuration is
+ * used for any commands that are run.
+ */
+void
+server_event_dispatch(struct event_loop *loop, struct config *config,
+                      time_t timeout)
+{
+    struct epoll_event events[EVENT_MAX];
+    struct session *session;
+    int count, i, fd;
+    unsigned int j;
+    bool listener;
+
+    count = epoll_wait(loop->epoll, events, EVENT_MAX, timeout * 1000);
+    if (count < 0 && errno != EINTR)
+        sysdie("epoll_wait failed");
+    for (i = 0; i < count; i++) {
+        fd = events[i].data.fd;
+        listener = false;
+        for (j = 0; j < loop->nlisteners; j++)
+            if (loop->listeners[j] == fd)
+                listener = true;
+        if (listener) {
+            event_accept(loop, fd);
+            continue;
+        }
+        if ((size_t) fd >= loop->size || loop->sessions[fd] == NULL)
+            continue;
+        session = loop->sessions[fd];
+        if (fd == session->result)
+            session_result(loop, session);
+        else
+            session_readable(loop, session, config);
+    }
+    event_expire(loop);
+}
+
+#endif /* HAVE_EPOLL_CREATE1 */
@@ -19,34 +19,28 @@
 #include <portable/uio.h>
 
 #include <server/internal.h>
+#include <util/gss-tokens.h>
 #include <util/messages.h>
 #include <util/tokens.h>
 #include <util/xmalloc.h>
 
 
 /*
- * Create a new client struct from a file descriptor and establish a GSS-API
- * context as a specified service with an incoming client and fills out the
- * client struct.  Returns a new client struct on success and NULL on failure,
- * logging an appropriate error message.
+ * Create a new client struct from a file descriptor and fill in the address
+ * of the remote client.  The hostname is looked up later, only if a command
+ * needs it, by server_client_hostname.  This doesn't do any GSS-API
+ * negotiation; server_accept_token should be called with each token received
+ * from the client until the context is established.  Returns a new client
+ * struct on success and NULL on failure, logging an appropriate error
+ * message.  The file descriptor is not closed on failure.
  */
 struct client *
-server_new_client(int fd, gss_cred_id_t creds)
+server_start_client(int fd)
 {
     struct client *client;
-    struct sockaddr_storage ss;
-    socklen_t socklen;
     size_t length;
     char *buffer;
-    gss_buffer_desc send_tok, recv_tok, name_buf;
-    gss_name_t name = GSS_C_NO_NAME;
-    gss_OID doid;
-    OM_uint32 major = 0;
-    OM_uint32 minor = 0;
-    OM_uint32 acc_minor;
-    int flags, status;
-    static const OM_uint32 req_gss_flags
-        = (GSS_C_MUTUAL_FLAG | GSS_C_CONF_FLAG | GSS_C_INTEG_FLAG);
+    int status;
 
     /* Create and initialize a new client struct. */
     client = xcalloc(1, sizeof(struct client));
@@ -56,95 +50,114 @@ server_new_client(int fd, gss_cred_id_t creds)
     client->output = NULL;
     client->hostname = NULL;
     client->ipaddress = NULL;
+    client->timeout = TIMEOUT;
 
-    /* Fill in hostname and IP address. */
-    socklen = sizeof(ss);
-    if (getpeername(fd, (struct sockaddr *) &ss, &socklen) != 0) {
+    /* Fill in the IP address. */
+    client->addrlen = sizeof(client->address);
+    if (getpeername(fd, (struct sockaddr *) &client->address,
+                    &client->addrlen) != 0) {
         syswarn("cannot get peer address");
         goto fail;
     }
     length = INET6_ADDRSTRLEN;
     buffer = xmalloc(length);
     client->ipaddress = buffer;
-    status = getnameinfo((struct sockaddr *) &ss, socklen, buffer, length,
-                         NULL, 0, NI_NUMERICHOST);
+    status = getnameinfo((struct sockaddr *) &client->address,
+                         client->addrlen, buffer, length, NULL, 0,
+                         NI_NUMERICHOST);
     if (status != 0) {
         syswarn("cannot translate IP address of client: %s",
                 gai_strerror(status));
         goto fail;
     }
-    length = NI_MAXHOST;
-    buffer = xmalloc(length);
-    status = getnameinfo((struct sockaddr *) &ss, socklen, buffer, length,
-                         NULL, 0, NI_NAMEREQD);
-    if (status == 0)
-        client->hostname = buffer;
-    else
-        free(buffer);
+    return client;
 
-    /* Accept the initial (worthless) token. */
-    status = token_recv(client->fd, &flags, &recv_tok, TOKEN_MAX_LENGTH,
-                        TIMEOUT);
-    if (status != TOKEN_OK) {
-        warn_token("receiving initial token", status, major, minor);
-        goto fail;
+fail:
+    client->fd = -1;
+    server_free_client(client);
+    return NULL;
+}
+
+
+/*
+ * Process one token received from a client whose context is not yet
+ * established.  Takes the client struct, the server credentials, and the
+ * flags and data of the token.  The first token is the initial (worthless)
+ * token that tells us the protocol version; each subsequent token is passed
+ * to the GSS-API, sending back a reply token if needed.  Once the context is
+ * established, checks the negotiated flags and fills out the user in the
+ * client struct.
+ *
+ * Returns ACCEPT_CONTINUE if another token is needed, ACCEPT_DONE once the
+ * context is established, and ACCEPT_FAIL on failure, logging an appropriate
+ * error message.  The token data is not freed.
+ */
+enum accept_status
+server_accept_token(struct client *client, gss_cred_id_t creds, int flags,
+                    gss_buffer_t recv_tok)
+{
+    gss_buffer_desc send_tok, name_buf;
+    gss_name_t name = GSS_C_NO_NAME;
+    gss_OID doid;
+    OM_uint32 major = 0;
+    OM_uint32 minor = 0;
+    OM_uint32 acc_minor;
+    int status;
+    static const OM_uint32 req_gss_flags
+        = (GSS_C_MUTUAL_FLAG | GSS_C_CONF_FLAG | GSS_C_INTEG_FLAG);
+
+    /* The initial token tells us which protocol the client speaks. */
+    if (client->protocol == 0) {
+        if (flags == (TOKEN_NOOP | TOKEN_CONTEXT_NEXT | TOKEN_PROTOCOL))
+            client->protocol = 2;
+        else if (flags == (TOKEN_NOOP | TOKEN_CONTEXT_NEXT))
+            client->protocol = 1;
+        else {
+            warn("bad token flags %d in initial token", flags);
+            return ACCEPT_FAIL;
+        }
+        return ACCEPT_CONTINUE;
     }
-    free(recv_tok.value);
-    if (flags == (TOKEN_NOOP | TOKEN_CONTEXT_NEXT | TOKEN_PROTOCOL))
-        client->protocol = 2;
-    else if (flags == (TOKEN_NOOP | TOKEN_CONTEXT_NEXT))
+
+    /* Now, do the real work of negotiating the context. */
+    if (flags == TOKEN_CONTEXT)
         client->protocol = 1;
-    else {
-        warn("bad token flags %d in initial token", flags);
-        goto fail;
+    else if (flags != (TOKEN_CONTEXT | TOKEN_PROTOCOL)) {
+        warn("bad token flags %d in context token", flags);
+        return ACCEPT_FAIL;
     }
+    debug("received context token (size=%lu)",
+          (unsigned long) recv_tok->length);
+    major = gss_accept_sec_context(&acc_minor, &client->context, creds,
+                recv_tok, GSS_C_NO_CHANNEL_BINDINGS, &name, &doid,
+                &send_tok, &client->flags, NULL, NULL);
 
-    /* Now, do the real work of negotiating the context. */
-    do {
-        status = token_recv(client->fd, &flags, &recv_tok, TOKEN_MAX_LENGTH,
-                            TIMEOUT);
+    /* Send back a token if we need to. */
+    if (send_tok.length != 0) {
+        debug("sending context token (size=%lu)",
+              (unsigned long) send_tok.length);
+        flags = TOKEN_CONTEXT;
+        if (client->protocol > 1)
+            flags |= TOKEN_PROTOCOL;
+        status = token_send(client->fd, flags, &send_tok,
+                            client->timeout);
         if (status != TOKEN_OK) {
-            warn_token("receiving context token", status, major, minor);
-            goto fail;
-        }
-        if (flags == TOKEN_CONTEXT)
-            client->protocol = 1;
-        else if (flags != (TOKEN_CONTEXT | TOKEN_PROTOCOL)) {
-            warn("bad token flags %d in context token", flags);
-            free(recv_tok.value);
-            goto fail;
-        }
-        debug("received context token (size=%lu)",
-              (unsigned long) recv_tok.length);
-        major = gss_accept_sec_context(&acc_minor, &client->context, creds,
-                    &recv_tok, GSS_C_NO_CHANNEL_BINDINGS, &name, &doid,
-                    &send_tok, &client->flags, NULL, NULL);
-        free(recv_tok.value);
-
-        /* Send back a token if we need to. */
-        if (send_tok.length != 0) {
-            debug("sending context token (size=%lu)",
-                  (unsigned long) send_tok.length);
-            flags = TOKEN_CONTEXT;
-            if (client->protocol > 1)
-                flags |= TOKEN_PROTOCOL;
-            status = token_send(client->fd, flags, &send_tok, TIMEOUT);
-            if (status != TOKEN_OK) {
-                warn_token("sending context token", status, major, minor);
-                gss_release_buffer(&minor, &send_tok);
-                goto fail;
-            }
+            warn_token("sending context token", status, major, minor);
             gss_release_buffer(&minor, &send_tok);
-        }
-
-        /* Bail out if we lose. */
-        if (major != GSS_S_COMPLETE && major != GSS_S_CONTINUE_NEEDED) {
-            warn_gssapi("while accepting context", major, acc_minor);
             goto fail;
         }
-        if (major == GSS_S_CONTINUE_NEEDED)
-            debug("continue needed while accepting context");
-    } while (major == GSS_S_CONTINUE_NEEDED);
+        gss_release_buffer(&minor, &send_tok);
+    }
+
+    /* Bail out if we lose. */
+    if (major != GSS_S_COMPLETE && major != GSS_S_CONTINUE_NEEDED) {
+        warn_gssapi("while accepting context", major, acc_minor);
+        goto fail;
+    }
+    if (major == GSS_S_CONTINUE_NEEDED) {
+        debug("continue needed while accepting context");
+        return ACCEPT_CONTINUE;
+    }
 
     /* Make sure that the appropriate context flags are set. */
     if (client->protocol > 1) {
@@ -163,18 +176,51 @@ server_new_client(int fd, gss_cred_id_t creds)
     major = gss_release_name(&minor, &name);
     client->user = xstrndup(name_buf.value, name_buf.length);
     gss_release_buffer(&minor, &name_buf);
-    return client;
+    return ACCEPT_DONE;
 
 fail:
-    if (client->context != GSS_C_NO_CONTEXT)
-        gss_delete_sec_context(&minor, &client->context, GSS_C_NO_BUFFER);
     if (name != GSS_C_NO_NAME)
         gss_release_name(&minor, &name);
-    if (client->ipaddress != NULL)
-        free(client->ipaddress);
-    if (client->hostname != NULL)
-        free(client->hostname);
-    free(client);
+    return ACCEPT_FAIL;
+}
+
+
+/*
+ * Create a new client struct from a file descriptor and establish a GSS-API
+ * context as a specified service with an incoming client and fills out the
+ * client struct.  Returns a new client struct on success and NULL on failure,
+ * logging an appropriate error message.
+ */
+struct client *
+server_new_client(int fd, gss_cred_id_t creds)
+{
+    struct client *client;
+    gss_buffer_desc recv_tok;
+    enum accept_status result;
+    int flags, status;
+
+    client = server_start_client(fd);
+    if (client == NULL)
+        return NULL;
+    do {
+        status = token_recv(client->fd, &flags, &recv_tok, TOKEN_MAX_LENGTH,
+                            TIMEOUT);
+        if (status != TOKEN_OK) {
+            if (client->protocol == 0)
+                warn_token("receiving initial token", status, 0, 0);
+            else
+                warn_token("receiving context token", status, 0, 0);
+            goto fail;
+        }
+        result = server_accept_token(client, creds, flags, &recv_tok);
+        free(recv_tok.value);
+    } while (result == ACCEPT_CONTINUE);
+    if (result == ACCEPT_DONE)
+        return client;
+
+fail:
+    client->fd = -1;
+    server_free_client(client);
     return NULL;
 }
 
@@ -194,6 +240,10 @@ server_free_client(struct client *client)
     }
     if (client->output != NULL)
         free(client->output);
+    if (client->buffer != NULL)
+        token_buffer_free(client->buffer);
+    if (client->sendbuf != NULL)
+        token_wrap_buffer_free(client->sendbuf);
     if (client->user != NULL)
         free(client->user);
     if (client->fd >= 0)
@@ -213,6 +263,11 @@ server_free_client(struct client *client)
  * (starting with the argument count), and the length of the payload.  If
  * there are any problems with the request, sends an error token, logs the
  * error, and then returns NULL.  Otherwise, returns the struct iovec array.
+ *
+ * The argument data is not copied.  The array of pointers and the iovecs are
+ * allocated as a single block, and each iovec points into the payload, so
+ * the caller must keep the payload around until it calls
+ * server_free_command.
  */
 struct iovec **
 server_parse_command(struct client *client, const char *buffer, size_t length)
@@ -220,6 +275,7 @@ server_parse_command(struct client *client, const char *buffer, size_t length)
     OM_uint32 tmp;
     size_t argc, arglen, count;
     struct iovec **argv = NULL;
+    struct iovec *args;
     const char *p = buffer;
 
     /* Read the argument count. */
@@ -242,7 +298,9 @@ server_parse_command(struct client *client, const char *buffer, size_t length)
         server_send_error(client, ERROR_BAD_COMMAND, "Invalid command token");
         return NULL;
     }
-    argv = xcalloc(argc + 1, sizeof(struct iovec *));
+    argv = xmalloc((argc + 1) * sizeof(struct iovec *)
+                   + argc * sizeof(struct iovec));
+    args = (struct iovec *) (void *) (argv + argc + 1);
 
     /*
      * Parse out the arguments and store them into a vector.  Arguments are
@@ -266,14 +324,9 @@ server_parse_command(struct client *client, const char *buffer, size_t length)
                               "Invalid command token");
             goto fail;
         }
-        argv[count] = xmalloc(sizeof(struct iovec));
+        argv[count] = &args[count];
         argv[count]->iov_len = arglen;
-        if (arglen == 0)
-            argv[count]->iov_base = NULL;
-        else {
-            argv[count]->iov_base = xmalloc(arglen);
-            memcpy(argv[count]->iov_base, p, arglen);
-        }
+        argv[count]->iov_base = (arglen == 0) ? NULL : (char *) p;
         count++;
         p += arglen;
         debug("arg %lu has length %lu", (unsigned long) count,
@@ -288,8 +341,7 @@ server_parse_command(struct client *client, const char *buffer, size_t length)
     return argv;
 
 fail:
-    if (argv != NULL)
-        server_free_command(argv);
+    free(argv);
     return NULL;
 }
 
@@ -0,0 +1,159 @@
+/*
+ * Reverse name lookups of client addresses.
+ *
+ * The hostname of a client is only used to set REMOTE_HOST for the commands
+ * it runs, so it's looked up the first time the client runs a command rather
+ * than when the connection is accepted.  Otherwise, when the resolver is
+ * slow, every connection would stall for the resolver timeout before the
+ * GSS-API negotiation could even start.  Lookups can also be disabled
+ * entirely.
+ *
+ * The results of lookups, including failures, are cached for HOSTNAME_TTL
+ * seconds.  In standalone mode, the parent creates the cache in anonymous
+ * shared memory before starting any children, so that all of the children
+ * and workers doing lookups share it.  There's no locking.  Instead, each
+ * entry is written with a checksum, and an entry whose checksum doesn't
+ * match, because it was read while being written or was written by two
+ * processes at once, is treated as a cache miss.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+#include <portable/socket.h>
+
+#include <sys/mman.h>
+#include <time.h>
+
+#include <server/internal.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* Not all systems use the same name for anonymous mappings. */
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* Number of entries in the cache, indexed by a hash of the address. */
+#define HOSTNAME_CACHE_SIZE 256
+
+/* The result of looking up the hostname of an address. */
+struct hostname_entry {
+    unsigned long checksum;
+    time_t expires;
+    bool found;                 /* Whether the address had a hostname. */
+    char address[INET6_ADDRSTRLEN];
+    char hostname[NI_MAXHOST];
+};
+
+/* The shared cache, or NULL if there isn't one. */
+static struct hostname_entry *hostname_cache = NULL;
+
+/* Whether lookups have been disabled. */
+static bool hostname_disabled = false;
+
+
+/*
+ * Compute the checksum of a cache entry, covering everything but the
+ * checksum itself.
+ */
+static unsigned long
+hostname_checksum(const struct hostname_entry *entry)
+{
+    unsigned long hash;
+
+    hash = server_hash_string(HASH_INIT, entry->address);
+    hash = server_hash_string(hash, entry->hostname);
+    return hash ^ (unsigned long) entry->expires ^ (entry->found ? 1 : 0);
+}
+
+
+/*
+ * Create the cache of lookups shared by this process and any children it
+ * forks afterwards.  If the shared memory can't be created, log a warning
+ * and continue without a cache.
+ */
+void
+server_hostname_cache(void)
+{
+    void *cache;
+    size_t size;
+
+    if (hostname_cache != NULL || hostname_disabled)
+        return;
+    size = HOSTNAME_CACHE_SIZE * sizeof(struct hostname_entry);
+    cache = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (cache == MAP_FAILED) {
+        syswarn("cannot create shared hostname cache");
+        return;
+    }
+    hostname_cache = cache;
+}
+
+
+/*
+ * Disable hostname lookups, so that REMOTE_HOST is never set.
+ */
+void
+server_hostname_disable(void)
+{
+    hostname_disabled = true;
+}
+
+
+/*
+ * Return the hostname of the client, looking it up if this is the first
+ * time it's been needed and it isn't cached.  Returns NULL if the address
+ * doesn't have a hostname or if lookups are disabled.
+ */
+const char *
+server_client_hostname(struct client *client)
+{
+    struct hostname_entry entry;
+    struct hostname_entry *slot = NULL;
+    char hostname[NI_MAXHOST];
+    unsigned long hash;
+    time_t now;
+    int status;
+
+    if (client->resolved || hostname_disabled || client->ipaddress == NULL)
+        return client->hostname;
+    client->resolved = true;
+
+    /* Check the cache. */
+    now = time(NULL);
+    if (hostname_cache != NULL) {
+        hash = server_hash_string(HASH_INIT, client->ipaddress);
+        slot = &hostname_cache[hash % HOSTNAME_CACHE_SIZE];
+        memcpy(&entry, slot, sizeof(entry));
+        entry.address[sizeof(entry.address) - 1] = '\0';
+        entry.hostname[sizeof(entry.hostname) - 1] = '\0';
+        if (entry.checksum == hostname_checksum(&entry)
+            && strcmp(entry.address, client->ipaddress) == 0
+            && entry.expires > now && entry.expires - now <= HOSTNAME_TTL) {
+            if (entry.found)
+                client->hostname = xstrdup(entry.hostname);
+            return client->hostname;
+        }
+    }
+
+    /* Not cached, so look it up and cache the result. */
+    status = getnameinfo((struct sockaddr *) &client->address,
+                         client->addrlen, hostname, sizeof(hostname), NULL, 0,
+                         NI_NAMEREQD);
+    if (status == 0)
+        client->hostname = xstrdup(hostname);
+    if (slot != NULL) {
+        memset(&entry, 0, sizeof(entry));
+        strlcpy(entry.address, client->ipaddress, sizeof(entry.address));
+        if (status == 0)
+            strlcpy(entry.hostname, hostname, sizeof(entry.hostname));
+        entry.found = (status == 0);
+        entry.expires = now + HOSTNAME_TTL;
+        entry.checksum = hostname_checksum(&entry);
+        memcpy(slot, &entry, sizeof(entry));
+    }
+    return client->hostname;
+}
@@ -14,12 +14,17 @@
 #include <config.h>
 #include <portable/gssapi.h>
 #include <portable/macros.h>
+#include <portable/socket.h>
 #include <portable/stdbool.h>
 #include <sys/types.h>
 #include <util/protocol.h>
 
 /* Forward declarations to avoid extra includes. */
+struct event_loop;
 struct iovec;
+struct limits;
+struct sockaddr_storage;
+struct stat;
 
 /*
  * Used as the default max buffer for the argv passed into the server, and for
@@ -27,6 +32,12 @@ struct iovec;
  */
 #define MAXBUFFER 64000
 
+/*
+ * The default maximum time in milliseconds to hold coalesced output before
+ * sending it, if the coalesce option doesn't give one.
+ */
+#define COALESCE_DELAY 50
+
 /*
  * The maximum size of argc passed to the server.  This is an arbitrary limit
  * to protect against memory-based denial of service attacks on the server.
@@ -39,11 +50,41 @@ struct iovec;
  */
 #define TIMEOUT (60 * 60)
 
+/* Initial value for server_hash_string. */
+#define HASH_INIT 2166136261UL
+
+/*
+ * How long in seconds to use the supplementary groups looked up for a user
+ * option before looking them up again.
+ */
+#define GROUPS_TTL (10 * 60)
+
+/* How long in seconds to cache the result of looking up a client hostname. */
+#define HOSTNAME_TTL (5 * 60)
+
+/*
+ * The identity of a file when it was read into one of the caches of parsed
+ * files, used to notice when the file has changed and must be read again.
+ */
+struct file_stamp {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    time_t ctime;
+    long mtime_nsec;            /* Nanoseconds, if the system records them. */
+    long ctime_nsec;
+    time_t stamped;             /* When the file was read. */
+};
+
 /* Holds the information about a client connection. */
 struct client {
     int fd;                     /* File descriptor of client connection. */
     char *hostname;             /* Hostname of client (if available). */
+    bool resolved;              /* Whether hostname has been looked up. */
     char *ipaddress;            /* IP address of client as a string. */
+    struct sockaddr_storage address; /* Address of client. */
+    socklen_t addrlen;          /* Length of the client address. */
     int protocol;               /* Protocol version number. */
     gss_ctx_id_t context;       /* GSS-API context. */
     char *user;                 /* Name of the client as a string. */
@@ -52,6 +93,16 @@ struct client {
     char *output;               /* Stores output to send to the client. */
     size_t outlen;              /* Length of output to send to client. */
     bool fatal;                 /* Whether a fatal error has occurred. */
+    time_t timeout;             /* Seconds to wait while sending a token. */
+    struct token_buffer *buffer; /* Read-ahead buffer for tokens, or NULL. */
+    struct token_wrap_buffer *sendbuf; /* Buffer for wrapping output. */
+};
+
+/* Result of processing a token while establishing a client context. */
+enum accept_status {
+    ACCEPT_CONTINUE,            /* More tokens are needed. */
+    ACCEPT_DONE,                /* The context has been established. */
+    ACCEPT_FAIL                 /* Negotiation failed. */
 };
 
 /* Holds the configuration for a single command. */
@@ -64,12 +115,21 @@ struct confline {
     char *program;              /* Full file name of executable. */
     unsigned int *logmask;      /* Zero-terminated list of args to mask. */
     long stdin_arg;             /* Arg to pass on stdin, -1 for last. */
+    size_t coalesce;            /* Coalesce output up to this size, or 0. */
+    long coalesce_delay;        /* Max milliseconds to hold output. */
+    long timeout;               /* Seconds before killing command, or 0. */
+    long rlimit_cpu;            /* CPU time limit in seconds, or 0. */
+    unsigned long rlimit_as;    /* Address space limit in bytes, or 0. */
+    long nice;                  /* Scheduling priority adjustment. */
+    long max_running;           /* Maximum simultaneous commands, or 0. */
+    bool remote_host;           /* Whether to set REMOTE_HOST. */
     char *user;                 /* Run executable as user. */
     uid_t uid;                  /* Run executable with this UID. */
     gid_t gid;                  /* Run executable with this GID. */
     char *summary;              /* Argument that gives a command summary. */
     char *help;                 /* Argument that gives help for a command. */
     char **acls;                /* Full file names of ACL files. */
+    unsigned int refs;          /* Configurations and cache using this. */
 };
 
 /* Holds the complete parsed configuration for remctld. */
@@ -77,6 +137,11 @@ struct config {
     struct confline **rules;
     size_t count;
     size_t allocated;
+    size_t *index;              /* Hash of first rule for each command pair. */
+    size_t index_size;          /* Number of slots in index. */
+    bool max_running;           /* Whether any rule sets max-running. */
+    size_t files;               /* Number of configuration files read. */
+    size_t changed;             /* Files parsed rather than cached. */
 };
 
 BEGIN_DECLS
@@ -89,8 +154,17 @@ void server_log_command(struct iovec **, struct confline *, const char *user);
 /* Configuration file functions. */
 struct config *server_config_load(const char *file);
 void server_config_free(struct config *);
+void server_config_preload(void);
+struct confline *server_config_find(struct config *, const char *command,
+                                    const char *subcommand);
 bool server_config_acl_permit(struct confline *, const char *user);
+bool server_config_groups(struct confline *, const gid_t **groups,
+                          size_t *count);
+void server_config_groups_refresh(void);
 void server_config_set_gput_file(char *file);
+unsigned long server_hash_string(unsigned long hash, const char *);
+void server_file_stamp(struct file_stamp *, const struct stat *);
+bool server_file_unchanged(const struct file_stamp *, const struct stat *);
 
 /* Running commands. */
 void server_run_command(struct client *, struct config *, struct iovec **);
@@ -100,7 +174,19 @@ void server_free_command(struct iovec **);
 
 /* Generic protocol functions. */
 struct client *server_new_client(int fd, gss_cred_id_t creds);
+struct client *server_start_client(int fd);
+enum accept_status server_accept_token(struct client *, gss_cred_id_t,
+                                       int flags, gss_buffer_t);
 void server_free_client(struct client *);
+
+/* Preloading the keytab. */
+bool server_keytab_load(const char *service, gss_cred_id_t *);
+bool server_keytab_refresh(const char *service, gss_cred_id_t *, bool force);
+
+/* Looking up client hostnames. */
+void server_hostname_cache(void);
+void server_hostname_disable(void);
+const char *server_client_hostname(struct client *);
 struct iovec **server_parse_command(struct client *, const char *, size_t);
 bool server_send_error(struct client *, enum error_codes, const char *);
 
@@ -109,11 +195,37 @@ bool server_v1_send_output(struct client *, int status);
 void server_v1_handle_messages(struct client *, struct config *);
 
 /* Protocol v2 functions. */
-bool server_v2_send_output(struct client *, int stream);
+bool server_v2_send_output(struct client *, int stream, const char *,
+                           size_t);
+char *server_v2_prepare_output(struct client *);
+bool server_v2_send_prepared_output(struct client *, int stream, char *,
+                                    size_t);
 bool server_v2_send_status(struct client *, int);
 bool server_v2_send_error(struct client *, enum error_codes, const char *);
+bool server_v2_handle_token(struct client *, struct config *, gss_buffer_t);
 void server_v2_handle_messages(struct client *, struct config *);
 
+/* Concurrency limits, tracked by the parent in standalone mode. */
+struct limits *server_limits_new(unsigned long max, unsigned long max_ip,
+                                 unsigned long max_user);
+bool server_limits_full(struct limits *);
+bool server_limits_permit(struct limits *, const char *ip);
+bool server_limits_start(struct limits *, struct config *);
+void server_limits_child(struct limits *);
+void server_limits_add(struct limits *, pid_t, const char *ip);
+void server_limits_remove(struct limits *, pid_t);
+int server_limits_accept(struct limits *, int fds[], unsigned int nfds,
+                         struct sockaddr_storage *);
+bool server_limits_admit(struct client *, struct confline *);
+void server_limits_release(void);
+
+/* Multiplexed connection handling in a single process. */
+struct event_loop *server_event_new(int fds[], unsigned int nfds,
+                                    gss_cred_id_t creds);
+void server_event_set_creds(struct event_loop *, gss_cred_id_t);
+void server_event_dispatch(struct event_loop *, struct config *,
+                           time_t timeout);
+
 END_DECLS
 
 #endif /* !SERVER_INTERNAL_H */
@@ -0,0 +1,283 @@
+/*
+ * Preloading the keytab for remctld in standalone mode.
+ *
+ * Normally, every gss_accept_sec_context call in every child opens and reads
+ * the keytab on disk.  When preloading is requested, the parent instead
+ * copies the keytab into an in-memory keytab once, imports acceptor
+ * credentials from it, and passes those credentials to the children, which
+ * inherit the in-memory keytab when they're forked.
+ *
+ * The keytab is copied again when the parent gets a SIGHUP or notices that
+ * the keytab file has changed before starting a child, using the same file
+ * stamp as the ACL file cache, which compares nanosecond timestamps where
+ * the system records them.  The new credentials are only used if the copy
+ * succeeds, so a keytab that is briefly missing or empty while being
+ * rewritten doesn't stop the server.
+ *
+ * This needs gss_krb5_import_cred and the Kerberos keytab API.  Without them,
+ * preloading isn't available.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+#include <portable/gssapi.h>
+
+#ifdef HAVE_KEYTAB_PRELOAD
+# include <krb5.h>
+#endif
+#include <sys/stat.h>
+
+#include <server/internal.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+#ifdef HAVE_KEYTAB_PRELOAD
+
+/* Older versions of MIT Kerberos only have the deprecated name. */
+#ifndef HAVE_KRB5_FREE_KEYTAB_ENTRY_CONTENTS
+# define krb5_free_keytab_entry_contents krb5_kt_free_entry
+#endif
+
+/* Maximum length of the name of the keytab on disk. */
+#define KEYTAB_NAME_MAX 1024
+
+/*
+ * The Kerberos context, the in-memory copy of the keytab that the current
+ * credentials were imported from, and the file it was copied from along with
+ * the identity of that file when it was copied.  path is NULL if the keytab
+ * isn't a file, in which case it can only be reloaded by a SIGHUP.
+ */
+static krb5_context keytab_context = NULL;
+static krb5_keytab keytab_memory = NULL;
+static char *keytab_path = NULL;
+static struct file_stamp keytab_stamp;
+
+/* Incremented for each copy to give each in-memory keytab a unique name. */
+static unsigned long keytab_generation = 0;
+
+
+/*
+ * Report a Kerberos error with the given message prefix.
+ */
+static void
+warn_krb5(const char *message, krb5_error_code code)
+{
+    const char *error;
+
+    error = krb5_get_error_message(keytab_context, code);
+    warn("%s: %s", message, error);
+    krb5_free_error_message(keytab_context, error);
+}
+
+
+/*
+ * Given the name of a keytab, return the path of the file that it's stored
+ * in as a newly allocated string, or NULL if it isn't a file keytab.
+ */
+static char *
+keytab_file(const char *name)
+{
+    if (strncmp(name, "FILE:", strlen("FILE:")) == 0)
+        return xstrdup(name + strlen("FILE:"));
+    if (strncmp(name, "WRFILE:", strlen("WRFILE:")) == 0)
+        return xstrdup(name + strlen("WRFILE:"));
+    if (name[0] == '/')
+        return xstrdup(name);
+    return NULL;
+}
+
+
+/*
+ * Copy every entry in the named keytab into a new in-memory keytab.  Returns
+ * the in-memory keytab, or NULL on failure after logging an error.
+ */
+static krb5_keytab
+keytab_copy(const char *name)
+{
+    krb5_keytab file = NULL;
+    krb5_keytab memory = NULL;
+    krb5_kt_cursor cursor;
+    krb5_keytab_entry entry;
+    krb5_error_code code;
+    char *memory_name;
+    unsigned long count = 0;
+
+    code = krb5_kt_resolve(keytab_context, name, &file);
+    if (code != 0) {
+        warn_krb5("cannot open keytab", code);
+        return NULL;
+    }
+    keytab_generation++;
+    xasprintf(&memory_name, "MEMORY:remctld-%lu-%lu",
+              (unsigned long) getpid(), keytab_generation);
+    code = krb5_kt_resolve(keytab_context, memory_name, &memory);
+    free(memory_name);
+    if (code != 0) {
+        warn_krb5("cannot create in-memory keytab", code);
+        goto fail;
+    }
+    code = krb5_kt_start_seq_get(keytab_context, file, &cursor);
+    if (code != 0) {
+        warn_krb5("cannot read keytab", code);
+        goto fail;
+    }
+    while (1) {
+        code = krb5_kt_next_entry(keytab_context, file, &entry, &cursor);
+        if (code != 0)
+            break;
+        code = krb5_kt_add_entry(keytab_context, memory, &entry);
+        krb5_free_keytab_entry_contents(keytab_context, &entry);
+        if (code != 0)
+            break;
+        count++;
+    }
+    krb5_kt_end_seq_get(keytab_context, file, &cursor);
+    if (code != KRB5_KT_END) {
+        warn_krb5("cannot copy keytab", code);
+        goto fail;
+    }
+    if (count == 0) {
+        warn("keytab %s contains no keys", name);
+        goto fail;
+    }
+    krb5_kt_close(keytab_context, file);
+    return memory;
+
+fail:
+    if (memory != NULL)
+        krb5_kt_close(keytab_context, memory);
+    krb5_kt_close(keytab_context, file);
+    return NULL;
+}
+
+
+/*
+ * Copy the keytab into memory and import acceptor credentials from it,
+ * limited to the given service principal if it's not NULL.  On success,
+ * release the old credentials and in-memory keytab, store the new
+ * credentials in creds, and return true.  On failure, log an error, leave
+ * creds alone, and return false.
+ */
+bool
+server_keytab_load(const char *service, gss_cred_id_t *creds)
+{
+    krb5_error_code code;
+    krb5_keytab memory;
+    krb5_principal principal = NULL;
+    gss_cred_id_t new;
+    OM_uint32 major, minor;
+    char name[KEYTAB_NAME_MAX];
+    struct stat st;
+    bool have_stat = false;
+
+    if (keytab_context == NULL) {
+        code = krb5_init_context(&keytab_context);
+        if (code != 0) {
+            warn("cannot initialize Kerberos context");
+            keytab_context = NULL;
+            return false;
+        }
+    }
+    code = krb5_kt_default_name(keytab_context, name, sizeof(name));
+    if (code != 0) {
+        warn_krb5("cannot get keytab name", code);
+        return false;
+    }
+    free(keytab_path);
+    keytab_path = keytab_file(name);
+    if (keytab_path != NULL && stat(keytab_path, &st) == 0)
+        have_stat = true;
+
+    /* Copy the keytab and import credentials from the copy. */
+    memory = keytab_copy(name);
+    if (memory == NULL)
+        return false;
+    if (service != NULL) {
+        code = krb5_parse_name(keytab_context, service, &principal);
+        if (code != 0) {
+            warn_krb5("cannot parse service principal", code);
+            krb5_kt_close(keytab_context, memory);
+            return false;
+        }
+    }
+    major = gss_krb5_import_cred(&minor, NULL, principal, memory, &new);
+    if (principal != NULL)
+        krb5_free_principal(keytab_context, principal);
+    if (major != GSS_S_COMPLETE) {
+        warn_gssapi("while importing credentials", major, minor);
+        krb5_kt_close(keytab_context, memory);
+        return false;
+    }
+
+    /*
+     * Swap in the new credentials.  Release the old ones before closing the
+     * in-memory keytab they were imported from.
+     */
+    if (*creds != GSS_C_NO_CREDENTIAL)
+        gss_release_cred(&minor, creds);
+    *creds = new;
+    if (keytab_memory != NULL)
+        krb5_kt_close(keytab_context, keytab_memory);
+    keytab_memory = memory;
+    if (have_stat)
+        server_file_stamp(&keytab_stamp, &st);
+    else
+        memset(&keytab_stamp, 0, sizeof(keytab_stamp));
+    return true;
+}
+
+
+/*
+ * If the keytab was preloaded, copy it again if force is set or if the file
+ * has changed since it was copied.  Returns true if the credentials in creds
+ * were replaced and false otherwise, including on failure, in which case the
+ * old credentials are still valid and are kept until the file changes again
+ * or another refresh is forced.
+ */
+bool
+server_keytab_refresh(const char *service, gss_cred_id_t *creds, bool force)
+{
+    struct stat st;
+
+    if (keytab_memory == NULL)
+        return false;
+    if (!force) {
+        if (keytab_path == NULL || stat(keytab_path, &st) < 0)
+            return false;
+        if (server_file_unchanged(&keytab_stamp, &st))
+            return false;
+
+        /* Don't try again until it changes again if this copy fails. */
+        server_file_stamp(&keytab_stamp, &st);
+    }
+    notice("reloading keytab");
+    return server_keytab_load(service, creds);
+}
+
+#else /* !HAVE_KEYTAB_PRELOAD */
+
+/*
+ * Preloading isn't supported, so always fail.
+ */
+bool
+server_keytab_load(const char *service UNUSED, gss_cred_id_t *creds UNUSED)
+{
+    warn("keytab preloading is not supported by this Kerberos library");
+    return false;
+}
+
+
+/*
+ * Preloading isn't supported, so there's never anything to refresh.
+ */
+bool
+server_keytab_refresh(const char *service UNUSED, gss_cred_id_t *creds UNUSED,
+                      bool force UNUSED)
+{
+    return false;
+}
+
+#endif /* !HAVE_KEYTAB_PRELOAD */
@@ -0,0 +1,572 @@
+/*
+ * Concurrency limits for remctld in standalone mode.
+ *
+ * When running as a standalone daemon that forks a child for each connection,
+ * the parent can limit the number of simultaneous children overall, from
+ * each client IP address, and for each authenticated user, and each command
+ * can limit how many copies of it run at once.  The parent keeps children in
+ * a hash table by PID and the counts in hash tables by IP address, user, and
+ * command, so starting and reaping a child takes constant time.
+ *
+ * The parent knows the client IP address when it accepts a connection, so
+ * the overall and per-IP limits are checked before forking.  Once the
+ * maximum number of children are running, the parent stops accepting
+ * connections and new connections wait in the listen queue until a child
+ * exits.  A connection from an IP address that is over its limit is closed
+ * without forking.
+ *
+ * The user and the command are only known to the child.  If either of those
+ * limits may apply, the parent creates a socketpair for the child, and the
+ * child asks the parent before running each command.  If the parent refuses,
+ * the child sends an error to the client instead of running the command.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+#include <portable/socket.h>
+
+#include <errno.h>
+#include <poll.h>
+
+#include <server/internal.h>
+#include <util/fdflag.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* Number of hash buckets for children and for each table of counts. */
+#define LIMITS_BUCKETS 256
+
+/* Maximum length of the user and command in a request from a child. */
+#define LIMITS_MESSAGE_MAX 4096
+
+/* Replies from the parent to a request from a child. */
+enum limits_reply {
+    LIMITS_OK,                  /* The command may be run. */
+    LIMITS_USER,                /* Too many connections for this user. */
+    LIMITS_COMMAND              /* Too many copies of the command running. */
+};
+
+/* Header of a request from a child, followed by the user and command. */
+struct limits_request {
+    long max_running;           /* Limit for the command, or 0. */
+    bool release;               /* Whether the command has finished. */
+};
+
+/* Number of children with a given IP address, user, or command. */
+struct limits_count {
+    char *key;
+    unsigned long count;
+    struct limits_count *next;
+};
+
+/* Parent's view of a single child. */
+struct limits_child {
+    pid_t pid;
+    int control;                /* Parent end of socketpair, or -1. */
+    struct limits_count *ip;    /* Count for the IP address, if limited. */
+    struct limits_count *user;  /* Count for the user, if limited. */
+    struct limits_count *command; /* Count for the running command. */
+    struct limits_child *next;
+};
+
+/* The limits and the current counts as tracked by the parent. */
+struct limits {
+    unsigned long max;          /* Maximum children, or 0. */
+    unsigned long max_ip;       /* Maximum children per IP address, or 0. */
+    unsigned long max_user;     /* Maximum children per user, or 0. */
+    unsigned long children;     /* Number of running children. */
+    int pending[2];             /* Socketpair for the next child. */
+    struct pollfd *pollfds;     /* Poll set for server_limits_accept. */
+    struct limits_child **polled; /* Child for each entry in the poll set. */
+    size_t size;                /* Allocated size of the poll set. */
+    struct limits_child *pids[LIMITS_BUCKETS];
+    struct limits_count *ips[LIMITS_BUCKETS];
+    struct limits_count *users[LIMITS_BUCKETS];
+    struct limits_count *commands[LIMITS_BUCKETS];
+};
+
+/* In a child, the socket to the parent, or -1 if there are no limits. */
+static int limits_control = -1;
+
+/* In a child, whether the parent has accepted our user. */
+static bool limits_user_ok = false;
+
+/* In a child, whether the parent is counting our running command. */
+static bool limits_running = false;
+
+
+/*
+ * Find the count for a key in a table.  Returns NULL if no child has that
+ * key.
+ */
+static struct limits_count *
+limits_count_find(struct limits_count **table, const char *key)
+{
+    struct limits_count *count;
+
+    count = table[server_hash_string(HASH_INIT, key) % LIMITS_BUCKETS];
+    for (; count != NULL; count = count->next)
+        if (strcmp(count->key, key) == 0)
+            return count;
+    return NULL;
+}
+
+
+/*
+ * Add a child to the count for a key in a table, creating the count if
+ * necessary, and return the count.
+ */
+static struct limits_count *
+limits_count_hold(struct limits_count **table, const char *key)
+{
+    struct limits_count *count;
+    size_t bucket;
+
+    count = limits_count_find(table, key);
+    if (count == NULL) {
+        bucket = server_hash_string(HASH_INIT, key) % LIMITS_BUCKETS;
+        count = xmalloc(sizeof(struct limits_count));
+        count->key = xstrdup(key);
+        count->count = 0;
+        count->next = table[bucket];
+        table[bucket] = count;
+    }
+    count->count++;
+    return count;
+}
+
+
+/*
+ * Remove a child from a count, freeing the count once no children are left.
+ * Does nothing if count is NULL.
+ */
+static void
+limits_count_release(struct limits_count **table, struct limits_count *count)
+{
+    struct limits_count **p;
+
+    if (count == NULL)
+        return;
+    count->count--;
+    if (count->count > 0)
+        return;
+    p = &table[server_hash_string(HASH_INIT, count->key) % LIMITS_BUCKETS];
+    while (*p != count)
+        p = &(*p)->next;
+    *p = count->next;
+    free(count->key);
+    free(count);
+}
+
+
+/*
+ * Returns true if the count for a key has reached the given maximum.  A
+ * maximum of 0 means there is no limit.
+ */
+static bool
+limits_reached(struct limits_count **table, const char *key,
+               unsigned long max)
+{
+    struct limits_count *count;
+
+    if (max == 0)
+        return false;
+    count = limits_count_find(table, key);
+    return (count != NULL && count->count >= max);
+}
+
+
+/*
+ * Create a new set of limits.  Each maximum may be 0 to not limit that
+ * count.
+ */
+struct limits *
+server_limits_new(unsigned long max, unsigned long max_ip,
+                  unsigned long max_user)
+{
+    struct limits *limits;
+
+    limits = xcalloc(1, sizeof(struct limits));
+    limits->max = max;
+    limits->max_ip = max_ip;
+    limits->max_user = max_user;
+    limits->pending[0] = -1;
+    limits->pending[1] = -1;
+    return limits;
+}
+
+
+/*
+ * Returns true if the maximum number of children are running.
+ */
+bool
+server_limits_full(struct limits *limits)
+{
+    return (limits->max > 0 && limits->children >= limits->max);
+}
+
+
+/*
+ * Returns true if another connection from the given IP address is allowed.
+ */
+bool
+server_limits_permit(struct limits *limits, const char *ip)
+{
+    return !limits_reached(limits->ips, ip, limits->max_ip);
+}
+
+
+/*
+ * Prepare to fork a new child.  If the child may need to ask the parent
+ * about the user or command limits, create the socketpair that it will use.
+ * Returns false if that fails, in which case the child should not be
+ * started.
+ */
+bool
+server_limits_start(struct limits *limits, struct config *config)
+{
+    if (limits->max_user == 0 && !config->max_running)
+        return true;
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, limits->pending) < 0) {
+        syswarn("cannot create socketpair for child");
+        limits->pending[0] = -1;
+        limits->pending[1] = -1;
+        return false;
+    }
+    fdflag_close_exec(limits->pending[0], true);
+    fdflag_close_exec(limits->pending[1], true);
+    fdflag_nonblocking(limits->pending[0], true);
+    return true;
+}
+
+
+/*
+ * Called in a newly forked child.  Close the parent's sockets for all of the
+ * other children and remember the socket to use to talk to the parent.
+ */
+void
+server_limits_child(struct limits *limits)
+{
+    struct limits_child *child;
+    size_t i;
+
+    for (i = 0; i < LIMITS_BUCKETS; i++)
+        for (child = limits->pids[i]; child != NULL; child = child->next)
+            if (child->control >= 0)
+                close(child->control);
+    if (limits->pending[0] >= 0)
+        close(limits->pending[0]);
+    limits_control = limits->pending[1];
+}
+
+
+/*
+ * Record a new child in the parent, given its PID and the client IP address.
+ * If the fork failed, pid will be -1 and this just cleans up.
+ */
+void
+server_limits_add(struct limits *limits, pid_t pid, const char *ip)
+{
+    struct limits_child *child;
+    size_t bucket;
+
+    if (limits->pending[1] >= 0)
+        close(limits->pending[1]);
+    if (pid < 0) {
+        if (limits->pending[0] >= 0)
+            close(limits->pending[0]);
+    } else {
+        child = xcalloc(1, sizeof(struct limits_child));
+        child->pid = pid;
+        child->control = limits->pending[0];
+        if (limits->max_ip > 0)
+            child->ip = limits_count_hold(limits->ips, ip);
+        bucket = (size_t) pid % LIMITS_BUCKETS;
+        child->next = limits->pids[bucket];
+        limits->pids[bucket] = child;
+        limits->children++;
+    }
+    limits->pending[0] = -1;
+    limits->pending[1] = -1;
+}
+
+
+/*
+ * Forget about a child that has been reaped, releasing everything it was
+ * counted against.  Unknown PIDs are ignored.
+ */
+void
+server_limits_remove(struct limits *limits, pid_t pid)
+{
+    struct limits_child **p;
+    struct limits_child *child;
+
+    p = &limits->pids[(size_t) pid % LIMITS_BUCKETS];
+    while (*p != NULL && (*p)->pid != pid)
+        p = &(*p)->next;
+    if (*p == NULL)
+        return;
+    child = *p;
+    *p = child->next;
+    if (child->control >= 0)
+        close(child->control);
+    limits_count_release(limits->ips, child->ip);
+    limits_count_release(limits->users, child->user);
+    limits_count_release(limits->commands, child->command);
+    free(child);
+    limits->children--;
+}
+
+
+/*
+ * Check a request from a child against the user and command limits,
+ * updating its counts if the command is allowed.  The user is only checked
+ * for the first request, since after that the child is already counted.
+ * Returns the reply to send to the child.
+ */
+static enum limits_reply
+limits_check(struct limits *limits, struct limits_child *child,
+             const char *user, const char *command, long max_running)
+{
+    if (child->user == NULL && limits->max_user > 0) {
+        if (limits_reached(limits->users, user, limits->max_user))
+            return LIMITS_USER;
+        child->user = limits_count_hold(limits->users, user);
+    }
+    limits_count_release(limits->commands, child->command);
+    child->command = NULL;
+    if (max_running > 0) {
+        if (limits_reached(limits->commands, command,
+                           (unsigned long) max_running))
+            return LIMITS_COMMAND;
+        child->command = limits_count_hold(limits->commands, command);
+    }
+    return LIMITS_OK;
+}
+
+
+/*
+ * Read and answer a request from a child.  If reading from the child fails,
+ * stop listening to it; its counts are released when it is reaped.
+ */
+static void
+limits_request(struct limits *limits, struct limits_child *child)
+{
+    char buffer[sizeof(struct limits_request) + LIMITS_MESSAGE_MAX];
+    struct limits_request request;
+    const char *user, *command, *end;
+    ssize_t got;
+    char reply;
+
+    got = recv(child->control, buffer, sizeof(buffer), 0);
+    if (got < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (got <= 0) {
+        syswarn("cannot read request from child %lu",
+                (unsigned long) child->pid);
+        close(child->control);
+        child->control = -1;
+        return;
+    }
+
+    /* Parse the request.  A release has no reply. */
+    memset(&request, 0, sizeof(request));
+    end = buffer + got;
+    user = NULL;
+    command = NULL;
+    if ((size_t) got >= sizeof(request)) {
+        memcpy(&request, buffer, sizeof(request));
+        if (request.release) {
+            limits_count_release(limits->commands, child->command);
+            child->command = NULL;
+            return;
+        }
+        user = buffer + sizeof(request);
+        command = memchr(user, '\0', end - user);
+        if (command != NULL) {
+            command++;
+            if (memchr(command, '\0', end - command) == NULL)
+                command = NULL;
+        }
+    }
+    if (command == NULL) {
+        warn("invalid request from child %lu", (unsigned long) child->pid);
+        reply = LIMITS_COMMAND;
+    } else {
+        reply = limits_check(limits, child, user, command,
+                             request.max_running);
+        if (reply != LIMITS_OK)
+            debug("refused command %s for %s in child %lu", command, user,
+                  (unsigned long) child->pid);
+    }
+    if (send(child->control, &reply, 1, 0) < 0)
+        syswarn("cannot send reply to child %lu", (unsigned long) child->pid);
+}
+
+
+/*
+ * Wait for a new connection in the parent, answering requests from children
+ * in the meantime.  Once the maximum number of children are running, stop
+ * listening for connections so that they wait in the listen queue.  Returns
+ * the new connection and stores the client address in ss.  Returns -1 with
+ * errno set to EINTR if there was no new connection within a second, so
+ * that the caller notices signals that arrived just before we started
+ * waiting, or -1 with errno set if accepting a connection failed.
+ */
+int
+server_limits_accept(struct limits *limits, int fds[], unsigned int nfds,
+                     struct sockaddr_storage *ss)
+{
+    struct limits_child *child;
+    socklen_t sslen;
+    size_t n, size;
+    unsigned int i;
+    int fd, status;
+    bool full;
+
+    /*
+     * The poll set holds the listening sockets, if we're not full, followed
+     * by the control socket of each child.  Grow it as needed to hold every
+     * child; it's never shrunk.
+     */
+    size = nfds + limits->children;
+    if (size > limits->size) {
+        limits->pollfds = xrealloc(limits->pollfds,
+                                   size * sizeof(struct pollfd));
+        limits->polled = xrealloc(limits->polled,
+                                  size * sizeof(struct limits_child *));
+        limits->size = size;
+    }
+    n = 0;
+    full = server_limits_full(limits);
+    if (!full)
+        for (i = 0; i < nfds; i++) {
+            limits->pollfds[n].fd = fds[i];
+            limits->pollfds[n].events = POLLIN;
+            limits->polled[n] = NULL;
+            n++;
+        }
+    for (i = 0; i < LIMITS_BUCKETS; i++)
+        for (child = limits->pids[i]; child != NULL; child = child->next) {
+            if (child->control < 0 || n >= size)
+                continue;
+            limits->pollfds[n].fd = child->control;
+            limits->pollfds[n].events = POLLIN;
+            limits->polled[n] = child;
+            n++;
+        }
+    status = poll(limits->pollfds, n, 1000);
+    if (status <= 0) {
+        if (status == 0)
+            errno = EINTR;
+        return -1;
+    }
+
+    /* Answer children first, since they're waiting on us. */
+    for (i = (full ? 0 : nfds); i < n; i++)
+        if (limits->pollfds[i].revents != 0)
+            limits_request(limits, limits->polled[i]);
+    if (!full)
+        for (i = 0; i < nfds; i++) {
+            if (limits->pollfds[i].revents == 0)
+                continue;
+            sslen = sizeof(struct sockaddr_storage);
+            fd = accept(fds[i], (struct sockaddr *) ss, &sslen);
+            if (fd >= 0)
+                return fd;
+            if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+                return -1;
+        }
+    errno = EINTR;
+    return -1;
+}
+
+
+/*
+ * Called in a child before running a command to ask the parent whether the
+ * user and command limits allow it.  If not, logs the reason, sends an error
+ * to the client, and returns false.  If the command is allowed, the caller
+ * must call server_limits_release once the command has finished.
+ *
+ * If the parent can't be reached, allow the command, since the parent would
+ * only be unreachable if it had exited.
+ */
+bool
+server_limits_admit(struct client *client, struct confline *cline)
+{
+    struct limits_request request;
+    char *command, *buffer;
+    size_t userlen, length;
+    ssize_t status;
+    char reply = LIMITS_OK;
+
+    if (limits_control < 0)
+        return true;
+    if (limits_user_ok && cline->max_running == 0)
+        return true;
+
+    /* Build and send the request and wait for the reply. */
+    xasprintf(&command, "%s %s", cline->command, cline->subcommand);
+    userlen = strlen(client->user) + 1;
+    length = sizeof(request) + userlen + strlen(command) + 1;
+    buffer = xmalloc(length);
+    memset(&request, 0, sizeof(request));
+    request.max_running = cline->max_running;
+    memcpy(buffer, &request, sizeof(request));
+    memcpy(buffer + sizeof(request), client->user, userlen);
+    memcpy(buffer + sizeof(request) + userlen, command, strlen(command) + 1);
+    if (send(limits_control, buffer, length, 0) < 0)
+        syswarn("cannot send request to parent");
+    else {
+        status = recv(limits_control, &reply, 1, 0);
+        while (status < 0 && errno == EINTR)
+            status = recv(limits_control, &reply, 1, 0);
+        if (status < 0)
+            syswarn("cannot read reply from parent");
+        if (status < 1)
+            reply = LIMITS_OK;
+    }
+    free(buffer);
+
+    /* Act on the reply. */
+    switch (reply) {
+    case LIMITS_USER:
+        notice("too many connections for user %s", client->user);
+        server_send_error(client, ERROR_INTERNAL,
+                          "Too many connections for user");
+        break;
+    case LIMITS_COMMAND:
+        notice("too many instances of command %s running for user %s",
+               command, client->user);
+        server_send_error(client, ERROR_INTERNAL,
+                          "Too many instances of command running");
+        break;
+    default:
+        limits_user_ok = true;
+        limits_running = (cline->max_running > 0);
+        break;
+    }
+    free(command);
+    return (reply == LIMITS_OK);
+}
+
+
+/*
+ * Called in a child once a command allowed by server_limits_admit has
+ * finished, so that the parent stops counting it.
+ */
+void
+server_limits_release(void)
+{
+    struct limits_request request;
+
+    if (limits_control < 0 || !limits_running)
+        return;
+    memset(&request, 0, sizeof(request));
+    request.release = true;
+    if (send(limits_control, &request, sizeof(request), 0) < 0)
+        syswarn("cannot send release to parent");
+    limits_running = false;
+}
@@ -18,8 +18,12 @@
 #include <portable/gssapi.h>
 #include <portable/socket.h>
 
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <signal.h>
 #include <syslog.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 #include <time.h>
 
@@ -54,15 +58,26 @@ static const char usage_message[] = "\
 Usage: remctld <options>\n\
 \n\
 Options:\n\
+    -A <count>    Run <count> acceptor processes, only with -m\n\
     -d            Log verbose debugging information\n\
+    -e            Handle idle connections in one process, only with -m\n\
     -f <file>     Config file (default: " CONFIG_FILE ")\n\
     -h            Display this help\n\
+    -I <max>      Maximum simultaneous connections from one IP address\n\
+    -K            Load the keytab into memory once, only with -m\n\
+    -L <max>      Maximum simultaneous connections, only with -m\n\
+    -l <backlog>  Length of the listen queue (default: system maximum)\n\
     -m            Stand-alone daemon mode, meant mostly for testing\n\
+    -N            Don't look up client hostnames for REMOTE_HOST\n\
     -P <file>     Write PID to file, only useful with -m\n\
     -p <port>     Port to use, only for standalone mode (default: 4373)\n\
+    -R <count>    Recycle each pool worker after <count> connections\n\
     -S            Log to standard output/error rather than syslog\n\
     -s <service>  Service principal to use (default: host/<host>)\n\
+    -U <max>      Maximum simultaneous connections for one user\n\
     -v            Display the version of remctld\n\
+    -W <max>      Maximum number of pre-forked workers (default: minimum)\n\
+    -w <min>      Pre-fork a pool of at least <min> workers, only with -m\n\
 \n\
 Supported ACL methods: file, princ, deny";
 
@@ -72,11 +87,56 @@ struct options {
     bool standalone;
     bool log_stdout;
     bool debug;
+    bool event;
+    bool no_hostnames;
+    bool preload_keytab;
     unsigned short port;
     char *service;
     const char *config_path;
     const char *pid_path;
     struct vector *bindaddrs;
+    unsigned int pool_min;
+    unsigned int pool_max;
+    unsigned long pool_requests;
+    unsigned long max_children;
+    unsigned long max_per_ip;
+    unsigned long max_per_user;
+    int backlog;
+    unsigned int acceptors;
+};
+
+/* Default length of the listen queue for standalone mode. */
+#define LISTEN_BACKLOG SOMAXCONN
+
+/* The most acceptor processes that may be started with -A. */
+#define MAX_ACCEPTORS 1024
+
+/* The most workers that may be started with -w or -W. */
+#define MAX_POOL 1024
+
+/* How long a worker may sit idle before the pool shrinks. */
+#define POOL_IDLE_TIMEOUT 30
+
+/* Status message sent from a worker to the parent. */
+struct pool_status {
+    pid_t pid;
+    int busy;
+};
+
+/* Parent's view of a single worker. */
+struct pool_worker {
+    pid_t pid;
+    int control;                /* Write end of control pipe or -1. */
+    bool busy;
+    time_t idle_since;
+};
+
+/* The pool of workers as tracked by the parent. */
+struct pool {
+    struct pool_worker *workers;
+    size_t count;
+    size_t allocated;
+    int status[2];
 };
 
 
@@ -106,6 +166,27 @@ usage(int status)
 }
 
 
+/*
+ * Parse the numeric argument to a command-line option, dying with an error
+ * if it isn't a number between min and max inclusive.
+ */
+static unsigned long
+parse_number(const char *arg, int option, unsigned long min,
+             unsigned long max)
+{
+    char *end;
+    unsigned long value;
+
+    errno = 0;
+    value = strtoul(arg, &end, 10);
+    if (!isdigit((unsigned char) *arg) || *end != '\0' || errno != 0
+        || value < min || value > max)
+        die("invalid argument %s to -%c (must be between %lu and %lu)", arg,
+            option, min, max);
+    return value;
+}
+
+
 /*
  * Signal handler for child processes forked when running in standalone mode.
  * Just set the child_signaled global so that we know to reap the processes
@@ -142,6 +223,57 @@ exit_handler(int sig UNUSED)
 }
 
 
+/*
+ * The max-running limit is enforced by the parent process, which only tracks
+ * running commands in stand-alone mode with a child for each connection.
+ * Warn if the configuration sets it in any other mode, since it will be
+ * ignored.
+ */
+static void
+check_max_running(const struct options *options, const struct config *config)
+{
+    if (!config->max_running)
+        return;
+    if (options->standalone && !options->event && options->pool_min == 0)
+        return;
+    warn("max-running is only enforced with -m and without -e, -w, or -W;"
+         " ignoring it");
+}
+
+
+/*
+ * Re-read the configuration file after a SIGHUP.  Only files that have
+ * changed are parsed again.  The new configuration replaces the old one only
+ * if it loads successfully; otherwise, log the error and keep using the old
+ * one rather than exiting.  Returns true if the configuration was replaced.
+ */
+static bool
+server_reload(struct options *options, struct config **config)
+{
+    struct config *new;
+    struct timeval start, end;
+    unsigned long elapsed;
+
+    notice("re-reading configuration");
+    gettimeofday(&start, NULL);
+    new = server_config_load(options->config_path);
+    gettimeofday(&end, NULL);
+    if (new == NULL) {
+        warn("cannot load configuration file %s, keeping old configuration",
+             options->config_path);
+        return false;
+    }
+    elapsed = (end.tv_sec - start.tv_sec) * 1000
+        + (end.tv_usec - start.tv_usec) / 1000;
+    notice("configuration reloaded in %lums (%lu of %lu files changed)",
+           elapsed, (unsigned long) new->changed, (unsigned long) new->files);
+    check_max_running(options, new);
+    server_config_free(*config);
+    *config = new;
+    return true;
+}
+
+
 /*
  * Given a service name, imports it and acquires credentials for it, storing
  * them in the second argument.  Returns true on success and false on failure,
@@ -257,108 +389,517 @@ is_ipv6(const char *string UNUSED)
 
 
 /*
- * Run as a daemon.  This is the main dispatch loop, which listens for network
- * connections, forks a child to process each connection, and reaps the
- * children when they're done.  This is only used in standalone mode; when run
- * from inetd or tcpserver, remctld processes one connection and then exits.
+ * Pre-forked worker pool support.  When a minimum pool size is given, rather
+ * than forking a child for every connection, remctld forks a set of workers
+ * that each accept connections directly from the shared listening sockets
+ * and handle them in turn.
+ *
+ * Each worker reports when it becomes busy or idle by writing a pool_status
+ * message to a status pipe shared with the parent.  Each worker also holds
+ * the read end of its own control pipe; the parent retires a worker by
+ * closing the write end, which the worker sees as end of file the next time
+ * it is idle and waiting for a connection.  This lets busy workers finish
+ * their current connection before exiting.
+ */
+
+/*
+ * Send a status message from a worker to the parent.  Errors are only
+ * warned about since there's nothing else that the worker can do.
  */
 static void
-server_daemon(struct options *options, struct config *config,
-              gss_cred_id_t creds)
+pool_worker_status(int fd, bool busy)
 {
-    socket_type s;
-    unsigned int nfds, i;
-    socket_type *fds;
-    const char *addr;
-    pid_t child;
+    struct pool_status status;
+
+    memset(&status, 0, sizeof(status));
+    status.pid = getpid();
+    status.busy = busy;
+    if (write(fd, &status, sizeof(status)) != sizeof(status))
+        syswarn("cannot send status to parent");
+}
+
+
+/*
+ * Wait for and accept a new connection as a worker.  The listening sockets
+ * are non-blocking, since another worker may accept the connection first.
+ * Returns the new socket, or INVALID_SOCKET if the parent closed our control
+ * pipe and we should exit.
+ */
+static socket_type
+pool_worker_accept(socket_type fds[], unsigned int nfds, int control,
+                   struct sockaddr *addr, socklen_t *addrlen)
+{
+    struct pollfd *pfds;
+    socket_type s = INVALID_SOCKET;
+    socklen_t length;
+    unsigned int i;
     int status;
-    struct sigaction sa, oldsa;
+    char c;
+
+    /* The control pipe is last in the poll set. */
+    pfds = xcalloc(nfds + 1, sizeof(struct pollfd));
+    for (i = 0; i < nfds; i++) {
+        pfds[i].fd = fds[i];
+        pfds[i].events = POLLIN;
+    }
+    pfds[nfds].fd = control;
+    pfds[nfds].events = POLLIN;
+    while (s == INVALID_SOCKET) {
+        status = poll(pfds, nfds + 1, -1);
+        if (status < 0) {
+            if (errno == EINTR)
+                continue;
+            sysdie("worker poll failed");
+        }
+        if (pfds[nfds].revents != 0)
+            if (read(control, &c, 1) <= 0)
+                break;
+        for (i = 0; i < nfds; i++) {
+            if (pfds[i].revents == 0)
+                continue;
+            length = *addrlen;
+            s = accept(fds[i], addr, &length);
+            if (s != INVALID_SOCKET) {
+                *addrlen = length;
+                break;
+            }
+            if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+                sysdie("error accepting incoming connection");
+        }
+    }
+    free(pfds);
+    return s;
+}
+
+
+/*
+ * The main loop of a worker.  Accept connections and handle them until
+ * either the parent retires us or we've handled the maximum number of
+ * connections configured, and then exit.
+ */
+static void
+pool_worker_run(struct options *options, struct config *config,
+                gss_cred_id_t creds, socket_type fds[], unsigned int nfds,
+                int control, int status)
+{
+    socket_type s;
+    unsigned long handled = 0;
     struct sockaddr_storage ss;
     socklen_t sslen;
     char ip[INET6_ADDRSTRLEN];
-    FILE *pid_file;
 
-    /* Set up a SIGCHLD handler so that we know when to reap children. */
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = child_handler;
-    if (sigaction(SIGCHLD, &sa, &oldsa) < 0)
-        sysdie("cannot set SIGCHLD handler");
+    debug("worker %lu started", (unsigned long) getpid());
+    while (options->pool_requests == 0 || handled < options->pool_requests) {
+        sslen = sizeof(ss);
+        s = pool_worker_accept(fds, nfds, control, (struct sockaddr *) &ss,
+                               &sslen);
+        if (s == INVALID_SOCKET)
+            break;
+        pool_worker_status(status, true);
+        fdflag_nonblocking(s, false);
+        fdflag_close_exec(s, true);
+        network_sockaddr_sprint(ip, sizeof(ip), (struct sockaddr *) &ss);
+        debug("worker %lu handling connection from %s",
+              (unsigned long) getpid(), ip);
+        server_handle_connection(s, config, creds);
+        if (options->log_stdout)
+            fflush(stdout);
+        handled++;
+        pool_worker_status(status, false);
+    }
+    debug("worker %lu exiting after %lu connections",
+          (unsigned long) getpid(), handled);
+    exit(0);
+}
 
-    /* Set up exit handlers for signals that call for a clean shutdown. */
-    sa.sa_handler = exit_handler;
-    if (sigaction(SIGINT, &sa, NULL) < 0)
-        sysdie("cannot set SIGINT handler");
-    if (sigaction(SIGTERM, &sa, NULL) < 0)
-        sysdie("cannot set SIGTERM handler");
 
-    /* Set up a SIGHUP handler so that we know when to re-read our config. */
-    sa.sa_handler = config_handler;
-    if (sigaction(SIGHUP, &sa, NULL) < 0)
-        sysdie("cannot set SIGHUP handler");
+/*
+ * Fork a new worker and add it to the pool.  Returns true on success and
+ * false if the fork failed.
+ */
+static bool
+pool_spawn(struct pool *pool, struct options *options, struct config *config,
+           gss_cred_id_t creds, socket_type fds[], unsigned int nfds,
+           struct sigaction *oldsa)
+{
+    int control[2];
+    pid_t child;
+    size_t i;
+    struct pool_worker *worker;
+
+    if (pipe(control) < 0) {
+        syswarn("cannot create worker control pipe");
+        return false;
+    }
+    fdflag_close_exec(control[0], true);
+    fdflag_close_exec(control[1], true);
+    child = fork();
+    if (child < 0) {
+        syswarn("forking a new worker failed");
+        close(control[0]);
+        close(control[1]);
+        return false;
+    } else if (child == 0) {
+        close(control[1]);
+        close(pool->status[0]);
+        for (i = 0; i < pool->count; i++)
+            if (pool->workers[i].control >= 0)
+                close(pool->workers[i].control);
+        if (sigaction(SIGCHLD, oldsa, NULL) < 0)
+            syswarn("cannot reset SIGCHLD handler");
+        pool_worker_run(options, config, creds, fds, nfds, control[0],
+                        pool->status[1]);
+    }
+    close(control[0]);
+    if (pool->count == pool->allocated) {
+        pool->allocated = (pool->allocated == 0) ? 8 : pool->allocated * 2;
+        pool->workers = xrealloc(pool->workers,
+                                 pool->allocated * sizeof(*pool->workers));
+    }
+    worker = &pool->workers[pool->count++];
+    worker->pid = child;
+    worker->control = control[1];
+    worker->busy = false;
+    worker->idle_since = time(NULL);
+    debug("started worker %lu", (unsigned long) child);
+    return true;
+}
 
-    /* Log a starting message. */
-    notice("starting");
 
-    /* Bind to the network sockets and configure listening addresses. */
+/*
+ * Retire a worker by closing its control pipe.  It will exit the next time
+ * that it's waiting for a new connection.
+ */
+static void
+pool_retire(struct pool_worker *worker)
+{
+    if (worker->control < 0)
+        return;
+    close(worker->control);
+    worker->control = -1;
+}
+
+
+/*
+ * Find a worker by PID.  Returns NULL if the worker isn't known.
+ */
+static struct pool_worker *
+pool_find(struct pool *pool, pid_t pid)
+{
+    size_t i;
+
+    for (i = 0; i < pool->count; i++)
+        if (pool->workers[i].pid == pid)
+            return &pool->workers[i];
+    return NULL;
+}
+
+
+/*
+ * Reap any exited workers and remove them from the pool.
+ */
+static void
+pool_reap(struct pool *pool)
+{
+    pid_t child;
+    int status;
+    struct pool_worker *worker;
+
+    while ((child = waitpid(-1, &status, WNOHANG)) > 0) {
+        server_log_child(child, status);
+        worker = pool_find(pool, child);
+        if (worker == NULL)
+            continue;
+        pool_retire(worker);
+        *worker = pool->workers[--pool->count];
+    }
+    if (child < 0 && errno != ECHILD)
+        sysdie("waitpid failed");
+}
+
+
+/*
+ * Read all pending status messages from workers and update the pool.
+ */
+static void
+pool_read_status(struct pool *pool)
+{
+    struct pool_status status;
+    struct pool_worker *worker;
+    ssize_t got;
+
+    while ((got = read(pool->status[0], &status, sizeof(status))) > 0) {
+        if (got != sizeof(status)) {
+            warn("short status message from worker");
+            continue;
+        }
+        worker = pool_find(pool, status.pid);
+        if (worker == NULL)
+            continue;
+        worker->busy = status.busy;
+        if (!worker->busy)
+            worker->idle_since = time(NULL);
+    }
+    if (got < 0 && errno != EAGAIN && errno != EINTR)
+        sysdie("cannot read worker status");
+}
+
+
+/*
+ * Adjust the size of the pool based on utilization.  Retire workers that
+ * have been idle for longer than POOL_IDLE_TIMEOUT as long as we stay at or
+ * above the minimum pool size and keep at least one idle worker.  Then start
+ * new workers until we have the minimum and, if every worker is busy, one
+ * more idle worker as long as we're under the maximum.
+ */
+static void
+pool_adjust(struct pool *pool, struct options *options, struct config *config,
+            gss_cred_id_t creds, socket_type fds[], unsigned int nfds,
+            struct sigaction *oldsa)
+{
+    size_t i, active, idle;
+    struct pool_worker *worker;
+    time_t now;
+
+    now = time(NULL);
+    active = 0;
+    idle = 0;
+    for (i = 0; i < pool->count; i++) {
+        if (pool->workers[i].control < 0)
+            continue;
+        active++;
+        if (!pool->workers[i].busy)
+            idle++;
+    }
+    for (i = 0; i < pool->count; i++) {
+        worker = &pool->workers[i];
+        if (active <= options->pool_min || idle <= 1)
+            break;
+        if (worker->control < 0 || worker->busy)
+            continue;
+        if (now - worker->idle_since < POOL_IDLE_TIMEOUT)
+            continue;
+        debug("retiring idle worker %lu", (unsigned long) worker->pid);
+        pool_retire(worker);
+        active--;
+        idle--;
+    }
+    while (active < options->pool_min
+           || (idle == 0 && active < options->pool_max)) {
+        if (!pool_spawn(pool, options, config, creds, fds, nfds, oldsa)) {
+            warn("sleeping ten seconds in the hope we recover...");
+            sleep(10);
+            return;
+        }
+        active++;
+        idle++;
+    }
+}
+
+
+/*
+ * Run the pre-forked worker pool.  This replaces the normal fork-per-
+ * connection processing loop when a pool size was given.  The parent never
+ * accepts connections itself; it only maintains the pool, re-reads the
+ * configuration on SIGHUP (replacing all workers so that they pick up the
+ * new configuration), and exits on SIGINT or SIGTERM.  Workers are also
+ * replaced if a preloaded keytab is reloaded.  On exit, workers finish their
+ * current connection and then exit.
+ */
+static void
+server_pool(struct options *options, struct config *config,
+            gss_cred_id_t creds, socket_type fds[], unsigned int nfds,
+            struct sigaction *oldsa)
+{
+    struct pool pool;
+    unsigned int i;
+    size_t j;
+    struct pollfd pfd;
+    bool reload, retire;
+
+    memset(&pool, 0, sizeof(pool));
+    if (pipe(pool.status) < 0)
+        sysdie("cannot create worker status pipe");
+    fdflag_nonblocking(pool.status[0], true);
+    fdflag_close_exec(pool.status[0], true);
+    fdflag_close_exec(pool.status[1], true);
+    for (i = 0; i < nfds; i++) {
+        fdflag_nonblocking(fds[i], true);
+        fdflag_close_exec(fds[i], true);
+    }
+    notice("starting worker pool (minimum %u, maximum %u)",
+           options->pool_min, options->pool_max);
+
+    do {
+        if (child_signaled) {
+            child_signaled = 0;
+            pool_reap(&pool);
+        }
+        pool_read_status(&pool);
+        reload = false;
+        retire = false;
+        if (config_signaled) {
+            config_signaled = 0;
+            reload = true;
+            retire = server_reload(options, &config);
+        }
+        if (server_keytab_refresh(options->service, &creds, reload))
+            retire = true;
+        if (retire)
+            for (j = 0; j < pool.count; j++)
+                pool_retire(&pool.workers[j]);
+        if (exit_signaled) {
+            notice("signal received, exiting");
+            for (j = 0; j < pool.count; j++)
+                pool_retire(&pool.workers[j]);
+            if (options->pid_path != NULL)
+                unlink(options->pid_path);
+            exit(0);
+        }
+        pool_adjust(&pool, options, config, creds, fds, nfds, oldsa);
+
+        /*
+         * Wait for a status message from a worker.  Signals will normally
+         * interrupt the poll, but use a timeout so that we notice signals
+         * that arrive just before it and so that idle workers are retired.
+         */
+        pfd.fd = pool.status[0];
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 1000) < 0)
+            if (errno != EINTR)
+                sysdie("poll failed");
+    } while (1);
+}
+
+
+/*
+ * Run the multiplexed processing loop.  This replaces the normal
+ * fork-per-connection processing loop when -e was given.  All connections
+ * are handled by the event loop in this process, which forks children only
+ * to run commands.  Each time through the loop, reap children, re-read the
+ * configuration on SIGHUP, and exit on SIGINT or SIGTERM as in the normal
+ * processing loop.  Commands that are running when we exit will finish.
+ */
+static void
+server_multiplex(struct options *options, struct config *config,
+                 gss_cred_id_t creds, socket_type fds[], unsigned int nfds)
+{
+    struct event_loop *loop;
+    pid_t child;
+    int status;
+    bool reload;
+
+    loop = server_event_new(fds, nfds, creds);
+    notice("handling connections in a single process");
+    do {
+        if (child_signaled) {
+            child_signaled = 0;
+            while ((child = waitpid(-1, &status, WNOHANG)) > 0)
+                server_log_child(child, status);
+            if (child < 0 && errno != ECHILD)
+                sysdie("waitpid failed");
+        }
+        reload = false;
+        if (config_signaled) {
+            config_signaled = 0;
+            server_reload(options, &config);
+            reload = true;
+        }
+        if (server_keytab_refresh(options->service, &creds, reload))
+            server_event_set_creds(loop, creds);
+        if (exit_signaled) {
+            notice("signal received, exiting");
+            if (options->pid_path != NULL)
+                unlink(options->pid_path);
+            exit(0);
+        }
+        server_event_dispatch(loop, config, 1);
+    } while (1);
+}
+
+
+/*
+ * Bind the listening sockets for the configured addresses and port and start
+ * listening on them.  Stores the array of sockets in fds and its length in
+ * nfds.  Dies on failure.
+ */
+static void
+server_bind(struct options *options, socket_type **fds, unsigned int *nfds)
+{
+    unsigned int i;
+    const char *addr;
+
     if (options->bindaddrs->count == 0) {
-        nfds = 0;
-        network_bind_all(options->port, &fds, &nfds);
-        if (nfds == 0)
+        *nfds = 0;
+        network_bind_all(options->port, fds, nfds);
+        if (*nfds == 0)
             sysdie("cannot bind any sockets");
     } else {
-        nfds = options->bindaddrs->count;
-        fds = xmalloc(nfds * sizeof(socket_type));
+        *nfds = options->bindaddrs->count;
+        *fds = xmalloc(*nfds * sizeof(socket_type));
         for (i = 0; i < options->bindaddrs->count; i++) {
             addr = options->bindaddrs->strings[i];
             if (is_ipv6(addr))
-                fds[i] = network_bind_ipv6(addr, options->port);
+                (*fds)[i] = network_bind_ipv6(addr, options->port);
             else
-                fds[i] = network_bind_ipv4(addr, options->port);
-            if (fds[i] == INVALID_SOCKET)
+                (*fds)[i] = network_bind_ipv4(addr, options->port);
+            if ((*fds)[i] == INVALID_SOCKET)
                 sysdie("cannot bind to address %s", addr);
         }
     }
-    for (i = 0; i < nfds; i++)
-        if (listen(fds[i], 5) < 0)
-            sysdie("error listening on socket (fd %d)", fds[i]);
+    for (i = 0; i < *nfds; i++)
+        if (listen((*fds)[i], options->backlog) < 0)
+            sysdie("error listening on socket (fd %d)", (*fds)[i]);
+}
 
-    /*
-     * Set up our PID file now that we're ready to accept connections, so that
-     * the PID file isn't created until clients can connect.
-     */
-    if (options->pid_path != NULL) {
-        pid_file = fopen(options->pid_path, "w");
-        if (pid_file == NULL)
-            sysdie("cannot create PID file %s", options->pid_path);
-        fprintf(pid_file, "%ld\n", (long) getpid());
-        fclose(pid_file);
-    }
 
-    /*
-     * The main processing loop.  Each time through the loop, check to see if
-     * we need to reap children, check to see if we should re-read our
-     * configuration, and check to see if we're exiting.  Then see if we have
-     * a new connection, and if so, fork a child to handle it.
-     *
-     * Note that there are no limits here on the number of simultaneous
-     * processes, so you may want to set system resource limits to prevent an
-     * attacker from consuming all available processes.
-     */
+/*
+ * The main processing loop for a set of listening sockets.  If a worker pool
+ * or multiplexed connections were requested, hand off to the appropriate
+ * processing loop.  Otherwise, each time through the loop, check to see if
+ * we need to reap children, check to see if we should re-read our
+ * configuration, and check to see if we're exiting.  Then see if we have a
+ * new connection, and if so, fork a child to handle it.
+ *
+ * The number of simultaneous children is only limited if -L, -I, or -U were
+ * given or a command sets max-running, so you may want to set system
+ * resource limits to prevent an attacker from consuming all available
+ * processes.  See limits.c for how the limits are enforced.
+ */
+static void
+server_loop(struct options *options, struct config *config,
+            gss_cred_id_t creds, socket_type fds[], unsigned int nfds,
+            struct sigaction *oldsa)
+{
+    socket_type s;
+    unsigned int i;
+    pid_t child;
+    int status;
+    struct sockaddr_storage ss;
+    char ip[INET6_ADDRSTRLEN];
+    struct limits *limits;
+
+    if (options->pool_min > 0)
+        server_pool(options, config, creds, fds, nfds, oldsa);
+    if (options->event)
+        server_multiplex(options, config, creds, fds, nfds);
+
+    limits = server_limits_new(options->max_children, options->max_per_ip,
+                               options->max_per_user);
     do {
         if (child_signaled) {
             child_signaled = 0;
-            while ((child = waitpid(0, &status, WNOHANG)) > 0)
+            while ((child = waitpid(0, &status, WNOHANG)) > 0) {
                 server_log_child(child, status);
+                server_limits_remove(limits, child);
+            }
             if (child < 0 && errno != ECHILD)
                 sysdie("waitpid failed");
         }
         if (config_signaled) {
             config_signaled = 0;
-            notice("re-reading configuration");
-            server_config_free(config);
-            config = server_config_load(options->config_path);
-            if (config == NULL)
-                die("cannot load configuration file %s", options->config_path);
+            server_reload(options, &config);
+            server_keytab_refresh(options->service, &creds, true);
         }
         if (exit_signaled) {
             notice("signal received, exiting");
@@ -366,37 +907,225 @@ server_daemon(struct options *options, struct config *config,
                 unlink(options->pid_path);
             exit(0);
         }
-        sslen = sizeof(ss);
-        s = network_accept_any(fds, nfds, (struct sockaddr *) &ss, &sslen);
+        s = server_limits_accept(limits, fds, nfds, &ss);
         if (s == INVALID_SOCKET) {
             if (errno != EINTR)
                 sysdie("error accepting incoming connection");
             continue;
         }
         fdflag_close_exec(s, true);
+        network_sockaddr_sprint(ip, sizeof(ip), (struct sockaddr *) &ss);
+        if (!server_limits_permit(limits, ip)) {
+            notice("too many connections from %s, closing connection", ip);
+            close(s);
+            continue;
+        }
+        if (!server_limits_start(limits, config)) {
+            close(s);
+            continue;
+        }
+        server_config_groups_refresh();
+        server_keytab_refresh(options->service, &creds, false);
         child = fork();
         if (child < 0) {
             syswarn("forking a new child failed");
+            server_limits_add(limits, child, ip);
             warn("sleeping ten seconds in the hope we recover...");
             sleep(10);
         } else if (child == 0) {
             for (i = 0; i < nfds; i++)
                 close(fds[i]);
-            if (sigaction(SIGCHLD, &oldsa, NULL) < 0)
+            if (sigaction(SIGCHLD, oldsa, NULL) < 0)
                 syswarn("cannot reset SIGCHLD handler");
+            server_limits_child(limits);
             server_handle_connection(s, config, creds);
             if (options->log_stdout)
                 fflush(stdout);
             exit(0);
         } else {
             close(s);
-            network_sockaddr_sprint(ip, sizeof(ip), (struct sockaddr *) &ss);
+            server_limits_add(limits, child, ip);
             debug("child %lu for %s", (unsigned long) child, ip);
         }
     } while (1);
 }
 
 
+/*
+ * Fork acceptor n, which runs the normal processing loop on its own set of
+ * listening sockets.  Returns the PID of the acceptor, or 0 if the fork
+ * failed.
+ */
+static pid_t
+acceptor_spawn(struct options *options, struct config *config,
+               gss_cred_id_t creds, socket_type *fds[], unsigned int nfds[],
+               unsigned int n, struct sigaction *oldsa)
+{
+    pid_t child;
+    unsigned int i, j;
+
+    child = fork();
+    if (child < 0) {
+        syswarn("forking a new acceptor failed");
+        return 0;
+    } else if (child == 0) {
+        for (i = 0; i < options->acceptors; i++)
+            if (i != n)
+                for (j = 0; j < nfds[i]; j++)
+                    close(fds[i][j]);
+        options->pid_path = NULL;
+        child_signaled = 0;
+        config_signaled = 0;
+        debug("acceptor %u started", n);
+        server_loop(options, config, creds, fds[n], nfds[n], oldsa);
+    }
+    return child;
+}
+
+
+/*
+ * Run several acceptor processes, each with its own listening sockets bound
+ * with SO_REUSEPORT, so that the kernel spreads new connections across them.
+ * The parent keeps all of the sockets open so that it can replace an
+ * acceptor that exits without losing the connections queued for it.  On
+ * SIGHUP, the parent re-reads the configuration, so that replacement
+ * acceptors get the new configuration, and passes the signal on.  On SIGINT
+ * or SIGTERM, it stops all of the acceptors and exits.
+ */
+static void
+server_acceptors(struct options *options, struct config *config,
+                 gss_cred_id_t creds, socket_type *fds[], unsigned int nfds[],
+                 struct sigaction *oldsa)
+{
+    pid_t *pids;
+    pid_t child;
+    unsigned int i;
+    int status;
+
+    pids = xcalloc(options->acceptors, sizeof(pid_t));
+    notice("starting %u acceptors", options->acceptors);
+    do {
+        if (child_signaled) {
+            child_signaled = 0;
+            while ((child = waitpid(-1, &status, WNOHANG)) > 0) {
+                server_log_child(child, status);
+                for (i = 0; i < options->acceptors; i++)
+                    if (pids[i] == child)
+                        pids[i] = 0;
+            }
+            if (child < 0 && errno != ECHILD)
+                sysdie("waitpid failed");
+        }
+        if (config_signaled) {
+            config_signaled = 0;
+            server_keytab_refresh(options->service, &creds, true);
+            if (server_reload(options, &config))
+                for (i = 0; i < options->acceptors; i++)
+                    if (pids[i] > 0 && kill(pids[i], SIGHUP) < 0)
+                        syswarn("cannot signal acceptor %lu",
+                                (unsigned long) pids[i]);
+        }
+        if (exit_signaled) {
+            notice("signal received, exiting");
+            for (i = 0; i < options->acceptors; i++)
+                if (pids[i] > 0 && kill(pids[i], SIGTERM) < 0)
+                    syswarn("cannot signal acceptor %lu",
+                            (unsigned long) pids[i]);
+            if (options->pid_path != NULL)
+                unlink(options->pid_path);
+            exit(0);
+        }
+        for (i = 0; i < options->acceptors; i++)
+            if (pids[i] == 0) {
+                pids[i] = acceptor_spawn(options, config, creds, fds, nfds, i,
+                                         oldsa);
+                if (pids[i] == 0) {
+                    warn("sleeping ten seconds in the hope we recover...");
+                    sleep(10);
+                    break;
+                }
+            }
+
+        /*
+         * Wait for a signal.  Use a timeout so that we notice signals that
+         * arrive just before we start waiting.
+         */
+        sleep(1);
+    } while (1);
+}
+
+
+/*
+ * Run as a daemon.  Sets up signal handlers, binds the listening sockets,
+ * and writes the PID file, and then runs the processing loop, which listens
+ * for network connections, forks a child to process each connection, and
+ * reaps the children when they're done.  If several acceptors were
+ * requested, each gets its own listening sockets and processing loop.  This
+ * is only used in standalone mode; when run from inetd or tcpserver, remctld
+ * processes one connection and then exits.
+ */
+static void
+server_daemon(struct options *options, struct config *config,
+              gss_cred_id_t creds)
+{
+    unsigned int i;
+    socket_type **fds;
+    unsigned int *nfds;
+    struct sigaction sa, oldsa;
+    FILE *pid_file;
+
+    /* Set up a SIGCHLD handler so that we know when to reap children. */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = child_handler;
+    if (sigaction(SIGCHLD, &sa, &oldsa) < 0)
+        sysdie("cannot set SIGCHLD handler");
+
+    /* Set up exit handlers for signals that call for a clean shutdown. */
+    sa.sa_handler = exit_handler;
+    if (sigaction(SIGINT, &sa, NULL) < 0)
+        sysdie("cannot set SIGINT handler");
+    if (sigaction(SIGTERM, &sa, NULL) < 0)
+        sysdie("cannot set SIGTERM handler");
+
+    /* Set up a SIGHUP handler so that we know when to re-read our config. */
+    sa.sa_handler = config_handler;
+    if (sigaction(SIGHUP, &sa, NULL) < 0)
+        sysdie("cannot set SIGHUP handler");
+
+    /* Log a starting message. */
+    notice("starting");
+
+    /*
+     * Bind to the network sockets and configure listening addresses.  With
+     * multiple acceptors, each acceptor gets its own set of sockets.
+     */
+    if (options->acceptors > 1)
+        if (!network_bind_reuseport(true))
+            die("multiple acceptors are not supported on this platform");
+    fds = xcalloc(options->acceptors, sizeof(socket_type *));
+    nfds = xcalloc(options->acceptors, sizeof(unsigned int));
+    for (i = 0; i < options->acceptors; i++)
+        server_bind(options, &fds[i], &nfds[i]);
+
+    /*
+     * Set up our PID file now that we're ready to accept connections, so that
+     * the PID file isn't created until clients can connect.
+     */
+    if (options->pid_path != NULL) {
+        pid_file = fopen(options->pid_path, "w");
+        if (pid_file == NULL)
+            sysdie("cannot create PID file %s", options->pid_path);
+        fprintf(pid_file, "%ld\n", (long) getpid());
+        fclose(pid_file);
+    }
+
+    /* Hand off to the appropriate processing loop. */
+    if (options->acceptors > 1)
+        server_acceptors(options, config, creds, fds, nfds, &oldsa);
+    server_loop(options, config, creds, fds[0], nfds[0], &oldsa);
+}
+
+
 /*
  * Main routine.  Parses command-line arguments, determines whether we're
  * running in stand-alone or inetd mode, and does the connection handling if
@@ -429,16 +1158,29 @@ main(int argc, char *argv[])
     options.pid_path = NULL;
     options.config_path = CONFIG_FILE;
     options.bindaddrs = vector_new();
+    options.backlog = LISTEN_BACKLOG;
+    options.acceptors = 1;
 
     /* Parse options. */
-    while ((option = getopt(argc, argv, "b:dFf:hk:mP:p:Ss:v")) != EOF) {
+    while ((option = getopt(argc, argv, "A:b:deFf:hI:Kk:L:l:mN"
+                                        "P:p:R:Ss:U:vW:w:")) != EOF) {
         switch (option) {
+        case 'A':
+            options.acceptors = parse_number(optarg, option, 1, MAX_ACCEPTORS);
+            break;
         case 'b':
             vector_add(options.bindaddrs, optarg);
             break;
         case 'd':
             options.debug = true;
             break;
+        case 'e':
+#ifdef HAVE_EPOLL_CREATE1
+            options.event = true;
+#else
+            die("-e is not supported on this platform");
+#endif
+            break;
         case 'F':
             options.foreground = true;
             break;
@@ -448,29 +1190,57 @@ main(int argc, char *argv[])
         case 'h':
             usage(0);
             break;
+        case 'I':
+            options.max_per_ip = parse_number(optarg, option, 1, ULONG_MAX);
+            break;
+        case 'K':
+            options.preload_keytab = true;
+            break;
         case 'k':
             if (setenv("KRB5_KTNAME", optarg, 1) < 0)
                 sysdie("cannot set KRB5_KTNAME");
             break;
+        case 'L':
+            options.max_children = parse_number(optarg, option, 1, ULONG_MAX);
+            break;
+        case 'l':
+            options.backlog = parse_number(optarg, option, 1, INT_MAX);
+            break;
         case 'm':
             options.standalone = true;
             break;
+        case 'N':
+            options.no_hostnames = true;
+            break;
         case 'P':
             options.pid_path = optarg;
             break;
         case 'p':
             options.port = atoi(optarg);
             break;
+        case 'R':
+            options.pool_requests = parse_number(optarg, option, 0,
+                                                 ULONG_MAX);
+            break;
         case 'S':
             options.log_stdout = true;
             break;
         case 's':
             options.service = optarg;
             break;
+        case 'U':
+            options.max_per_user = parse_number(optarg, option, 1, ULONG_MAX);
+            break;
         case 'v':
             printf("remctld %s\n", PACKAGE_VERSION);
             exit(0);
             break;
+        case 'W':
+            options.pool_max = parse_number(optarg, option, 1, MAX_POOL);
+            break;
+        case 'w':
+            options.pool_min = parse_number(optarg, option, 1, MAX_POOL);
+            break;
         default:
             usage(1);
             break;
@@ -480,6 +1250,31 @@ main(int argc, char *argv[])
     /* Check arguments for consistency. */
     if (options.bindaddrs->count > 0 && !options.standalone)
         die("-b only makes sense in combination with -m");
+    if (options.pool_max > 0 && options.pool_min == 0)
+        options.pool_min = 1;
+    if (options.pool_min > 0 && !options.standalone)
+        die("-w and -W only make sense in combination with -m");
+    if (options.pool_requests > 0 && options.pool_min == 0)
+        die("-R only makes sense in combination with -w or -W");
+    if (options.pool_max == 0)
+        options.pool_max = options.pool_min;
+    if (options.pool_max < options.pool_min)
+        die("maximum pool size must be at least the minimum pool size");
+    if (options.event && !options.standalone)
+        die("-e only makes sense in combination with -m");
+    if (options.event && options.pool_min > 0)
+        die("-e cannot be combined with -w or -W");
+    if (options.acceptors > 1 && !options.standalone)
+        die("-A only makes sense in combination with -m");
+    if (options.preload_keytab && !options.standalone)
+        die("-K only makes sense in combination with -m");
+    if (options.max_children > 0 || options.max_per_ip > 0
+        || options.max_per_user > 0) {
+        if (!options.standalone)
+            die("-L, -I, and -U only make sense in combination with -m");
+        if (options.event || options.pool_min > 0)
+            die("-L, -I, and -U cannot be combined with -e, -w, or -W");
+    }
 
     /* Daemonize if told to do so. */
     if (options.standalone && !options.foreground)
@@ -502,18 +1297,39 @@ main(int argc, char *argv[])
             message_handlers_debug(1, message_log_syslog_debug);
     }
 
-    /* Read the configuration file. */
+    /*
+     * Read the configuration file.  In stand-alone mode, it's used for many
+     * connections, so parse everything it references up front.
+     */
+    if (options.standalone)
+        server_config_preload();
     config = server_config_load(options.config_path);
     if (config == NULL)
         die("cannot read configuration file %s", options.config_path);
+    check_max_running(&options, config);
+
+    /*
+     * Client hostnames are looked up when a command needs them.  In
+     * stand-alone mode, set up the cache of lookups now so that it's shared
+     * by all of the children.
+     */
+    if (options.no_hostnames)
+        server_hostname_disable();
+    else if (options.standalone)
+        server_hostname_cache();
 
     /*
      * If a service was specified, we should load only those credentials since
      * those are the only ones we're allowed to use.  Otherwise, creds will
      * keep its default value of GSS_C_NO_CREDENTIAL, which means support
-     * anything that's in the keytab.
+     * anything that's in the keytab.  If the keytab is to be preloaded,
+     * acquire credentials from an in-memory copy of it instead, limited to
+     * the service if one was specified.
      */
-    if (options.service != NULL) {
+    if (options.preload_keytab) {
+        if (!server_keytab_load(options.service, &creds))
+            die("unable to preload keytab, aborting");
+    } else if (options.service != NULL) {
         if (!acquire_creds(options.service, &creds))
             die("unable to acquire creds, aborting");
     }
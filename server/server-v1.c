@@ -54,7 +54,7 @@ server_v1_send_output(struct client *client, int exit_status)
     
     /* Send the token. */
     status = token_send_priv(client->fd, client->context, TOKEN_DATA, &token,
-                             TIMEOUT, &major, &minor);
+                             client->timeout, &major, &minor);
     if (status != TOKEN_OK) {
         warn_token("sending output token", status, major, minor);
         free(token.value);
@@ -104,14 +104,17 @@ server_v1_handle_messages(struct client *client, struct config *config)
      * code for v2 (v2 just pulls more data off the front of the token first).
      */
     argv = server_parse_command(client, token.value, token.length);
-    gss_release_buffer(&minor, &token);
-    if (argv == NULL)
+    if (argv == NULL) {
+        gss_release_buffer(&minor, &token);
         return;
+    }
 
     /*
      * Check the ACL and existence of the command, run the command if
-     * possible, and accumulate the output in the client struct.
+     * possible, and accumulate the output in the client struct.  argv points
+     * into the token, so it has to be kept until we're done.
      */
     server_run_command(client, config, argv);
     server_free_command(argv);
+    gss_release_buffer(&minor, &token);
 }
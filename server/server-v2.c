@@ -22,52 +22,120 @@
 #include <util/messages.h>
 #include <util/xmalloc.h>
 
+/* Size of the header of an output token (version, type, stream, length). */
+#define OUTPUT_HEADER_SIZE (1 + 1 + 1 + 4)
+
 
 /*
- * Given the client struct and the stream number the data is from, send a
- * protocol v2 output token to the client containing the data stored in the
- * buffer in the client struct.  Returns true on success, false on failure
- * (and logs a message on failure).
+ * Return the buffer used to wrap output tokens for a client, allocating it
+ * if necessary.  It's kept for the life of the connection.
+ */
+static struct token_wrap_buffer *
+server_v2_sendbuf(struct client *client)
+{
+    if (client->sendbuf == NULL) {
+        client->sendbuf = token_wrap_buffer_new();
+        if (client->sendbuf == NULL)
+            sysdie("cannot allocate token buffer");
+    }
+    return client->sendbuf;
+}
+
+
+/*
+ * Fill in the header of a protocol v2 output token in the provided buffer,
+ * which must have room for OUTPUT_HEADER_SIZE bytes.
+ */
+static void
+server_v2_output_header(char *header, int stream, size_t length)
+{
+    OM_uint32 tmp;
+
+    header[0] = 2;
+    header[1] = MESSAGE_OUTPUT;
+    header[2] = stream;
+    tmp = htonl(length);
+    memcpy(header + 3, &tmp, 4);
+}
+
+
+/*
+ * Given the client struct, the stream number the data is from, and the data
+ * and its length, send a protocol v2 output token to the client containing
+ * that data.  Returns true on success, false on failure (and logs a message
+ * on failure).
  */
 bool
-server_v2_send_output(struct client *client, int stream)
+server_v2_send_output(struct client *client, int stream, const char *data,
+                      size_t length)
 {
-    gss_buffer_desc token;
-    char *p;
-    OM_uint32 tmp, major, minor;
+    char header[OUTPUT_HEADER_SIZE];
+    struct iovec iov[2];
+    OM_uint32 major, minor;
     int status;
 
-    /* Allocate room for the total message. */
-    token.length = 1 + 1 + 1 + 4 + client->outlen;
-    token.value = xmalloc(token.length);
+    /* The data follows the header directly from the caller's buffer. */
+    server_v2_output_header(header, stream, length);
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (char *) data;
+    iov[1].iov_len = length;
+    status = token_send_priv_iov(client->fd, server_v2_sendbuf(client),
+                                 client->context, TOKEN_DATA | TOKEN_PROTOCOL,
+                                 iov, 2, client->timeout, &major, &minor);
+    if (status != TOKEN_OK) {
+        warn_token("sending output token", status, major, minor);
+        client->fatal = true;
+        return false;
+    }
+    return true;
+}
 
-    /*
-     * Fill in the header (version, type, stream, length, and data) and then
-     * the data.
-     */
-    p = token.value;
-    *p = 2;
-    p++;
-    *p = MESSAGE_OUTPUT;
-    p++;
-    *p = stream;
-    p++;
-    tmp = htonl(client->outlen);
-    memcpy(p, &tmp, 4);
-    p += 4;
-    memcpy(p, client->output, client->outlen);
 
-    /* Send the token. */
-    status = token_send_priv(client->fd, client->context,
-                             TOKEN_DATA | TOKEN_PROTOCOL, &token, TIMEOUT,
-                             &major, &minor);
+/*
+ * Return a pointer to a buffer with room for MAXBUFFER bytes of output.  The
+ * buffer is placed so that output stored in it can be sent with
+ * server_v2_send_prepared_output and wrapped where it is, without copying
+ * it.  The buffer is only valid until the next output is sent.
+ */
+char *
+server_v2_prepare_output(struct client *client)
+{
+    char *data;
+
+    data = token_wrap_buffer_prepare(server_v2_sendbuf(client),
+                                     client->context,
+                                     OUTPUT_HEADER_SIZE + MAXBUFFER);
+    if (data == NULL)
+        sysdie("cannot allocate token buffer");
+    return data + OUTPUT_HEADER_SIZE;
+}
+
+
+/*
+ * Given the client struct, the stream number the data is from, the buffer
+ * returned by server_v2_prepare_output, and the length of the output stored
+ * in it, send a protocol v2 output token to the client containing that data.
+ * Returns true on success, false on failure (and logs a message on failure).
+ */
+bool
+server_v2_send_prepared_output(struct client *client, int stream,
+                               char *output, size_t length)
+{
+    OM_uint32 major, minor;
+    int status;
+
+    server_v2_output_header(output - OUTPUT_HEADER_SIZE, stream, length);
+    status = token_send_priv_prepared(client->fd, client->sendbuf,
+                                      client->context,
+                                      TOKEN_DATA | TOKEN_PROTOCOL,
+                                      OUTPUT_HEADER_SIZE + length,
+                                      client->timeout, &major, &minor);
     if (status != TOKEN_OK) {
         warn_token("sending output token", status, major, minor);
-        free(token.value);
         client->fatal = true;
         return false;
     }
-    free(token.value);
     return true;
 }
 
@@ -94,8 +162,8 @@ server_v2_send_status(struct client *client, int exit_status)
 
     /* Send the token. */
     status = token_send_priv(client->fd, client->context,
-                             TOKEN_DATA | TOKEN_PROTOCOL, &token, TIMEOUT,
-                             &major, &minor);
+                             TOKEN_DATA | TOKEN_PROTOCOL, &token,
+                             client->timeout, &major, &minor);
     if (status != TOKEN_OK) {
         warn_token("sending status token", status, major, minor);
         client->fatal = true;
@@ -137,8 +205,8 @@ server_v2_send_error(struct client *client, enum error_codes code,
 
     /* Send the token. */
     status = token_send_priv(client->fd, client->context,
-                             TOKEN_DATA | TOKEN_PROTOCOL, &token, TIMEOUT,
-                             &major, &minor);
+                             TOKEN_DATA | TOKEN_PROTOCOL, &token,
+                             client->timeout, &major, &minor);
     if (status != TOKEN_OK) {
         warn_token("sending error token", status, major, minor);
         free(token.value);
@@ -172,8 +240,8 @@ server_v2_send_version(struct client *client)
 
     /* Send the token. */
     status = token_send_priv(client->fd, client->context,
-                             TOKEN_DATA | TOKEN_PROTOCOL, &token, TIMEOUT,
-                             &major, &minor);
+                             TOKEN_DATA | TOKEN_PROTOCOL, &token,
+                             client->timeout, &major, &minor);
     if (status != TOKEN_OK) {
         warn_token("sending version token", status, major, minor);
         client->fatal = true;
@@ -204,8 +272,8 @@ server_v3_send_noop(struct client *client)
 
     /* Send the token. */
     status = token_send_priv(client->fd, client->context,
-                             TOKEN_DATA | TOKEN_PROTOCOL, &token, TIMEOUT,
-                             &major, &minor);
+                             TOKEN_DATA | TOKEN_PROTOCOL, &token,
+                             client->timeout, &major, &minor);
     if (status != TOKEN_OK) {
         warn_token("sending no-op token", status, major, minor);
         client->fatal = true;
@@ -227,8 +295,10 @@ server_v2_read_token(struct client *client, gss_buffer_t token)
     OM_uint32 major, minor;
     int status, flags;
     
-    status = token_recv_priv(client->fd, client->context, &flags, token,
-                             TOKEN_MAX_LENGTH, TIMEOUT, &major, &minor);
+    status = token_recv_priv_buffered(client->fd, client->buffer,
+                                      client->context, &flags, token,
+                                      TOKEN_MAX_LENGTH, TIMEOUT, &major,
+                                      &minor);
     if (status != TOKEN_OK) {
         warn_token("receiving token", status, major, minor);
         if (status != TOKEN_FAIL_EOF && status != TOKEN_FAIL_SOCKET)
@@ -362,14 +432,20 @@ server_v2_handle_command(struct client *client, struct config *config,
      * multiple tokens.  Now we can parse it.
      */
     argv = server_parse_command(client, buffer, total);
-    if (allocated)
-        free(buffer);
-    if (argv == NULL)
+    if (argv == NULL) {
+        if (allocated)
+            free(buffer);
         return !client->fatal;
+    }
 
-    /* We have a command.  Now do the heavy lifting. */
+    /*
+     * We have a command.  Now do the heavy lifting.  argv points into
+     * buffer, so it can't be freed until we're done.
+     */
     server_run_command(client, config, argv);
     server_free_command(argv);
+    if (allocated)
+        free(buffer);
     return !client->fatal;
 
 fail:
@@ -386,7 +462,7 @@ fail:
  * without keep-alive, or QUIT was received and we should stop processing
  * tokens.
  */
-static bool
+bool
 server_v2_handle_token(struct client *client, struct config *config,
                        gss_buffer_t token)
 {
@@ -432,7 +508,14 @@ server_v2_handle_messages(struct client *client, struct config *config)
     OM_uint32 minor;
     int status;
 
-    /* Loop receiving messages until we're finished. */
+    /*
+     * Loop receiving messages until we're finished.  Since this process
+     * handles everything the client sends from here on, tokens can be read
+     * through a read-ahead buffer.  If it can't be allocated, just read
+     * without one.
+     */
+    if (client->buffer == NULL)
+        client->buffer = token_buffer_new();
     client->keepalive = true;
     do {
         status = server_v2_read_token(client, &token);
@@ -0,0 +1,159 @@
+/*
+ * Test suite for the non-blocking client interface.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/remctl.h>
+
+
+/*
+ * Wait for the socket to be ready for the events the library wants.  Returns
+ * true on success and false if poll fails or there's nothing to wait for.
+ */
+static bool
+wait_events(struct remctl *r)
+{
+    struct pollfd pfd;
+    int events;
+
+    events = remctl_events(r);
+    if (remctl_fd(r) < 0 || events == 0)
+        return false;
+    pfd.fd = remctl_fd(r);
+    pfd.events = 0;
+    if (events & REMCTL_EVENT_READ)
+        pfd.events |= POLLIN;
+    if (events & REMCTL_EVENT_WRITE)
+        pfd.events |= POLLOUT;
+    return poll(&pfd, 1, 10 * 1000) > 0;
+}
+
+
+/*
+ * Finish opening a connection started with remctl_open_start, waiting on the
+ * socket between steps.
+ */
+static enum remctl_async_status
+open_finish(struct remctl *r)
+{
+    enum remctl_async_status status;
+
+    while ((status = remctl_open_try(r)) == REMCTL_ASYNC_PENDING)
+        if (!wait_events(r))
+            return REMCTL_ASYNC_ERROR;
+    return status;
+}
+
+
+/*
+ * Get the next output without blocking, waiting on the socket between
+ * attempts.  Returns NULL on failure.
+ */
+static struct remctl_output *
+output_next(struct remctl *r)
+{
+    struct remctl_output *output;
+    enum remctl_async_status status;
+
+    while ((status = remctl_output_try(r, &output)) == REMCTL_ASYNC_PENDING)
+        if (!wait_events(r))
+            return NULL;
+    return (status == REMCTL_ASYNC_DONE) ? output : NULL;
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct remctl *r;
+    struct remctl_output *output;
+    struct iovec command[2];
+    const char *test[] = { "test", "test", NULL };
+    const char *streaming[] = { "test", "streaming", NULL };
+    size_t outputs = 0;
+    bool okay;
+
+    /* Set up Kerberos and remctld. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+    remctld_start(config, "data/conf-simple", (char *) 0);
+
+    plan(19);
+
+    /* Open a connection without blocking. */
+    r = remctl_new();
+    ok(r != NULL, "remctl_new");
+    is_int(-1, remctl_fd(r), "remctl_fd with no connection");
+    ok(remctl_open_start(r, "localhost", 14373, config->principal),
+       "remctl_open_start");
+    ok(remctl_fd(r) >= 0, "...and remctl_fd returns a descriptor");
+    ok(remctl_events(r) != 0, "...and remctl_events returns events");
+    is_int(REMCTL_ASYNC_DONE, open_finish(r), "remctl_open_try");
+    is_string("no error", remctl_error(r), "...with no error");
+
+    /* Run a command with streaming output without blocking. */
+    ok(remctl_command_start(r, streaming), "remctl_command_start");
+    okay = true;
+    do {
+        output = output_next(r);
+        if (output == NULL || output->type != REMCTL_OUT_OUTPUT)
+            break;
+        outputs++;
+        if (outputs == 2 && output->stream != 2)
+            okay = false;
+        if (outputs != 2 && output->stream != 1)
+            okay = false;
+    } while (1);
+    ok(okay && outputs == 3, "...and remctl_output_try returns the output");
+    ok(output != NULL && output->type == REMCTL_OUT_STATUS
+       && output->status == 0, "...and the status");
+    is_int(0, remctl_events(r), "...and then isn't waiting");
+
+    /* The blocking functions can be mixed with the non-blocking ones. */
+    command[0].iov_base = (char *) "test";
+    command[0].iov_len = 4;
+    command[1].iov_base = (char *) "test";
+    command[1].iov_len = 4;
+    ok(remctl_commandv_start(r, command, 2), "remctl_commandv_start");
+    output = remctl_output(r);
+    ok(output != NULL && output->type == REMCTL_OUT_OUTPUT
+       && output->length == 12
+       && memcmp("hello world\n", output->data, 12) == 0,
+       "...and remctl_output returns the output");
+    remctl_close(r);
+
+    /* And a connection opened with remctl_open can be used as well. */
+    r = remctl_new();
+    if (!remctl_open(r, "localhost", 14373, config->principal))
+        bail("cannot open connection: %s", remctl_error(r));
+    ok(remctl_command_start(r, test),
+       "remctl_command_start after remctl_open");
+    output = output_next(r);
+    ok(output != NULL && output->type == REMCTL_OUT_OUTPUT
+       && output->length == 12
+       && memcmp("hello world\n", output->data, 12) == 0,
+       "...and remctl_output_try returns the output");
+    remctl_close(r);
+
+    /* Check errors. */
+    r = remctl_new();
+    okay = remctl_open_start(r, "localhost", 14445, config->principal);
+    ok(!okay || open_finish(r) == REMCTL_ASYNC_ERROR,
+       "remctl_open_start to a refused port fails");
+    ok(strncmp(remctl_error(r), "cannot connect to localhost (port 14445)",
+               strlen("cannot connect to localhost (port 14445)")) == 0,
+       "...with the right error");
+    ok(!remctl_command_start(r, test), "remctl_command_start without open");
+    is_string("no connection open", remctl_error(r), "...with error");
+    remctl_close(r);
+
+    return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * Test suite for running commands on many hosts in parallel.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/remctl.h>
+#include <util/protocol.h>
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct remctl_multi *multi;
+    struct remctl_result *result;
+    struct remctl_output *output;
+    const char *test[] = { "test", "test", NULL };
+    const char *error[] = { "test", "bad-command", NULL };
+    size_t i, index;
+    size_t outputs[3] = { 0, 0, 0 };
+    bool okay;
+
+    /* Set up Kerberos and remctld. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+    remctld_start(config, "data/conf-simple", (char *) 0);
+
+    plan(21);
+
+    /* Two working hosts and one that refuses connections. */
+    multi = remctl_multi_new();
+    ok(multi != NULL, "remctl_multi_new");
+    ok(remctl_multi_add(multi, "localhost", 14373, config->principal),
+       "remctl_multi_add");
+    ok(remctl_multi_add(multi, "127.0.0.1", 14373, config->principal),
+       "...second host");
+    ok(remctl_multi_add(multi, "localhost", 14445, config->principal),
+       "...third host");
+    is_string("127.0.0.1", remctl_multi_host(multi, 1), "remctl_multi_host");
+    ok(remctl_multi_host(multi, 3) == NULL, "...with an invalid index");
+    ok(remctl_multi_result(multi, 0) == NULL,
+       "No results before remctl_multi_run");
+
+    /* Run a command everywhere and check the results. */
+    ok(remctl_multi_command(multi, test), "remctl_multi_command");
+    ok(remctl_multi_run(multi), "remctl_multi_run");
+    for (i = 0; i < 2; i++) {
+        result = remctl_multi_result(multi, i);
+        ok(result != NULL && result->error == NULL && result->status == 0
+           && result->stdout_len == 12
+           && memcmp("hello world\n", result->stdout_buf, 12) == 0,
+           "...result for host %lu", (unsigned long) i);
+    }
+    result = remctl_multi_result(multi, 2);
+    ok(result != NULL && result->error != NULL
+       && strncmp(result->error, "cannot connect to localhost",
+                  strlen("cannot connect to localhost")) == 0,
+       "...and the refused host has an error");
+
+    /* Now retrieve the output as it arrives, one host at a time. */
+    ok(remctl_multi_set_parallel(multi, 1), "remctl_multi_set_parallel");
+    ok(remctl_multi_command(multi, error), "remctl_multi_command again");
+    okay = true;
+    do {
+        output = remctl_multi_output(multi, &index);
+        if (output == NULL || output->type == REMCTL_OUT_DONE)
+            break;
+        if (index > 2 || output->type != REMCTL_OUT_ERROR) {
+            okay = false;
+            continue;
+        }
+        outputs[index]++;
+        if (index < 2 && output->error != ERROR_UNKNOWN_COMMAND)
+            okay = false;
+        if (index == 2 && output->error != 0)
+            okay = false;
+    } while (1);
+    ok(output != NULL, "remctl_multi_output");
+    ok(okay, "...with the right errors");
+    ok(outputs[0] == 1 && outputs[1] == 1 && outputs[2] == 1,
+       "...and one for each host");
+    ok(remctl_multi_result(multi, 0) == NULL,
+       "...and old results are discarded");
+    output = remctl_multi_output(multi, &index);
+    ok(output != NULL && output->type == REMCTL_OUT_DONE,
+       "...and done once finished");
+    remctl_multi_free(multi);
+
+    /* Check errors for the multi struct itself. */
+    multi = remctl_multi_new();
+    ok(remctl_multi_output(multi, &index) == NULL,
+       "remctl_multi_output without a command fails");
+    is_string("no command given", remctl_multi_error(multi), "...with error");
+    remctl_multi_free(multi);
+
+    return 0;
+}
@@ -0,0 +1,241 @@
+/*
+ * Test suite for remctl connection pools.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+#include <portable/gssapi.h>
+#include <portable/socket.h>
+
+#include <sys/wait.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/remctl.h>
+#include <util/gss-tokens.h>
+#include <util/messages.h>
+#include <util/protocol.h>
+#include <util/tokens.h>
+
+
+/*
+ * Check that a result is the successful output of the test test command.
+ */
+static void
+is_hello(struct remctl_result *result, const char *message)
+{
+    ok(result != NULL && result->error == NULL && result->status == 0
+       && result->stdout_len == 12
+       && memcmp("hello world\n", result->stdout_buf, 12) == 0,
+       "%s", message);
+}
+
+
+/*
+ * The die handler function set by serve_without_noop so that it will exit
+ * with _exit and not exit on errors and not run the cleanup functions.
+ */
+static int
+exit_child(void)
+{
+    _exit(1);
+}
+
+
+/*
+ * Accept a single connection on the given listening socket and act like a
+ * remctl server that only speaks protocol version 2: answer NOOP with a
+ * version message and every command with the output of the test test
+ * command.  Run in a subprocess and exits when the client quits.
+ */
+static void
+serve_without_noop(socket_type s)
+{
+    socket_type conn;
+    int flags;
+    gss_buffer_desc send_tok, recv_tok;
+    OM_uint32 major, minor, code;
+    gss_ctx_id_t context;
+    gss_name_t client;
+    gss_OID doid;
+    char version[3] = { 2, MESSAGE_VERSION, 2 };
+    char output[7 + 12] = { 2, MESSAGE_OUTPUT, 1 };
+    char status[3] = { 2, MESSAGE_STATUS, 0 };
+    const char *p;
+
+    /* Set up the exit handler so that we don't call exit. */
+    message_fatal_cleanup = exit_child;
+
+    /* Accept one connection and then stop listening. */
+    conn = accept(s, NULL, 0);
+    if (conn == INVALID_SOCKET)
+        sysdie("error accepting connection");
+    socket_close(s);
+
+    /* Do the context negotiation. */
+    if (token_recv(conn, &flags, &recv_tok, 64 * 1024, 0) != TOKEN_OK)
+        die("cannot recv initial token");
+    context = GSS_C_NO_CONTEXT;
+    do {
+        if (token_recv(conn, &flags, &recv_tok, 64 * 1024, 0) != TOKEN_OK)
+            die("cannot recv subsequent token");
+        major = gss_accept_sec_context(&minor, &context, GSS_C_NO_CREDENTIAL,
+                       &recv_tok, GSS_C_NO_CHANNEL_BINDINGS, &client, &doid,
+                       &send_tok, NULL, NULL, NULL);
+        if (major != GSS_S_COMPLETE && major != GSS_S_CONTINUE_NEEDED)
+            die("GSS-API failure: %ld %ld\n", (long) major, (long) minor);
+        gss_release_buffer(&minor, &recv_tok);
+        if (send_tok.length != 0) {
+            flags = TOKEN_CONTEXT | TOKEN_PROTOCOL;
+            if (token_send(conn, flags, &send_tok, 0) != TOKEN_OK)
+                die("cannot send subsequent token");
+            gss_release_buffer(&minor, &send_tok);
+        }
+    } while (major == GSS_S_CONTINUE_NEEDED);
+
+    /* Answer messages until the client quits or goes away. */
+    code = htonl(12);
+    memcpy(output + 3, &code, 4);
+    memcpy(output + 7, "hello world\n", 12);
+    while (token_recv_priv(conn, context, &flags, &recv_tok, 64 * 1024, 0,
+                           &major, &minor) == TOKEN_OK) {
+        p = recv_tok.value;
+        if (recv_tok.length < 2 || p[1] == MESSAGE_QUIT)
+            break;
+        if (p[0] != 2) {
+            send_tok.value = version;
+            send_tok.length = sizeof(version);
+        } else {
+            send_tok.value = output;
+            send_tok.length = sizeof(output);
+            if (token_send_priv(conn, context, TOKEN_DATA | TOKEN_PROTOCOL,
+                                &send_tok, 0, &major, &minor) != TOKEN_OK)
+                die("cannot send output token");
+            send_tok.value = status;
+            send_tok.length = sizeof(status);
+        }
+        if (token_send_priv(conn, context, TOKEN_DATA | TOKEN_PROTOCOL,
+                            &send_tok, 0, &major, &minor) != TOKEN_OK)
+            die("cannot send reply token");
+        gss_release_buffer(&minor, &recv_tok);
+    }
+    socket_close(conn);
+    _exit(0);
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct remctl_pool *pool, *shortpool;
+    struct remctl_result *result;
+    const char *test[] = { "test", "test", NULL };
+    const char *error[] = { "test", "bad-command", NULL };
+    struct sockaddr_in saddr;
+    socket_type s;
+    int on = 1;
+    const void *onaddr = &on;
+    pid_t child;
+
+    /* Set up Kerberos and remctld. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+    remctld_start(config, "data/conf-simple", (char *) 0);
+
+    plan(12);
+
+    /* Run commands through a pool that never expires connections. */
+    pool = remctl_pool_new(0);
+    ok(pool != NULL, "remctl_pool_new");
+    result = remctl_pool_command(pool, "localhost", 14373, config->principal,
+                                 test);
+    is_hello(result, "remctl_pool_command");
+    remctl_result_free(result);
+    result = remctl_pool_command(pool, "localhost", 14373, config->principal,
+                                 error);
+    ok(result != NULL, "remctl_pool_command with error works");
+    if (result == NULL || result->error == NULL)
+        ok(0, "...and the right error string");
+    else
+        is_string("Unknown command", result->error,
+                  "...and the right error string");
+    remctl_result_free(result);
+
+    /* And through a pool that expires connections after a second. */
+    shortpool = remctl_pool_new(1);
+    result = remctl_pool_command(shortpool, "localhost", 14373,
+                                 config->principal, test);
+    is_hello(result, "remctl_pool_command with short idle timeout");
+    remctl_result_free(result);
+
+    /*
+     * Stop the server.  The children handling our pooled connections keep
+     * running, but new connections will be refused, so commands only work if
+     * the pool reuses its connection.
+     */
+    remctld_stop();
+    sleep(2);
+    result = remctl_pool_command(pool, "localhost", 14373, config->principal,
+                                 test);
+    is_hello(result, "remctl_pool_command reuses the connection");
+    remctl_result_free(result);
+    result = remctl_pool_command(shortpool, "localhost", 14373,
+                                 config->principal, test);
+    ok(result != NULL && result->error != NULL,
+       "...but not after it expired");
+    remctl_result_free(result);
+    remctl_pool_free(shortpool);
+
+    /* The simple interface uses the pool once it's set. */
+    remctl_set_pool(pool);
+    result = remctl("localhost", 14373, config->principal, test);
+    is_hello(result, "remctl uses the pool");
+    remctl_result_free(result);
+    remctl_pool_free(pool);
+    result = remctl("localhost", 14373, config->principal, test);
+    ok(result != NULL && result->error != NULL,
+       "...and stops once the pool is freed");
+    remctl_result_free(result);
+
+    /* remctl_pool_new rejects negative timeouts. */
+    ok(remctl_pool_new(-1) == NULL, "remctl_pool_new with negative timeout");
+
+    /*
+     * Connections to a server that doesn't support NOOP are still reused.
+     * The fake server only accepts one connection, so the second command
+     * only works if the pool keeps the connection after the failed check.
+     */
+    saddr.sin_family = AF_INET;
+    saddr.sin_port = htons(14374);
+    saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s == INVALID_SOCKET)
+        sysbail("error creating socket");
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, onaddr, sizeof(on));
+    if (bind(s, (struct sockaddr *) &saddr, sizeof(saddr)) < 0)
+        sysbail("error binding socket");
+    if (listen(s, 1) < 0)
+        sysbail("error listening to socket");
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0)
+        serve_without_noop(s);
+    socket_close(s);
+    pool = remctl_pool_new(0);
+    result = remctl_pool_command(pool, "127.0.0.1", 14374, config->principal,
+                                 test);
+    is_hello(result, "remctl_pool_command to server without NOOP");
+    remctl_result_free(result);
+    result = remctl_pool_command(pool, "127.0.0.1", 14374, config->principal,
+                                 test);
+    is_hello(result, "...and the connection is reused");
+    remctl_result_free(result);
+    remctl_pool_free(pool);
+    waitpid(child, NULL, 0);
+
+    return 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * Small C program to write short chunks of output with a delay between them.
+ * Takes the number of chunks and the delay in milliseconds as its last two
+ * arguments.  Each chunk is written separately, so that remctld sees each
+ * one as a separate read unless it coalesces the output.  Used to test
+ * coalescing of command output.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#ifdef HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
+#include <sys/time.h>
+
+
+int
+main(int argc, char *argv[])
+{
+    struct timeval tv;
+    long count, delay, i;
+
+    if (argc < 3)
+        return 1;
+    count = atol(argv[argc - 2]);
+    delay = atol(argv[argc - 1]);
+    for (i = 0; i < count; i++) {
+        if (i > 0 && delay > 0) {
+            tv.tv_sec = delay / 1000;
+            tv.tv_usec = (delay % 1000) * 1000;
+            select(0, NULL, NULL, NULL, &tv);
+        }
+        if (write(STDOUT_FILENO, "chunk\n", 6) != 6)
+            return 1;
+    }
+    return 0;
+}
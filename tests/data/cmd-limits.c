@@ -0,0 +1,51 @@
+/*
+ * Small C program to report the resource limits and scheduling priority it
+ * was run with.  Prints the soft CPU time and address space limits and the
+ * nice value, one per line, so that tests can check that remctld applied the
+ * rlimit-cpu, rlimit-as, and nice options.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <sys/resource.h>
+
+
+/*
+ * Print a resource limit with the given label, or unlimited if there is no
+ * limit.  Returns false if the limit can't be retrieved.
+ */
+static bool
+print_limit(const char *label, int resource)
+{
+    struct rlimit limit;
+
+    if (getrlimit(resource, &limit) < 0)
+        return false;
+    if (limit.rlim_cur == RLIM_INFINITY)
+        printf("%s unlimited\n", label);
+    else
+        printf("%s %lu\n", label, (unsigned long) limit.rlim_cur);
+    return true;
+}
+
+
+int
+main(void)
+{
+    int priority;
+
+    if (!print_limit("cpu", RLIMIT_CPU))
+        return 1;
+    if (!print_limit("as", RLIMIT_AS))
+        return 1;
+    errno = 0;
+    priority = getpriority(PRIO_PROCESS, 0);
+    if (priority == -1 && errno != 0)
+        return 1;
+    printf("nice %d\n", priority);
+    return 0;
+}
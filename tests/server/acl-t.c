@@ -15,17 +15,36 @@
 #include <server/internal.h>
 #include <tests/tap/basic.h>
 #include <tests/tap/messages.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Write the given contents to a file, replacing anything already there.
+ */
+static void
+write_acl(const char *path, const char *contents)
+{
+    FILE *file;
+
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    if (fputs(contents, file) == EOF || fclose(file) == EOF)
+        sysbail("cannot write to %s", path);
+}
 
 
 int
 main(void)
 {
     struct confline confline = {
-        NULL, 0, NULL, NULL, NULL, NULL, NULL, 0, NULL, 0, 0, NULL, NULL, NULL
+        NULL, 0, NULL, NULL, NULL, NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 0, false,
+        NULL, 0, 0, NULL, NULL, NULL, 0
     };
     const char *acls[5];
+    char *tmpdir, *path, *newpath;
 
-    plan(70);
+    plan(79);
     if (chdir(getenv("SOURCE")) < 0)
         sysbail("can't chdir to SOURCE");
 
@@ -293,5 +312,40 @@ main(void)
     ok(!server_config_acl_permit(&confline, "tilde@EXAMPLE.ORG"),
        "invalid chars 3");
 
+    /* ACL files are cached, but changes to them must still be noticed. */
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/acl-cache", tmpdir);
+    basprintf(&newpath, "%s/acl-cache.new", tmpdir);
+    write_acl(path, "one@EXAMPLE.ORG\n");
+    acls[0] = path;
+    ok(server_config_acl_permit(&confline, "one@EXAMPLE.ORG"), "cached 1");
+    ok(!server_config_acl_permit(&confline, "two@EXAMPLE.ORG"), "cached 2");
+    write_acl(newpath, "two@EXAMPLE.ORG\n");
+    if (rename(newpath, path) < 0)
+        sysbail("cannot rename %s to %s", newpath, path);
+    ok(!server_config_acl_permit(&confline, "one@EXAMPLE.ORG"),
+       "replaced ACL file noticed");
+    ok(server_config_acl_permit(&confline, "two@EXAMPLE.ORG"),
+       "...and new contents used");
+    write_acl(path, "deny:two@EXAMPLE.ORG\ntwo@EXAMPLE.ORG\n");
+    ok(!server_config_acl_permit(&confline, "two@EXAMPLE.ORG"),
+       "ACL file rewritten in place noticed");
+    write_acl(path, "one@EXAMPLE.ORG\n");
+    ok(server_config_acl_permit(&confline, "one@EXAMPLE.ORG"),
+       "ACL file rewritten again");
+    write_acl(path, "two@EXAMPLE.ORG\n");
+    ok(!server_config_acl_permit(&confline, "one@EXAMPLE.ORG"),
+       "...and rewrite with the same size in the same second noticed");
+    ok(server_config_acl_permit(&confline, "two@EXAMPLE.ORG"),
+       "...and new contents used");
+    unlink(path);
+    errors_capture();
+    ok(!server_config_acl_permit(&confline, "two@EXAMPLE.ORG"),
+       "removed ACL file noticed");
+    errors_uncapture();
+    free(path);
+    free(newpath);
+    test_tmpdir_free(tmpdir);
+
     return 0;
 }
@@ -0,0 +1,96 @@
+/*
+ * Test suite for coalescing command output in the server.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/remctl.h>
+
+
+/*
+ * Run the cmd-chunks command under the given subcommand, asking it to write
+ * count chunks of six bytes with delay milliseconds between them.  Checks
+ * that the expected number of output tokens arrive, using exact if it's
+ * true and otherwise only requiring more than one token, and that all of
+ * the output and a successful exit status were received.
+ */
+static void
+test_chunks(struct remctl *r, const char *subcommand, const char *count,
+            const char *delay, size_t tokens, bool exact, const char *label)
+{
+    struct remctl_output *output;
+    const char *command[] = { "test", NULL, NULL, NULL, NULL };
+    size_t seen = 0;
+    size_t length = 0;
+    int status = -1;
+
+    command[1] = subcommand;
+    command[2] = count;
+    command[3] = delay;
+    if (!remctl_command(r, command)) {
+        diag("remctl error %s", remctl_error(r));
+        ok_block(0, 3, "%s: command failed", label);
+        return;
+    }
+    do {
+        output = remctl_output(r);
+        if (output == NULL)
+            break;
+        if (output->type == REMCTL_OUT_OUTPUT) {
+            seen++;
+            length += output->length;
+        } else if (output->type == REMCTL_OUT_STATUS)
+            status = output->status;
+    } while (output->type == REMCTL_OUT_OUTPUT);
+    if (exact)
+        is_int(tokens, seen, "%s", label);
+    else
+        ok(seen > tokens, "%s", label);
+    is_int((unsigned long) atol(count) * 6, length, "...with all the output");
+    is_int(0, status, "...and the right status");
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct remctl *r;
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+    remctld_start(config, "data/conf-simple", NULL);
+
+    plan(10);
+
+    r = remctl_new();
+    ok(remctl_open(r, "localhost", 14373, config->principal), "remctl_open");
+
+    /* Without coalescing, each chunk is read and sent separately. */
+    test_chunks(r, "chunks", "20", "10", 1, false,
+                "uncoalesced output sent in several tokens");
+
+    /*
+     * With a buffer larger than the output and a long delay, all of the
+     * output is held until the command exits and then sent at once.
+     */
+    test_chunks(r, "coalesce", "20", "10", 1, true,
+                "coalesced output sent in one token");
+
+    /*
+     * With a short delay, output is sent once it has been held that long
+     * even though the buffer isn't full, so two chunks written a second
+     * apart are sent separately.
+     */
+    test_chunks(r, "coalesce-delay", "2", "1000", 2, true,
+                "coalesced output sent after the delay");
+
+    remctl_close(r);
+    return 0;
+}
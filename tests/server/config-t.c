@@ -11,9 +11,30 @@
 #include <config.h>
 #include <portable/system.h>
 
+#include <sys/stat.h>
+#include <time.h>
+
 #include <server/internal.h>
 #include <tests/tap/basic.h>
 #include <tests/tap/messages.h>
+#include <tests/tap/string.h>
+#include <util/macros.h>
+
+
+/*
+ * Write the given contents to a file, replacing anything already there.
+ */
+static void
+write_conf(const char *path, const char *contents)
+{
+    FILE *file;
+
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    if (fputs(contents, file) == EOF || fclose(file) == EOF)
+        sysbail("cannot write to %s", path);
+}
 
 
 /*
@@ -40,12 +61,70 @@ test_error(const char *file, const char *expected)
 }
 
 
+/*
+ * Test command lookup against data/conf-match, which has a rule for each
+ * combination of literal, ALL, and EMPTY commands and subcommands plus some
+ * shadowed duplicates.  Each lookup gives the program of the rule that should
+ * match first, or NULL if nothing should match.
+ */
+static const struct {
+    const char *command;
+    const char *subcommand;
+    const char *program;
+} lookups[] = {
+    { "foo",   "bar",  "data/cmd-1" },
+    { "foo",   "baz",  "data/cmd-3" },
+    { "foo",   NULL,   "data/cmd-3" },
+    { "other", "bar",  "data/cmd-2" },
+    { "baz",   "quux", "data/cmd-6" },
+    { "baz",   NULL,   "data/cmd-6" },
+    { NULL,    NULL,   "data/cmd-8" },
+    { "EMPTY", NULL,   "data/cmd-8" },
+    { "other", NULL,   "data/cmd-9" },
+    { "other", "foo",  "data/cmd-9" },
+    { "ALL",   "bar",  "data/cmd-2" },
+};
+
+
+/*
+ * Check the result of a configuration lookup against the expected program.
+ */
+static void
+test_lookup(struct config *config, const char *command,
+            const char *subcommand, const char *program)
+{
+    struct confline *cline;
+
+    cline = server_config_find(config, command, subcommand);
+    if (program == NULL)
+        ok(cline == NULL, "no match for %s %s",
+           command == NULL ? "(null)" : command,
+           subcommand == NULL ? "(null)" : subcommand);
+    else
+        is_string(program, cline == NULL ? NULL : cline->program,
+                  "lookup of %s %s", command == NULL ? "(null)" : command,
+                  subcommand == NULL ? "(null)" : subcommand);
+}
+
+
 int
 main(void)
 {
-    struct config *config;
+    struct config *config, *reload;
+    char *tmpdir, *path, *include, *contents;
+    struct file_stamp stamp;
+    struct stat st;
+    size_t i;
+#ifdef HAVE_REGCOMP
+    const char *expected;
+#endif
+#ifdef HAVE_GETGROUPLIST
+    const gid_t *groups;
+    size_t count;
+    bool found;
+#endif
 
-    plan(49);
+    plan(116 + ARRAY_SIZE(lookups));
     if (chdir(getenv("SOURCE")) < 0)
         sysbail("can't chdir to SOURCE");
 
@@ -57,6 +136,13 @@ main(void)
     is_string("foo", config->rules[0]->subcommand, "subcommand 1");
     is_string("data/cmd-hello", config->rules[0]->program, "program 1");
     ok(config->rules[0]->logmask == NULL, "logmask 1");
+    is_int(0, config->rules[0]->coalesce, "coalesce 1");
+    is_int(0, config->rules[0]->timeout, "timeout 1");
+    is_int(0, config->rules[0]->rlimit_cpu, "rlimit-cpu 1");
+    ok(config->rules[0]->rlimit_as == 0, "rlimit-as 1");
+    is_int(0, config->rules[0]->nice, "nice 1");
+    is_int(0, config->rules[0]->max_running, "max-running 1");
+    ok(config->rules[0]->remote_host, "remote-host 1");
     is_string("data/acl-nonexistent", config->rules[0]->acls[0], "acl 1");
     ok(config->rules[0]->acls[1] == NULL, "...and only one acl");
 
@@ -65,6 +151,13 @@ main(void)
     is_string("data/cmd-hello", config->rules[1]->program, "program 2");
     is_int(4, config->rules[1]->logmask[0], "logmask 2");
     is_int(0, config->rules[1]->logmask[1], "...and only one logmask");
+    is_int(8192, config->rules[1]->coalesce, "coalesce 2");
+    is_int(COALESCE_DELAY, config->rules[1]->coalesce_delay,
+           "...with the default delay");
+    is_int(60, config->rules[1]->timeout, "timeout 2");
+    is_int(5, config->rules[1]->nice, "nice 2");
+    is_int(2, config->rules[1]->max_running, "max-running 2");
+    ok(config->max_running, "...and the config knows max-running is used");
     is_string("data/acl-nonexistent", config->rules[1]->acls[0], "acl 2 1");
     is_string("data/acl-no-such-file", config->rules[1]->acls[1], "acl 2 2");
     ok(config->rules[1]->acls[2] == NULL, "...and only two acls");
@@ -80,6 +173,11 @@ main(void)
     ok(config->rules[2]->acls[1] == NULL, "...and only one acl");
     is_string("data/cmd-hello", config->rules[2]->summary, "summary 3");
     is_string("data/command-hello", config->rules[2]->help, "help 3");
+    is_int(4096, config->rules[2]->coalesce, "coalesce 3");
+    is_int(200, config->rules[2]->coalesce_delay, "...with the right delay");
+    is_int(10, config->rules[2]->rlimit_cpu, "rlimit-cpu 3");
+    ok(config->rules[2]->rlimit_as == 512UL * 1024 * 1024, "rlimit-as 3");
+    ok(!config->rules[2]->remote_host, "remote-host 3");
 
     is_string("foo", config->rules[3]->command, "command 4");
     is_string("ALL", config->rules[3]->subcommand, "subcommand 4");
@@ -89,8 +187,125 @@ main(void)
     is_string("data/acl-simple", config->rules[3]->acls[1], "acl 4 2");
     is_string("data/acl-simple", config->rules[3]->acls[187], "acl 4 188");
     ok(config->rules[3]->acls[188] == NULL, "...and 188 total ACLs");
+
+    /* Check lookups, which go through the index. */
+    test_lookup(config, "test", "bar", "data/cmd-hello");
+    ok(server_config_find(config, "test", "bar") == config->rules[1],
+       "lookup of test bar finds the right rule");
+    ok(server_config_find(config, "foo", "anything") == config->rules[3],
+       "lookup of foo anything finds foo ALL");
+    test_lookup(config, "test", NULL, NULL);
+    server_config_free(config);
+
+    /* Check that lookups preserve first-match ordering. */
+    config = server_config_load("data/conf-match");
+    ok(config != NULL, "match config loaded");
+    for (i = 0; i < ARRAY_SIZE(lookups); i++)
+        test_lookup(config, lookups[i].command, lookups[i].subcommand,
+                    lookups[i].program);
+    server_config_free(config);
+
+    /*
+     * Check that supplementary groups for the user option are looked up when
+     * first needed, since this configuration isn't preloaded.
+     */
+    config = server_config_load("data/conf-user");
+    ok(config != NULL, "user config loaded");
+    is_string("root", config->rules[0]->user, "...with the right user");
+#ifdef HAVE_GETGROUPLIST
+    ok(server_config_groups(config->rules[0], &groups, &count),
+       "...and its groups are cached");
+    found = false;
+    for (i = 0; i < count; i++)
+        if (groups[i] == config->rules[0]->gid)
+            found = true;
+    ok(found, "...including the primary group");
+#else
+    skip_block(2, "getgrouplist not available");
+#endif
     server_config_free(config);
 
+    /*
+     * Loading a configuration again only parses the files that changed, and
+     * a failed load leaves the previous configuration alone.  A file changed
+     * in the same second that it was read is always parsed again, since a
+     * rewrite with the same size may not be visible otherwise, so wait for
+     * the next second before loading the configuration the first time.
+     */
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/conf-reload", tmpdir);
+    basprintf(&include, "%s/conf-reload-include", tmpdir);
+    basprintf(&contents, "include %s\ntest one data/cmd-hello ANYUSER\n",
+              include);
+    write_conf(include, "test two data/cmd-hello ANYUSER\n");
+    write_conf(path, contents);
+    sleep(1);
+    config = server_config_load(path);
+    ok(config != NULL, "reload config loaded");
+    is_int(2, config->files, "...from two files");
+    is_int(2, config->changed, "...both of which were parsed");
+    reload = server_config_load(path);
+    ok(reload != NULL, "reload config loaded again");
+    is_int(0, reload->changed, "...without parsing either file");
+    ok(reload->rules[0] == config->rules[0], "...sharing the parsed commands");
+    server_config_free(config);
+    is_string("two", reload->rules[0]->subcommand,
+              "...which survive freeing the old configuration");
+    write_conf(include, "test three data/cmd-hello ANYUSER\n");
+    config = server_config_load(path);
+    is_int(1, config->changed, "changed include parsed again");
+    is_string("three", config->rules[0]->subcommand, "...with new contents");
+    is_string("one", config->rules[1]->subcommand, "...and the rest reused");
+    ok(config->rules[1] == reload->rules[1], "...without parsing it");
+    server_config_free(reload);
+    write_conf(include, "test eight data/cmd-hello ANYUSER\n");
+    reload = server_config_load(path);
+    is_int(1, reload->changed, "rewrite with the same size parsed again");
+    is_string("eight", reload->rules[0]->subcommand, "...with new contents");
+    server_config_free(reload);
+    write_conf(include, "test four\n");
+    errors_capture();
+    reload = server_config_load(path);
+    errors_uncapture();
+    ok(reload == NULL, "broken include fails to load");
+    is_string("three", config->rules[0]->subcommand,
+              "...leaving the old configuration intact");
+    server_config_free(config);
+    unlink(include);
+    unlink(path);
+    free(contents);
+    free(include);
+    free(path);
+    test_tmpdir_free(tmpdir);
+
+    /*
+     * Invalid regular expressions don't prevent loading the configuration.
+     * ACLs are only parsed when the configuration is loaded if preloading
+     * was requested, in which case they're reported then.
+     */
+#ifdef HAVE_REGCOMP
+    errors_capture();
+    config = server_config_load("data/configs/bad-regex-1");
+    errors_uncapture();
+    ok(config != NULL, "config with invalid regex loaded");
+    is_string(NULL, errors, "...without parsing ACLs");
+    if (config != NULL)
+        server_config_free(config);
+    server_config_preload();
+    errors_capture();
+    config = server_config_load("data/configs/bad-regex-1");
+    errors_uncapture();
+    ok(config != NULL, "config with invalid regex preloaded");
+    expected = "data/configs/bad-regex-1:1: compilation of regex"
+        " '*host/.*' failed:";
+    ok(errors != NULL && strncmp(errors, expected, strlen(expected)) == 0,
+       "...with the regex error reported");
+    if (config != NULL)
+        server_config_free(config);
+#else
+    skip_block(4, "regex support not available");
+#endif
+
     /* Now test for errors. */
     test_error("data/configs/bad-option-1",
                "data/configs/bad-option-1:1: unknown option unknown=yes\n");
@@ -109,6 +324,46 @@ main(void)
                " found\n");
     test_error("data/configs/bad-user-1",
                "data/configs/bad-user-1:1: invalid user value nonexistent\n");
+    test_error("data/configs/bad-coalesce-1",
+               "data/configs/bad-coalesce-1:1: invalid coalesce value"
+               " 100000\n");
+    test_error("data/configs/bad-coalesce-2",
+               "data/configs/bad-coalesce-2:1: invalid coalesce value"
+               " 1024,soon\n");
+    test_error("data/configs/bad-timeout-1",
+               "data/configs/bad-timeout-1:1: invalid timeout value 0\n");
+    test_error("data/configs/bad-timeout-2",
+               "data/configs/bad-timeout-2:1: invalid timeout value"
+               " 2147484\n");
+    test_error("data/configs/bad-max-running-1",
+               "data/configs/bad-max-running-1:1: invalid max-running value"
+               " none\n");
+    test_error("data/configs/bad-nice-1",
+               "data/configs/bad-nice-1:1: invalid nice value 20\n");
+    test_error("data/configs/bad-remote-host-1",
+               "data/configs/bad-remote-host-1:1: invalid remote-host value"
+               " maybe\n");
+    test_error("data/configs/bad-rlimit-1",
+               "data/configs/bad-rlimit-1:1: invalid rlimit-as value 12X\n");
+    test_error("data/configs/bad-rlimit-2",
+               "data/configs/bad-rlimit-2:1: invalid rlimit-cpu value -5\n");
+
+    /*
+     * A file changed in the second it was stamped isn't trusted, but one
+     * with timestamps in the future is trusted until its stat fields change.
+     */
+    memset(&st, 0, sizeof(st));
+    st.st_size = 100;
+    st.st_ctime = time(NULL) - 60;
+    st.st_mtime = st.st_ctime;
+    server_file_stamp(&stamp, &st);
+    stamp.stamped = st.st_ctime;
+    ok(!server_file_unchanged(&stamp, &st), "file stamp in same second");
+    st.st_mtime = time(NULL) + 24 * 60 * 60;
+    server_file_stamp(&stamp, &st);
+    ok(server_file_unchanged(&stamp, &st), "file stamp in the future");
+    st.st_size = 200;
+    ok(!server_file_unchanged(&stamp, &st), "...until the file changes");
 
     return 0;
 }
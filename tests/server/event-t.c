@@ -0,0 +1,83 @@
+/*
+ * Test suite for multiplexed connection handling in the server.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/remctl.h>
+
+/* Number of simultaneous connections to open. */
+#define CONNECTIONS 5
+
+
+/*
+ * Run the test test command on an open connection and check that we get
+ * the expected output and exit status.
+ */
+static void
+test_command(struct remctl *r)
+{
+    struct remctl_output *output;
+    const char *command[] = { "test", "test", NULL };
+
+    if (!remctl_command(r, command)) {
+        diag("remctl error %s", remctl_error(r));
+        ok_block(0, 2, "... command failed");
+        return;
+    }
+    output = remctl_output(r);
+    ok(output != NULL && output->type == REMCTL_OUT_OUTPUT
+       && output->length == 12
+       && memcmp("hello world\n", output->data, 12) == 0,
+       "... output is correct");
+    output = remctl_output(r);
+    ok(output != NULL && output->type == REMCTL_OUT_STATUS
+       && output->status == 0, "... status is correct");
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct remctl *r[CONNECTIONS];
+    int i, j;
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+#ifndef HAVE_EPOLL_CREATE1
+    skip_all("multiplexed connections not supported");
+#endif
+    remctld_start(config, "data/conf-simple", "-e", NULL);
+
+    plan(CONNECTIONS * 6);
+
+    /* Open several connections that the server has to hold at once. */
+    for (i = 0; i < CONNECTIONS; i++) {
+        r[i] = remctl_new();
+        ok(remctl_open(r[i], "localhost", 14373, config->principal),
+           "remctl_open %d", i);
+    }
+
+    /*
+     * Run commands on each connection in turn, with a no-op in between, to
+     * check that the context is handed back correctly after each command.
+     */
+    for (j = 0; j < 2; j++)
+        for (i = 0; i < CONNECTIONS; i++) {
+            test_command(r[i]);
+            if (j == 0)
+                ok(remctl_noop(r[i]), "remctl_noop %d", i);
+        }
+    for (i = 0; i < CONNECTIONS; i++)
+        remctl_close(r[i]);
+
+    remctld_stop();
+    return 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * Test suite for looking up client hostnames in the server.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+#include <portable/socket.h>
+
+#include <sys/wait.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <util/network.h>
+
+
+int
+main(void)
+{
+    socket_type fd, client_fd, server_fd;
+    struct sockaddr_in sin;
+    socklen_t length;
+    struct client *client;
+    struct client fake;
+    char expected[NI_MAXHOST];
+    bool found;
+    pid_t child;
+
+    plan(6);
+
+    /*
+     * Accept a connection to the loopback address and check that the client
+     * hostname isn't looked up until something asks for it.
+     */
+    fd = network_bind_ipv4("127.0.0.1", 0);
+    if (fd == INVALID_SOCKET)
+        sysbail("cannot bind to 127.0.0.1");
+    if (listen(fd, 1) < 0)
+        sysbail("cannot listen");
+    length = sizeof(sin);
+    if (getsockname(fd, (struct sockaddr *) &sin, &length) < 0)
+        sysbail("cannot get bound port");
+    client_fd = network_connect_host("127.0.0.1", ntohs(sin.sin_port), NULL,
+                                     10);
+    if (client_fd == INVALID_SOCKET)
+        sysbail("cannot connect to 127.0.0.1");
+    server_fd = accept(fd, NULL, NULL);
+    if (server_fd == INVALID_SOCKET)
+        sysbail("cannot accept connection");
+    client = server_start_client(server_fd);
+    ok(client != NULL, "client started");
+    is_string("127.0.0.1", client->ipaddress, "...with the right address");
+    ok(!client->resolved && client->hostname == NULL,
+       "...without looking up its hostname");
+
+    /*
+     * Look up the hostname in a child, which should cache it for the parent.
+     * Check that with a client whose address can't be looked up.
+     */
+    found = (getnameinfo((struct sockaddr *) &client->address,
+                         client->addrlen, expected, sizeof(expected), NULL, 0,
+                         NI_NAMEREQD) == 0);
+    server_hostname_cache();
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        server_client_hostname(client);
+        _exit(0);
+    }
+    if (waitpid(child, NULL, 0) < 0)
+        sysbail("cannot wait for child");
+    memset(&fake, 0, sizeof(fake));
+    fake.ipaddress = client->ipaddress;
+    fake.address.ss_family = AF_UNSPEC;
+    if (found)
+        is_string(expected, server_client_hostname(&fake),
+                  "hostname looked up by child is cached");
+    else
+        skip("127.0.0.1 has no hostname");
+    ok(fake.resolved, "...and remembered for the client");
+    free(fake.hostname);
+
+    /* Once lookups are disabled, there's never a hostname. */
+    server_hostname_disable();
+    memset(&fake, 0, sizeof(fake));
+    fake.ipaddress = client->ipaddress;
+    ok(server_client_hostname(&fake) == NULL,
+       "no hostname when lookups are disabled");
+
+    server_free_client(client);
+    close(client_fd);
+    close(fd);
+    return 0;
+}
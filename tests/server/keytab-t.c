@@ -0,0 +1,196 @@
+/*
+ * Test suite for preloading the keytab in the server.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <signal.h>
+#include <sys/stat.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/remctl.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Open a connection, run the test test command, and check that we get the
+ * expected output and exit status.
+ */
+static void
+test_command(struct kerberos_config *config, const char *label)
+{
+    struct remctl *r;
+    struct remctl_output *output;
+    const char *command[] = { "test", "test", NULL };
+
+    r = remctl_new();
+    if (!remctl_open(r, "localhost", 14373, config->principal)) {
+        diag("remctl error %s", remctl_error(r));
+        ok_block(0, 3, "%s: remctl_open failed", label);
+        remctl_close(r);
+        return;
+    }
+    ok(1, "%s: remctl_open", label);
+    if (!remctl_command(r, command)) {
+        diag("remctl error %s", remctl_error(r));
+        ok_block(0, 2, "... command failed");
+        remctl_close(r);
+        return;
+    }
+    output = remctl_output(r);
+    ok(output != NULL && output->type == REMCTL_OUT_OUTPUT
+       && output->length == 12
+       && memcmp("hello world\n", output->data, 12) == 0,
+       "... output is correct");
+    output = remctl_output(r);
+    ok(output != NULL && output->type == REMCTL_OUT_STATUS
+       && output->status == 0, "... status is correct");
+    remctl_close(r);
+}
+
+
+/*
+ * Read the file at path into newly allocated memory and store its length in
+ * length.
+ */
+static unsigned char *
+read_file(const char *path, size_t *length)
+{
+    FILE *file;
+    struct stat st;
+    unsigned char *data;
+
+    file = fopen(path, "rb");
+    if (file == NULL)
+        sysbail("cannot open %s", path);
+    if (fstat(fileno(file), &st) < 0)
+        sysbail("cannot stat %s", path);
+    *length = (size_t) st.st_size;
+    data = bmalloc(*length);
+    if (fread(data, 1, *length, file) != *length)
+        sysbail("cannot read %s", path);
+    fclose(file);
+    return data;
+}
+
+
+/*
+ * Write data to a new file and rename it over path, the way that keytabs are
+ * normally replaced.
+ */
+static void
+replace_file(const char *path, const unsigned char *data, size_t length)
+{
+    FILE *file;
+    char *tmp;
+
+    basprintf(&tmp, "%s.new", path);
+    file = fopen(tmp, "wb");
+    if (file == NULL)
+        sysbail("cannot create %s", tmp);
+    if (fwrite(data, 1, length, file) != length || fclose(file) != 0)
+        sysbail("cannot write to %s", tmp);
+    if (rename(tmp, path) < 0)
+        sysbail("cannot rename %s to %s", tmp, path);
+    free(tmp);
+}
+
+
+/*
+ * Damage every key in a keytab.  A keytab file is a two-byte version number
+ * followed by entries, each preceded by its length as a four-byte big-endian
+ * number, with negative lengths marking deleted entries.  The last byte of
+ * each entry is part of either the key or the key version number, so
+ * changing it means that the keytab can no longer decrypt the service's
+ * tickets but still parses and still contains the service principal.
+ */
+static void
+damage_keytab(unsigned char *data, size_t length)
+{
+    size_t offset = 2;
+    unsigned long size;
+
+    while (length - offset >= 4) {
+        size = ((unsigned long) data[offset] << 24)
+            | ((unsigned long) data[offset + 1] << 16)
+            | ((unsigned long) data[offset + 2] << 8) | data[offset + 3];
+        offset += 4;
+        if (size >= 0x80000000UL)
+            size = 0xffffffffUL - size + 1;
+        else if (size > 0 && size <= length - offset)
+            data[offset + size - 1] ^= 0xff;
+        if (size > length - offset)
+            break;
+        offset += size;
+    }
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct remctl *r;
+    pid_t remctld;
+    char *tmpdir, *keytab, *option;
+    unsigned char *data;
+    size_t length;
+
+#ifndef HAVE_KEYTAB_PRELOAD
+    skip_all("keytab preloading not supported");
+#endif
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+
+    /* Run remctld from a copy of the keytab so the test can replace it. */
+    tmpdir = test_tmpdir();
+    basprintf(&keytab, "%s/keytab", tmpdir);
+    basprintf(&option, "-kFILE:%s", keytab);
+    data = read_file(config->keytab, &length);
+    replace_file(keytab, data, length);
+    remctld = remctld_start(config, "data/conf-simple", "-K", option, NULL);
+
+    plan(10);
+
+    /* Authentication works with the credentials from the preloaded keytab. */
+    test_command(config, "preloaded");
+
+    /* And still works after a SIGHUP forces the keytab to be copied again. */
+    if (kill(remctld, SIGHUP) < 0)
+        sysbail("cannot send SIGHUP to remctld");
+    sleep(1);
+    test_command(config, "reloaded");
+
+    /*
+     * Replace the keytab with one whose keys are wrong.  remctld should
+     * notice the new file without a signal and stop accepting tickets.
+     */
+    damage_keytab(data, length);
+    replace_file(keytab, data, length);
+    r = remctl_new();
+    ok(!remctl_open(r, "localhost", 14373, config->principal),
+       "replaced keytab used without a signal");
+    remctl_close(r);
+
+    /* Putting the original keytab back makes authentication work again. */
+    free(data);
+    data = read_file(config->keytab, &length);
+    replace_file(keytab, data, length);
+    test_command(config, "restored");
+
+    /* Clean up. */
+    remctld_stop();
+    if (unlink(keytab) < 0)
+        sysdiag("cannot remove %s", keytab);
+    free(data);
+    free(option);
+    free(keytab);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
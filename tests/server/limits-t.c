@@ -0,0 +1,195 @@
+/*
+ * Test suite for the concurrency limits in the server.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/remctl.h>
+#include <util/protocol.h>
+
+
+/*
+ * Run the test test command on an open connection.  Returns the type of the
+ * first output token, which will be REMCTL_OUT_OUTPUT if the command was
+ * allowed and REMCTL_OUT_ERROR otherwise, or -1 if the command couldn't be
+ * sent.  Reads the status as well if the command was run.  If the first
+ * token isn't output, it's stored in the output argument so that the error
+ * can be checked; the status read afterwards reuses the same struct, so
+ * output tokens can't be returned that way.
+ */
+static int
+run_command(struct remctl *r, struct remctl_output **output)
+{
+    const char *command[] = { "test", "test", NULL };
+
+    *output = NULL;
+    if (!remctl_command(r, command))
+        return -1;
+    *output = remctl_output(r);
+    if (*output == NULL)
+        return -1;
+    if ((*output)->type != REMCTL_OUT_OUTPUT)
+        return (*output)->type;
+    *output = NULL;
+    if (remctl_output(r) == NULL)
+        return -1;
+    return REMCTL_OUT_OUTPUT;
+}
+
+
+/*
+ * Run a command on an open connection and return the first output token,
+ * or NULL if the command couldn't be sent or no output was read.
+ */
+static struct remctl_output *
+start_command(struct remctl *r, const char **command)
+{
+    if (!remctl_command(r, command))
+        return NULL;
+    return remctl_output(r);
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct remctl *first, *second;
+    struct remctl_output *output;
+    const char *sleep_command[] = { "test", "sleep-limited", "hello", NULL };
+    int i, type;
+    bool opened;
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+    remctld_start(config, "data/conf-simple", "-U", "1", NULL);
+
+    plan(19);
+
+    /* The first connection for our principal is allowed. */
+    first = remctl_new();
+    ok(remctl_open(first, "localhost", 14373, config->principal),
+       "remctl_open of first connection");
+    type = run_command(first, &output);
+    is_int(REMCTL_OUT_OUTPUT, type, "... and command runs");
+
+    /* The second is refused while the first is still open. */
+    second = remctl_new();
+    ok(remctl_open(second, "localhost", 14373, config->principal),
+       "remctl_open of second connection");
+    type = run_command(second, &output);
+    ok(type == REMCTL_OUT_ERROR && output->error == ERROR_INTERNAL,
+       "... and command is refused");
+    ok(output != NULL && output->length == 29
+       && memcmp("Too many connections for user", output->data, 29) == 0,
+       "... with the right error");
+
+    /*
+     * Once the first connection is closed, the second connection can run
+     * commands.  The server has to notice the first child exiting first, so
+     * retry for a while.
+     */
+    remctl_close(first);
+    for (i = 0; i < 10; i++) {
+        type = run_command(second, &output);
+        if (type == REMCTL_OUT_OUTPUT)
+            break;
+        sleep(1);
+    }
+    is_int(REMCTL_OUT_OUTPUT, type,
+           "... and command runs after the first connection closes");
+    remctl_close(second);
+    remctld_stop();
+
+    /*
+     * With a global limit of one child, a second connection waits in the
+     * listen queue, so it times out during authentication while the first
+     * connection is open.
+     */
+    remctld_start(config, "data/conf-simple", "-L", "1", NULL);
+    first = remctl_new();
+    ok(remctl_open(first, "localhost", 14373, config->principal),
+       "remctl_open of first connection with -L");
+    second = remctl_new();
+    remctl_set_timeout(second, 1);
+    ok(!remctl_open(second, "localhost", 14373, config->principal),
+       "... second connection waits");
+    is_string("error receiving token: timed out", remctl_error(second),
+              "... and times out");
+    remctl_close(second);
+
+    /* Once the first connection is closed, a new connection is handled. */
+    remctl_close(first);
+    opened = false;
+    for (i = 0; i < 10 && !opened; i++) {
+        second = remctl_new();
+        remctl_set_timeout(second, 1);
+        opened = remctl_open(second, "localhost", 14373, config->principal);
+        if (opened)
+            type = run_command(second, &output);
+        remctl_close(second);
+    }
+    ok(opened, "... and connects after the first connection closes");
+    is_int(REMCTL_OUT_OUTPUT, type, "... and command runs");
+    remctld_stop();
+
+    /*
+     * With a limit of one connection per IP address, a second connection
+     * from the same address is closed before authentication.  Depending on
+     * timing, the client sees either the end of file or a reset.
+     */
+    remctld_start(config, "data/conf-simple", "-I", "1", NULL);
+    first = remctl_new();
+    ok(remctl_open(first, "localhost", 14373, config->principal),
+       "remctl_open of first connection with -I");
+    second = remctl_new();
+    ok(!remctl_open(second, "localhost", 14373, config->principal),
+       "... second connection from the same address refused");
+    ok(strncmp(remctl_error(second), "error receiving token: ", 23) == 0
+       || strncmp(remctl_error(second), "error sending token: ", 21) == 0,
+       "... during authentication");
+    remctl_close(second);
+    remctl_close(first);
+    remctld_stop();
+
+    /*
+     * A command with max-running=1 is refused while another copy is running,
+     * even from another connection of the same user.
+     */
+    remctld_start(config, "data/conf-simple", NULL);
+    first = remctl_new();
+    second = remctl_new();
+    if (!remctl_open(first, "localhost", 14373, config->principal)
+        || !remctl_open(second, "localhost", 14373, config->principal))
+        bail("cannot connect to remctld: %s", remctl_error(first));
+    output = start_command(first, sleep_command);
+    ok(output != NULL && output->type == REMCTL_OUT_OUTPUT,
+       "first copy of limited command runs");
+    output = start_command(second, sleep_command);
+    ok(output != NULL && output->type == REMCTL_OUT_ERROR
+       && output->error == ERROR_INTERNAL,
+       "... and second copy is refused");
+    ok(output != NULL && output->length == 37
+       && memcmp("Too many instances of command running", output->data,
+                 37) == 0,
+       "... with the right error");
+    do {
+        output = remctl_output(first);
+    } while (output != NULL && output->type == REMCTL_OUT_OUTPUT);
+    ok(output != NULL && output->type == REMCTL_OUT_STATUS
+       && output->status == 0, "... and first copy finishes");
+    output = start_command(second, sleep_command);
+    ok(output != NULL && output->type == REMCTL_OUT_OUTPUT,
+       "... after which another copy runs");
+    remctl_close(second);
+    remctl_close(first);
+
+    remctld_stop();
+    return 0;
+}
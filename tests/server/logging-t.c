@@ -21,7 +21,8 @@ int
 main(void)
 {
     struct confline confline = {
-        NULL, 0, NULL, NULL, NULL, NULL, NULL, 0, NULL, 0, 0, NULL, NULL, NULL
+        NULL, 0, NULL, NULL, NULL, NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 0, false,
+        NULL, 0, 0, NULL, NULL, NULL, 0
     };
     struct iovec **command;
     int i;
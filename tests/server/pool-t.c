@@ -0,0 +1,144 @@
+/*
+ * Test suite for the pre-forked worker pool in the server.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <sys/wait.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/remctl.h>
+
+/* Number of simultaneous connections to open. */
+#define CONNECTIONS 4
+
+
+/*
+ * Run the test test command on an open connection and check that we get
+ * the expected output and exit status.
+ */
+static void
+test_command(struct remctl *r)
+{
+    struct remctl_output *output;
+    const char *command[] = { "test", "test", NULL };
+
+    if (!remctl_command(r, command)) {
+        diag("remctl error %s", remctl_error(r));
+        ok_block(0, 2, "... command failed");
+        return;
+    }
+    output = remctl_output(r);
+    ok(output != NULL && output->type == REMCTL_OUT_OUTPUT
+       && output->length == 12
+       && memcmp("hello world\n", output->data, 12) == 0,
+       "... output is correct");
+    output = remctl_output(r);
+    ok(output != NULL && output->type == REMCTL_OUT_STATUS
+       && output->status == 0, "... status is correct");
+}
+
+
+/*
+ * Open a connection and run the test test command in a child process,
+ * exiting with status 0 if the command produced the expected output.  Used
+ * to run a connection that has to wait for a worker without blocking the
+ * test.
+ */
+static pid_t
+test_command_child(struct kerberos_config *config)
+{
+    struct remctl *r;
+    struct remctl_output *output;
+    const char *command[] = { "test", "test", NULL };
+    pid_t child;
+
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child > 0)
+        return child;
+    alarm(30);
+    r = remctl_new();
+    if (!remctl_open(r, "localhost", 14373, config->principal))
+        _exit(1);
+    if (!remctl_command(r, command))
+        _exit(1);
+    output = remctl_output(r);
+    if (output == NULL || output->type != REMCTL_OUT_OUTPUT
+        || output->length != 12
+        || memcmp("hello world\n", output->data, 12) != 0)
+        _exit(1);
+    output = remctl_output(r);
+    if (output == NULL || output->type != REMCTL_OUT_STATUS
+        || output->status != 0)
+        _exit(1);
+    remctl_close(r);
+    _exit(0);
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct remctl *r[CONNECTIONS - 1];
+    pid_t child, result;
+    int i, status;
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+    remctld_start(config, "data/conf-simple", "-w", "1", "-W", "3", "-R",
+                  "2", NULL);
+
+    plan((CONNECTIONS - 1) * 3 + 8);
+
+    /*
+     * Open as many simultaneous connections as the maximum pool size and
+     * run a command on each, keeping them all open so that every worker is
+     * busy.
+     */
+    for (i = 0; i < CONNECTIONS - 1; i++) {
+        r[i] = remctl_new();
+        ok(remctl_open(r[i], "localhost", 14373, config->principal),
+           "remctl_open %d", i);
+        test_command(r[i]);
+    }
+
+    /*
+     * One more connection has to wait for a worker to become free, so it
+     * shouldn't finish until one of the open connections is closed.  Run it
+     * in a child so that the test doesn't block.
+     */
+    child = test_command_child(config);
+    sleep(2);
+    result = waitpid(child, &status, WNOHANG);
+    ok(result == 0, "connection past the maximum waits for a worker");
+    remctl_close(r[0]);
+    if (result == 0) {
+        alarm(30);
+        result = waitpid(child, &status, 0);
+        alarm(0);
+    }
+    ok(result == child && WIFEXITED(status) && WEXITSTATUS(status) == 0,
+       "... and runs its command once a worker is free");
+    for (i = 1; i < CONNECTIONS - 1; i++)
+        remctl_close(r[i]);
+
+    /* Sequential connections exercise recycling of workers. */
+    for (i = 0; i < 2; i++) {
+        r[0] = remctl_new();
+        ok(remctl_open(r[0], "localhost", 14373, config->principal),
+           "sequential remctl_open %d", i);
+        test_command(r[0]);
+        remctl_close(r[0]);
+    }
+
+    remctld_stop();
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * Test suite for per-command timeouts and resource limits in the server.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/remctl.h>
+#include <tests/tap/string.h>
+#include <util/protocol.h>
+
+
+/*
+ * Run a command, collecting all of its output into a newly allocated string.
+ * Stores the exit status in the status argument, or -1 if the command didn't
+ * return a status, and returns the final token (status or error) in output.
+ * Returns NULL if the command couldn't be run.
+ */
+static char *
+run_command(struct remctl *r, const char **command, int *status,
+            struct remctl_output **final)
+{
+    struct remctl_output *output;
+    char *data = NULL;
+    char *old;
+
+    *status = -1;
+    *final = NULL;
+    if (!remctl_command(r, command))
+        return NULL;
+    data = bstrdup("");
+    do {
+        output = remctl_output(r);
+        if (output == NULL) {
+            free(data);
+            return NULL;
+        }
+        if (output->type == REMCTL_OUT_OUTPUT) {
+            old = data;
+            basprintf(&data, "%s%.*s", old, (int) output->length,
+                      output->data);
+            free(old);
+        } else if (output->type == REMCTL_OUT_STATUS)
+            *status = output->status;
+    } while (output->type == REMCTL_OUT_OUTPUT);
+    *final = output;
+    return data;
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct remctl *r;
+    struct remctl_output *output;
+    const char *timeout[] = { "test", "timeout", "hello", NULL };
+    const char *limits[] = { "test", "limits", NULL };
+    char *data, *expected;
+    time_t start;
+    int status, priority;
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+    remctld_start(config, "data/conf-simple", NULL);
+
+    plan(8);
+
+    r = remctl_new();
+    ok(remctl_open(r, "localhost", 14373, config->principal), "remctl_open");
+
+    /*
+     * A command that runs longer than its timeout is killed.  Output it sent
+     * before the timeout still arrives, followed by an error.
+     */
+    start = time(NULL);
+    data = run_command(r, timeout, &status, &output);
+    is_string("hello\n", data, "output before the timeout is sent");
+    ok(output != NULL && output->type == REMCTL_OUT_ERROR
+       && output->error == ERROR_INTERNAL,
+       "...followed by an error");
+    ok(output != NULL && output->length == 17
+       && memcmp("Command timed out", output->data, 17) == 0,
+       "...with the right message");
+    ok(time(NULL) - start < 3, "...and the command is killed");
+    free(data);
+
+    /*
+     * The resource limits and priority change are visible to the command.
+     * The server runs with our priority, so the command's priority should be
+     * ours adjusted by the configured amount.
+     */
+    errno = 0;
+    priority = getpriority(PRIO_PROCESS, 0);
+    if (priority == -1 && errno != 0)
+        sysbail("cannot get priority");
+    priority = (priority + 5 > 19) ? 19 : priority + 5;
+    basprintf(&expected, "cpu 30\nas %lu\nnice %d\n", 1024UL * 1024 * 1024,
+              priority);
+    data = run_command(r, limits, &status, &output);
+    is_string(expected, data, "command runs with the configured limits");
+    ok(output != NULL && output->type == REMCTL_OUT_STATUS,
+       "...and returns a status");
+    is_int(0, status, "...of zero");
+    free(data);
+    free(expected);
+
+    remctl_close(r);
+    return 0;
+}
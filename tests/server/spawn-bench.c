@@ -0,0 +1,219 @@
+/*
+ * Benchmark for starting commands from the server.
+ *
+ * Compares how many commands per second can be run when starting them with
+ * fork and exec, as remctld does for commands with resource limits or a
+ * different user, and with posix_spawn, as it does otherwise.  The cost of
+ * fork grows with the size of the process, so the benchmark first allocates
+ * and touches some memory to stand in for the sessions held by a busy
+ * server.  Each command is run the way remctld runs it: standard input from
+ * /dev/null, standard output and error to pipes that are read until the
+ * command closes them, and then waitpid.
+ *
+ * Usage: spawn-bench [-m <megabytes>] [-n <count>] [<program>]
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#ifdef HAVE_POSIX_SPAWN
+# include <spawn.h>
+#endif
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* Not all systems declare the environment in unistd.h. */
+#if !HAVE_DECL_ENVIRON
+extern char **environ;
+#endif
+
+/* The ways of starting a command. */
+enum method {
+    METHOD_FORK,
+    METHOD_SPAWN
+};
+
+
+/*
+ * Start the program with fork and exec, with its output going to the write
+ * ends of the given pipes.  The child closes both ends of each pipe once
+ * they've been copied, as remctld does.  Returns the process ID.
+ */
+static pid_t
+start_fork(char **argv, int fds[2][2])
+{
+    pid_t pid;
+    int fd, i;
+
+    pid = fork();
+    if (pid < 0)
+        sysdie("cannot fork");
+    else if (pid == 0) {
+        dup2(fds[0][1], 1);
+        dup2(fds[1][1], 2);
+        for (i = 0; i < 2; i++) {
+            close(fds[i][0]);
+            close(fds[i][1]);
+        }
+        fd = open("/dev/null", O_RDONLY);
+        if (fd > 0) {
+            dup2(fd, 0);
+            close(fd);
+        }
+        execve(argv[0], argv, environ);
+        _exit(127);
+    }
+    return pid;
+}
+
+
+#ifdef HAVE_POSIX_SPAWN
+/*
+ * Start the program with posix_spawn, with its output going to the write
+ * ends of the given pipes.  As in remctld, the pipes aren't close-on-exec,
+ * so the child is told to close both ends of each once they've been copied.
+ * Returns the process ID.
+ */
+static pid_t
+start_spawn(char **argv, int fds[2][2])
+{
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+    int i, j, status;
+
+    if (posix_spawn_file_actions_init(&actions) != 0)
+        sysdie("cannot initialize spawn actions");
+    if (posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY,
+                                         0) != 0)
+        sysdie("cannot add spawn action");
+    if (posix_spawn_file_actions_adddup2(&actions, fds[0][1], 1) != 0)
+        sysdie("cannot add spawn action");
+    if (posix_spawn_file_actions_adddup2(&actions, fds[1][1], 2) != 0)
+        sysdie("cannot add spawn action");
+    for (i = 0; i < 2; i++)
+        for (j = 0; j < 2; j++)
+            if (posix_spawn_file_actions_addclose(&actions, fds[i][j]) != 0)
+                sysdie("cannot add spawn action");
+    status = posix_spawn(&pid, argv[0], &actions, NULL, argv, environ);
+    if (status != 0) {
+        errno = status;
+        sysdie("cannot spawn %s", argv[0]);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    return pid;
+}
+#endif /* HAVE_POSIX_SPAWN */
+
+
+/*
+ * Run the program once with the given method, reading all of its output and
+ * waiting for it to exit.
+ */
+static void
+run(enum method method, char **argv)
+{
+    int fds[2][2];
+    char buffer[BUFSIZ];
+    ssize_t status;
+    pid_t pid;
+    int i;
+
+    if (pipe(fds[0]) != 0 || pipe(fds[1]) != 0)
+        sysdie("cannot create pipes");
+#ifdef HAVE_POSIX_SPAWN
+    if (method == METHOD_SPAWN)
+        pid = start_spawn(argv, fds);
+    else
+#endif
+        pid = start_fork(argv, fds);
+    for (i = 0; i < 2; i++) {
+        close(fds[i][1]);
+        do {
+            status = read(fds[i][0], buffer, sizeof(buffer));
+        } while (status > 0 || (status < 0 && errno == EINTR));
+        close(fds[i][0]);
+    }
+    if (waitpid(pid, NULL, 0) < 0)
+        sysdie("cannot wait for child");
+}
+
+
+/*
+ * Run the program count times with the given method and report how many
+ * commands per second that works out to.
+ */
+static void
+benchmark(enum method method, const char *name, char **argv,
+          unsigned long count)
+{
+    struct timeval start, end;
+    unsigned long i;
+    double elapsed;
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < count; i++)
+        run(method, argv);
+    gettimeofday(&end, NULL);
+    elapsed = (end.tv_sec - start.tv_sec)
+        + (end.tv_usec - start.tv_usec) / 1000000.0;
+    printf("%-12s %8lu commands in %6.2fs: %8.0f commands/s\n", name, count,
+           elapsed, count / elapsed);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    unsigned long count = 1000;
+    unsigned long megabytes = 256;
+    char *program[2] = { (char *) "/bin/true", NULL };
+    char *memory = NULL;
+    int option;
+
+    message_program_name = "spawn-bench";
+    while ((option = getopt(argc, argv, "m:n:")) != EOF) {
+        switch (option) {
+        case 'm':
+            megabytes = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            count = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            die("usage: spawn-bench [-m <megabytes>] [-n <count>]"
+                " [<program>]");
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc > 1)
+        die("usage: spawn-bench [-m <megabytes>] [-n <count>] [<program>]");
+    if (argc == 1)
+        program[0] = argv[0];
+    if (count == 0)
+        die("count must be positive");
+
+    /* Touch every page so that the memory is really mapped. */
+    if (megabytes > 0) {
+        memory = xmalloc(megabytes * 1024 * 1024);
+        memset(memory, 1, megabytes * 1024 * 1024);
+    }
+    printf("Running %s with %lu MB allocated\n", program[0], megabytes);
+    fflush(stdout);
+
+    benchmark(METHOD_FORK, "fork", program, count);
+#ifdef HAVE_POSIX_SPAWN
+    benchmark(METHOD_SPAWN, "posix_spawn", program, count);
+#else
+    printf("posix_spawn  not available\n");
+#endif
+    free(memory);
+    return 0;
+}
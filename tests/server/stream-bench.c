@@ -0,0 +1,157 @@
+/*
+ * Benchmark for streaming command output from the server.
+ *
+ * Runs a command on a remctld server several times, discarding its output,
+ * and reports how fast the output arrived and how much CPU time the client
+ * used.  Meant to be run against a server configured with a command that
+ * writes a lot of output, such as tests/data/cmd-zero, to measure the
+ * server's data path from the command's pipe to the network.  Run remctld
+ * under time or watch it with a process monitor to see its own CPU use.
+ *
+ * Usage: stream-bench [-n <runs>] [-p <port>] [-s <principal>] <host>
+ *            <command> [<arg> ...]
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include <client/remctl.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* Usage message. */
+#define USAGE \
+    "usage: stream-bench [-n <runs>] [-p <port>] [-s <principal>] <host>" \
+    " <command> [<arg> ...]"
+
+
+/*
+ * Return the difference between two times in seconds.
+ */
+static double
+elapsed(const struct timeval *start, const struct timeval *end)
+{
+    return (end->tv_sec - start->tv_sec)
+        + (end->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+
+/*
+ * Comparison function for sorting the results of each run.
+ */
+static int
+compare_double(const void *a, const void *b)
+{
+    const double *x = a;
+    const double *y = b;
+
+    return (*x > *y) - (*x < *y);
+}
+
+
+/*
+ * Run the command once over an open connection, discarding its output.
+ * Returns the number of bytes of output received, or dies on failure.
+ */
+static unsigned long long
+run(struct remctl *r, const char **command)
+{
+    struct remctl_output *output;
+    unsigned long long total = 0;
+
+    if (!remctl_command(r, command))
+        die("cannot send command: %s", remctl_error(r));
+    while (1) {
+        output = remctl_output(r);
+        if (output == NULL)
+            die("cannot read output: %s", remctl_error(r));
+        switch (output->type) {
+        case REMCTL_OUT_OUTPUT:
+            total += output->length;
+            break;
+        case REMCTL_OUT_STATUS:
+            if (output->status != 0)
+                die("command exited with status %d", output->status);
+            return total;
+        case REMCTL_OUT_ERROR:
+            die("command failed: %.*s", (int) output->length, output->data);
+        case REMCTL_OUT_DONE:
+            return total;
+        }
+    }
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct remctl *r;
+    struct timeval start, end;
+    struct timeval zero = { 0, 0 };
+    struct rusage usage;
+    unsigned long runs = 5;
+    unsigned short port = 0;
+    const char *principal = NULL;
+    const char *host;
+    unsigned long long bytes;
+    double *rates;
+    double seconds, cpu;
+    unsigned long i;
+    int option;
+
+    message_program_name = "stream-bench";
+    while ((option = getopt(argc, argv, "+n:p:s:")) != EOF) {
+        switch (option) {
+        case 'n':
+            runs = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            port = (unsigned short) strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            principal = optarg;
+            break;
+        default:
+            die("%s", USAGE);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc < 2)
+        die("%s", USAGE);
+    if (runs == 0)
+        die("number of runs must be positive");
+    host = argv[0];
+
+    r = remctl_new();
+    if (r == NULL)
+        sysdie("cannot allocate remctl object");
+    if (!remctl_open(r, host, port, principal))
+        die("cannot connect to %s: %s", host, remctl_error(r));
+    rates = xmalloc(runs * sizeof(double));
+    for (i = 0; i < runs; i++) {
+        gettimeofday(&start, NULL);
+        bytes = run(r, (const char **) argv + 1);
+        gettimeofday(&end, NULL);
+        seconds = elapsed(&start, &end);
+        rates[i] = bytes / seconds / (1024 * 1024);
+        printf("run %-3lu %12llu bytes in %7.2fs: %8.1f MB/s\n", i + 1, bytes,
+               seconds, rates[i]);
+        fflush(stdout);
+    }
+    remctl_close(r);
+
+    /* Report the median and the CPU time used by the client. */
+    qsort(rates, runs, sizeof(double), compare_double);
+    if (getrusage(RUSAGE_SELF, &usage) < 0)
+        sysdie("cannot get resource usage");
+    cpu = elapsed(&zero, &usage.ru_utime) + elapsed(&zero, &usage.ru_stime);
+    printf("median %8.1f MB/s, client CPU %.2fs\n", rates[runs / 2], cpu);
+    free(rates);
+    return 0;
+}
@@ -25,12 +25,14 @@ main(void)
     struct remctl *r;
     struct remctl_output *output;
     const char *command[] = { "test", "streaming", NULL };
+    const char *zero[] = { "test", "zero", "4", NULL };
+    size_t length;
 
     /* Unless we have Kerberos available, we can't really do anything. */
     config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
     remctld_start(config, "data/conf-simple", NULL);
 
-    plan(32);
+    plan(34);
 
     /* First, version 2. */
     r = remctl_new();
@@ -71,6 +73,19 @@ main(void)
     ok(output != NULL, "status is not null");
     is_int(REMCTL_OUT_STATUS, output->type, "...and is right type");
     is_int(0, output->status, "...and is right status");
+
+    /*
+     * Output still in the pipe when the command exits should be sent as
+     * well, even if it's more than one read.
+     */
+    length = 0;
+    ok(remctl_command(r, zero), "remctl_command for large output");
+    do {
+        output = remctl_output(r);
+        if (output != NULL && output->type == REMCTL_OUT_OUTPUT)
+            length += output->length;
+    } while (output != NULL && output->type == REMCTL_OUT_OUTPUT);
+    is_int(4 * 1024 * 1024, length, "...and all of the output arrives");
     remctl_close(r);
 
     /* Now, version 1. */
@@ -11,10 +11,12 @@
 #include <config.h>
 #include <portable/system.h>
 #include <portable/gssapi.h>
+#include <portable/uio.h>
 
 #include <tests/tap/basic.h>
 #include <tests/tap/kerberos.h>
 #include <util/gss-tokens.h>
+#include <util/protocol.h>
 
 /* From faketoken.c. */
 extern char send_buffer[2048];
@@ -35,11 +37,14 @@ main(void)
     gss_ctx_id_t server_ctx, client_ctx;
     OM_uint32 c_stat, c_min_stat, s_stat, s_min_stat, ret_flags;
     gss_OID doid;
-    int status, flags;
+    int status, flags, i;
+    struct token_wrap_buffer *wrap;
+    char *data;
+    struct iovec iov[2];
 
     /* Unless we have Kerberos available, we can't really do anything. */
     config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
-    plan(28);
+    plan(28 + 2 * 4 + 1 + 5);
 
     /*
      * We have to set up a context first in order to do this test, which is
@@ -164,6 +169,57 @@ main(void)
     is_int(GSS_S_COMPLETE, s_stat, "...and would send correct MIC");
     gss_release_buffer(&c_min_stat, &client_tok);
 
+    /*
+     * Send a token given as iovecs through a wrap buffer.  Do it twice to
+     * check that the buffer can be reused.
+     */
+    wrap = token_wrap_buffer_new();
+    if (wrap == NULL)
+        sysbail("cannot allocate wrap buffer");
+    iov[0].iov_base = (char *) "hel";
+    iov[0].iov_len = 3;
+    iov[1].iov_base = (char *) "lo";
+    iov[1].iov_len = 2;
+    for (i = 0; i < 2; i++) {
+        status = token_send_priv_iov(0, wrap, server_ctx, 3, iov, 2, 0,
+                                     &s_stat, &s_min_stat);
+        is_int(TOKEN_OK, status, "sent a token from iovecs");
+        server_tok.value = send_buffer;
+        server_tok.length = send_length;
+        c_stat = gss_unwrap(&c_min_stat, client_ctx, &server_tok,
+                            &client_tok, NULL, NULL);
+        is_int(GSS_S_COMPLETE, c_stat, "...and it unwrapped");
+        is_int(5, client_tok.length, "...with the right length");
+        ok(memcmp(client_tok.value, "hello", 5) == 0, "...and contents");
+        gss_release_buffer(&c_min_stat, &client_tok);
+    }
+    iov[1].iov_len = TOKEN_MAX_DATA;
+    status = token_send_priv_iov(0, wrap, server_ctx, 3, iov, 2, 0, &s_stat,
+                                 &s_min_stat);
+    is_int(TOKEN_FAIL_LARGE, status, "sending too large of a token");
+
+    /*
+     * Send a token stored directly in the wrap buffer, using less than the
+     * space prepared.
+     */
+    data = token_wrap_buffer_prepare(wrap, server_ctx, 1024);
+    ok(data != NULL, "prepared wrap buffer");
+    if (data == NULL)
+        bail("cannot prepare wrap buffer");
+    memcpy(data, "hello", 5);
+    status = token_send_priv_prepared(0, wrap, server_ctx, 3, 5, 0, &s_stat,
+                                      &s_min_stat);
+    is_int(TOKEN_OK, status, "sent a prepared token");
+    server_tok.value = send_buffer;
+    server_tok.length = send_length;
+    c_stat = gss_unwrap(&c_min_stat, client_ctx, &server_tok, &client_tok,
+                        NULL, NULL);
+    is_int(GSS_S_COMPLETE, c_stat, "...and it unwrapped");
+    is_int(5, client_tok.length, "...with the right length");
+    ok(memcmp(client_tok.value, "hello", 5) == 0, "...and contents");
+    gss_release_buffer(&c_min_stat, &client_tok);
+    token_wrap_buffer_free(wrap);
+
     /*
      * Test sending and receiving a token with a timeout.  This and the tests
      * below must come last, and after any successful token test, because
@@ -31,13 +31,16 @@
 #include <config.h>
 #include <portable/system.h>
 #include <portable/socket.h>
+#include <portable/uio.h>
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/wait.h>
 #include <signal.h>
 
 #include <tests/tap/basic.h>
+#include <util/fdflag.h>
 #include <util/macros.h>
 #include <util/messages.h>
 #include <util/network.h>
@@ -327,6 +330,31 @@ test_any(void)
 }
 
 
+/*
+ * Test that network_bind_reuseport allows two sockets to be bound to the
+ * same address and port.
+ */
+static void
+test_reuseport(void)
+{
+    socket_type first, second;
+
+    if (!network_bind_reuseport(true)) {
+        skip_block(2, "SO_REUSEPORT not supported");
+        return;
+    }
+    first = network_bind_ipv4("127.0.0.1", 11119);
+    ok(first != INVALID_SOCKET, "bind with SO_REUSEPORT");
+    second = network_bind_ipv4("127.0.0.1", 11119);
+    ok(second != INVALID_SOCKET, "...and second bind to the same port");
+    network_bind_reuseport(false);
+    if (first != INVALID_SOCKET)
+        socket_close(first);
+    if (second != INVALID_SOCKET)
+        socket_close(second);
+}
+
+
 /*
  * Bring up a server on port 11119 on the loopback address and test connecting
  * to it via IPv4 using network_client_create.  Takes an optional source
@@ -551,69 +579,118 @@ test_network_read(void)
 
 
 /*
- * Test the network write function with a timeout.  We fork off a child
- * process that runs delay_reader, and then we write 64KB to the network in
- * two chunks, once with a timeout and once without, and then try a third time
- * when we should time out.
+ * Write data with network_write or, if vector is true, with network_writev
+ * after splitting the data between two buffers.
+ */
+static bool
+write_data(socket_type fd, char *data, size_t length, time_t timeout,
+           bool vector)
+{
+    struct iovec iov[2];
+
+    if (!vector)
+        return network_write(fd, data, length, timeout);
+    iov[0].iov_base = data;
+    iov[0].iov_len = 5;
+    iov[1].iov_base = data + 5;
+    iov[1].iov_len = length - 5;
+    return network_writev(fd, iov, 2, timeout);
+}
+
+
+/*
+ * Test the network write functions with a timeout.  We fork off a child
+ * process that runs delay_reader on one end of a socketpair, and then we
+ * write 64KB to the other end in two chunks, once with a timeout and once
+ * without, and then try a third time when we should time out.  The send
+ * buffer is kept small so that the kernel can't absorb the third write
+ * however large the default socket buffers are.  If vector is true, test
+ * network_writev instead of network_write.
  */
 static void
-test_network_write(void)
+test_network_write(bool vector)
 {
-    socket_type fd, c;
+    socket_type fds[2];
     pid_t child;
-    struct sockaddr_in sin;
-    socklen_t slen;
     char *buffer;
+    const char *name;
+    int size = 16 * 1024;
 
+    name = vector ? "network_writev" : "network_write";
     buffer = bmalloc(512 * 1024);
     memset(buffer, 'a', 512 * 1024);
-    fd = network_bind_ipv4("127.0.0.1", 11119);
-    if (fd == INVALID_SOCKET)
-        sysbail("cannot create or bind socket");
-    if (listen(fd, 1) < 0) {
-        sysdiag("cannot listen to socket");
-        ok_block(4, 0, "network_write");
-        socket_close(fd);
-        free(buffer);
-        return;
-    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        sysbail("cannot create socketpair");
+    if (setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0)
+        sysbail("cannot set send buffer size");
     child = fork();
     if (child < 0)
         sysbail("cannot fork");
     else if (child == 0) {
-        socket_close(fd);
-        c = network_connect_host("127.0.0.1", 11119, NULL, 0);
-        if (c == INVALID_SOCKET)
-            _exit(1);
-        delay_reader(c);
-    } else {
-        alarm(10);
-        slen = sizeof(struct sockaddr_in);
-        c = accept(fd, &sin, &slen);
-        if (c == INVALID_SOCKET) {
-            sysdiag("cannot accept on socket");
-            ok_block(4, 0, "network_write");
-            socket_close(fd);
-            free(buffer);
-            return;
-        }
-        socket_set_errno(0);
-        ok(network_write(c, buffer, 32 * 1024, 0), "network_write");
-        ok(network_write(c, buffer, 32 * 1024, 1),
-           "network_write with timeout");
-        ok(!network_write(c, buffer, 512 * 1024, 1),
-           "network_write aborted with timeout");
-        is_int(ETIMEDOUT, socket_errno, "...with correct error");
-        socket_close(c);
-        kill(child, SIGTERM);
-        waitpid(child, NULL, 0);
-        alarm(0);
+        socket_close(fds[0]);
+        delay_reader(fds[1]);
     }
-    socket_close(fd);
+    socket_close(fds[1]);
+    alarm(10);
+    socket_set_errno(0);
+    ok(write_data(fds[0], buffer, 32 * 1024, 0, vector), "%s", name);
+    ok(write_data(fds[0], buffer, 32 * 1024, 1, vector), "%s with timeout",
+       name);
+    ok(!write_data(fds[0], buffer, 512 * 1024, 1, vector),
+       "%s aborted with timeout", name);
+    is_int(ETIMEDOUT, socket_errno, "...with correct error");
+    socket_close(fds[0]);
+    kill(child, SIGTERM);
+    waitpid(child, NULL, 0);
+    alarm(0);
     free(buffer);
 }
 
 
+/*
+ * Test network_read and network_write on a socket that's left non-blocking,
+ * which they should handle without changing its mode, and on a pipe, which
+ * isn't a socket and so can't use MSG_DONTWAIT.
+ */
+static void
+test_network_nonblocking(void)
+{
+    socket_type fds[2];
+    int pipefds[2];
+    char buffer[5];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        sysbail("cannot create socketpair");
+    if (!fdflag_nonblocking(fds[0], true) || !fdflag_nonblocking(fds[1], true))
+        sysbail("cannot set socketpair non-blocking");
+    alarm(10);
+    ok(network_write(fds[0], "hello", 5, 1),
+       "network_write on non-blocking socket");
+    ok(fcntl(fds[0], F_GETFL) & O_NONBLOCK,
+       "...and socket still non-blocking");
+    ok(network_read(fds[1], buffer, 5, 0)
+       && memcmp(buffer, "hello", 5) == 0,
+       "network_read on non-blocking socket");
+    socket_set_errno(0);
+    ok(!network_read(fds[1], buffer, 5, 1),
+       "network_read on non-blocking socket aborted with timeout");
+    is_int(ETIMEDOUT, socket_errno, "...with correct error");
+    socket_close(fds[0]);
+    socket_close(fds[1]);
+
+    /* Pipes aren't sockets, so these exercise the fallback. */
+    if (pipe(pipefds) < 0)
+        sysbail("cannot create pipe");
+    ok(network_write(pipefds[1], "hello", 5, 1), "network_write on pipe");
+    ok(network_read(pipefds[0], buffer, 5, 1)
+       && memcmp(buffer, "hello", 5) == 0,
+       "network_read on pipe");
+    alarm(0);
+    close(pipefds[0]);
+    close(pipefds[1]);
+}
+
+
 /*
  * Tests network_addr_compare.  Takes the expected result, the two addresses,
  * and the mask.
@@ -645,7 +722,7 @@ main(void)
     static const char *ipv6_addr = "FEDC:BA98:7654:3210:FEDC:BA98:7654:3210";
 #endif
 
-    plan(111);
+    plan(124);
 
     /*
      * If IPv6 support appears to be available but doesn't work, we have to
@@ -673,12 +750,17 @@ main(void)
     /* Test network_accept_any. */
     test_any();
 
+    /* Test binding multiple sockets with SO_REUSEPORT. */
+    test_reuseport();
+
     /* Test network_connect with a timeout. */
     test_timeout_ipv4();
 
-    /* Test network_read and network_write. */
+    /* Test network_read, network_write, and network_writev. */
     test_network_read();
-    test_network_write();
+    test_network_write(false);
+    test_network_write(true);
+    test_network_nonblocking();
 
     /*
      * Now, test network_sockaddr_sprint, network_sockaddr_equal, and
@@ -38,6 +38,9 @@
 /* A token for testing. */
 static const char token[] = { 3, 0, 0, 0, 5, 'h', 'e', 'l', 'l', 'o' };
 
+/* Size of a token too large for the token_recv_buffered read-ahead buffer. */
+#define BIG_TOKEN (100 * 1024)
+
 
 /*
  * Create a server socket, wait for a connection, and return the connected
@@ -140,10 +143,14 @@ main(void)
     char buffer[20];
     ssize_t length;
     gss_buffer_desc result;
+    struct token_buffer *tokens;
+    char *big;
+    OM_uint32 len;
+    int i;
 
     alarm(20);
 
-    plan(12);
+    plan(18);
     if (chdir(getenv("BUILD")) < 0)
         sysbail("can't chdir to BUILD");
 
@@ -239,6 +246,64 @@ main(void)
         socket_close(client);
     }
 
+    /*
+     * Send several tokens at once, including one larger than the read-ahead
+     * buffer, and read them through a token buffer.
+     */
+    unlink("server-ready");
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        server = create_server();
+        send_hand_token(server);
+        send_hand_token(server);
+        big = bmalloc(BIG_TOKEN + 5);
+        big[0] = 3;
+        len = htonl(BIG_TOKEN);
+        memcpy(big + 1, &len, 4);
+        memset(big + 5, 'b', BIG_TOKEN);
+        socket_xwrite(server, big, BIG_TOKEN + 5);
+        free(big);
+        send_hand_token(server);
+        socket_close(server);
+        exit(0);
+    } else {
+        client = create_client();
+        tokens = token_buffer_new();
+        ok(tokens != NULL, "created token buffer");
+        for (i = 0; i < 2; i++) {
+            status = token_recv_buffered(client, tokens, &flags, &result, 5,
+                                         0);
+            ok(status == TOKEN_OK && flags == 3 && result.length == 5
+               && memcmp(result.value, "hello", 5) == 0,
+               "buffered token %d", i + 1);
+            if (status == TOKEN_OK)
+                free(result.value);
+        }
+        status = token_recv_buffered(client, tokens, &flags, &result,
+                                     BIG_TOKEN, 1);
+        big = bmalloc(BIG_TOKEN);
+        memset(big, 'b', BIG_TOKEN);
+        ok(status == TOKEN_OK && result.length == BIG_TOKEN
+           && memcmp(result.value, big, BIG_TOKEN) == 0,
+           "buffered large token");
+        if (status == TOKEN_OK)
+            free(result.value);
+        free(big);
+        status = token_recv_buffered(client, tokens, &flags, &result, 5, 1);
+        ok(status == TOKEN_OK && result.length == 5
+           && memcmp(result.value, "hello", 5) == 0,
+           "buffered token after large token");
+        if (status == TOKEN_OK)
+            free(result.value);
+        status = token_recv_buffered(client, tokens, &flags, &result, 5, 0);
+        is_int(TOKEN_FAIL_EOF, status, "buffered end of file");
+        token_buffer_free(tokens);
+        waitpid(child, NULL, 0);
+        socket_close(client);
+    }
+
     /*
      * Test a timeout on sending a token.  We have to send a large enough
      * token that the network layer doesn't just buffer it.
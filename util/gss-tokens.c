@@ -19,6 +19,7 @@
 #include <portable/gssapi.h>
 #include <portable/socket.h>
 #include <portable/system.h>
+#include <portable/uio.h>
 
 #include <time.h>
 
@@ -37,6 +38,21 @@ enum token_status token_send(int, int, gss_buffer_t, time_t);
 enum token_status token_recv(int, int *, gss_buffer_t, size_t, time_t);
 #endif
 
+/*
+ * A reusable buffer in which tokens are assembled and wrapped.  The token
+ * data starts at offset, leaving room for the GSS-API header in front of it
+ * if iov is set and the token will be wrapped with gss_wrap_iov.  no_iov is
+ * set once gss_wrap_iov has reported that the mechanism doesn't support it
+ * so that we don't keep trying.
+ */
+struct token_wrap_buffer {
+    char *data;                 /* Allocated memory. */
+    size_t size;                /* Size of allocated memory. */
+    size_t offset;              /* Offset of the token data. */
+    bool iov;                   /* Whether to wrap with gss_wrap_iov. */
+    bool no_iov;                /* Whether gss_wrap_iov is unsupported. */
+};
+
 
 /*
  * Wraps, encrypts, and sends a data payload token.  Takes the file descriptor
@@ -86,6 +102,259 @@ token_send_priv(socket_type fd, gss_ctx_id_t ctx, int flags, gss_buffer_t tok,
 }
 
 
+/*
+ * Allocate a new, empty wrap buffer.  Memory for the data is allocated as
+ * needed when sending tokens.  Returns NULL on memory allocation failure.
+ */
+struct token_wrap_buffer *
+token_wrap_buffer_new(void)
+{
+    struct token_wrap_buffer *buffer;
+
+    buffer = malloc(sizeof(struct token_wrap_buffer));
+    if (buffer == NULL)
+        return NULL;
+    buffer->data = NULL;
+    buffer->size = 0;
+    buffer->offset = 0;
+    buffer->iov = false;
+    buffer->no_iov = false;
+    return buffer;
+}
+
+
+/*
+ * Free a wrap buffer.
+ */
+void
+token_wrap_buffer_free(struct token_wrap_buffer *buffer)
+{
+    if (buffer == NULL)
+        return;
+    free(buffer->data);
+    free(buffer);
+}
+
+
+/*
+ * Ensure that a wrap buffer has room for at least size bytes.  Returns false
+ * on memory allocation failure.
+ */
+static bool
+token_wrap_buffer_resize(struct token_wrap_buffer *buffer, size_t size)
+{
+    char *data;
+
+    if (size <= buffer->size)
+        return true;
+    data = realloc(buffer->data, size);
+    if (data == NULL)
+        return false;
+    buffer->data = data;
+    buffer->size = size;
+    return true;
+}
+
+
+#ifdef HAVE_GSS_WRAP_IOV
+/*
+ * Ask the mechanism how much room it needs around length bytes of data when
+ * wrapping them with gss_wrap_iov.  On success, the lengths of the header,
+ * padding, and trailer are in the first, third, and fourth elements of wrap.
+ * Sets no_iov in the buffer if the mechanism doesn't support gss_wrap_iov.
+ */
+static OM_uint32
+token_wrap_iov_length(struct token_wrap_buffer *buffer, gss_ctx_id_t ctx,
+                      size_t length, gss_iov_buffer_desc wrap[4],
+                      OM_uint32 *minor)
+{
+    OM_uint32 major;
+
+    wrap[0].type = GSS_IOV_BUFFER_TYPE_HEADER;
+    wrap[1].type = GSS_IOV_BUFFER_TYPE_DATA;
+    wrap[1].buffer.length = length;
+    wrap[1].buffer.value = NULL;
+    wrap[2].type = GSS_IOV_BUFFER_TYPE_PADDING;
+    wrap[3].type = GSS_IOV_BUFFER_TYPE_TRAILER;
+    major = gss_wrap_iov_length(minor, ctx, 1, GSS_C_QOP_DEFAULT, NULL,
+                                wrap, 4);
+    if (major == GSS_S_UNAVAILABLE)
+        buffer->no_iov = true;
+    return major;
+}
+
+
+/*
+ * Wrap length bytes of data at the offset in the wrap buffer in place using
+ * gss_wrap_iov, laying out the GSS-API header, the data, the padding, and
+ * the trailer so that together they form the same token that gss_wrap would
+ * have returned.  On success, sets out to point into the wrap buffer and
+ * returns TOKEN_OK.  If the mechanism doesn't support gss_wrap_iov, sets
+ * no_iov in the buffer and returns TOKEN_FAIL_GSSAPI.
+ */
+static enum token_status
+token_wrap_iov(struct token_wrap_buffer *buffer, gss_ctx_id_t ctx,
+               size_t length, gss_buffer_t out, OM_uint32 *major,
+               OM_uint32 *minor)
+{
+    gss_iov_buffer_desc wrap[4];
+    size_t header, padding, trailer, offset;
+
+    /*
+     * Get the sizes for the actual length of the data.  The header normally
+     * has the size we left room for, but move the data if it doesn't.
+     */
+    *major = token_wrap_iov_length(buffer, ctx, length, wrap, minor);
+    if (*major != GSS_S_COMPLETE)
+        return TOKEN_FAIL_GSSAPI;
+    header = wrap[0].buffer.length;
+    padding = wrap[2].buffer.length;
+    trailer = wrap[3].buffer.length;
+    if (!token_wrap_buffer_resize(buffer, header + length + padding + trailer))
+        return TOKEN_FAIL_SYSTEM;
+    if (header != buffer->offset) {
+        memmove(buffer->data + header, buffer->data + buffer->offset, length);
+        buffer->offset = header;
+    }
+
+    /* Wrap the data. */
+    wrap[0].buffer.value = buffer->data;
+    wrap[1].buffer.value = buffer->data + header;
+    wrap[2].buffer.value = buffer->data + header + length;
+    wrap[3].buffer.value = buffer->data + header + length + padding;
+    *major = gss_wrap_iov(minor, ctx, 1, GSS_C_QOP_DEFAULT, NULL, wrap, 4);
+    if (*major == GSS_S_UNAVAILABLE)
+        buffer->no_iov = true;
+    if (*major != GSS_S_COMPLETE)
+        return TOKEN_FAIL_GSSAPI;
+
+    /*
+     * The mechanism may have used less padding than it asked for, in which
+     * case the trailer has to be moved down to follow it.
+     */
+    offset = header + length + wrap[2].buffer.length;
+    if (wrap[2].buffer.length < padding && wrap[3].buffer.length > 0)
+        memmove(buffer->data + offset, wrap[3].buffer.value,
+                wrap[3].buffer.length);
+    out->value = buffer->data;
+    out->length = offset + wrap[3].buffer.length;
+    return TOKEN_OK;
+}
+#endif /* HAVE_GSS_WRAP_IOV */
+
+
+/*
+ * Prepare a wrap buffer to hold up to length bytes of token data and return a
+ * pointer to where the caller should store the data, which is then sent with
+ * token_send_priv_prepared.  If gss_wrap_iov will be used, room is left in
+ * front of the data for the GSS-API header so that the data can be wrapped
+ * where it is, which lets the caller read data directly into the buffer
+ * without copying it again.  Returns NULL on memory allocation failure.
+ */
+char *
+token_wrap_buffer_prepare(struct token_wrap_buffer *buffer, gss_ctx_id_t ctx,
+                          size_t length)
+{
+    size_t header = 0;
+    size_t extra = 0;
+#ifdef HAVE_GSS_WRAP_IOV
+    gss_iov_buffer_desc wrap[4];
+    OM_uint32 minor;
+
+    buffer->iov = false;
+    if (!buffer->no_iov)
+        if (token_wrap_iov_length(buffer, ctx, length, wrap, &minor)
+            == GSS_S_COMPLETE) {
+            buffer->iov = true;
+            header = wrap[0].buffer.length;
+            extra = wrap[2].buffer.length + wrap[3].buffer.length;
+        }
+#endif
+    if (!token_wrap_buffer_resize(buffer, header + length + extra))
+        return NULL;
+    buffer->offset = header;
+    return buffer->data + header;
+}
+
+
+/*
+ * The same as token_send_priv, but sends the length bytes of data stored in
+ * the wrap buffer at the pointer returned by token_wrap_buffer_prepare,
+ * wrapping them in place with gss_wrap_iov if possible.  length must not be
+ * larger than the length passed to token_wrap_buffer_prepare.
+ */
+enum token_status
+token_send_priv_prepared(socket_type fd, struct token_wrap_buffer *buffer,
+                         gss_ctx_id_t ctx, int flags, size_t length,
+                         time_t timeout, OM_uint32 *major, OM_uint32 *minor)
+{
+    gss_buffer_desc tok;
+#ifdef HAVE_GSS_WRAP_IOV
+    enum token_status status;
+#endif
+
+    if (length > TOKEN_MAX_DATA)
+        return TOKEN_FAIL_LARGE;
+
+    /*
+     * Use gss_wrap_iov unless we know it's not supported.  The remctl v1 MIC
+     * hack needs the original data after wrapping, so leave that case to
+     * token_send_priv.
+     */
+#ifdef HAVE_GSS_WRAP_IOV
+    if (buffer->iov
+        && !((flags & TOKEN_SEND_MIC) && !(flags & TOKEN_PROTOCOL))) {
+        status = token_wrap_iov(buffer, ctx, length, &tok, major, minor);
+        if (status == TOKEN_OK)
+            return token_send(fd, flags, &tok, timeout);
+        if (!buffer->no_iov)
+            return status;
+    }
+#endif
+
+    /* Fall back on using gss_wrap. */
+    tok.value = buffer->data + buffer->offset;
+    tok.length = length;
+    return token_send_priv(fd, ctx, flags, &tok, timeout, major, minor);
+}
+
+
+/*
+ * The same as token_send_priv, but takes the token data as an array of
+ * iovecs and assembles and wraps the token in the provided wrap buffer,
+ * which can be reused for all tokens sent on a connection.  Where the
+ * GSS-API library and mechanism support gss_wrap_iov, the data is copied
+ * once and encrypted in place, avoiding any memory allocation once the
+ * buffer is large enough.  Otherwise, the data is gathered into the buffer
+ * and sent with token_send_priv.
+ */
+enum token_status
+token_send_priv_iov(socket_type fd, struct token_wrap_buffer *buffer,
+                    gss_ctx_id_t ctx, int flags, const struct iovec *iov,
+                    int count, time_t timeout, OM_uint32 *major,
+                    OM_uint32 *minor)
+{
+    char *data;
+    size_t length;
+    int i;
+
+    length = 0;
+    for (i = 0; i < count; i++)
+        length += iov[i].iov_len;
+    if (length > TOKEN_MAX_DATA)
+        return TOKEN_FAIL_LARGE;
+    data = token_wrap_buffer_prepare(buffer, ctx, length);
+    if (data == NULL)
+        return TOKEN_FAIL_SYSTEM;
+    for (i = 0; i < count; i++) {
+        memcpy(data, iov[i].iov_base, iov[i].iov_len);
+        data += iov[i].iov_len;
+    }
+    return token_send_priv_prepared(fd, buffer, ctx, flags, length, timeout,
+                                    major, minor);
+}
+
+
 /*
  * Receives and unwraps a data payload token.  Takes the file descriptor,
  * GSS-API context, a pointer into which to storge the flags, a buffer for the
@@ -103,12 +372,30 @@ enum token_status
 token_recv_priv(socket_type fd, gss_ctx_id_t ctx, int *flags,
                 gss_buffer_t tok, size_t max, time_t timeout,
                 OM_uint32 *major, OM_uint32 *minor)
+{
+    return token_recv_priv_buffered(fd, NULL, ctx, flags, tok, max, timeout,
+                                    major, minor);
+}
+
+
+/*
+ * The same as token_recv_priv, but reads the token through the given token
+ * buffer using token_recv_buffered.  buffer may be NULL to not buffer.
+ */
+enum token_status
+token_recv_priv_buffered(socket_type fd, struct token_buffer *buffer,
+                         gss_ctx_id_t ctx, int *flags, gss_buffer_t tok,
+                         size_t max, time_t timeout, OM_uint32 *major,
+                         OM_uint32 *minor)
 {
     gss_buffer_desc in, mic;
     int state;
     enum token_status status;
 
-    status = token_recv(fd, flags, &in, max, timeout);
+    if (buffer == NULL)
+        status = token_recv(fd, flags, &in, max, timeout);
+    else
+        status = token_recv_buffered(fd, buffer, flags, &in, max, timeout);
     if (status != TOKEN_OK)
         return status;
     *major = gss_unwrap(minor, ctx, &in, tok, &state, NULL);
@@ -18,6 +18,10 @@
 #include <portable/socket.h>
 #include <util/tokens.h>
 
+/* Forward declarations to avoid unnecessary includes. */
+struct iovec;
+struct token_wrap_buffer;
+
 BEGIN_DECLS
 
 /* Default to a hidden visibility for all util functions. */
@@ -37,6 +41,35 @@ enum token_status token_recv_priv(socket_type, gss_ctx_id_t, int *flags,
                                   gss_buffer_t, size_t max, time_t,
                                   OM_uint32 *, OM_uint32 *);
 
+/* The same as token_recv_priv, but using token_recv_buffered. */
+enum token_status token_recv_priv_buffered(socket_type, struct token_buffer *,
+                                           gss_ctx_id_t, int *flags,
+                                           gss_buffer_t, size_t max, time_t,
+                                           OM_uint32 *, OM_uint32 *);
+
+/*
+ * Sending a token given as an array of iovecs, wrapping it in place in a wrap
+ * buffer that can be reused for every token sent on a connection.
+ */
+struct token_wrap_buffer *token_wrap_buffer_new(void);
+void token_wrap_buffer_free(struct token_wrap_buffer *);
+enum token_status token_send_priv_iov(socket_type, struct token_wrap_buffer *,
+                                      gss_ctx_id_t, int flags,
+                                      const struct iovec *, int count,
+                                      time_t, OM_uint32 *, OM_uint32 *);
+
+/*
+ * Sending a token whose data has been stored directly in a wrap buffer at
+ * the location returned by token_wrap_buffer_prepare.
+ */
+char *token_wrap_buffer_prepare(struct token_wrap_buffer *, gss_ctx_id_t,
+                                size_t length);
+enum token_status token_send_priv_prepared(socket_type,
+                                           struct token_wrap_buffer *,
+                                           gss_ctx_id_t, int flags,
+                                           size_t length, time_t,
+                                           OM_uint32 *, OM_uint32 *);
+
 /* Undo default visibility change. */
 #pragma GCC visibility pop
 
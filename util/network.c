@@ -46,21 +46,16 @@
 #include <config.h>
 #include <portable/system.h>
 #include <portable/socket.h>
+#include <portable/uio.h>
 
 #include <errno.h>
-#ifdef HAVE_SYS_SELECT_H
-# include <sys/select.h>
-#endif
-#ifdef HAVE_SYS_TIME_H
-# include <sys/time.h>
-#endif
+#include <limits.h>
 #include <time.h>
 
 #include <util/fdflag.h>
 #include <util/messages.h>
 #include <util/network.h>
 #include <util/xmalloc.h>
-#include <util/xwrite.h>
 
 /* Macros to set the len attribute of sockaddrs. */
 #if HAVE_STRUCT_SOCKADDR_SA_LEN
@@ -77,16 +72,66 @@
 #endif
 
 /*
- * Windows requires a different function when sending to sockets, but can't
- * return short writes on blocking sockets.
+ * The number of sockets network_accept_any can wait for without allocating
+ * memory.
+ */
+#define NETWORK_POLL_SMALL 8
+
+/*
+ * Whether to set SO_REUSEPORT on sockets created by the bind functions.  Set
+ * with network_bind_reuseport.  If SO_REUSEPORT isn't available, make calls
+ * to set_reuseport go away.
+ */
+#ifdef SO_REUSEPORT
+static bool network_reuseport = false;
+#else
+# define network_set_reuseport(fd)      /* empty */
+#endif
+
+/*
+ * Flag to make a single send or recv non-blocking without changing the mode
+ * of the socket, so that network_read and network_write can enforce a
+ * timeout without two fcntl calls per call.  If it isn't available, or if
+ * the descriptor turns out not to be a socket, the write functions instead
+ * set the descriptor non-blocking for the duration of the write.
  */
+#ifdef MSG_DONTWAIT
+# define NETWORK_NOWAIT                 MSG_DONTWAIT
+#else
+# define NETWORK_NOWAIT                 0
+#endif
+
+/* Windows sockets take the length of the buffer as an int. */
 #ifdef _WIN32
-# define socket_xwrite(fd, b, s)        send((fd), (b), (s), 0)
+# define socket_recv(fd, b, s, f)       recv((fd), (b), (int) (s), (f))
+# define socket_send(fd, b, s, f)       send((fd), (b), (int) (s), (f))
 #else
-# define socket_xwrite(fd, b, s)        xwrite((fd), (b), (s))
+# define socket_recv(fd, b, s, f)       recv((fd), (b), (s), (f))
+# define socket_send(fd, b, s, f)       send((fd), (b), (s), (f))
 #endif
 
 
+/*
+ * Wait for a socket to become ready for the given poll events or for the
+ * timeout (in seconds) to expire.  A timeout of 0 waits forever.  Returns the
+ * result of poll: positive if the socket is ready, 0 on timeout, and -1 on
+ * error, setting socket_errno.  Unlike select, poll has no limit on the value
+ * of the file descriptor.
+ */
+static int
+network_wait(socket_type fd, short events, time_t timeout)
+{
+    struct pollfd pfd;
+
+    if (timeout > INT_MAX / 1000)
+        timeout = INT_MAX / 1000;
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    return socket_poll(&pfd, 1, (timeout == 0) ? -1 : (int) timeout * 1000);
+}
+
+
 /*
  * Set SO_REUSEADDR on a socket if possible (so that something new can listen
  * on the same port immediately if the daemon dies unexpectedly).
@@ -104,6 +149,42 @@ network_set_reuseaddr(socket_type fd)
 #endif
 
 
+/*
+ * Set SO_REUSEPORT on a socket if requested with network_bind_reuseport.
+ */
+#ifdef SO_REUSEPORT
+static void
+network_set_reuseport(socket_type fd)
+{
+    int flag = 1;
+    const void *flagaddr = &flag;
+
+    if (!network_reuseport)
+        return;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, flagaddr, sizeof(flag)) < 0)
+        syswarn("cannot mark bind port reusable");
+}
+#endif
+
+
+/*
+ * Set whether the bind functions should set SO_REUSEPORT on the sockets they
+ * create, allowing several sockets to be bound to the same address and port
+ * so that the kernel spreads incoming connections between them.  Returns
+ * false if SO_REUSEPORT isn't supported on this platform.
+ */
+bool
+network_bind_reuseport(bool flag)
+{
+#ifdef SO_REUSEPORT
+    network_reuseport = flag;
+    return true;
+#else
+    return !flag;
+#endif
+}
+
+
 /*
  * Create an IPv4 socket and bind it, returning the resulting file descriptor
  * (or INVALID_SOCKET on a failure).
@@ -122,6 +203,7 @@ network_bind_ipv4(const char *address, unsigned short port)
         return INVALID_SOCKET;
     }
     network_set_reuseaddr(fd);
+    network_set_reuseport(fd);
 
     /* Accept "any" or "all" in the bind address to mean 0.0.0.0. */
     if (!strcmp(address, "any") || !strcmp(address, "all"))
@@ -175,6 +257,7 @@ network_bind_ipv6(const char *address, unsigned short port)
         return INVALID_SOCKET;
     }
     network_set_reuseaddr(fd);
+    network_set_reuseport(fd);
 
     /*
      * Restrict the socket to IPv6 only if possible.  The default behavior is
@@ -346,27 +429,38 @@ socket_type
 network_accept_any(socket_type fds[], unsigned int count,
                    struct sockaddr *addr, socklen_t *addrlen)
 {
-    fd_set readfds;
-    socket_type maxfd, fd;
+    struct pollfd small[NETWORK_POLL_SMALL];
+    struct pollfd *pfds;
+    socket_type fd;
     unsigned int i;
-    int status;
+    int status, oerrno;
 
-    FD_ZERO(&readfds);
-    maxfd = -1;
+    /* Avoid an allocation for the common case of only a few sockets. */
+    if (count <= NETWORK_POLL_SMALL)
+        pfds = small;
+    else {
+        pfds = malloc(count * sizeof(struct pollfd));
+        if (pfds == NULL)
+            return INVALID_SOCKET;
+    }
     for (i = 0; i < count; i++) {
-        FD_SET(fds[i], &readfds);
-        if (fds[i] > maxfd)
-            maxfd = fds[i];
+        pfds[i].fd = fds[i];
+        pfds[i].events = POLLIN;
+        pfds[i].revents = 0;
     }
-    status = select(maxfd + 1, &readfds, NULL, NULL, NULL);
-    if (status < 0)
-        return INVALID_SOCKET;
+    status = socket_poll(pfds, count, -1);
     fd = INVALID_SOCKET;
-    for (i = 0; i < count; i++)
-        if (FD_ISSET(fds[i], &readfds)) {
-            fd = fds[i];
-            break;
-        }
+    if (status > 0)
+        for (i = 0; i < count; i++)
+            if (pfds[i].revents != 0) {
+                fd = fds[i];
+                break;
+            }
+    if (pfds != small) {
+        oerrno = socket_errno;
+        free(pfds);
+        socket_set_errno(oerrno);
+    }
     if (fd == INVALID_SOCKET)
         return INVALID_SOCKET;
     else
@@ -429,8 +523,6 @@ network_connect(struct addrinfo *ai, const char *source, time_t timeout)
     socket_type fd = INVALID_SOCKET;
     int oerrno, status, err;
     socklen_t len;
-    struct timeval tv;
-    fd_set set;
 
     for (status = -1; status != 0 && ai != NULL; ai = ai->ai_next) {
         if (fd != INVALID_SOCKET)
@@ -446,15 +538,11 @@ network_connect(struct addrinfo *ai, const char *source, time_t timeout)
             fdflag_nonblocking(fd, true);
             status = connect(fd, ai->ai_addr, ai->ai_addrlen);
             if (status < 0 && socket_errno == EINPROGRESS) {
-                tv.tv_sec = timeout;
-                tv.tv_usec = 0;
-                FD_ZERO(&set);
-                FD_SET(fd, &set);
-                status = select(fd + 1, NULL, &set, NULL, &tv);
-                if (status == 0 && !FD_ISSET(fd, &set)) {
+                status = network_wait(fd, POLLOUT, timeout);
+                if (status == 0) {
                     status = -1;
                     socket_set_errno(ETIMEDOUT);
-                } else if (status > 0 && FD_ISSET(fd, &set)) {
+                } else if (status > 0) {
                     len = sizeof(err);
                     status = getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
                     if (status == 0) {
@@ -537,87 +625,79 @@ network_client_create(int domain, int type, const char *source)
 
 
 /*
- * Equivalent to read, but reads all the available data up to the buffer
- * length, using multiple reads if needed and handling EINTR and EAGAIN.  If
- * we get EOF before we get enough data, set the socket errno to EPIPE.
+ * Compute how long to wait for the socket given the overall timeout and the
+ * time the operation started.  Returns 0 to wait forever if there is no
+ * timeout, and otherwise always waits for at least a second.
  */
-static ssize_t
-socket_xread(socket_type fd, void *buffer, size_t size)
+static time_t
+network_remaining(time_t start, time_t timeout)
 {
-    size_t total;
-    ssize_t status;
-    int count = 0;
-
-    /* Abort the read if we try 100 times with no forward progress. */
-    for (total = 0, status = 0; total < size; total += status) {
-        if (++count > 100)
-            break;
-        status = socket_read(fd, (char *) buffer + total, size - total);
-        if (status > 0)
-            count = 0;
-        else if (status == 0)
-            break;
-        else {
-            if ((socket_errno != EINTR) && (socket_errno != EAGAIN))
-                break;
-            status = 0;
-        }
-    }
-    if (status == 0 && total < size)
-        socket_set_errno(EPIPE);
-    return (total < size) ? -1 : (ssize_t) total;
+    time_t wait;
+
+    if (timeout == 0)
+        return 0;
+    wait = timeout - (time(NULL) - start);
+    return (wait < 1) ? 1 : wait;
 }
 
 
 /*
  * Read the specified number of bytes from the network, enforcing a timeout
- * (in seconds).  We use select to wait for data to become available and then
- * keep reading until either we time out or we've gotten all the data we're
- * looking for.  timeout may be 0 to never time out.  Return true on success
+ * (in seconds).  timeout may be 0 to never time out.  Return true on success
  * and false (setting socket_errno) on failure.
+ *
+ * We try the read first and only use poll to wait for data if the socket
+ * has nothing for us, so a read of data that has already arrived costs one
+ * system call.  This works whether or not the socket is non-blocking.  If
+ * there is a timeout, each read is done with MSG_DONTWAIT so that a blocking
+ * socket can't block past it.  Without MSG_DONTWAIT, or if the descriptor
+ * isn't a socket, poll before each read instead.
  */
 bool
 network_read(socket_type fd, void *buffer, size_t total, time_t timeout)
 {
-    time_t start, now;
-    fd_set set;
-    struct timeval tv;
+    time_t start;
     size_t got = 0;
     ssize_t status;
+    int flags = (timeout == 0) ? 0 : NETWORK_NOWAIT;
+    bool ready = (timeout == 0 || NETWORK_NOWAIT != 0);
 
-    /* If there's no timeout, do this the easy way. */
-    if (timeout == 0)
-        return (socket_xread(fd, buffer, total) >= 0);
-
-    /* The hard way.  We try to apply the timeout on the whole read. */
     start = time(NULL);
-    now = start;
     do {
-        FD_ZERO(&set);
-        FD_SET(fd, &set);
-        tv.tv_sec = timeout - (now - start);
-        if (tv.tv_sec < 1)
-            tv.tv_sec = 1;
-        tv.tv_usec = 0;
-        status = select(fd + 1, &set, NULL, NULL, &tv);
-        if (status < 0)
-            return false;
-        else if (status == 0) {
-            socket_set_errno(ETIMEDOUT);
-            return false;
+        if (!ready) {
+            status = network_wait(fd, POLLIN,
+                                  network_remaining(start, timeout));
+            if (status < 0)
+                return false;
+            else if (status == 0) {
+                socket_set_errno(ETIMEDOUT);
+                return false;
+            }
         }
-        status = socket_read(fd, (char *) buffer + got, total - got);
-        if (status < 0)
-            return false;
-        else if (status == 0) {
+        if (flags == 0)
+            status = socket_read(fd, (char *) buffer + got, total - got);
+        else
+            status = socket_recv(fd, (char *) buffer + got, total - got,
+                                 flags);
+        if (status < 0) {
+            if (flags != 0 && socket_errno == ENOTSOCK) {
+                flags = 0;
+                ready = false;
+                continue;
+            }
+            if (socket_errno != EINTR && socket_errno != EAGAIN)
+                return false;
+            ready = (socket_errno == EINTR);
+            continue;
+        } else if (status == 0) {
             socket_set_errno(EPIPE);
             return false;
         }
         got += status;
         if (got == total)
             return true;
-        now = time(NULL);
-    } while (now - start < timeout);
+        ready = (timeout == 0);
+    } while (timeout == 0 || time(NULL) - start < timeout);
     socket_set_errno(ETIMEDOUT);
     return false;
 }
@@ -625,61 +705,203 @@ network_read(socket_type fd, void *buffer, size_t total, time_t timeout)
 
 /*
  * Write the specified number of bytes from the network, enforcing a timeout
- * (in seconds).  We use select to wait for the socket to become available and
- * then keep reading until either we time out or we've sent all the data.
- * timeout may be 0 to never time out.  Return true on success and false
- * (setting socket_errno) on failure.
+ * (in seconds).  timeout may be 0 to never time out.  Return true on success
+ * and false (setting socket_errno) on failure.
+ *
+ * As with network_read, we try the write first and only poll if the socket
+ * buffer is full, so the common case of a write that fits in the buffer is a
+ * single system call.  If there is a timeout, each write is done with
+ * MSG_DONTWAIT so that the mode of the socket doesn't have to be changed.
+ * Without MSG_DONTWAIT, or if the descriptor isn't a socket, fall back on
+ * setting it non-blocking for the duration of the write and polling before
+ * each write.
  */
 bool
 network_write(socket_type fd, const void *buffer, size_t total, time_t timeout)
 {
-    time_t start, now;
-    fd_set set;
-    struct timeval tv;
+    time_t start;
     size_t sent = 0;
     ssize_t status;
+    int flags = (timeout == 0) ? 0 : NETWORK_NOWAIT;
+    bool ready = (timeout == 0 || NETWORK_NOWAIT != 0);
+    bool toggled = !ready;
     int err;
 
-    /* If there's no timeout, do this the easy way. */
-    if (timeout == 0)
-        return (socket_xwrite(fd, buffer, total) >= 0);
-
-    /* The hard way.  We try to apply the timeout on the whole write. */
-    fdflag_nonblocking(fd, true);
+    if (toggled)
+        fdflag_nonblocking(fd, true);
     start = time(NULL);
-    now = start;
     do {
-        FD_ZERO(&set);
-        FD_SET(fd, &set);
-        tv.tv_sec = timeout - (now - start);
-        if (tv.tv_sec < 1)
-            tv.tv_sec = 1;
-        tv.tv_usec = 0;
-        status = select(fd + 1, NULL, &set, NULL, &tv);
-        if (status < 0)
-            goto fail;
-        else if (status == 0) {
-            socket_set_errno(ETIMEDOUT);
-            goto fail;
+        if (!ready) {
+            status = network_wait(fd, POLLOUT,
+                                  network_remaining(start, timeout));
+            if (status < 0)
+                goto fail;
+            else if (status == 0) {
+                socket_set_errno(ETIMEDOUT);
+                goto fail;
+            }
+        }
+        if (flags == 0)
+            status = socket_write(fd, (const char *) buffer + sent,
+                                  total - sent);
+        else
+            status = socket_send(fd, (const char *) buffer + sent,
+                                 total - sent, flags);
+        if (status < 0) {
+            if (flags != 0 && socket_errno == ENOTSOCK) {
+                flags = 0;
+                ready = false;
+                toggled = true;
+                fdflag_nonblocking(fd, true);
+                continue;
+            }
+            if (socket_errno != EINTR && socket_errno != EAGAIN)
+                goto fail;
+            ready = (socket_errno == EINTR);
+            continue;
         }
-        status = socket_write(fd, (const char *) buffer + sent, total - sent);
-        if (status < 0)
-            goto fail;
         sent += status;
         if (sent == total) {
-            fdflag_nonblocking(fd, false);
+            if (toggled)
+                fdflag_nonblocking(fd, false);
+            return true;
+        }
+        ready = (timeout == 0);
+    } while (timeout == 0 || time(NULL) - start < timeout);
+    socket_set_errno(ETIMEDOUT);
+
+fail:
+    err = socket_errno;
+    if (toggled)
+        fdflag_nonblocking(fd, false);
+    socket_set_errno(err);
+    return false;
+}
+
+
+/*
+ * Write the data described by an array of iovecs to the network, enforcing a
+ * timeout (in seconds) on the whole write.  This works like network_write,
+ * but lets the caller send data from several buffers in a single system call
+ * without copying it.  The iovec array is not modified.  timeout may be 0 to
+ * never time out.  Return true on success and false (setting socket_errno) on
+ * failure.
+ */
+#ifdef _WIN32
+bool
+network_writev(socket_type fd, const struct iovec iov[], int iovcnt,
+               time_t timeout)
+{
+    int i;
+
+    /* Windows has no writev for sockets, so just send each buffer. */
+    for (i = 0; i < iovcnt; i++)
+        if (iov[i].iov_len > 0)
+            if (!network_write(fd, iov[i].iov_base, iov[i].iov_len, timeout))
+                return false;
+    return true;
+}
+#else
+bool
+network_writev(socket_type fd, const struct iovec iov[], int iovcnt,
+               time_t timeout)
+{
+    time_t start;
+    struct iovec *tmpiov = NULL;
+    struct msghdr msg;
+    size_t skip, length;
+    ssize_t status;
+    int i = 0;
+    int left = iovcnt;
+    int flags = (timeout == 0) ? 0 : NETWORK_NOWAIT;
+    bool ready = (timeout == 0 || NETWORK_NOWAIT != 0);
+    bool toggled = !ready;
+    int err;
+
+    /*
+     * Most of the time the first write will send everything.  If it doesn't,
+     * copy the rest of the iovec array so that we can adjust the first
+     * partially written buffer.  Use sendmsg rather than writev when we need
+     * to pass MSG_DONTWAIT.
+     */
+    if (toggled)
+        fdflag_nonblocking(fd, true);
+    memset(&msg, 0, sizeof(msg));
+    start = time(NULL);
+    do {
+        if (!ready) {
+            status = network_wait(fd, POLLOUT,
+                                  network_remaining(start, timeout));
+            if (status < 0)
+                goto fail;
+            else if (status == 0) {
+                socket_set_errno(ETIMEDOUT);
+                goto fail;
+            }
+        }
+        if (tmpiov == NULL)
+            msg.msg_iov = (struct iovec *) iov + i;
+        else
+            msg.msg_iov = tmpiov + i;
+        msg.msg_iovlen = left;
+        if (flags == 0)
+            status = writev(fd, msg.msg_iov, left);
+        else
+            status = sendmsg(fd, &msg, flags);
+        if (status < 0) {
+            if (flags != 0 && errno == ENOTSOCK) {
+                flags = 0;
+                ready = false;
+                toggled = true;
+                fdflag_nonblocking(fd, true);
+                continue;
+            }
+            if (errno != EINTR && errno != EAGAIN)
+                goto fail;
+            ready = (errno == EINTR);
+            continue;
+        }
+
+        /* Skip over the buffers that were completely written. */
+        skip = status;
+        while (left > 0) {
+            length = (tmpiov == NULL) ? iov[i].iov_len : tmpiov[i].iov_len;
+            if (skip < length)
+                break;
+            skip -= length;
+            i++;
+            left--;
+        }
+        if (left == 0) {
+            free(tmpiov);
+            if (toggled)
+                fdflag_nonblocking(fd, false);
             return true;
         }
-        now = time(NULL);
-    } while (now - start < timeout);
+        if (skip > 0) {
+            if (tmpiov == NULL) {
+                tmpiov = malloc(left * sizeof(struct iovec));
+                if (tmpiov == NULL)
+                    goto fail;
+                memcpy(tmpiov, iov + i, left * sizeof(struct iovec));
+                i = 0;
+            }
+            tmpiov[i].iov_base = (char *) tmpiov[i].iov_base + skip;
+            tmpiov[i].iov_len -= skip;
+        }
+        ready = (timeout == 0);
+    } while (timeout == 0 || time(NULL) - start < timeout);
     socket_set_errno(ETIMEDOUT);
 
 fail:
     err = socket_errno;
-    fdflag_nonblocking(fd, false);
+    free(tmpiov);
+    if (toggled)
+        fdflag_nonblocking(fd, false);
     socket_set_errno(err);
     return false;
 }
+#endif /* !_WIN32 */
 
 
 /*
@@ -38,6 +38,9 @@
 
 #include <sys/types.h>
 
+/* Forward declaration to avoid an include. */
+struct iovec;
+
 BEGIN_DECLS
 
 /* Default to a hidden visibility for all util functions. */
@@ -54,6 +57,14 @@ socket_type network_bind_ipv4(const char *address, unsigned short port)
 socket_type network_bind_ipv6(const char *address, unsigned short port)
     __attribute__((__nonnull__));
 
+/*
+ * Set whether sockets created by the bind functions get SO_REUSEPORT, so that
+ * several sockets can be bound to the same address and port and the kernel
+ * distributes incoming connections between them.  Returns false if that
+ * isn't supported on this platform.
+ */
+bool network_bind_reuseport(bool);
+
 /*
  * Create and bind sockets for every local address (normally two, one for IPv4
  * and one for IPv6, if IPv6 support is enabled).  If IPv6 is not enabled,
@@ -112,15 +123,23 @@ socket_type network_client_create(int domain, int type, const char *source);
  * timeout.  Both return true on success and false on failure; on failure, the
  * socket errno is set.
  *
- * network_write will set the file descriptor non-blocking and then set it
- * back to blocking at the conclusion of the write, so don't use this function
- * with file descriptors that should stay non-blocking.
+ * Both work with either blocking or non-blocking sockets and leave the mode
+ * of the socket alone, so a connection may be set non-blocking once and left
+ * that way.  On platforms without MSG_DONTWAIT, network_write with a timeout
+ * sets the socket back to blocking when it's done.
  */
 bool network_read(socket_type, void *, size_t, time_t)
     __attribute__((__nonnull__));
 bool network_write(socket_type, const void *, size_t, time_t)
     __attribute__((__nonnull__));
 
+/*
+ * Like network_write, but write the data from an array of iovecs, sending
+ * them in a single system call where possible.
+ */
+bool network_writev(socket_type, const struct iovec[], int, time_t)
+    __attribute__((__nonnull__));
+
 /*
  * Put an ASCII representation of the address in a sockaddr into the provided
  * buffer, which should hold at least INET6_ADDRSTRLEN characters.
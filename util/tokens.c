@@ -17,8 +17,10 @@
 #include <portable/gssapi.h>
 #include <portable/socket.h>
 #include <portable/system.h>
+#include <portable/uio.h>
 
 #include <errno.h>
+#include <limits.h>
 #include <time.h>
 
 #include <util/messages.h>
@@ -26,6 +28,23 @@
 #include <util/tokens.h>
 #include <util/xwrite.h>
 
+/*
+ * The size of the read-ahead buffer used by token_recv_buffered.  This is
+ * large enough to hold a maximum-size data token plus its GSS-API wrapping
+ * in the common case, so most tokens can be read with a single read.
+ */
+#define TOKEN_BUFFER_SIZE (64 * 1024 + 1024)
+
+/*
+ * Buffered data read from a connection but not yet returned as a token.  The
+ * unread data starts at offset and is left bytes long.
+ */
+struct token_buffer {
+    char *data;
+    size_t offset;
+    size_t left;
+};
+
 
 /*
  * Given a socket errno, map it to one of our error codes.
@@ -50,27 +69,26 @@ map_socket_error(int err)
  * and writes them to the file descriptor.  Returns TOKEN_OK on success and
  * TOKEN_FAIL_SYSTEM, TOKEN_FAIL_SOCKET, or TOKEN_FAIL_TIMEOUT on an error
  * (including partial writes).
+ *
+ * The header and the token data are sent together with a single writev
+ * rather than copying the token into a new buffer after the header.
  */
 enum token_status
 token_send(socket_type fd, int flags, gss_buffer_t tok, time_t timeout)
 {
-    size_t buflen;
-    char *buffer;
-    bool okay;
-    unsigned char char_flags = (unsigned char) flags;
+    unsigned char header[1 + sizeof(OM_uint32)];
+    struct iovec iov[2];
     OM_uint32 len = htonl(tok->length);
 
-    /* Send out the whole message in a single write. */
-    buflen = 1 + sizeof(OM_uint32) + tok->length;
-    buffer = malloc(buflen);
-    if (buffer == NULL)
-        return TOKEN_FAIL_SYSTEM;
-    memcpy(buffer, &char_flags, 1);
-    memcpy(buffer + 1, &len, sizeof(OM_uint32));
-    memcpy(buffer + 1 + sizeof(OM_uint32), tok->value, tok->length);
-    okay = network_write(fd, buffer, buflen, timeout);
-    free(buffer);
-    return okay ? TOKEN_OK : map_socket_error(socket_errno);
+    header[0] = (unsigned char) flags;
+    memcpy(header + 1, &len, sizeof(OM_uint32));
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = tok->value;
+    iov[1].iov_len = tok->length;
+    if (!network_writev(fd, iov, tok->length > 0 ? 2 : 1, timeout))
+        return map_socket_error(socket_errno);
+    return TOKEN_OK;
 }
 
 
@@ -91,25 +109,24 @@ token_send(socket_type fd, int flags, gss_buffer_t tok, time_t timeout)
  * on Windows.
  *
  * recv_token reads the token flags (a single byte, even though they're stored
- * into an integer, then reads the token length (as a network long), allocates
- * memory to hold the data, and then reads the token data from the file
- * descriptor.  On a successful return, the value member of the token should
- * be freed with free().
+ * into an integer) and the token length (as a network long) with a single
+ * read, allocates memory to hold the data, and then reads the token data from
+ * the file descriptor.  On a successful return, the value member of the token
+ * should be freed with free().
  */
 enum token_status
 token_recv(socket_type fd, int *flags, gss_buffer_t tok, size_t max,
            time_t timeout)
 {
     OM_uint32 len;
-    unsigned char char_flags;
+    unsigned char header[1 + sizeof(OM_uint32)];
     int err;
 
-    if (!network_read(fd, &char_flags, 1, timeout))
-        return map_socket_error(socket_errno);
-    *flags = char_flags;
-
-    if (!network_read(fd, &len, sizeof(OM_uint32), timeout))
+    /* Read the flags and the length together. */
+    if (!network_read(fd, header, sizeof(header), timeout))
         return map_socket_error(socket_errno);
+    *flags = header[0];
+    memcpy(&len, header + 1, sizeof(OM_uint32));
     tok->length = ntohl(len);
     if (tok->length > max)
         return TOKEN_FAIL_LARGE;
@@ -129,3 +146,194 @@ token_recv(socket_type fd, int *flags, gss_buffer_t tok, size_t max,
     }
     return TOKEN_OK;
 }
+
+
+/*
+ * Allocate a new, empty token buffer.  Returns NULL on memory allocation
+ * failure.
+ */
+struct token_buffer *
+token_buffer_new(void)
+{
+    struct token_buffer *buffer;
+
+    buffer = malloc(sizeof(struct token_buffer));
+    if (buffer == NULL)
+        return NULL;
+    buffer->data = malloc(TOKEN_BUFFER_SIZE);
+    if (buffer->data == NULL) {
+        free(buffer);
+        return NULL;
+    }
+    buffer->offset = 0;
+    buffer->left = 0;
+    return buffer;
+}
+
+
+/*
+ * Free a token buffer, discarding any data in it.
+ */
+void
+token_buffer_free(struct token_buffer *buffer)
+{
+    if (buffer == NULL)
+        return;
+    free(buffer->data);
+    free(buffer);
+}
+
+
+/*
+ * Copy up to length bytes of data already read into the buffer to data,
+ * removing it from the buffer.  Returns the number of bytes copied, which is
+ * 0 if the buffer is empty.  This lets a caller stop using the buffer
+ * without losing data that was read ahead.
+ */
+size_t
+token_buffer_take(struct token_buffer *buffer, void *data, size_t length)
+{
+    if (length > buffer->left)
+        length = buffer->left;
+    if (length == 0)
+        return 0;
+    memcpy(data, buffer->data + buffer->offset, length);
+    buffer->offset += length;
+    buffer->left -= length;
+    return length;
+}
+
+
+/*
+ * Make sure that at least the given number of bytes are in the buffer,
+ * reading as much as is available from the file descriptor each time to save
+ * system calls on later tokens.  needed must not be larger than
+ * TOKEN_BUFFER_SIZE.  Applies the timeout (in seconds) to the whole read,
+ * and timeout may be 0 to never time out.  Returns true on success and false
+ * on failure, setting socket_errno.
+ */
+static bool
+token_buffer_fill(socket_type fd, struct token_buffer *buffer, size_t needed,
+                  time_t timeout)
+{
+    time_t start, now, wait;
+    struct pollfd pfd;
+    ssize_t status;
+    char *end;
+
+    if (buffer->left >= needed)
+        return true;
+    if (buffer->offset + needed > TOKEN_BUFFER_SIZE) {
+        memmove(buffer->data, buffer->data + buffer->offset, buffer->left);
+        buffer->offset = 0;
+    }
+    start = time(NULL);
+    now = start;
+    while (buffer->left < needed) {
+        if (timeout > 0) {
+            if (now - start >= timeout) {
+                socket_set_errno(ETIMEDOUT);
+                return false;
+            }
+            wait = timeout - (now - start);
+            if (wait > INT_MAX / 1000)
+                wait = INT_MAX / 1000;
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            status = socket_poll(&pfd, 1, (int) wait * 1000);
+            if (status < 0) {
+                if (socket_errno != EINTR)
+                    return false;
+                now = time(NULL);
+                continue;
+            } else if (status == 0) {
+                socket_set_errno(ETIMEDOUT);
+                return false;
+            }
+        }
+        end = buffer->data + buffer->offset + buffer->left;
+        status = socket_read(fd, end, TOKEN_BUFFER_SIZE - buffer->offset
+                                      - buffer->left);
+        if (status < 0) {
+            if (socket_errno != EINTR && socket_errno != EAGAIN)
+                return false;
+        } else if (status == 0) {
+            socket_set_errno(EPIPE);
+            return false;
+        } else
+            buffer->left += status;
+        now = time(NULL);
+    }
+    return true;
+}
+
+
+/*
+ * Receive a token from a file descriptor using a read-ahead buffer.  This
+ * works like token_recv, but reads as much data as is available (up to the
+ * size of the buffer) each time, so that the header and data of a token, and
+ * often the following tokens, are read with a single system call.  Any data
+ * left over is kept in the buffer for the next call, so all reads from the
+ * file descriptor must go through the same buffer.  If buffer is NULL, this
+ * is just token_recv.
+ */
+enum token_status
+token_recv_buffered(socket_type fd, struct token_buffer *buffer, int *flags,
+                    gss_buffer_t tok, size_t max, time_t timeout)
+{
+    OM_uint32 len;
+    unsigned char header[1 + sizeof(OM_uint32)];
+    size_t copied;
+    int err;
+
+    if (buffer == NULL)
+        return token_recv(fd, flags, tok, max, timeout);
+
+    /* Get the flags and the length. */
+    if (!token_buffer_fill(fd, buffer, sizeof(header), timeout))
+        return map_socket_error(socket_errno);
+    memcpy(header, buffer->data + buffer->offset, sizeof(header));
+    buffer->offset += sizeof(header);
+    buffer->left -= sizeof(header);
+    *flags = header[0];
+    memcpy(&len, header + 1, sizeof(OM_uint32));
+    tok->length = ntohl(len);
+    if (tok->length > max)
+        return TOKEN_FAIL_LARGE;
+    if (tok->length == 0) {
+        tok->value = NULL;
+        return TOKEN_OK;
+    }
+    tok->value = malloc(tok->length);
+    if (tok->value == NULL)
+        return TOKEN_FAIL_SYSTEM;
+
+    /*
+     * If the token fits in the buffer, fill the buffer as needed and copy it
+     * out.  Otherwise, copy whatever we have and read the rest directly.
+     */
+    if (tok->length <= TOKEN_BUFFER_SIZE) {
+        if (!token_buffer_fill(fd, buffer, tok->length, timeout))
+            goto fail;
+        copied = tok->length;
+    } else
+        copied = buffer->left;
+    memcpy(tok->value, buffer->data + buffer->offset, copied);
+    buffer->offset += copied;
+    buffer->left -= copied;
+    if (buffer->left == 0)
+        buffer->offset = 0;
+    if (copied < tok->length) {
+        if (!network_read(fd, (char *) tok->value + copied,
+                          tok->length - copied, timeout))
+            goto fail;
+    }
+    return TOKEN_OK;
+
+fail:
+    err = socket_errno;
+    free(tok->value);
+    socket_set_errno(err);
+    return map_socket_error(err);
+}
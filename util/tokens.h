@@ -18,6 +18,9 @@
 #include <portable/socket.h>
 #include <sys/types.h>
 
+/* Opaque struct holding data read ahead from a connection. */
+struct token_buffer;
+
 /* Token types and flags. */
 enum token_flags {
     TOKEN_NOOP          = (1 << 0),
@@ -56,6 +59,21 @@ enum token_status token_send(socket_type, int flags, gss_buffer_t,
 enum token_status token_recv(socket_type, int *flags, gss_buffer_t,
                              size_t max, time_t timeout);
 
+/*
+ * Receiving tokens with a read-ahead buffer, which saves system calls when
+ * reading many tokens from the same connection.  Once a buffer has been used
+ * with a connection, every read from that connection must use it, since it
+ * may hold data already read.  token_recv_buffered with a NULL buffer is the
+ * same as token_recv.  token_buffer_new returns NULL on allocation failure.
+ * token_buffer_take removes and returns data already read into the buffer.
+ */
+struct token_buffer *token_buffer_new(void);
+void token_buffer_free(struct token_buffer *);
+size_t token_buffer_take(struct token_buffer *, void *, size_t length);
+enum token_status token_recv_buffered(socket_type, struct token_buffer *,
+                                      int *flags, gss_buffer_t, size_t max,
+                                      time_t timeout);
+
 /* Undo default visibility change. */
 #pragma GCC visibility pop
 